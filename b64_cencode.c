@@ -13,6 +13,9 @@
   2. I want to make sure that I don't overrun my buffer, so
      base64_encode_block() takes in the buffer length
 
+  This is the scalar fallback. The SIMD implementations and the decoder live in
+  vnlog-base64.c
+
  */
 
 
@@ -161,8 +164,10 @@ static int base64_encode_blockend(char* code_out, base64_encodestate* state_in)
 	return codechar - code_out;
 }
 
-int vnlog_base64_encode(       char* dst, int dstlen,
-                         const char* src, int srclen )
+// The scalar implementation. vnlog_base64_encode() in vnlog-base64.c uses a
+// SIMD implementation instead if the CPU supports one
+int _vnlog_base64_encode_scalar(       char* dst, int dstlen,
+                                 const char* src, int srclen )
 {
     if(srclen <= 0)
     {
@@ -0,0 +1,76 @@
+// Throughput of each base64 implementation this CPU supports, for a few sizes
+// of binary fields. vnlog_base64_encode() and vnlog_base64_decode() use the
+// fastest one. The output is itself a vnlog
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../vnlog-base64.h"
+
+// Bytes processed for each measurement
+#define TOTAL (256 << 20)
+
+static double now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec * 1e9 + (double)t.tv_nsec;
+}
+
+// I accumulate the output lengths into this to keep the compiler from
+// optimizing the work away
+static volatile long sink;
+
+int main(void)
+{
+    static const int sizes[] = {16, 100, 1000, 8192, 65536};
+    const int size_max = sizes[sizeof(sizes)/sizeof(sizes[0]) - 1];
+
+    char* plain   = malloc(size_max);
+    char* encoded = malloc(vnlog_base64_dstlen_to_encode(size_max));
+    char* decoded = malloc(size_max);
+    if(plain == NULL || encoded == NULL || decoded == NULL)
+    {
+        fprintf(stderr, "malloc failed\n");
+        return 1;
+    }
+    for(int i=0; i<size_max; i++)
+        plain[i] = (char)(i*7 + (i>>3));
+
+    printf("# impl size encode_MBps decode_MBps\n");
+    for(vnlog_base64_impl_t impl = 0; impl < VNLOG_BASE64_N_IMPLS; impl++)
+    {
+        if(!_vnlog_base64_impl_available(impl))
+            continue;
+
+        for(int isize=0; isize<(int)(sizeof(sizes)/sizeof(sizes[0])); isize++)
+        {
+            const int size   = sizes[isize];
+            const int Niter  = TOTAL / size;
+            const int dstlen = vnlog_base64_dstlen_to_encode(size);
+            long len = 0;
+
+            double t0 = now_ns();
+            for(int i=0; i<Niter; i++)
+                len += _vnlog_base64_encode_impl(impl, encoded, dstlen, plain, size);
+            double t1 = now_ns();
+            const int len_encoded = (int)(len / Niter);
+            for(int i=0; i<Niter; i++)
+                len += _vnlog_base64_decode_impl(impl, decoded, size, encoded, len_encoded);
+            double t2 = now_ns();
+            sink += len;
+
+            // MB/s of binary data
+            printf("%s %d %.0f %.0f\n",
+                   _vnlog_base64_impl_name(impl), size,
+                   (double)Niter*size / (t1-t0) * 1e3,
+                   (double)Niter*size / (t2-t1) * 1e3);
+        }
+    }
+
+    free(plain);
+    free(encoded);
+    free(decoded);
+    return 0;
+}
@@ -0,0 +1,71 @@
+// Cost of emitting a record with the generic setters, and with the specialized
+// emitter from "vnl-gen-header --emitter". The records go to /dev/null. The
+// output is itself a vnlog
+#include <stdio.h>
+#include <time.h>
+
+#include "vnlog_emitter_generated.h"
+
+#define N 2000000
+
+static double now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec * 1e9 + (double)t.tv_nsec;
+}
+
+static struct vnlog_record record(int i)
+{
+    return (struct vnlog_record){ .t           = 1700000000000000000LL + i*1000LL,
+                                  .i           = i,
+                                  .flags       = (uint8_t)i,
+                                  .mode        = (uint16_t)(i % 7),
+                                  .x           = i * 0.001,
+                                  .y           = 1.0 / (i+1),
+                                  .z           = -3.5,
+                                  .temperature = 20.0f + (float)(i % 100) * 0.1f,
+                                  .name        = (char*)"sensor" };
+}
+
+int main(void)
+{
+    FILE* fp = fopen("/dev/null", "w");
+    if(fp == NULL)
+    {
+        fprintf(stderr, "Couldn't open /dev/null\n");
+        return 1;
+    }
+    vnlog_set_output_FILE(NULL, fp);
+    vnlog_emit_legend();
+
+    double t0 = now_ns();
+    for(int i=0; i<N; i++)
+    {
+        const struct vnlog_record r = record(i);
+        vnlog_set_field_value__t(r.t);
+        vnlog_set_field_value__i(r.i);
+        vnlog_set_field_value__flags(r.flags);
+        vnlog_set_field_value__mode(r.mode);
+        vnlog_set_field_value__x(r.x);
+        vnlog_set_field_value__y(r.y);
+        vnlog_set_field_value__z(r.z);
+        vnlog_set_field_value__temperature(r.temperature);
+        vnlog_set_field_value__name(r.name);
+        vnlog_emit_record();
+    }
+    double t1 = now_ns();
+    for(int i=0; i<N; i++)
+    {
+        const struct vnlog_record r = record(i);
+        vnlog_emit_struct(&r);
+    }
+    double t2 = now_ns();
+
+    printf("# path ns_per_record\n");
+    printf("generic %.1f\n", (t1-t0) / N);
+    printf("struct %.1f\n",  (t2-t1) / N);
+
+    fclose(fp);
+    return 0;
+}
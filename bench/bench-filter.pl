@@ -0,0 +1,72 @@
+#!/usr/bin/env perl
+
+# Benchmarks the vnl-filter engines
+#
+# SYNOPSIS
+#
+#   bench/bench-filter.pl [--records N] [--columns N]
+#
+# Writes a synthetic vnlog of --records records (200000 by default) of --columns
+# columns (50 by default) to a temporary file, and runs a few typical vnl-filter
+# queries on it with each engine: awk (mawk), native and perl. The native
+# output must match the awk output exactly. perl formats numbers differently, so
+# its output isn't checked
+#
+# The output is a vnlog with a row for each case, like the output of "make bench"
+
+use strict;
+use warnings;
+use feature ':5.10';
+
+use Getopt::Long;
+use Time::HiRes 'time';
+use File::Temp 'tempfile';
+use FindBin '$RealBin';
+
+my %options = (records => 200000,
+               columns => 50);
+GetOptions(\%options, "records=i", "columns=i")
+  or die "Usage: $0 [--records N] [--columns N]\n";
+
+my $Ncolumns = $options{columns};
+die "Need at least 4 columns\n" if $Ncolumns < 4;
+
+my ($fh, $filename) = tempfile(UNLINK => 1);
+say $fh '# ' . join(' ', map {"c$_"} 0..$Ncolumns-1);
+srand(0);
+for my $i (0..$options{records}-1)
+{
+    say $fh join(' ', map { sprintf('%.3f', rand(2000) - 1000) } 0..$Ncolumns-1);
+}
+close $fh;
+my $MB = (-s $filename) / 1e6;
+
+my $clast = 'c' . ($Ncolumns-1);
+my %queries =
+  ( pick   => ['-p', "c1,$clast"],
+    match  => ['-p', 'c0,c2', 'c1 > 0 && c3 < 500'],
+    arith  => ['-p', "s=c0+c1,r=c2/2,d=diff(c3)", "$clast < 0"],
+    all    => ['c1 > 900'] );
+
+say "# case seconds MBps";
+for my $query (qw(pick match arith all))
+{
+    my $out_ref;
+    for my $engine (qw(awk native perl))
+    {
+        # vnl-filter reads its input on stdin
+        open STDIN, '<', $filename or die "Couldn't open '$filename': $!";
+
+        my $t0 = time;
+        open my $pipe, '-|', "$RealBin/../vnl-filter", "--engine=$engine", @{$queries{$query}}
+          or die "Couldn't run vnl-filter: $!";
+        my $out = join('', <$pipe>);
+        close $pipe or die "vnl-filter failed";
+        my $dt = time - $t0;
+
+        $out_ref //= $out;
+        die "filter/$query: the native output doesn't match the awk output\n"
+          if $engine eq 'native' && $out ne $out_ref;
+        printf("filter/%s/%s %.3f %.1f\n", $query, $engine, $dt, $MB/$dt);
+    }
+}
@@ -0,0 +1,92 @@
+// Microbenchmark of the field formatters in vnlog-format.h against the
+// snprintf() calls the vnlog writer used to make. Each line of the output
+// reports the cost per formatted value for one type. The output is itself a
+// vnlog
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "../vnlog-format.h"
+
+#define N 2000000
+
+static double now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec * 1e9 + (double)t.tv_nsec;
+}
+
+// I accumulate the output lengths into this to keep the compiler from
+// optimizing the work away
+static volatile long sink;
+
+static uint64_t rng_state = 0x0123456789ABCDEFull;
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// Each benchmark formats the same N values twice: once with snprintf() and once
+// with vnlog_format_...()
+#define BENCH(name, type, fmt, formatter, generate)                     \
+static void bench_ ## name(void)                                        \
+{                                                                       \
+    type* x = malloc(N * sizeof(type));                                 \
+    if(x == NULL) { fprintf(stderr, "malloc failed\n"); exit(1); }      \
+    for(int i=0; i<N; i++)                                              \
+    {                                                                   \
+        uint64_t r = rng(); (void)r;                                    \
+        x[i] = (type)(generate);                                        \
+    }                                                                   \
+                                                                        \
+    char buf[32];                                                       \
+    long len = 0;                                                       \
+                                                                        \
+    double t0 = now_ns();                                               \
+    for(int i=0; i<N; i++)                                              \
+        len += snprintf(buf, sizeof(buf), fmt, x[i]);                   \
+    double t1 = now_ns();                                               \
+    for(int i=0; i<N; i++)                                              \
+        len += vnlog_format_ ## formatter(buf, sizeof(buf), x[i]);      \
+    double t2 = now_ns();                                               \
+    sink += len;                                                        \
+                                                                        \
+    const double ns_snprintf = (t1-t0) / N;                             \
+    const double ns_vnlog    = (t2-t1) / N;                             \
+    printf("%s %.2f %.2f %.2f\n", #name,                                \
+           ns_snprintf, ns_vnlog, ns_snprintf/ns_vnlog);                \
+    free(x);                                                            \
+}
+
+BENCH(int8_t,   int8_t,      "%" PRId8,  int64,  r)
+BENCH(int32_t,  int32_t,     "%" PRId32, int64,  r)
+BENCH(int64_t,  int64_t,     "%" PRId64, int64,  r >> (r & 63))
+BENCH(uint8_t,  uint8_t,     "%" PRIu8,  uint64, r)
+BENCH(uint32_t, uint32_t,    "%" PRIu32, uint64, r)
+BENCH(uint64_t, uint64_t,    "%" PRIu64, uint64, r >> (r & 63))
+BENCH(char,     char,        "%c",       char,   'a' + r % 26)
+BENCH(float,    float,       "%.20g",    float,  (double)(int32_t)r / 1e3)
+BENCH(double,   double,      "%.20g",    double, (double)(int64_t)r / 1e6)
+BENCH(charp,    const char*, "%s",       string, (r & 1) ? "asdf" : "a-longer-string")
+
+int main(void)
+{
+    printf("# type ns_snprintf ns_vnlog speedup\n");
+    bench_int8_t();
+    bench_int32_t();
+    bench_int64_t();
+    bench_uint8_t();
+    bench_uint32_t();
+    bench_uint64_t();
+    bench_char();
+    bench_float();
+    bench_double();
+    bench_charp();
+    return 0;
+}
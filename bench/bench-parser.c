@@ -0,0 +1,393 @@
+// Throughput of the parser with each scanner this CPU supports, reading the
+// file through a FILE and mapped, for a few widths of synthetic numeric logs.
+// For reference, the "strtok" rows split the same files the way the parser did
+// it before the scanners: getline() and strtok(). These do no legend or
+// comment handling, so they're a lower bound of the old cost.
+//
+// The "doubles" rows read every field of the mapped file as a double: with
+// strtod() on the strings ("strtod-doubles"), with the typed accessors
+// ("typed-doubles"), and in columnar batches ("batch-doubles"). The "first"
+// rows read only the first column, with the typed accessors: without a
+// projection ("typed-first") and with one ("project-first"). The "parallel"
+// rows read every field as a double with a thread per CPU: with the typed
+// accessors in vnlog_parser_parallel_foreach() ("parallel-typed-doubles"), and
+// in ordered batches ("parallel-batch-doubles"). The output is itself a vnlog
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "../vnlog-parser.h"
+
+#define MSG(fmt, ...) \
+    fprintf(stderr, "%s:%d " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+
+static double now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec * 1e9 + (double)t.tv_nsec;
+}
+
+// Writes a synthetic vnlog with Ncolumns columns of numbers of various lengths,
+// about size bytes long. Returns the number of records
+static long write_input(FILE* fp, int Ncolumns, long size)
+{
+    fprintf(fp, "#");
+    for(int j=0; j<Ncolumns; j++)
+        fprintf(fp, " column%d", j);
+    fprintf(fp, "\n");
+
+    long Nrecords = 0;
+    while(ftell(fp) < size)
+    {
+        for(int j=0; j<Ncolumns; j++)
+        {
+            if(j % 4 == 3) fprintf(fp, "-");
+            else           fprintf(fp, "%.*f", j % 6, (double)Nrecords * 1.25 + j);
+            fputc(j == Ncolumns-1 ? '\n' : ' ', fp);
+        }
+        Nrecords++;
+    }
+    fflush(fp);
+    return Nrecords;
+}
+
+static long parse(FILE* fp, const char* filename, bool use_mmap)
+{
+    vnlog_parser_t ctx;
+    vnlog_parser_result_t result =
+        use_mmap ?
+        vnlog_parser_init_mmap(&ctx, filename, false) :
+        vnlog_parser_init     (&ctx, fp);
+    if(result != VNL_OK)
+    {
+        MSG("Couldn't initialize the parser");
+        exit(1);
+    }
+
+    long N = 0;
+    while(VNL_OK == (result = vnlog_parser_read_record(&ctx, use_mmap ? NULL : fp)))
+        N++;
+    vnlog_parser_free(&ctx);
+    if(result != VNL_EOF)
+    {
+        MSG("Parsing failed");
+        exit(1);
+    }
+    return N;
+}
+
+// I accumulate the values into this to keep the compiler from optimizing the
+// work away
+static volatile double sink;
+
+static long parse_doubles(const char* filename, bool typed)
+{
+    vnlog_parser_t ctx;
+    if(VNL_OK != vnlog_parser_init_mmap(&ctx, filename, !typed))
+    {
+        MSG("Couldn't initialize the parser");
+        exit(1);
+    }
+
+    double sum = 0.0;
+    long   N   = 0;
+    vnlog_parser_result_t result;
+    while(VNL_OK == (result = vnlog_parser_read_record(&ctx, NULL)))
+    {
+        for(int i=0; i<ctx.Ncolumns; i++)
+        {
+            double x;
+            if(typed)
+                vnlog_parser_get_double(&ctx, i, &x);
+            else
+                x = (0 == strcmp(ctx.record[i].value, "-")) ?
+                    0.0 : strtod(ctx.record[i].value, NULL);
+            sum += x;
+        }
+        N++;
+    }
+    vnlog_parser_free(&ctx);
+    if(result != VNL_EOF)
+    {
+        MSG("Parsing failed");
+        exit(1);
+    }
+    sink += sum;
+    return N;
+}
+
+static long parse_first(const char* filename, bool project)
+{
+    vnlog_parser_t ctx;
+    if(VNL_OK != vnlog_parser_init_mmap(&ctx, filename, false))
+    {
+        MSG("Couldn't initialize the parser");
+        exit(1);
+    }
+
+    const vnlog_parser_column_t column = 0;
+    if(project && !vnlog_parser_set_projection(&ctx, &column, 1, false))
+    {
+        MSG("Couldn't set the projection");
+        exit(1);
+    }
+
+    double sum = 0.0;
+    long   N   = 0;
+    vnlog_parser_result_t result;
+    while(VNL_OK == (result = vnlog_parser_read_record(&ctx, NULL)))
+    {
+        double x;
+        vnlog_parser_get_double(&ctx, column, &x);
+        sum += x;
+        N++;
+    }
+    vnlog_parser_free(&ctx);
+    if(result != VNL_EOF)
+    {
+        MSG("Parsing failed");
+        exit(1);
+    }
+    sink += sum;
+    return N;
+}
+
+static long parse_batch_doubles(const char* filename)
+{
+    vnlog_parser_t ctx;
+    if(VNL_OK != vnlog_parser_init_mmap(&ctx, filename, false))
+    {
+        MSG("Couldn't initialize the parser");
+        exit(1);
+    }
+
+    const char*        keys [ctx.Ncolumns];
+    vnlog_batch_type_t types[ctx.Ncolumns];
+    for(int i=0; i<ctx.Ncolumns; i++)
+    {
+        keys [i] = ctx.record[i].key;
+        types[i] = VNLOG_BATCH_DOUBLE;
+    }
+    vnlog_batch_t batch;
+    if(!vnlog_batch_init(&batch, &ctx, keys, types, ctx.Ncolumns, 4096))
+    {
+        MSG("Couldn't initialize the batch");
+        exit(1);
+    }
+
+    double sum = 0.0;
+    long   N   = 0;
+    vnlog_parser_result_t result;
+    while(VNL_OK == (result = vnlog_parser_read_batch(&ctx, NULL, &batch)))
+    {
+        // The nulls are NaN. Skip them without looking at the bitmap
+        for(int i=0; i<batch.Ncolumns; i++)
+        {
+            const double* x = batch.columns[i].values;
+            for(int j=0; j<batch.Nrows; j++)
+                sum += x[j] == x[j] ? x[j] : 0.0;
+        }
+        N += batch.Nrows;
+    }
+    vnlog_batch_free(&batch);
+    vnlog_parser_free(&ctx);
+    if(result != VNL_EOF)
+    {
+        MSG("Parsing failed");
+        exit(1);
+    }
+    sink += sum;
+    return N;
+}
+
+static bool sum_chunk(vnlog_parser_t* chunk,
+                      int i_chunk __attribute__((unused)),
+                      void* cookie)
+{
+    double sum = 0.0;
+    long   N   = 0;
+    vnlog_parser_result_t result;
+    while(VNL_OK == (result = vnlog_parser_read_record(chunk, NULL)))
+    {
+        for(int i=0; i<chunk->Ncolumns; i++)
+        {
+            double x;
+            vnlog_parser_get_double(chunk, i, &x);
+            sum += x == x ? x : 0.0;
+        }
+        N++;
+    }
+    // The threads share the count, but not the sum: looking at it is enough
+    __atomic_add_fetch((long*)cookie, N, __ATOMIC_RELAXED);
+    return result == VNL_EOF && sum == sum;
+}
+
+static long parse_parallel_doubles(const char* filename, bool ordered)
+{
+    vnlog_parser_t ctx;
+    if(VNL_OK != vnlog_parser_init_mmap(&ctx, filename, false))
+    {
+        MSG("Couldn't initialize the parser");
+        exit(1);
+    }
+
+    long N = 0;
+    if(!ordered)
+    {
+        if(VNL_OK != vnlog_parser_parallel_foreach(&ctx, 0, 0, sum_chunk, &N))
+        {
+            MSG("Parsing failed");
+            exit(1);
+        }
+        vnlog_parser_free(&ctx);
+        return N;
+    }
+
+    const char*        keys [ctx.Ncolumns];
+    vnlog_batch_type_t types[ctx.Ncolumns];
+    for(int i=0; i<ctx.Ncolumns; i++)
+    {
+        keys [i] = ctx.record[i].key;
+        types[i] = VNLOG_BATCH_DOUBLE;
+    }
+    vnlog_parser_parallel_t par;
+    if(!vnlog_parser_parallel_init(&par, &ctx, keys, types, ctx.Ncolumns, 4096, 0, 0))
+    {
+        MSG("Couldn't initialize the parallel parser");
+        exit(1);
+    }
+
+    double sum = 0.0;
+    const vnlog_batch_t* batch;
+    vnlog_parser_result_t result;
+    while(VNL_OK == (result = vnlog_parser_parallel_read_batch(&par, &batch)))
+    {
+        for(int i=0; i<batch->Ncolumns; i++)
+        {
+            const double* x = batch->columns[i].values;
+            for(int j=0; j<batch->Nrows; j++)
+                sum += x[j] == x[j] ? x[j] : 0.0;
+        }
+        N += batch->Nrows;
+    }
+    vnlog_parser_parallel_free(&par);
+    vnlog_parser_free(&ctx);
+    if(result != VNL_EOF)
+    {
+        MSG("Parsing failed");
+        exit(1);
+    }
+    sink += sum;
+    return N;
+}
+
+static long parse_strtok(FILE* fp)
+{
+    char*  line = NULL;
+    size_t n    = 0;
+    long   N    = 0;
+    while(0 <= getline(&line, &n, fp))
+    {
+        char* saveptr;
+        for(char* token = strtok_r(line, " \t\n", &saveptr);
+            token != NULL;
+            token = strtok_r(NULL, " \t\n", &saveptr))
+        {
+            if(token[0] == '#')
+                break;
+        }
+        N++;
+    }
+    free(line);
+    return N - 1; // not counting the legend
+}
+
+enum { STRTOK, PARSE, PARSE_MMAP, STRTOD_DOUBLES, TYPED_DOUBLES, BATCH_DOUBLES,
+       TYPED_FIRST, PROJECT_FIRST, PARALLEL_TYPED_DOUBLES, PARALLEL_BATCH_DOUBLES };
+
+// Once to get the file into the page cache, and once to measure
+static void report(FILE* fp, const char* filename,
+                   const char* name, int Ncolumns, long Nrecords,
+                   int mode)
+{
+    double t0 = 0.0;
+    long   N  = 0;
+    for(int pass=0; pass<2; pass++)
+    {
+        rewind(fp);
+        t0 = now_ns();
+        switch(mode)
+        {
+        case STRTOK:         N = parse_strtok(fp);                break;
+        case PARSE:          N = parse(fp, filename, false);      break;
+        case PARSE_MMAP:     N = parse(fp, filename, true);       break;
+        case STRTOD_DOUBLES: N = parse_doubles(filename, false);  break;
+        case TYPED_DOUBLES:  N = parse_doubles(filename, true);   break;
+        case BATCH_DOUBLES:  N = parse_batch_doubles(filename);   break;
+        case TYPED_FIRST:    N = parse_first(filename, false);    break;
+        case PROJECT_FIRST:  N = parse_first(filename, true);     break;
+        case PARALLEL_TYPED_DOUBLES: N = parse_parallel_doubles(filename, false); break;
+        case PARALLEL_BATCH_DOUBLES: N = parse_parallel_doubles(filename, true);  break;
+        }
+    }
+    const double t1 = now_ns();
+    if(N != Nrecords)
+    {
+        MSG("%s: parsed %ld records; expected %ld", name, N, Nrecords);
+        exit(1);
+    }
+
+    fseek(fp, 0, SEEK_END);
+    printf("%s %d %.0f\n", name, Ncolumns, (double)ftell(fp) / (t1-t0) * 1e3);
+    fflush(stdout);
+}
+
+int main(void)
+{
+    printf("# impl columns MBps\n");
+
+    static const int widths[] = {4, 16, 64, 256};
+    for(int i=0; i<(int)(sizeof(widths)/sizeof(widths[0])); i++)
+    {
+        FILE* fp = tmpfile();
+        if(fp == NULL)
+        {
+            MSG("tmpfile() failed");
+            return 1;
+        }
+        const long Nrecords = write_input(fp, widths[i], 64L << 20);
+
+        // The tmpfile() has no name, but /proc gives it one
+        char filename[64];
+        snprintf(filename, sizeof(filename), "/proc/self/fd/%d", fileno(fp));
+
+        report(fp, filename, "strtok", widths[i], Nrecords, STRTOK);
+        for(vnlog_parser_impl_t impl = 0; impl < VNLOG_PARSER_N_IMPLS; impl++)
+        {
+            if(!_vnlog_parser_impl_available(impl))
+                continue;
+            _vnlog_parser_set_impl(impl);
+
+            char name[64];
+            snprintf(name, sizeof(name), "%s", _vnlog_parser_impl_name(impl));
+            report(fp, filename, name, widths[i], Nrecords, PARSE);
+            snprintf(name, sizeof(name), "%s-mmap", _vnlog_parser_impl_name(impl));
+            report(fp, filename, name, widths[i], Nrecords, PARSE_MMAP);
+        }
+
+        // With the last scanner: the fastest
+        report(fp, filename, "strtod-doubles", widths[i], Nrecords, STRTOD_DOUBLES);
+        report(fp, filename, "typed-doubles",  widths[i], Nrecords, TYPED_DOUBLES);
+        report(fp, filename, "batch-doubles",  widths[i], Nrecords, BATCH_DOUBLES);
+        report(fp, filename, "typed-first",    widths[i], Nrecords, TYPED_FIRST);
+        report(fp, filename, "project-first",  widths[i], Nrecords, PROJECT_FIRST);
+        report(fp, filename, "parallel-typed-doubles", widths[i], Nrecords, PARALLEL_TYPED_DOUBLES);
+        report(fp, filename, "parallel-batch-doubles", widths[i], Nrecords, PARALLEL_BATCH_DOUBLES);
+        fclose(fp);
+    }
+    return 0;
+}
@@ -0,0 +1,105 @@
+#!/usr/bin/env perl
+
+# Benchmarks Vnlog::Parser
+#
+# SYNOPSIS
+#
+#   bench/bench-perl-parser.pl [--records N]
+#
+# Parses a synthetic vnlog of --records records (1000000 by default) of 8
+# columns, held in memory, with the compiled parser and with the pure-perl one:
+#
+# - line by line, with parse() and getValues()
+# - line by line, with parse() and getValuesHash()
+# - in batches of whole columns, with readColumns()
+#
+# The output is a vnlog with a row for each case, like the output of "make bench"
+
+use strict;
+use warnings;
+use feature ':5.10';
+
+use Getopt::Long;
+use Time::HiRes 'time';
+use FindBin '$RealBin';
+use lib "$RealBin/../lib";
+
+use Vnlog::Parser;
+
+my %options = (records => 1000000);
+GetOptions(\%options, "records=i") or die "Usage: $0 [--records N]\n";
+
+if( !$Vnlog::Parser::have_xs )
+{
+    die "The compiled Vnlog::Parser isn't available\n";
+}
+
+my $Ncolumns = 8;
+my $text     = '# ' . join(' ', map {"c$_"} 0..$Ncolumns-1) . "\n";
+srand(0);
+for my $i (0..$options{records}-1)
+{
+    $text .= join(' ', map { $_ == 5 && $i % 10 == 0 ? '-' : sprintf('%.3f', rand(2000) - 1000) } 0..$Ncolumns-1) . "\n";
+}
+
+my %cases =
+  ( getValues =>
+    sub
+    {
+        my ($parser, $fh) = @_;
+        my $N = 0;
+        while(<$fh>)
+        {
+            $parser->parse($_) or die $parser->error();
+            my $v = $parser->getValues() or next;
+            $N++;
+        }
+        return $N;
+    },
+
+    getValuesHash =>
+    sub
+    {
+        my ($parser, $fh) = @_;
+        my $N = 0;
+        while(<$fh>)
+        {
+            $parser->parse($_) or die $parser->error();
+            my $d = $parser->getValuesHash() or next;
+            $N++ if %$d;
+        }
+        return $N;
+    },
+
+    readColumns =>
+    sub
+    {
+        my ($parser, $fh) = @_;
+        my $N = 0;
+        while(my $columns = $parser->readColumns($fh, 1024))
+        {
+            $N += @{$columns->{c0}};
+        }
+        return $N;
+    } );
+
+say "# case ns_per_record records_per_sec";
+for my $case (qw(getValues getValuesHash readColumns))
+{
+    for my $impl (qw(xs pp))
+    {
+        no strict 'refs';
+        no warnings 'redefine';
+        local *Vnlog::Parser::parse         = \&{"Vnlog::Parser::_parse_$impl"};
+        local *Vnlog::Parser::getValuesHash = \&{"Vnlog::Parser::_getValuesHash_$impl"};
+        local $Vnlog::Parser::have_xs       = $impl eq 'xs';
+        use strict 'refs';
+
+        open my $fh, '<', \$text;
+        my $t0 = time;
+        my $N  = $cases{$case}->(Vnlog::Parser->new(), $fh);
+        my $dt = time - $t0;
+        die "Read $N records; expected $options{records}" if $N != $options{records};
+        printf("perl-parser/%s/%s %.1f %.0f\n", $case, $impl, $dt*1e9/$N, $N/$dt);
+    }
+}
@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+
+r'''Benchmarks vnlog.slurp()
+
+SYNOPSIS
+
+  bench/bench-slurp.py [--size MB] [--threads N] [--keep FILE]
+
+Writes a synthetic vnlog of about --size MB (1GB by default) into a temporary
+file, and slurps it:
+
+- with the compiled _vnlog extension, using all the CPUs and using one thread
+
+- with the python path (numpy.loadtxt()), unless --size is large and
+  --with-python isn't given: that takes minutes
+
+once with a plain float dtype, and once with a structured dtype that reads a
+subset of the columns. The file has no nulls, so that numpy.loadtxt() can read
+it. The output is a vnlog with a row for each case, like the output of "make
+bench"
+
+'''
+
+import argparse
+import os
+import sys
+import tempfile
+import time
+
+import numpy as np
+
+sys.path[:0] = (os.path.abspath(os.path.dirname(sys.argv[0])) + "/../lib",)
+import vnlog
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--size', type=int, default=1024,
+                    help='The size of the log, in MB. 1024 by default')
+parser.add_argument('--threads', type=int, default=0,
+                    help='The number of threads for the parallel case. 0 (the default) means one per CPU')
+parser.add_argument('--with-python', action='store_true',
+                    help='Run the python path even with --size > 100')
+parser.add_argument('--keep',
+                    help='Write the log to this file, and keep it. If the file exists, it is reused')
+args = parser.parse_args()
+
+Ncolumns = 8
+legend   = '# ' + ' '.join(f'c{i}' for i in range(Ncolumns)) + '\n'
+
+def write_log(filename):
+    # A block of lines, written repeatedly. Each block is 10000 records
+    rng   = np.random.default_rng(0)
+    block = np.round(rng.normal(size=(10000,Ncolumns)) * 1000, 3)
+    text  = ''.join(' '.join(f'{x:.3f}' for x in row) + '\n' for row in block)
+    with open(filename, 'w') as f:
+        f.write(legend)
+        Nbytes = len(legend)
+        while Nbytes < args.size * (1 << 20):
+            f.write(text)
+            Nbytes += len(text)
+
+def run(name, filename, slurp_kwargs, native):
+    _vnlog = vnlog._vnlog
+    if not native:
+        vnlog._vnlog = None
+    try:
+        with open(filename) as f:
+            t0  = time.perf_counter()
+            arr = vnlog._slurp_native(f, **slurp_kwargs) \
+                if native else vnlog.slurp(f, dtype = slurp_kwargs.get('dtype'))
+            dt  = time.perf_counter() - t0
+    finally:
+        vnlog._vnlog = _vnlog
+    if type(arr) is tuple:
+        arr = arr[0]
+    Nrecords = arr.shape[0]
+    Nbytes   = os.path.getsize(filename)
+    print(f"{name} {dt*1e9/Nrecords:.1f} {Nrecords/dt:.0f} {Nbytes/dt/1e6:.1f}")
+    sys.stdout.flush()
+
+if vnlog._vnlog is None:
+    print("The _vnlog extension isn't available", file=sys.stderr)
+    sys.exit(1)
+
+with tempfile.TemporaryDirectory() as d:
+    filename = args.keep if args.keep else d + '/bench.vnl'
+    if not os.path.exists(filename):
+        write_log(filename)
+
+    print("# case ns_per_record records_per_sec MBps")
+    dtype_subset = np.dtype([ ('c1 c3', float, (2,)),
+                              ('c6',    np.float32) ])
+    for dtype_name,dtype in (('float',  None),
+                             ('subset', dtype_subset)):
+        run(f"slurp/{dtype_name}/native-parallel", filename,
+            dict(dtype = dtype, Nthreads = args.threads), True)
+        run(f"slurp/{dtype_name}/native-1thread", filename,
+            dict(dtype = dtype, Nthreads = 1), True)
+        if args.size <= 100 or args.with_python:
+            run(f"slurp/{dtype_name}/loadtxt", filename,
+                dict(dtype = dtype), False)
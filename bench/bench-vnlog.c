@@ -0,0 +1,315 @@
+// The benchmark suite run by "make bench". Measures
+//
+// - the writer: _vnlog_emit_record() for several mixes of field types, sizes of
+//   binary fields and numbers of threads. The records go to a FILE that counts
+//   the bytes and throws them away
+//
+// - the parser: vnlog_parser_read_record() on synthetic files of several
+//   widths, read through a FILE, and mapped with vnlog_parser_init_mmap()
+//
+// The output is a vnlog with one row per case, so the results of two builds can
+// be compared:
+//
+//   make bench > before.vnl
+//   ... change things, rebuild ...
+//   make bench > after.vnl
+//   vnl-join -j case --vnl-sort - --vnl-suffix1 _before --vnl-suffix2 _after before.vnl after.vnl
+//
+// The writer cases have different numbers of fields, so they call the
+// _vnlog_...() functions directly, instead of going through a header made by
+// vnl-gen-header. Each context has room for MAX_FIELDS fields
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#define MAX_FIELDS     256
+#define VNLOG_N_FIELDS MAX_FIELDS
+#include "../vnlog.h"
+#include "../vnlog-parser.h"
+
+#define MSG(fmt, ...) \
+    fprintf(stderr, "%s:%d " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+
+static double now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec * 1e9 + (double)t.tv_nsec;
+}
+
+static void report(const char* name, long Nrecords, long Nbytes, double dt_ns)
+{
+    printf("%s %.1f %.0f %.1f\n",
+           name,
+           dt_ns / (double)Nrecords,
+           (double)Nrecords / dt_ns * 1e9,
+           (double)Nbytes   / dt_ns * 1e3);
+    fflush(stdout);
+}
+
+
+
+
+////////////////// Writer
+
+typedef struct
+{
+    const char* name;
+    int         Nfields;
+    long        Nrecords;
+    void      (*set)(struct vnlog_context_t* ctx, long i);
+} writer_case_t;
+
+static const char* strings[] = { "alpha", "bravo-charlie", "delta", "echo-foxtrot-golf" };
+static char binary_data[65536 + 64];
+
+static void set_ints(struct vnlog_context_t* ctx, long i)
+{
+    for(int j=0; j<8; j++)
+        _vnlog_set_field_value_int64_t(ctx, "i", j, i*(j+1) - 1000);
+}
+static void set_doubles(struct vnlog_context_t* ctx, long i)
+{
+    for(int j=0; j<8; j++)
+        _vnlog_set_field_value_double(ctx, "d", j, (double)i / (double)(j+3));
+}
+static void set_mixed(struct vnlog_context_t* ctx, long i)
+{
+    _vnlog_set_field_value_int64_t(ctx, "t",    0, 1700000000000000000LL + i*1000);
+    _vnlog_set_field_value_int    (ctx, "i",    1, (int)i);
+    _vnlog_set_field_value_uint8_t(ctx, "flag", 2, (uint8_t)i);
+    _vnlog_set_field_value_double (ctx, "x",    3, (double)i * 0.001);
+    _vnlog_set_field_value_double (ctx, "y",    4, 1.0 / (double)(i+1));
+    _vnlog_set_field_value_double (ctx, "z",    5, -3.5);
+    _vnlog_set_field_value_float  (ctx, "temp", 6, 20.0f + (float)(i % 100) * 0.1f);
+    _vnlog_set_field_value_ccharp (ctx, "name", 7, strings[i%4]);
+}
+static void set_strings(struct vnlog_context_t* ctx, long i)
+{
+    for(int j=0; j<4; j++)
+        _vnlog_set_field_value_ccharp(ctx, "s", j, strings[(i+j)%4]);
+}
+// A wide record, with most of the fields left empty
+static void set_sparse(struct vnlog_context_t* ctx, long i)
+{
+    for(int j=0; j<4; j++)
+        _vnlog_set_field_value_double(ctx, "d", j*64 + (int)(i%64), (double)i);
+}
+#define DEFINE_SET_BINARY(size)                                         \
+static void set_binary ## size(struct vnlog_context_t* ctx, long i)     \
+{                                                                       \
+    _vnlog_set_field_value_int   (ctx, "i", 0, (int)i);                 \
+    _vnlog_set_field_value_binary(ctx, "b", 1, &binary_data[i%64], size); \
+}
+DEFINE_SET_BINARY(16)
+DEFINE_SET_BINARY(256)
+DEFINE_SET_BINARY(4096)
+DEFINE_SET_BINARY(65536)
+
+static const writer_case_t writer_cases[] =
+{
+    { "ints8",       8,          1000000, set_ints       },
+    { "doubles8",    8,          1000000, set_doubles    },
+    { "mixed8",      8,          1000000, set_mixed      },
+    { "strings4",    4,          1000000, set_strings    },
+    { "sparse256",   MAX_FIELDS,  200000, set_sparse     },
+    { "binary16",    2,          1000000, set_binary16   },
+    { "binary256",   2,           500000, set_binary256  },
+    { "binary4096",  2,           100000, set_binary4096 },
+    { "binary65536", 2,            10000, set_binary65536},
+};
+
+// A FILE that counts what's written to it, and throws it away. Each fwrite()
+// is done holding the FILE lock, so the count needs no more locking
+static ssize_t count_write(void* cookie, const char* buf __attribute__((unused)), size_t size)
+{
+    *(long*)cookie += (long)size;
+    return (ssize_t)size;
+}
+
+typedef struct
+{
+    const writer_case_t*          c;
+    const struct vnlog_context_t* session;
+    long                          Nrecords;
+} writer_thread_t;
+
+static void* writer_thread(void* cookie)
+{
+    const writer_thread_t* t = cookie;
+
+    struct vnlog_context_t ctx;
+    _vnlog_init_child_ctx(&ctx, t->session, t->c->Nfields);
+    for(long i=0; i<t->Nrecords; i++)
+    {
+        t->c->set(&ctx, i);
+        _vnlog_emit_record(&ctx, t->c->Nfields);
+    }
+    _vnlog_free_ctx(&ctx, t->c->Nfields);
+    return NULL;
+}
+
+// Nthreads threads write c->Nrecords records between them, each from its own
+// context
+static void bench_writer(const writer_case_t* c, int Nthreads)
+{
+    long  Nbytes = 0;
+    FILE* fp     = fopencookie(&Nbytes, "w",
+                               (cookie_io_functions_t){ .write = count_write });
+    if(fp == NULL)
+    {
+        MSG("fopencookie() failed");
+        exit(1);
+    }
+
+    // The legend: "# f0 f1 f2 ..."
+    char legend[MAX_FIELDS*5 + 3] = "#";
+    for(int j=0; j<c->Nfields; j++)
+        sprintf(&legend[strlen(legend)], " f%d", j);
+    strcat(legend, "\n");
+
+    static struct vnlog_context_t session;
+    _vnlog_init_session_ctx(&session, c->Nfields);
+    _vnlog_set_output_FILE (&session, fp, c->Nfields);
+    _vnlog_emit_legend     (&session, legend, c->Nfields);
+    fflush(fp);
+    Nbytes = 0;
+
+    pthread_t       threads[Nthreads];
+    writer_thread_t args   [Nthreads];
+    const double t0 = now_ns();
+    for(int j=0; j<Nthreads; j++)
+    {
+        args[j] = (writer_thread_t){ .c        = c,
+                                     .session  = &session,
+                                     .Nrecords = c->Nrecords / Nthreads };
+        pthread_create(&threads[j], NULL, writer_thread, &args[j]);
+    }
+    for(int j=0; j<Nthreads; j++)
+        pthread_join(threads[j], NULL);
+    fflush(fp);
+    const double t1 = now_ns();
+
+    char name[128];
+    snprintf(name, sizeof(name), "write/%s/threads%d", c->name, Nthreads);
+    report(name, (c->Nrecords / Nthreads) * Nthreads, Nbytes, t1-t0);
+
+    _vnlog_free_ctx(&session, c->Nfields);
+    fclose(fp);
+}
+
+
+
+
+////////////////// Parser
+
+// Writes a synthetic vnlog with Ncolumns columns of numbers of various lengths,
+// about size bytes long, into a temporary file. Returns the number of records
+static long write_parser_input(FILE* fp, int Ncolumns, long size)
+{
+    fprintf(fp, "#");
+    for(int j=0; j<Ncolumns; j++)
+        fprintf(fp, " column%d", j);
+    fprintf(fp, "\n");
+
+    long Nrecords = 0;
+    while(ftell(fp) < size)
+    {
+        for(int j=0; j<Ncolumns; j++)
+        {
+            if(j % 4 == 3) fprintf(fp, "-");
+            else           fprintf(fp, "%.*f", j % 6, (double)Nrecords * 1.25 + j);
+            fputc(j == Ncolumns-1 ? '\n' : ' ', fp);
+        }
+        Nrecords++;
+    }
+    fflush(fp);
+    return Nrecords;
+}
+
+static void bench_parser(int Ncolumns, bool use_mmap)
+{
+    FILE* fp = tmpfile();
+    if(fp == NULL)
+    {
+        MSG("tmpfile() failed");
+        exit(1);
+    }
+    const long Nrecords = write_parser_input(fp, Ncolumns, 64L << 20);
+    const long Nbytes   = ftell(fp);
+
+    // Once to get the file into the page cache, and once to measure
+    double t0 = 0.0;
+    for(int pass=0; pass<2; pass++)
+    {
+        rewind(fp);
+        t0 = now_ns();
+
+        vnlog_parser_t ctx;
+        vnlog_parser_result_t result;
+        if(use_mmap)
+        {
+            // The tmpfile() has no name, but /proc gives it one
+            char filename[64];
+            snprintf(filename, sizeof(filename), "/proc/self/fd/%d", fileno(fp));
+            result = vnlog_parser_init_mmap(&ctx, filename, false);
+        }
+        else
+            result = vnlog_parser_init(&ctx, fp);
+        if(result != VNL_OK)
+        {
+            MSG("Couldn't initialize the parser");
+            exit(1);
+        }
+        long N = 0;
+        while(VNL_OK == (result = vnlog_parser_read_record(&ctx, use_mmap ? NULL : fp)))
+            N++;
+        vnlog_parser_free(&ctx);
+        if(result != VNL_EOF || N != Nrecords)
+        {
+            MSG("Parsed %ld records; expected %ld", N, Nrecords);
+            exit(1);
+        }
+    }
+    const double t1 = now_ns();
+
+    char name[128];
+    snprintf(name, sizeof(name), "%s/columns%d",
+             use_mmap ? "parse-mmap" : "parse", Ncolumns);
+    report(name, Nrecords, Nbytes, t1-t0);
+
+    fclose(fp);
+}
+
+
+
+
+int main(void)
+{
+    for(int i=0; i<(int)sizeof(binary_data); i++)
+        binary_data[i] = (char)(i*7 + (i>>5));
+
+    printf("# case ns_per_record records_per_sec MBps\n");
+
+    for(int i=0; i<(int)(sizeof(writer_cases)/sizeof(writer_cases[0])); i++)
+        bench_writer(&writer_cases[i], 1);
+
+    // The "mixed8" case from several threads
+    static const int Nthreads[] = {2, 4, 8};
+    for(int i=0; i<(int)(sizeof(Nthreads)/sizeof(Nthreads[0])); i++)
+        bench_writer(&writer_cases[2], Nthreads[i]);
+
+    static const int widths[] = {4, 16, 64, 256};
+    for(int i=0; i<(int)(sizeof(widths)/sizeof(widths[0])); i++)
+    {
+        bench_parser(widths[i], false);
+        bench_parser(widths[i], true);
+    }
+
+    return 0;
+}
@@ -9,6 +9,10 @@ our $VERSION = 1.00;
 use base 'Exporter';
 our @EXPORT_OK = qw();
 
+# The compiled implementation (vnlog-perlwrap.xs) is used if it was built. The
+# pure-perl implementation below is the fallback. Both work on the same objects
+our $have_xs = eval { require XSLoader; XSLoader::load(__PACKAGE__); 1 } ? 1 : 0;
+
 sub new
 {
     my $classname = shift;
@@ -21,7 +25,7 @@ sub new
     return $this;
 }
 
-sub parse
+sub _parse_pp
 {
     my ($this, $line) = @_;
 
@@ -93,7 +97,7 @@ sub getValues
     return $this->{values}
 }
 
-sub getValuesHash
+sub _getValuesHash_pp
 {
     my ($this) = @_;
 
@@ -119,6 +123,80 @@ sub getValuesHash
     return $this->{values_hash};
 }
 
+sub _splitFields_pp
+{
+    my ($line) = @_;
+    return map {$_ eq '-' ? undef : $_} split(' ', $line);
+}
+
+sub _readColumns_pp
+{
+    my ($this, $fh, $Nrows_max, $columns) = @_;
+
+    $this->{values}      = undef;
+    $this->{values_hash} = undef;
+    $this->{error}       = '';
+
+    my @icols;
+    my @columns_read;
+    my $Nrows = 0;
+    while( !$Nrows_max || $Nrows < $Nrows_max )
+    {
+        my $line = <$fh>;
+        last if !defined $line;
+
+        return undef if !_parse_pp($this, $line);
+        next if !defined $this->{values};
+
+        if( !@columns_read )
+        {
+            # The columns. A column given by key is the last one with that key,
+            # as with getValuesHash()
+            my @keys = @{$this->{keys}};
+            if( defined $columns )
+            {
+                for my $key (@$columns)
+                {
+                    my ($i) = grep { $keys[$_] eq $key } reverse 0..$#keys;
+                    if( !defined $i )
+                    {
+                        $this->{error} = "Unknown column '$key'";
+                        return undef;
+                    }
+                    push @icols, $i;
+                }
+            }
+            else
+            {
+                @icols = 0..$#keys;
+            }
+            @columns_read = map { [] } @icols;
+        }
+
+        for my $j (0..$#icols)
+        {
+            push @{$columns_read[$j]}, $this->{values}[$icols[$j]];
+        }
+        $Nrows++;
+    }
+
+    $this->{values} = undef;
+    return undef if !$Nrows;
+    return { map { $this->{keys}[$icols[$_]] => $columns_read[$_] } 0..$#icols };
+}
+
+sub readColumns
+{
+    my ($this, $fh, $Nrows_max, $columns) = @_;
+    return $have_xs ?
+      _readColumns_xs($this, $fh, $Nrows_max // 0, $columns) :
+      _readColumns_pp($this, $fh, $Nrows_max,      $columns);
+}
+
+*parse         = $have_xs ? \&_parse_xs         : \&_parse_pp;
+*getValuesHash = $have_xs ? \&_getValuesHash_xs : \&_getValuesHash_pp;
+*splitFields   = $have_xs ? \&_splitFields_xs   : \&_splitFields_pp;
+
 1;
 
 =head1 NAME
@@ -197,8 +275,40 @@ in the values returned here.
 
 =item *
 
+readColumns(fh, Nrows_max, columns)
+
+Reads up to Nrows_max records from the filehandle fh, or all the rest of them if
+Nrows_max is 0 or undef, and returns them a column at a time: a hash-ref mapping
+each key to a list-ref of the values in that column. If columns is given, it's a
+list-ref of the keys of the columns to read. Otherwise all the columns are read.
+Empty fields are undef, as in getValues(). The legend is read from fh, unless
+parse() read it already. Returns undef at the end of the data, or on error. Call
+error() to tell them apart: it returns '' at the end of the data. Once
+readColumns() reads from a filehandle, only readColumns() should read from it:
+with the compiled parser, it reads ahead. Batches of about a thousand records
+are the fastest to read and to process: much bigger batches don't fit into the
+CPU caches.
+
+=item *
+
+splitFields(line)
+
+A function, not a method. Splits a data line into its fields, and returns them
+as a list. Empty fields are undef, as in getValues(). Nothing is checked, so
+this is the fastest way to read a line if the caller deals with the legend and
+the comments itself.
+
 =back
 
+Vnlog::Parser has a compiled implementation, written in XS, which is built with
+the C library by C<make>. It's much faster, and it's used if it was built. If
+not, the pure-perl implementation is used. Both behave identically, except that
+the compiled readColumns() reads the data with the C parser, which follows the C
+library's reading of the format: only spaces and tabs separate fields, and a C<#>
+anywhere in a line starts a comment, in the legend too. And the C parser reports
+the details of any errors on stderr. C<$Vnlog::Parser::have_xs> is true if the
+compiled implementation is used.
+
 =head1 REPOSITORY
 
 L<https://github.com/dkogan/vnlog>
@@ -17,28 +17,118 @@ our @EXPORT_OK = qw(get_unbuffered_line parse_options read_and_preparse_input en
 use FindBin '$Bin';
 use lib "$Bin/lib";
 use Vnlog::Parser;
-use Fcntl qw(F_GETFD F_SETFD FD_CLOEXEC);
+use Fcntl qw(F_GETFD F_SETFD FD_CLOEXEC SEEK_SET SEEK_CUR);
 use Getopt::Long 'GetOptionsFromArray';
+use POSIX ();
+use Scalar::Util 'refaddr';
 
 
 
 
-# Reads a line from STDIN one byte at a time. This means that as far as the OS
-# is concerned we never read() past our line.
+# Reads a line from the given filehandle. This is used to read the preamble and
+# the legend of a vnlog, before exec()-ing some other program to read the rest.
+# As far as the OS is concerned, we never read() past the legend: once this
+# returns the legend, the file descriptor is at the start of the next line.
+#
+# The preamble (comments, empty lines) and the legend are read in one pass, in
+# large blocks, and the data we read past each line is kept here. When we return
+# the legend (or any other line that's not a comment), we give back the data we
+# read past it. Regular files seek back. Pipes can't seek: their file descriptor
+# is replaced by a pipe from a helper process that writes out the data read past
+# the legend, and then the rest of the original pipe. This happens once per
+# preamble. The first bytes of a pipe are read one at a time, so a normal-sized
+# preamble needs no helper at all
+my $unbuffered_bytewise_max = 1024;
+my $unbuffered_block_size   = 65536;
+
+# The state of each handle we're reading a preamble from. Cleared once we're
+# past the preamble
+my %unbuffered_state;
+
 sub get_unbuffered_line
 {
     my $fd = shift;
 
-    my $line = '';
+    my $key   = refaddr(*{$fd}{IO});
+    my $state = $unbuffered_state{$key} //=
+      { seekable       => (-f $fd && defined sysseek($fd, 0, SEEK_CUR)),
+        buffered       => '',
+        Nread_bytewise => 0 };
 
+    my $line;
     while(1)
     {
-        my $c = '';
-        return undef unless 1 == sysread($fd, $c, 1);
+        my $i = index($state->{buffered}, "\n");
+        if( $i >= 0 )
+        {
+            $line = substr($state->{buffered}, 0, $i + 1, '');
+            last;
+        }
+
+        # While a pipe is read one byte at a time, nothing past the current
+        # line is ever buffered
+        my $bytewise =
+          !$state->{seekable} && $state->{Nread_bytewise} < $unbuffered_bytewise_max;
+        last unless sysread($fd, $state->{buffered},
+                            $bytewise ? 1 : $unbuffered_block_size,
+                            length $state->{buffered});
+        $state->{Nread_bytewise}++ if $bytewise;
+    }
+
+    # Comments are the same as in Vnlog::Parser. Past them the caller is done
+    # with the preamble, so I give back the data I read past this line
+    if( !defined $line || $line !~ /^\s*(?:#[#!]|#\s*$|$)/ )
+    {
+        if( length $state->{buffered} )
+        {
+            if( $state->{seekable} )
+            {
+                defined sysseek($fd, -length($state->{buffered}), SEEK_CUR)
+                  or confess "Couldn't seek: $!";
+            }
+            else
+            {
+                hand_off_unbuffered_remainder($fd, $state->{buffered});
+            }
+        }
+        delete $unbuffered_state{$key};
+    }
+
+    return $line;
+}
+
+# We read $remainder past our line from the pipe $fd. I replace $fd (keeping its
+# file descriptor number) with a new pipe. A helper process writes $remainder
+# into it, and then the rest of the old pipe
+sub hand_off_unbuffered_remainder
+{
+    my ($fd, $remainder) = @_;
+
+    pipe(my $pipe_read, my $pipe_write) or confess "Couldn't create a pipe: $!";
+
+    my $pid = fork() // confess "Can't fork: $!";
+    if (!$pid)
+    {
+        # child
+        close $pipe_read;
+        while( length $remainder )
+        {
+            my $N = syswrite($pipe_write, $remainder);
+            POSIX::_exit(1) if !$N;
+            substr($remainder, 0, $N, '');
+        }
 
-        $line .= $c;
-        return $line if $c eq "\n";
+        # The rest of the data is copied by cat
+        defined POSIX::dup2(fileno($fd),         0) or POSIX::_exit(1);
+        defined POSIX::dup2(fileno($pipe_write), 1) or POSIX::_exit(1);
+        exec 'cat' or POSIX::_exit(1);
     }
+
+    # parent
+    close $pipe_write;
+    defined POSIX::dup2(fileno($pipe_read), fileno($fd))
+      or confess "Couldn't dup2: $!";
+    close $pipe_read;
 }
 
 
@@ -71,18 +161,27 @@ sub open_file_as_pipe
         }
     }
 
-    # This invocation of 'mawk' or cat below is important. I want to read the
-    # legend in this perl program from a FILE, and then exec the underlying
-    # application, with the inner application using the post-legend
-    # file-descriptor. Conceptually this works, BUT the inner application
-    # expects to get a filename that it calls open() on, NOT an already-open
-    # file-descriptor. I can get an open-able filename from /dev/fd/N, but on
-    # Linux this is a plain symlink to the actual file, so the file would be
-    # re-opened, and the legend visible again. By using a filtering process
-    # (grep here), /dev/fd/N is a pipe, not a file. And opening this pipe DOES
-    # start reading the file from the post-legend location
+    # This invocation of the comment-stripping filter or cat below is
+    # important. I want to read the legend in this perl program from a FILE,
+    # and then exec the underlying application, with the inner application
+    # using the post-legend file-descriptor. Conceptually this works, BUT the
+    # inner application expects to get a filename that it calls open() on, NOT
+    # an already-open file-descriptor. I can get an open-able filename from
+    # /dev/fd/N, but on Linux this is a plain symlink to the actual file, so the
+    # file would be re-opened, and the legend visible again. By using a
+    # filtering process, /dev/fd/N is a pipe, not a file. And opening this pipe
+    # DOES start reading the file from the post-legend location
 
     my $pipe_cmd = $input_filter;
+    if(!defined $pipe_cmd && -x "$Bin/vnl-strip-comments")
+    {
+        # The compiled filter, if it was built. It produces the same output as
+        # the mawk script below, but it is MUCH faster: the lines that need no
+        # changes are passed through untouched, with splice() if possible. It
+        # writes out each chunk of data as soon as it is read, so it works
+        # unbuffered as it is
+        $pipe_cmd = ["$Bin/vnl-strip-comments"];
+    }
     if(!defined $pipe_cmd)
     {
         # mawk script to strip away comments and trailing whitespace (GNU coreutils
@@ -666,10 +765,20 @@ which is identical to the basic form
  while(<STDIN>)
  { ... }
 
-except C<get_unbuffered_line> reads I<only> the bytes in the line from the OS.
-The rest is guaranteed to be available for future reading. This is useful for
-tools that bootstrap vnlog processing by reading up-to the legend, and then
-C<exec> some other tool to process the rest.
+except that once C<get_unbuffered_line> returns the legend, the OS hasn't
+given us anything past it. The rest is guaranteed to be available for future
+reading. This is useful for tools that bootstrap vnlog processing by reading
+up-to the legend, and then C<exec> some other tool to process the rest.
+
+This is efficient even with very long preambles and legends. The comments and
+the legend are read in large blocks, and the data read past the lines is kept
+in the process until the legend (or any other non-comment line) is returned.
+Then regular files seek back to the end of that line. For pipes the file
+descriptor is replaced by a pipe (with the same file descriptor number) from a
+helper process, which writes out the data that was read past the legend, and
+then copies the rest of the original pipe. This happens at most once per
+preamble. The first 1024 bytes of a pipe are read one at a time, so short
+preambles don't need the helper.
 
 =back
 
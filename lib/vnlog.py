@@ -11,7 +11,7 @@ Synopsis:
 Vnlog is simple, and you don't NEED a parser to read it, but this library makes
 it a bit nicer.
 
-This module provides three different ways to parse vnlog
+This module provides four different ways to parse vnlog
 
 1. slurp the whole thing into a numpy array: the slurp() function. Basic usage:
 
@@ -19,9 +19,12 @@ This module provides three different ways to parse vnlog
    arr,list_keys,dict_key_index = \
         vnlog.slurp(filename_or_fileobject)
 
-   This parses out the legend, and then calls numpy.loadtxt(). Null data values
-   ('-') are not supported at this time. A structured dtype can be passed-in to
-   read non-numerical data. See the docstring for vnlog.slurp() for details
+   This parses out the legend, and then reads the data. If the compiled _vnlog
+   extension is available and a file on disk is given, the data is parsed in C,
+   by several threads, and null data values ('-') are read as NaN. Otherwise
+   numpy.loadtxt() is used, and null values are not supported. A structured
+   dtype can be passed-in to read non-numerical data. See the docstring for
+   vnlog.slurp() for details
 
 2. Iterate through the records: vnlog class, used as an iterator. Basic usage:
 
@@ -31,7 +34,18 @@ This module provides three different ways to parse vnlog
 
    Null data values are represented as None
 
-3. Parse incoming lines individually: vnlog class, using the parse() method.
+3. Iterate through batches of columns: the batches() function. Basic usage:
+
+   import vnlog
+   for b in vnlog.batches(filename_or_fileobject,
+                          columns = ('time','height')):
+       print(b['time'].shape, np.mean(b['height']))
+
+   Each batch is a dict of numpy arrays of up to batch_size records, so large
+   files and pipes can be processed in vectorized form without reading all of
+   the data into memory. Null data values are NaN
+
+4. Parse incoming lines individually: vnlog class, using the parse() method.
    Basic usage:
 
    import vnlog
@@ -43,8 +57,8 @@ This module provides three different ways to parse vnlog
            continue
        print(d['time'],d['height'])
 
-Most of the time you'd use options 1 or 2 above. Option 3 is the most general,
-but also the most verbose
+Most of the time you'd use options 1, 2 or 3 above. Option 4 is the most
+general, but also the most verbose
 
 '''
 
@@ -52,6 +66,11 @@ but also the most verbose
 from __future__ import print_function
 import re
 
+try:
+    import _vnlog
+except ImportError:
+    _vnlog = None
+
 class vnlog:
 
     r'''Class to facilitate vnlog parsing
@@ -223,6 +242,160 @@ class vnlog:
     next = __next__
 
 
+# Expands the fields in a dtype into a flat list of (name, dtype, offset). For
+# vnlog purposes this doesn't support multiple levels of fields and it doesn't
+# support unnamed fields. It DOES support (require!) compound elements with
+# whitespace-separated field names, such as 'x y z' for a shape-(3,) field. Each
+# element of such a field is yielded separately, with the dtype and offset of
+# that element.
+#
+# This function is an analogue of field_type_grow_recursive() in
+# https://github.com/numpy/numpy/blob/9815c16f449e12915ef35a8255329ba26dacd5c0/numpy/core/src/multiarray/textreading/field_types.c#L95
+def _fields_in_dtype(dtype,
+                     split_name = None,
+                     name       = None,
+                     offset     = 0):
+    import numpy as np
+
+    if dtype.subdtype is not None:
+        if split_name is None:
+            raise Exception("only structured dtypes with named fields are supported")
+        size = np.prod(dtype.shape)
+        if size != len(split_name):
+            raise Exception(f'Field "{name}" has {len(split_name)} elements, but the dtype has it associated with a field of shape {dtype.shape} with {size} elements. The sizes MUST match')
+        base = dtype.base
+        for i in range(len(split_name)):
+            yield split_name[i], base, offset + i*base.itemsize
+        return
+
+    if dtype.fields is not None:
+        if split_name is not None:
+            raise Exception("structured dtype with nested fields unsupported")
+        for name1 in dtype.names:
+            field_descr, offset1 = dtype.fields[name1][:2]
+
+            yield from _fields_in_dtype(field_descr,
+                                        name       = name1,
+                                        split_name = name1.split(),
+                                        offset     = offset + offset1)
+        return
+
+    if split_name is None:
+        raise Exception("structured dtype with unnamed fields unsupported")
+    if len(split_name) != 1:
+        raise Exception(f"Field '{name}' is a scalar so it may not contain whitespace in its name")
+    yield split_name[0], dtype, offset
+
+
+# The name of the file on disk that f reads, if f is a regular file that hasn't
+# been read yet. None otherwise
+def _unread_file_name(f):
+    import os
+    import stat
+    try:
+        name = f.name
+        st   = os.fstat(f.fileno())
+        if not isinstance(name, str) or \
+           not stat.S_ISREG(st.st_mode) or \
+           f.tell() != 0:
+            return None
+        st_name = os.stat(name)
+        if (st.st_dev, st.st_ino) != (st_name.st_dev, st_name.st_ino):
+            return None
+    except Exception:
+        return None
+    return name
+
+
+def _slurp_native(f,
+                  *,
+                  dtype      = None,
+                  Nthreads   = 0,
+                  chunk_size = 0):
+    r'''Reads a whole vnlog into memory with the _vnlog extension
+
+    This is an internal function. Returns what _slurp() returns, or None if the
+    extension can't read this f or this dtype; the caller then uses _slurp().
+    Nthreads = 0 uses one thread per CPU. chunk_size = 0 uses the default chunk
+    size of the C parser
+
+    '''
+    if _vnlog is None:
+        return None
+    filename = _unread_file_name(f)
+    if filename is None:
+        return None
+
+    import numpy as np
+
+    def native_kind(dtype):
+        if not dtype.isnative:
+            return None
+        if dtype.kind == 'f' and dtype.itemsize in (4,8):
+            return 'f'
+        if dtype.kind in 'iu' and dtype.itemsize in (1,2,4,8):
+            return dtype.kind
+        if dtype.kind in 'SU' and dtype.itemsize > 0:
+            return dtype.kind
+        return None
+
+    structured = \
+        isinstance(dtype, np.dtype) and \
+        ( dtype.fields is not None or \
+          dtype.subdtype is not None )
+
+    if not structured:
+        try:
+            dtype = np.dtype(dtype)
+        except Exception:
+            return None
+        if dtype.fields is not None or dtype.subdtype is not None:
+            # A structured dtype given in some other form. numpy.loadtxt()
+            # interprets it
+            return None
+        kind = native_kind(dtype)
+        if kind is None:
+            return None
+
+        def layout(keys):
+            return \
+                ( [ (i, i*dtype.itemsize, kind, dtype.itemsize) \
+                    for i in range(len(keys)) ],
+                  max(len(keys),1) * dtype.itemsize )
+    else:
+        fields = list(_fields_in_dtype(dtype))
+        if any(native_kind(field_dtype) is None for _,field_dtype,_ in fields):
+            return None
+
+        def layout(keys):
+            dict_key_index = { keys[i]: i for i in range(len(keys)) }
+            l = []
+            for name, field_dtype, offset in fields:
+                try:
+                    i_in = dict_key_index[name]
+                except:
+                    raise Exception(f"The given dtype contains field {name=} but this doesn't appear in the vnlog columns {keys=}")
+                l.append( (i_in, offset, native_kind(field_dtype), field_dtype.itemsize) )
+            return l, dtype.itemsize
+
+    keys, data, Nrows = _vnlog.slurp(filename, layout,
+                                     Nthreads   = Nthreads,
+                                     chunk_size = chunk_size)
+
+    # Like the python path, I read the file to the end
+    import os
+    f.seek(0, os.SEEK_END)
+
+    if structured:
+        return np.frombuffer(data, dtype=dtype)
+
+    # numpy.loadtxt(ndmin=2) returns an array of shape (0,1) if there's no data
+    arr = np.frombuffer(data, dtype=dtype).reshape(Nrows, len(keys)) \
+        if Nrows > 0 else np.zeros((0,1), dtype=dtype)
+    dict_key_index = { keys[i]: i for i in range(len(keys)) }
+    return arr, keys, dict_key_index
+
+
 def _slurp(f,
            *,
            dtype = None):
@@ -233,48 +406,11 @@ def _slurp(f,
     See the docs for slurp() for details
 
     '''
-    import numpy as np
-
-
-    # Expands the fields in a dtype into a flat list of names. For vnlog
-    # purposes this doesn't support multiple levels of fields and it doesn't
-    # support unnamed fields. It DOES support (require!) compound elements with
-    # whitespace-separated field names, such as 'x y z' for a shape-(3,) field.
-    #
-    # This function is an analogue of field_type_grow_recursive() in
-    # https://github.com/numpy/numpy/blob/9815c16f449e12915ef35a8255329ba26dacd5c0/numpy/core/src/multiarray/textreading/field_types.c#L95
-    def field_names_in_dtype(dtype,
-                             split_name = None,
-                             name       = None):
-
-        if dtype.subdtype is not None:
-            if split_name is None:
-                raise Exception("only structured dtypes with named fields are supported")
-            size = np.prod(dtype.shape)
-            if size != len(split_name):
-                raise Exception(f'Field "{name}" has {len(split_name)} elements, but the dtype has it associated with a field of shape {dtype.shape} with {size} elements. The sizes MUST match')
-            yield from split_name
-            return
-
-        if dtype.fields is not None:
-            if split_name is not None:
-                raise("structured dtype with nested fields unsupported")
-            for name1 in dtype.names:
-                tup = dtype.fields[name1]
-                field_descr = tup[0]
-
-                yield from field_names_in_dtype(field_descr,
-                                                name       = name1,
-                                                split_name = name1.split(),)
-            return
-
-        if split_name is None:
-            raise Exception("structured dtype with unnamed fields unsupported")
-        if len(split_name) != 1:
-            raise Exception(f"Field '{name}' is a scalar so it may not contain whitespace in its name")
-        yield split_name[0]
-
+    result = _slurp_native(f, dtype=dtype)
+    if result is not None:
+        return result
 
+    import numpy as np
 
     parser = vnlog()
 
@@ -306,7 +442,7 @@ def _slurp(f,
     # columns in the input (from the vnl legend that we just parsed), and
     # load everything with np.loadtxt()
 
-    names_dtype = list(field_names_in_dtype(dtype))
+    names_dtype = [name for name,_,_ in _fields_in_dtype(dtype)]
 
     # We have input fields in the vnl represented in:
     # - keys
@@ -374,8 +510,13 @@ SYNOPSIS
     print(arr['temperature'])
     ---> array([34., 35.])
 
-This function is primarily a wrapper around numpy.loadtxt(), which does most of
-the work. Null data values ('-') are not supported at this time.
+If the compiled _vnlog extension is available, and f is a file on disk (a
+filename, or a file object that hasn't been read yet), the data is parsed in C,
+by several threads. Null data values ('-') are then read as NaN into
+floating-point columns, and as '-' into string columns; a null in an integer
+column is an error. Otherwise, this function is a wrapper around
+numpy.loadtxt(), which does most of the work, and null data values are not
+supported. The results are otherwise the same.
 
 A dtype can be given in a keyword argument. If this is a base type (something
 like 'float' or 'np.int8'), the returned array will be composed entirely of
@@ -438,6 +579,186 @@ RETURN VALUE
 
 
 
+# A function that returns some of the data in f: f.read or something like it.
+# It mustn't wait for more than it needs: a live pipe shouldn't have to fill a
+# whole buffer before we see the lines that are already there
+def _read_function(f):
+    import os
+    import stat
+
+    if hasattr(f, 'read1'):
+        # binary
+        return f.read1
+    try:
+        if not stat.S_ISREG(os.fstat(f.fileno()).st_mode):
+            # A text pipe or terminal. Whole lines only
+            return lambda size: f.readline()
+    except Exception:
+        pass
+    return f.read
+
+
+def _batches(f,
+             *,
+             columns    = None,
+             dtype      = float,
+             batch_size = 65536):
+    r'''Reads a vnlog in batches of columns
+
+    This is an internal function. The argument is a file object, not a filename.
+
+    See the docs for batches() for details
+
+    '''
+    import numpy as np
+
+    def kind_of(key):
+        d = np.dtype(dtype[key] if isinstance(dtype, dict) else dtype)
+        if d.kind not in 'fiu':
+            raise Exception(f"Column '{key}': batches() can only read numerical dtypes. Got {d}")
+        return d, ('f' if d.kind == 'f' else 'i')
+
+    def make_batch(columns, dtypes, arrays):
+        batch = {}
+        for key,d,arr in zip(columns, dtypes, arrays):
+            batch[key] = arr if arr.dtype == d else arr.astype(d)
+        return batch
+
+    if _vnlog is not None:
+        reader = _vnlog.batch_reader(_read_function(f))
+        if columns is None:
+            columns = reader.keys
+        columns = list(columns)
+        kinds   = [kind_of(key) for key in columns]
+        dtypes  = [d for d,_ in kinds]
+        reader.select(columns, [k for _,k in kinds], batch_size)
+
+        while True:
+            b = reader.read()
+            if b is None:
+                return
+            Nrows, values, Nnulls = b
+            arrays = []
+            for key,(_,k),v,Nnull in zip(columns, kinds, values, Nnulls):
+                if k == 'i' and Nnull:
+                    raise Exception(f"Column '{key}' has null values, but an integer dtype")
+                arrays.append(np.frombuffer(v, dtype = float if k == 'f' else np.int64))
+            yield make_batch(columns, dtypes, arrays)
+
+    # No compiled extension. Use the python parser
+    parser = vnlog()
+    for line in f:
+        parser.parse(line)
+        if parser.keys() is not None:
+            break
+    else:
+        raise Exception("vnlog parser did not find a legend line")
+    keys = parser.keys()
+    if columns is None:
+        columns = keys
+    columns = list(columns)
+    for key in columns:
+        if key not in keys:
+            raise KeyError(f"The vnlog has no column '{key}'")
+    kinds   = [kind_of(key) for key in columns]
+    dtypes  = [d for d,_ in kinds]
+    indices = [keys.index(key) for key in columns]
+
+    def flush(rows):
+        arrays = []
+        for i,(key,(_,k)) in zip(indices, zip(columns, kinds)):
+            values = [row[i] for row in rows]
+            if k == 'i':
+                if None in values:
+                    raise Exception(f"Column '{key}' has null values, but an integer dtype")
+                arrays.append(np.array([int(x) for x in values], dtype=np.int64))
+            else:
+                arrays.append(np.array([float('nan') if x is None else float(x) for x in values],
+                                       dtype=float))
+        return make_batch(columns, dtypes, arrays)
+
+    rows = []
+    for line in f:
+        parser.parse(line)
+        values = parser.values()
+        if values is None:
+            continue
+        rows.append(values)
+        if len(rows) == batch_size:
+            yield flush(rows)
+            rows = []
+    if rows:
+        yield flush(rows)
+
+
+def batches(f,
+            *,
+            columns    = None,
+            dtype      = float,
+            batch_size = 65536):
+    r'''Reads a vnlog in batches of columns
+
+SYNOPSIS
+
+    import vnlog
+
+    for b in vnlog.batches(filename_or_fileobject,
+                           columns = ('time', 'x')):
+        print( np.mean(b['x']) )
+
+    # A live pipe, with integer timestamps
+    for b in vnlog.batches(sys.stdin,
+                           columns    = ('time', 'x'),
+                           dtype      = dict(time = int, x = float),
+                           batch_size = 1000):
+        process(b['time'], b['x'])
+
+Each batch is a dict mapping the column names to numpy arrays of their values
+in up to batch_size consecutive records. Only one batch is in memory at a time,
+so this reads arbitrarily large files, and pipes, in vectorized form without
+slurping everything. Each batch is a new set of arrays, so the caller can keep
+them.
+
+If the compiled _vnlog extension is available, the data is read and parsed in
+C. Otherwise the python parser is used, which is much slower.
+
+This reads numerical data only. Null values ('-') are NaN in floating-point
+columns. Integer columns can't have null values.
+
+ARGUMENTS
+
+- f: a filename or a readable Python "file" object. We read this until the end.
+  The legend is read when the first batch is requested
+
+- columns: an iterable of the names of the columns to read. If omitted or None,
+  all the columns are read
+
+- dtype: the dtype of the arrays. Either one dtype for all the columns, or a
+  dict mapping the column names to their dtypes. Must be floating-point or
+  integer. float by default
+
+- batch_size: the maximum number of records in each batch. Each batch has this
+  many records, except the last one. 65536 by default
+
+RETURN VALUE
+
+A generator of dicts mapping the column names to numpy arrays
+
+    '''
+
+    if type(f) is str:
+        with open(f, 'r') as fh:
+            yield from _batches(fh,
+                                columns    = columns,
+                                dtype      = dtype,
+                                batch_size = batch_size)
+    else:
+        yield from _batches(f,
+                            columns    = columns,
+                            dtype      = dtype,
+                            batch_size = batch_size)
+
+
 # Basic usage. More examples in test_python_parser.py
 if __name__ == '__main__':
 
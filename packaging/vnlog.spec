@@ -95,6 +95,8 @@ make clean
 %{_bindir}/vnl-ts
 %{_bindir}/vnl-tac
 %{_bindir}/vnl-paste
+%{_bindir}/vnl-shm-cat
+%{_bindir}/vnl-decode
 %doc %{_mandir}/man1/vnl-filter.1.gz
 %doc %{_mandir}/man1/vnl-tail.1.gz
 %doc %{_mandir}/man1/vnl-sort.1.gz
@@ -104,5 +106,7 @@ make clean
 %doc %{_mandir}/man1/vnl-align.1.gz
 %doc %{_mandir}/man1/vnl-ts.1.gz
 %doc %{_mandir}/man1/vnl-tac.1.gz
+%doc %{_mandir}/man1/vnl-shm-cat.1.gz
+%doc %{_mandir}/man1/vnl-decode.1.gz
 %{_datadir}/zsh/*
 %{_datadir}/bash-completion/*
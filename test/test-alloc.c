@@ -0,0 +1,89 @@
+// Checks that logging doesn't touch the heap once the buffers have grown to
+// the size of the records. malloc() and friends are replaced here with wrappers
+// that count the calls. Binary fields are logged both copied and borrowed, from
+// the global context and from a child context. The records go to stdout
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vnlog_fields_generated1.h"
+
+#define MSG(fmt, ...) \
+    fprintf(stderr, "%s:%d " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+
+#define NRECORDS 100000
+
+// glibc's allocator, under its internal names
+void* __libc_malloc (size_t size);
+void* __libc_calloc (size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void  __libc_free   (void* ptr);
+
+static bool counting = false;
+static long Nallocs  = 0;
+
+void* malloc(size_t size)
+{
+    if(counting) Nallocs++;
+    return __libc_malloc(size);
+}
+void* calloc(size_t n, size_t size)
+{
+    if(counting) Nallocs++;
+    return __libc_calloc(n, size);
+}
+void* realloc(void* ptr, size_t size)
+{
+    if(counting) Nallocs++;
+    return __libc_realloc(ptr, size);
+}
+void free(void* ptr)
+{
+    if(counting && ptr != NULL) Nallocs++;
+    __libc_free(ptr);
+}
+
+static void write_records(struct vnlog_context_t* ctx, int N, int i0)
+{
+    char data[1000];
+    for(int i=0; i<N; i++)
+    {
+        const int len = (i0 + i) % (int)sizeof(data);
+        memset(data, i0 + i, len);
+
+        vnlog_set_field_value_ctx__w(ctx, i0 + i);
+        vnlog_set_field_value_ctx__y(ctx, "xyz");
+        vnlog_set_field_value_ctx__z(ctx, 0.5 * i);
+        if(i % 2)
+            vnlog_set_field_value_ctx__d(ctx, data, len);
+        else
+            vnlog_set_field_value_borrowed_ctx__d(ctx, data, len);
+        vnlog_emit_record_ctx(ctx);
+    }
+}
+
+int main(void)
+{
+    vnlog_emit_legend();
+
+    struct vnlog_context_t ctx;
+    vnlog_init_child_ctx(&ctx, NULL);
+
+    // Warm up: the buffers grow to the largest record
+    write_records(NULL, 1000, 0);
+    write_records(&ctx, 1000, 0);
+
+    counting = true;
+    write_records(NULL, NRECORDS, 1000);
+    write_records(&ctx, NRECORDS, 1000);
+    counting = false;
+
+    vnlog_free_ctx(&ctx);
+
+    if(Nallocs != 0)
+    {
+        MSG("Logging %d records did %ld heap calls; wanted 0", 2*NRECORDS, Nallocs);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,60 @@
+// Writes records from many threads into an asynchronous session. Usage:
+//
+//   test-async block|drop
+//
+// Each thread writes its index into "w" and a running counter into "x". With
+// the "block" policy every record must appear, with the records from each
+// thread in order. With "drop", records may be lost, and the number lost is
+// reported in a trailing comment
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "vnlog_fields_generated1.h"
+
+#define NTHREADS 8
+#define NRECORDS 20000
+
+static void* writer(void* cookie)
+{
+    const int ithread = (int)(intptr_t)cookie;
+
+    struct vnlog_context_t ctx;
+    vnlog_init_child_ctx(&ctx, NULL);
+    for(int i=0; i<NRECORDS; i++)
+    {
+        vnlog_set_field_value_ctx__w(&ctx, ithread);
+        vnlog_set_field_value_ctx__z(&ctx, (double)i);
+        vnlog_emit_record_ctx(&ctx);
+    }
+    vnlog_free_ctx(&ctx);
+    return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc != 2)
+    {
+        fprintf(stderr, "Usage: %s block|drop\n", argv[0]);
+        return 1;
+    }
+
+    const bool drop = (0 == strcmp(argv[1], "drop"));
+
+    // A small ring for "drop", so that we actually drop something
+    vnlog_set_async(NULL,
+                    drop ? 4096 : 0,
+                    drop ? VNLOG_ASYNC_DROP : VNLOG_ASYNC_BLOCK);
+    vnlog_emit_legend();
+
+    pthread_t threads[NTHREADS];
+    for(int i=0; i<NTHREADS; i++)
+        pthread_create(&threads[i], NULL, writer, (void*)(intptr_t)i);
+    for(int i=0; i<NTHREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    vnlog_flush();
+    vnlog_printf("## dropped %" PRIu64 "\n", vnlog_async_Ndropped(NULL));
+    vnlog_flush();
+    return 0;
+}
@@ -0,0 +1,156 @@
+// Checks the base64 implementations against each other. Every implementation
+// this CPU supports must encode exactly like the scalar libb64 encoder, and
+// must decode that back to the original data. Invalid input must be rejected
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../vnlog-base64.h"
+
+#define MSG(fmt, ...) \
+    fprintf(stderr, "%s:%d " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+
+static int Nfailed = 0;
+
+// xorshift: I want a reproducible sequence, independent of the libc
+static uint64_t rng_state = 0xFEDCBA9876543210ull;
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static void check_known(vnlog_base64_impl_t impl,
+                        const char* plain, const char* encoded)
+{
+    char buf[256];
+    const int len = _vnlog_base64_encode_impl(impl, buf, sizeof(buf), plain, (int)strlen(plain));
+    if(len != (int)strlen(encoded) || 0 != strcmp(buf, encoded))
+    {
+        MSG("%s: encoding '%s' gave '%s'; wanted '%s'",
+            _vnlog_base64_impl_name(impl), plain, buf, encoded);
+        Nfailed++;
+    }
+
+    const int len_decoded = _vnlog_base64_decode_impl(impl, buf, sizeof(buf), encoded, (int)strlen(encoded));
+    if(len_decoded != (int)strlen(plain) || 0 != memcmp(buf, plain, len_decoded))
+    {
+        MSG("%s: decoding '%s' failed", _vnlog_base64_impl_name(impl), encoded);
+        Nfailed++;
+    }
+}
+
+// The buffers are allocated with the exact sizes, so any overrun is caught by
+// a memory checker
+static void check_roundtrip(vnlog_base64_impl_t impl, const char* src, int srclen)
+{
+    const int dstlen = vnlog_base64_dstlen_to_encode(srclen);
+    char* want = malloc(dstlen);
+    char* got  = malloc(dstlen);
+    const int len_want = _vnlog_base64_encode_scalar  (      want, dstlen, src, srclen);
+    const int len_got  = _vnlog_base64_encode_impl(impl, got,  dstlen, src, srclen);
+    if(len_want != len_got || 0 != memcmp(want, got, len_want+1))
+    {
+        MSG("%s: encoding %d bytes doesn't match the scalar encoder",
+            _vnlog_base64_impl_name(impl), srclen);
+        Nfailed++;
+    }
+
+    // Exactly-sized output buffer
+    char* decoded = malloc(srclen > 0 ? srclen : 1);
+    const int len_decoded = _vnlog_base64_decode_impl(impl, decoded, srclen, want, len_want);
+    if(len_decoded != srclen || 0 != memcmp(decoded, src, srclen))
+    {
+        MSG("%s: decoding %d bytes didn't round-trip",
+            _vnlog_base64_impl_name(impl), srclen);
+        Nfailed++;
+    }
+    // Too-small output buffer
+    if(srclen > 0 &&
+       0 <= _vnlog_base64_decode_impl(impl, decoded, srclen-1, want, len_want))
+    {
+        MSG("%s: decoding %d bytes into a too-small buffer wasn't rejected",
+            _vnlog_base64_impl_name(impl), srclen);
+        Nfailed++;
+    }
+
+    // Corrupt one character. This must be rejected by everybody
+    if(len_want > 0)
+    {
+        static const char invalid[] = "!@#$%^&*()-_.,:;\"' \n\x80\xff";
+        const int i = (int)(rng() % len_want);
+        const char c = want[i];
+        want[i] = invalid[rng() % (sizeof(invalid)-1)];
+        if(0 <= _vnlog_base64_decode_impl(impl, decoded, srclen, want, len_want))
+        {
+            MSG("%s: decoding corrupted data (%d bytes, at %d) wasn't rejected",
+                _vnlog_base64_impl_name(impl), srclen, i);
+            Nfailed++;
+        }
+        want[i] = c;
+    }
+
+    free(want);
+    free(got);
+    free(decoded);
+}
+
+int main(void)
+{
+    int Nimpls = 0;
+    for(vnlog_base64_impl_t impl = 0; impl < VNLOG_BASE64_N_IMPLS; impl++)
+    {
+        if(!_vnlog_base64_impl_available(impl))
+            continue;
+        Nimpls++;
+
+        check_known(impl, "",       "");
+        check_known(impl, "f",      "Zg==");
+        check_known(impl, "fo",     "Zm8=");
+        check_known(impl, "foo",    "Zm9v");
+        check_known(impl, "foobar", "Zm9vYmFy");
+        check_known(impl,
+                    "The quick brown fox jumps over the lazy dog, many many times over",
+                    "VGhlIHF1aWNrIGJyb3duIGZveCBqdW1wcyBvdmVyIHRoZSBsYXp5IGRvZywgbWFueSBtYW55IHRpbWVzIG92ZXI=");
+
+        // Bad lengths and bad padding
+        char buf[16];
+        if(0 <= _vnlog_base64_decode_impl(impl, buf, sizeof(buf), "Zm9", 3) ||
+           0 <= _vnlog_base64_decode_impl(impl, buf, sizeof(buf), "Z===", 4) ||
+           0 <= _vnlog_base64_decode_impl(impl, buf, sizeof(buf), "Zm=v", 4) ||
+           0 <= _vnlog_base64_decode_impl(impl, buf, sizeof(buf), "Zg==Zm9v", 8))
+        {
+            MSG("%s: invalid input wasn't rejected", _vnlog_base64_impl_name(impl));
+            Nfailed++;
+        }
+
+        // All the lengths around the SIMD block sizes, and then random ones
+        char src[4096];
+        for(int i=0; i<(int)sizeof(src); i++)
+            src[i] = (char)rng();
+        for(int len=0; len<200; len++)
+            check_roundtrip(impl, &src[rng() % 64], len);
+        for(int i=0; i<20000; i++)
+        {
+            for(int j=0; j<(int)sizeof(src); j += 8)
+            {
+                const uint64_t x = rng();
+                memcpy(&src[j], &x, sizeof(x));
+            }
+            check_roundtrip(impl, src, (int)(rng() % sizeof(src)));
+            if(Nfailed > 20)
+                break;
+        }
+    }
+
+    if(Nfailed)
+    {
+        MSG("%d tests failed", Nfailed);
+        return 1;
+    }
+    printf("Tested %d base64 implementations\n", Nimpls);
+    return 0;
+}
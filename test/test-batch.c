@@ -0,0 +1,395 @@
+// Checks the columnar batches and the projections: a synthetic log is read in
+// batches of several sizes, through a FILE and mapped, with buffers allocated
+// by the parser and provided by the caller, with and without a projection to
+// the batch's columns, and in parallel with several chunk sizes and thread
+// counts. Everything must match what was written. Also checks the errors:
+// unknown keys, fields that aren't numbers, and lines of the wrong length with
+// projections
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include "../vnlog-parser.h"
+
+#define MSG(fmt, ...) \
+    fprintf(stderr, "%s:%d " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+
+#define NROWS 1000
+
+static int Nfailed = 0;
+
+// Row i of the synthetic log. x is null in every 5th row
+static int64_t want_i(int i)       { return (int64_t)i * 1000003 - 500000000; }
+static double  want_x(int i)       { return (double)i / 7.0; }
+static bool    want_x_null(int i)  { return i % 5 == 0; }
+
+static void write_input(FILE* fp)
+{
+    fprintf(fp, "# i s x t\n");
+    for(int i=0; i<NROWS; i++)
+    {
+        if(want_x_null(i)) fprintf(fp, "%" PRId64 " str%d - tail\n",    want_i(i), i);
+        else               fprintf(fp, "%" PRId64 " str%d %.17g tail\n", want_i(i), i, want_x(i));
+        if(i % 100 == 0)
+            fprintf(fp, "## a comment\n\n");
+    }
+    fflush(fp);
+}
+
+enum { NO_PROJECTION, PROJECTION, PROJECTION_VALIDATED };
+
+static void check_file(FILE* fp, const char* filename, bool use_mmap,
+                       int Nrows_max, bool own_buffers, int projection)
+{
+    rewind(fp);
+
+    vnlog_parser_t ctx;
+    if(VNL_OK != (use_mmap ?
+                  vnlog_parser_init_mmap(&ctx, filename, false) :
+                  vnlog_parser_init     (&ctx, fp)))
+    {
+        MSG("Couldn't initialize the parser");
+        Nfailed++;
+        return;
+    }
+
+    const char*        keys [] = {"x", "i"};
+    vnlog_batch_type_t types[] = {VNLOG_BATCH_DOUBLE, VNLOG_BATCH_INT64};
+    vnlog_batch_t batch;
+    if(!vnlog_batch_init(&batch, &ctx, keys, types, 2, Nrows_max))
+    {
+        MSG("Couldn't initialize the batch");
+        Nfailed++;
+        vnlog_parser_free(&ctx);
+        return;
+    }
+
+    if(projection != NO_PROJECTION)
+    {
+        // Only the columns in the batch. The "t" column after them isn't
+        // looked at
+        const vnlog_parser_column_t columns[] = {batch.columns[0].column,
+                                                 batch.columns[1].column};
+        if(!vnlog_parser_set_projection(&ctx, columns, 2,
+                                        projection == PROJECTION_VALIDATED))
+        {
+            MSG("Couldn't set the projection");
+            Nfailed++;
+        }
+    }
+
+    double  x_buf   [NROWS*2];
+    uint8_t null_buf[NROWS*2/8 + 1];
+    if(own_buffers)
+    {
+        batch.columns[0].values = x_buf;
+        batch.columns[0].null   = null_buf;
+    }
+
+    int irow = 0;
+    vnlog_parser_result_t result;
+    while(VNL_OK == (result = vnlog_parser_read_batch(&ctx, use_mmap ? NULL : fp, &batch)))
+    {
+        if(batch.Nrows <= 0 || batch.Nrows > Nrows_max ||
+           (batch.Nrows < Nrows_max && irow + batch.Nrows != NROWS))
+        {
+            MSG("Batch of %d rows at row %d; wanted up to %d", batch.Nrows, irow, Nrows_max);
+            Nfailed++;
+            break;
+        }
+
+        const double*  x      = batch.columns[0].values;
+        const uint8_t* x_null = batch.columns[0].null;
+        const int64_t* i_vals = batch.columns[1].values;
+        const uint8_t* i_null = batch.columns[1].null;
+        for(int j=0; j<batch.Nrows; j++, irow++)
+        {
+            const bool is_null = x_null[j/8] >> (j%8) & 1;
+            if(is_null != want_x_null(irow) ||
+               (is_null  && !isnan(x[j])) ||
+               (!is_null && x[j] != want_x(irow)) ||
+               (i_null[j/8] >> (j%8) & 1) ||
+               i_vals[j] != want_i(irow))
+            {
+                MSG("mmap=%d Nrows_max=%d projection=%d: row %d mismatched",
+                    use_mmap, Nrows_max, projection, irow);
+                Nfailed++;
+                break;
+            }
+        }
+    }
+    if(result != VNL_EOF || irow != NROWS)
+    {
+        MSG("mmap=%d Nrows_max=%d projection=%d: read %d rows, ending with %d",
+            use_mmap, Nrows_max, projection, irow, result);
+        Nfailed++;
+    }
+
+    if(own_buffers && (batch.columns[0].values != x_buf || batch.columns[0].null != null_buf))
+    {
+        MSG("The batch didn't use the caller's buffers");
+        Nfailed++;
+    }
+
+    vnlog_batch_free(&batch);
+    vnlog_parser_free(&ctx);
+}
+
+static void check_errors(FILE* fp)
+{
+    rewind(fp);
+    vnlog_parser_t ctx;
+    if(VNL_OK != vnlog_parser_init(&ctx, fp))
+    {
+        MSG("Couldn't initialize the parser");
+        Nfailed++;
+        return;
+    }
+
+    vnlog_batch_t batch;
+    const char*        keys_missing[] = {"x", "nope"};
+    vnlog_batch_type_t types       [] = {VNLOG_BATCH_DOUBLE, VNLOG_BATCH_DOUBLE};
+    if(vnlog_batch_init(&batch, &ctx, keys_missing, types, 2, 10))
+    {
+        MSG("A batch with an unknown key should have failed");
+        Nfailed++;
+        vnlog_batch_free(&batch);
+    }
+
+    const char* keys_strings[] = {"s"};
+    if(!vnlog_batch_init(&batch, &ctx, keys_strings, types, 1, 10))
+    {
+        MSG("Couldn't initialize the batch");
+        Nfailed++;
+    }
+    else
+    {
+        if(VNL_ERROR != vnlog_parser_read_batch(&ctx, fp, &batch))
+        {
+            MSG("Reading strings as doubles should have failed");
+            Nfailed++;
+        }
+        vnlog_batch_free(&batch);
+    }
+    vnlog_parser_free(&ctx);
+}
+
+static void check_parallel(const char* filename,
+                           int Nrows_max, int Nthreads, size_t chunk_size)
+{
+    vnlog_parser_t ctx;
+    if(VNL_OK != vnlog_parser_init_mmap(&ctx, filename, false))
+    {
+        MSG("Couldn't initialize the parser");
+        Nfailed++;
+        return;
+    }
+
+    const char*        keys [] = {"x", "i"};
+    vnlog_batch_type_t types[] = {VNLOG_BATCH_DOUBLE, VNLOG_BATCH_INT64};
+    vnlog_parser_parallel_t par;
+    if(!vnlog_parser_parallel_init(&par, &ctx, keys, types, 2, Nrows_max,
+                                   Nthreads, chunk_size))
+    {
+        MSG("Couldn't initialize the parallel parser");
+        Nfailed++;
+        vnlog_parser_free(&ctx);
+        return;
+    }
+
+    int irow = 0;
+    const vnlog_batch_t* batch;
+    vnlog_parser_result_t result;
+    while(VNL_OK == (result = vnlog_parser_parallel_read_batch(&par, &batch)))
+    {
+        if(batch->Nrows <= 0 || batch->Nrows > Nrows_max)
+        {
+            MSG("Parallel batch of %d rows at row %d; wanted up to %d",
+                batch->Nrows, irow, Nrows_max);
+            Nfailed++;
+            break;
+        }
+
+        const double*  x      = batch->columns[0].values;
+        const uint8_t* x_null = batch->columns[0].null;
+        const int64_t* i_vals = batch->columns[1].values;
+        for(int j=0; j<batch->Nrows; j++, irow++)
+        {
+            const bool is_null = x_null[j/8] >> (j%8) & 1;
+            if(is_null != want_x_null(irow) ||
+               (!is_null && x[j] != want_x(irow)) ||
+               i_vals[j] != want_i(irow))
+            {
+                MSG("Nthreads=%d chunk_size=%zu: row %d mismatched",
+                    Nthreads, chunk_size, irow);
+                Nfailed++;
+                break;
+            }
+        }
+    }
+    if(result != VNL_EOF || irow != NROWS)
+    {
+        MSG("Nthreads=%d chunk_size=%zu: read %d rows, ending with %d",
+            Nthreads, chunk_size, irow, result);
+        Nfailed++;
+    }
+
+    vnlog_parser_parallel_free(&par);
+    vnlog_parser_free(&ctx);
+}
+
+// An invalid row in the middle: the rows before it are read, and then the
+// error is reported
+static void check_parallel_error(void)
+{
+    FILE* fp = tmpfile();
+    if(fp == NULL)
+    {
+        MSG("tmpfile() failed");
+        Nfailed++;
+        return;
+    }
+    fprintf(fp, "# x\n");
+    for(int i=0; i<1000; i++)
+        fprintf(fp, i == 500 ? "xxx\n" : "%d\n", i);
+    fflush(fp);
+
+    char filename[64];
+    snprintf(filename, sizeof(filename), "/proc/self/fd/%d", fileno(fp));
+
+    vnlog_parser_t ctx;
+    if(VNL_OK != vnlog_parser_init_mmap(&ctx, filename, false))
+    {
+        MSG("Couldn't initialize the parser");
+        Nfailed++;
+        fclose(fp);
+        return;
+    }
+
+    const char*        keys [] = {"x"};
+    vnlog_batch_type_t types[] = {VNLOG_BATCH_DOUBLE};
+    vnlog_parser_parallel_t par;
+    if(!vnlog_parser_parallel_init(&par, &ctx, keys, types, 1, 10, 4, 100))
+    {
+        MSG("Couldn't initialize the parallel parser");
+        Nfailed++;
+    }
+    else
+    {
+        int Nrows = 0;
+        const vnlog_batch_t* batch;
+        vnlog_parser_result_t result;
+        while(VNL_OK == (result = vnlog_parser_parallel_read_batch(&par, &batch)))
+            Nrows += batch->Nrows;
+        if(result != VNL_ERROR || Nrows > 500)
+        {
+            MSG("Parallel parsing of an invalid row: read %d rows, ending with %d",
+                Nrows, result);
+            Nfailed++;
+        }
+        vnlog_parser_parallel_free(&par);
+    }
+    vnlog_parser_free(&ctx);
+    fclose(fp);
+}
+
+// Reads the given log with a projection to the given column. Returns the
+// number of rows read, or -1 on error
+static int read_projected(const char* log, const char* key, bool validate)
+{
+    FILE* fp = fmemopen((void*)log, strlen(log), "r");
+    if(fp == NULL)
+    {
+        MSG("fmemopen() failed");
+        return -1;
+    }
+
+    int Nrows = -1;
+    vnlog_parser_t ctx;
+    if(VNL_OK == vnlog_parser_init(&ctx, fp))
+    {
+        const vnlog_parser_column_t column = vnlog_parser_column(&ctx, key);
+        if(vnlog_parser_set_projection(&ctx, &column, 1, validate))
+        {
+            vnlog_parser_result_t result;
+            Nrows = 0;
+            while(VNL_OK == (result = vnlog_parser_read_record(&ctx, fp)))
+                Nrows++;
+            if(result != VNL_EOF)
+                Nrows = -1;
+        }
+    }
+    vnlog_parser_free(&ctx);
+    fclose(fp);
+    return Nrows;
+}
+
+static void check_projection_errors(void)
+{
+    // A line that's too long is only an error if validating
+    const char* too_long = "# a b c\n1 2 3\n1 2 3 4\n";
+    if(read_projected(too_long, "a", false) != 2 ||
+       read_projected(too_long, "a", true)  != -1)
+    {
+        MSG("Projections handled a line that's too long incorrectly");
+        Nfailed++;
+    }
+
+    // A line without the needed column is always an error. A short line that
+    // does have it is an error only if validating
+    const char* too_short = "# a b c\n1 2 3\n1 2\n";
+    if(read_projected(too_short, "c", false) != -1 ||
+       read_projected(too_short, "b", false) != 2  ||
+       read_projected(too_short, "b", true)  != -1)
+    {
+        MSG("Projections handled a line that's too short incorrectly");
+        Nfailed++;
+    }
+}
+
+int main(void)
+{
+    FILE* fp = tmpfile();
+    if(fp == NULL)
+    {
+        MSG("tmpfile() failed");
+        return 1;
+    }
+    write_input(fp);
+
+    // The tmpfile() has no name, but /proc gives it one
+    char filename[64];
+    snprintf(filename, sizeof(filename), "/proc/self/fd/%d", fileno(fp));
+
+    static const int sizes[] = {1, 7, 64, NROWS, NROWS*2};
+    for(int i=0; i<(int)(sizeof(sizes)/sizeof(sizes[0])); i++)
+        for(int use_mmap=0; use_mmap<2; use_mmap++)
+            for(int own=0; own<2; own++)
+                for(int projection=0; projection<3; projection++)
+                    check_file(fp, filename, use_mmap, sizes[i], own, projection);
+
+    for(int Nthreads=1; Nthreads<=4; Nthreads++)
+    {
+        check_parallel(filename, 7,     Nthreads, 1);
+        check_parallel(filename, 64,    Nthreads, 1000);
+        check_parallel(filename, NROWS, Nthreads, 0);
+    }
+
+    // These print errors. That's expected
+    check_errors(fp);
+    check_projection_errors();
+    check_parallel_error();
+
+    fclose(fp);
+
+    if(Nfailed)
+    {
+        MSG("%d checks failed", Nfailed);
+        return 1;
+    }
+    return 0;
+}
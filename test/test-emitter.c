@@ -0,0 +1,59 @@
+// Writes the same records with the generic setters or with the specialized
+// emitter from "vnl-gen-header --emitter". Usage:
+//
+//   test-emitter generic|struct [capture]
+//
+// The output must be identical. With "capture" a binary capture is written,
+// which the emitter handles by falling back to the setters
+#include <stdio.h>
+#include <string.h>
+
+#include "vnlog_emitter_generated1.h"
+
+#define NRECORDS 100
+
+static const char* strings[] = { NULL, "short",
+                                 "a-string-that-is-much-longer-than-the-fields-themselves" };
+
+int main(int argc, char* argv[])
+{
+    if(argc < 2 ||
+       (0 != strcmp(argv[1], "generic") && 0 != strcmp(argv[1], "struct")))
+    {
+        fprintf(stderr, "Usage: %s generic|struct [capture]\n", argv[0]);
+        return 1;
+    }
+    const bool use_struct = 0 == strcmp(argv[1], "struct");
+    if(argc > 2 && 0 == strcmp(argv[2], "capture"))
+        vnlog_set_binary_capture(NULL);
+
+    vnlog_emit_legend();
+
+    char data[32];
+    for(int i=0; i<(int)sizeof(data); i++)
+        data[i] = (char)(i*41);
+
+    for(int i=0; i<NRECORDS; i++)
+    {
+        const struct vnlog_record r =
+            { .w     = i*37 - 500,
+              .x     = (uint8_t)(i*5),
+              .y     = (char*)strings[i%3],
+              .z     = i*0.1,
+              .d     = i%4 ? &data[i%8] : NULL,
+              .d_len = 1 + i%20 };
+
+        if(use_struct)
+            vnlog_emit_struct(&r);
+        else
+        {
+            vnlog_set_field_value__w(r.w);
+            vnlog_set_field_value__x(r.x);
+            if(r.y != NULL) vnlog_set_field_value__y(r.y);
+            vnlog_set_field_value__z(r.z);
+            if(r.d != NULL) vnlog_set_field_value__d(r.d, r.d_len);
+            vnlog_emit_record();
+        }
+    }
+    return 0;
+}
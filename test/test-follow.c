@@ -0,0 +1,224 @@
+// Checks follow mode: a log is written bit by bit while it's being read. The
+// legend arrives late, lines arrive in pieces, and the file is truncated and
+// replaced. Also checks that vnlog_parser_follow_wait() and the
+// vnlog_parser_follow_fd() wake up when something is written
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../vnlog-parser.h"
+
+#define MSG(fmt, ...) \
+    fprintf(stderr, "%s:%d " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+
+static int Nfailed = 0;
+
+#define CHECK(cond, fmt, ...)                   \
+    do {                                        \
+        if(!(cond))                             \
+        {                                       \
+            MSG(fmt, ##__VA_ARGS__);            \
+            Nfailed++;                          \
+        }                                       \
+    } while(0)
+
+static char filename[256];
+
+static void write_file(const char* mode, const char* s)
+{
+    FILE* fp = fopen(filename, mode);
+    if(fp == NULL)
+    {
+        MSG("Couldn't open '%s'", filename);
+        exit(1);
+    }
+    fputs(s, fp);
+    fclose(fp);
+}
+
+// Replaces the file with a new one with the given contents, like a log
+// rotation would
+static void rotate(const char* s)
+{
+    char rotated[sizeof(filename) + 8];
+    snprintf(rotated, sizeof(rotated), "%s.1", filename);
+    if(0 != rename(filename, rotated))
+    {
+        MSG("Couldn't rename '%s'", filename);
+        exit(1);
+    }
+    write_file("w", s);
+}
+
+static void check_record(vnlog_parser_t* ctx, int line, const char* a, const char* b)
+{
+    vnlog_parser_result_t result = vnlog_parser_read_record(ctx, NULL);
+    if(result != VNL_OK)
+    {
+        MSG("line %d: expected a record, but got result %d", line, result);
+        Nfailed++;
+        return;
+    }
+    CHECK(ctx->Ncolumns == 2 &&
+          0 == strcmp(ctx->record[0].value, a) &&
+          0 == strcmp(ctx->record[1].value, b),
+          "line %d: expected (%s,%s); got (%s,%s)", line, a, b,
+          ctx->record[0].value, ctx->record[1].value);
+}
+
+static void check_result(vnlog_parser_t* ctx, int line, vnlog_parser_result_t want)
+{
+    vnlog_parser_result_t result = vnlog_parser_read_record(ctx, NULL);
+    CHECK(result == want, "line %d: expected result %d; got %d", line, want, result);
+}
+
+static double now_ms(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec * 1e3 + (double)t.tv_nsec / 1e6;
+}
+
+static void* write_later(void* s)
+{
+    usleep(100000);
+    write_file("a", (const char*)s);
+    return NULL;
+}
+
+int main(void)
+{
+    char dir[] = "/tmp/vnlog-follow-XXXXXX";
+    if(mkdtemp(dir) == NULL)
+    {
+        MSG("mkdtemp() failed");
+        return 1;
+    }
+    snprintf(filename, sizeof(filename), "%s/log.vnl", dir);
+
+    vnlog_parser_t ctx;
+    CHECK(VNL_ERROR == vnlog_parser_init_follow(&ctx, filename),
+          "Following a file that doesn't exist should fail");
+
+    // The legend isn't complete yet
+    write_file("w", "## a comment\n# a");
+    CHECK(VNL_AGAIN == vnlog_parser_init_follow(&ctx, filename),
+          "Expected VNL_AGAIN without a legend");
+    check_result(&ctx, __LINE__, VNL_AGAIN);
+
+    // Lines arrive in pieces
+    write_file("a", " b\n1 2\n3");
+    check_record(&ctx, __LINE__, "1", "2");
+    check_result(&ctx, __LINE__, VNL_AGAIN);
+    write_file("a", " 4\n");
+    check_record(&ctx, __LINE__, "3", "4");
+    check_result(&ctx, __LINE__, VNL_AGAIN);
+
+    // A line longer than the buffer
+    static char long_value[200001];
+    memset(long_value, 'x', sizeof(long_value)-1);
+    long_value[100000] = '\0';
+    write_file("a", long_value);
+    check_result(&ctx, __LINE__, VNL_AGAIN);
+    long_value[100000] = 'x';
+    write_file("a", &long_value[100000]);
+    write_file("a", " 5\n");
+    check_record(&ctx, __LINE__, long_value, "5");
+
+    const bool have_notifications = vnlog_parser_follow_fd(&ctx) >= 0;
+    if(!have_notifications)
+        MSG("inotify isn't available. Not checking the notifications");
+    else
+    {
+        // Nothing is happening, so the wait times out
+        CHECK(VNL_AGAIN == vnlog_parser_follow_wait(&ctx, 50),
+              "Waiting with no changes should time out");
+
+        // The wait wakes up promptly when something is written
+        pthread_t thread;
+        pthread_create(&thread, NULL, write_later, "6 7\n");
+        const double t0 = now_ms();
+        CHECK(VNL_OK == vnlog_parser_follow_wait(&ctx, 5000),
+              "Waiting for a write failed");
+        CHECK(now_ms() - t0 < 2000, "Waiting for a write took too long");
+        pthread_join(thread, NULL);
+        check_record(&ctx, __LINE__, "6", "7");
+        check_result(&ctx, __LINE__, VNL_AGAIN);
+
+        // The fd for an external event loop becomes readable
+        write_file("a", "8 9\n");
+        struct pollfd pfd = {.fd = vnlog_parser_follow_fd(&ctx), .events = POLLIN};
+        CHECK(1 == poll(&pfd, 1, 1000), "The follow fd didn't become readable");
+        check_record(&ctx, __LINE__, "8", "9");
+        check_result(&ctx, __LINE__, VNL_AGAIN);
+    }
+
+    // Batches end at the end of what's available
+    write_file("a", "10 11\n12 13\n");
+    const char*        keys [] = {"b"};
+    vnlog_batch_type_t types[] = {VNLOG_BATCH_INT64};
+    vnlog_batch_t batch;
+    if(!vnlog_batch_init(&batch, &ctx, keys, types, 1, 10))
+    {
+        MSG("Couldn't initialize the batch");
+        Nfailed++;
+    }
+    else
+    {
+        CHECK(VNL_OK == vnlog_parser_read_batch(&ctx, NULL, &batch) &&
+              batch.Nrows == 2 &&
+              ((int64_t*)batch.columns[0].values)[0] == 11 &&
+              ((int64_t*)batch.columns[0].values)[1] == 13,
+              "Reading a batch in follow mode failed");
+        CHECK(VNL_AGAIN == vnlog_parser_read_batch(&ctx, NULL, &batch),
+              "Reading a batch with nothing available should return VNL_AGAIN");
+        vnlog_batch_free(&batch);
+    }
+
+    // Truncated: read from the start again. The legend is checked, and then
+    // ignored
+    write_file("w", "# a b\n14 15\n");
+    check_record(&ctx, __LINE__, "14", "15");
+    check_result(&ctx, __LINE__, VNL_AGAIN);
+
+    // Replaced: the rest of the old file, and then the new file. A partial line
+    // at the end of the old file is thrown away
+    write_file("a", "16 17\n18");
+    rotate("## new file\n#\n# a b\n19 20\n");
+    check_record(&ctx, __LINE__, "16", "17");
+    check_record(&ctx, __LINE__, "19", "20");
+    check_result(&ctx, __LINE__, VNL_AGAIN);
+
+    // Replaced with a file with a different legend. That's an error
+    rotate("# a c\n21 22\n");
+    check_result(&ctx, __LINE__, VNL_ERROR);
+    vnlog_parser_free(&ctx);
+
+    // Replaced with a file without a legend. Also an error
+    write_file("w", "# a b\n");
+    CHECK(VNL_OK == vnlog_parser_init_follow(&ctx, filename),
+          "Couldn't start following");
+    check_result(&ctx, __LINE__, VNL_AGAIN);
+    rotate("23 24\n");
+    check_result(&ctx, __LINE__, VNL_ERROR);
+    vnlog_parser_free(&ctx);
+
+    char rotated[sizeof(filename) + 8];
+    snprintf(rotated, sizeof(rotated), "%s.1", filename);
+    unlink(rotated);
+    unlink(filename);
+    rmdir(dir);
+
+    if(Nfailed)
+    {
+        MSG("%d checks failed", Nfailed);
+        return 1;
+    }
+    return 0;
+}
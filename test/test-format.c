@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include "../vnlog-format.h"
+
+#define MSG(fmt, ...) \
+    fprintf(stderr, "%s:%d " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+
+static int Nfailed = 0;
+
+static void check_string(const char* what, const char* got, const char* want)
+{
+    if(0 != strcmp(got, want))
+    {
+        MSG("%s: got '%s', wanted '%s'", what, got, want);
+        Nfailed++;
+    }
+}
+
+// xorshift: I want a reproducible sequence, independent of the libc
+static uint64_t rng_state = 0x0123456789ABCDEFull;
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static void check_double(double x)
+{
+    char buf[VNLOG_FORMAT_NUMBER_MAXLEN];
+    if(0 > vnlog_format_double(buf, sizeof(buf), x))
+    {
+        MSG("Couldn't format %.17g", x);
+        Nfailed++;
+        return;
+    }
+    const double y = strtod(buf, NULL);
+    if(memcmp(&x, &y, sizeof(x)) != 0 && !(isnan(x) && isnan(y)))
+    {
+        MSG("double %.17g formatted as '%s', which reads back as %.17g", x, buf, y);
+        Nfailed++;
+    }
+}
+
+static void check_float(float x)
+{
+    char buf[VNLOG_FORMAT_NUMBER_MAXLEN];
+    if(0 > vnlog_format_float(buf, sizeof(buf), x))
+    {
+        MSG("Couldn't format %.9g", x);
+        Nfailed++;
+        return;
+    }
+    const float y = strtof(buf, NULL);
+    if(memcmp(&x, &y, sizeof(x)) != 0 && !(isnan(x) && isnan(y)))
+    {
+        MSG("float %.9g formatted as '%s', which reads back as %.9g", x, buf, y);
+        Nfailed++;
+    }
+}
+
+int main(void)
+{
+    char buf[64];
+
+    //// Fixed cases
+    vnlog_format_double(buf, sizeof(buf), 0.3);        check_string("0.3",     buf, "0.3");
+    vnlog_format_double(buf, sizeof(buf), -0.5);       check_string("-0.5",    buf, "-0.5");
+    vnlog_format_double(buf, sizeof(buf), 0.0);        check_string("0",       buf, "0");
+    vnlog_format_double(buf, sizeof(buf), -0.0);       check_string("-0",      buf, "-0");
+    vnlog_format_double(buf, sizeof(buf), 100.0);      check_string("100",     buf, "100");
+    vnlog_format_double(buf, sizeof(buf), 1e-5);       check_string("1e-05",   buf, "1e-05");
+    vnlog_format_double(buf, sizeof(buf), 1.5e-4);     check_string("0.00015", buf, "0.00015");
+    vnlog_format_double(buf, sizeof(buf), 1e17);       check_string("1e+17",   buf, "1e+17");
+    vnlog_format_double(buf, sizeof(buf), 1e300);      check_string("1e+300",  buf, "1e+300");
+    vnlog_format_double(buf, sizeof(buf), INFINITY);   check_string("inf",     buf, "inf");
+    vnlog_format_double(buf, sizeof(buf), -INFINITY);  check_string("-inf",    buf, "-inf");
+    vnlog_format_double(buf, sizeof(buf), NAN);        check_string("nan",     buf, "nan");
+    vnlog_format_double(buf, sizeof(buf), 5e-324);     check_string("5e-324",  buf, "5e-324");
+    vnlog_format_double(buf, sizeof(buf), 1.7976931348623157e308);
+    check_string("DBL_MAX", buf, "1.7976931348623157e+308");
+    vnlog_format_float (buf, sizeof(buf), 0.3f);       check_string("0.3f",    buf, "0.3");
+    vnlog_format_float (buf, sizeof(buf), 16777216.f); check_string("2^24",    buf, "16777216");
+
+    vnlog_format_int64 (buf, sizeof(buf), INT64_MIN);  check_string("INT64_MIN",  buf, "-9223372036854775808");
+    vnlog_format_uint64(buf, sizeof(buf), UINT64_MAX); check_string("UINT64_MAX", buf, "18446744073709551615");
+    vnlog_format_int64 (buf, sizeof(buf), 0);          check_string("int 0",      buf, "0");
+    vnlog_format_char  (buf, sizeof(buf), 'x');        check_string("char",       buf, "x");
+    vnlog_format_string(buf, sizeof(buf), "asdf");     check_string("string",     buf, "asdf");
+
+    // Overflow is reported
+    if(0 <= vnlog_format_string(buf, 4, "asdf"))
+    {
+        MSG("String overflow not detected");
+        Nfailed++;
+    }
+    if(0 <= vnlog_format_int64(buf, 3, -10))
+    {
+        MSG("Integer overflow not detected");
+        Nfailed++;
+    }
+
+    //// Randomized round-trip checks
+    for(int i=0; i<1000000; i++)
+    {
+        const uint64_t bits = rng();
+        double x;
+        memcpy(&x, &bits, sizeof(x));
+        check_double(x);
+
+        const uint32_t bits32 = (uint32_t)(bits >> 32);
+        float xf;
+        memcpy(&xf, &bits32, sizeof(xf));
+        check_float(xf);
+
+        // "normal-looking" values, which is what we usually log
+        check_double((double)(int64_t)bits / 1e6);
+        check_float ((float)(int32_t)bits32 / 1e3f);
+
+        const int64_t xi = (int64_t)(bits >> (bits & 63));
+        char want[32];
+        vnlog_format_int64(buf, sizeof(buf), xi);
+        snprintf(want, sizeof(want), "%" PRId64, xi);
+        check_string("int64", buf, want);
+
+        vnlog_format_uint64(buf, sizeof(buf), (uint64_t)xi);
+        snprintf(want, sizeof(want), "%" PRIu64, (uint64_t)xi);
+        check_string("uint64", buf, want);
+
+        if(Nfailed > 20)
+            break;
+    }
+
+    if(Nfailed)
+    {
+        MSG("%d tests failed", Nfailed);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,156 @@
+// Checks vnlog_parse_double() and vnlog_parse_int64() against strtod() and
+// strtoll(): on specific tricky inputs, on the shortest representations of
+// random doubles (what the vnlog writer produces), and on random decimal
+// strings
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <math.h>
+
+#include "../vnlog-parse-number.h"
+#include "../vnlog-format.h"
+
+#define MSG(fmt, ...) \
+    fprintf(stderr, "%s:%d " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+
+static int Nfailed = 0;
+
+// xorshift: I want a reproducible sequence, independent of the libc
+static uint64_t rng_state = 0x0123456789ABCDEFull;
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// The string must parse exactly as strtod() parses it, or be rejected if
+// strtod() doesn't consume all of it
+static void check_double(const char* s)
+{
+    char* end;
+    const double want       = strtod(s, &end);
+    const bool   want_valid = (end != s && *end == '\0');
+
+    double got;
+    const bool got_valid = vnlog_parse_double(s, (int)strlen(s), &got);
+    if(got_valid != want_valid)
+    {
+        MSG("'%s': valid = %d, but strtod() says %d", s, got_valid, want_valid);
+        Nfailed++;
+        return;
+    }
+    if(got_valid &&
+       memcmp(&got, &want, sizeof(got)) != 0 && !(isnan(got) && isnan(want)))
+    {
+        MSG("'%s': got %.17g, but strtod() says %.17g", s, got, want);
+        Nfailed++;
+    }
+}
+
+static void check_int64(const char* s)
+{
+    char* end;
+    errno = 0;
+    const long long want       = strtoll(s, &end, 10);
+    const bool      want_valid = (end != s && *end == '\0' && errno == 0);
+
+    int64_t got;
+    const bool got_valid = vnlog_parse_int64(s, (int)strlen(s), &got);
+    if(got_valid != want_valid)
+    {
+        MSG("'%s': valid = %d, but strtoll() says %d", s, got_valid, want_valid);
+        Nfailed++;
+        return;
+    }
+    if(got_valid && got != (int64_t)want)
+    {
+        MSG("'%s': got %" PRId64 ", but strtoll() says %lld", s, got, want);
+        Nfailed++;
+    }
+}
+
+int main(void)
+{
+    static const char* doubles[] =
+        { "0", "-0", "1", "-1", "+1.5", "0.3", ".5", "5.", "-.25", "007", "0.000123",
+          "1e300", "1E-300", "1e+22", "1e23", "1e-400", "1e400", "-1e400",
+          "1.7976931348623157e308", "1.7976931348623159e308",
+          "2.2250738585072014e-308", "2.2250738585072011e-308", "4.9e-324",
+          "9007199254740992", "9007199254740993", "9007199254740995",
+          "18446744073709551615", "123456789012345678901234567890",
+          "0.1000000000000000055511151231257827", "7.3177701707893310e+15",
+          "inf", "-inf", "nan", "infinity", "0x1p3",
+          "", "-", "+", ".", "e5", "1e", "1e+", "1.5x", "abc", "1 2", "--1", "1..2" };
+    for(int i=0; i<(int)(sizeof(doubles)/sizeof(doubles[0])); i++)
+        check_double(doubles[i]);
+
+    static const char* ints[] =
+        { "0", "-0", "+5", "123", "-123", "007",
+          "9223372036854775807", "-9223372036854775808",
+          "9223372036854775808", "-9223372036854775809", "18446744073709551616",
+          "1.0", "1e3", "", "-", "+", "12a" };
+    for(int i=0; i<(int)(sizeof(ints)/sizeof(ints[0])); i++)
+        check_int64(ints[i]);
+
+    char buf[64];
+
+    // What the writer produces: the (usually) shortest representation of
+    // random doubles
+    for(int i=0; i<1000000; i++)
+    {
+        uint64_t bits = rng();
+        double x;
+        memcpy(&x, &bits, sizeof(x));
+        if(0 > vnlog_format_double(buf, sizeof(buf), x))
+        {
+            MSG("Couldn't format %.17g", x);
+            Nfailed++;
+            continue;
+        }
+        check_double(buf);
+    }
+
+    // Random decimal strings: up to 20 digits, the point anywhere, exponents
+    // covering the whole range and then some
+    for(int i=0; i<1000000; i++)
+    {
+        const uint64_t r = rng();
+        char* p = buf;
+        if(r & 1) *p++ = '-';
+
+        const int Ndigits = 1 + (int)((r >> 1) % 20);
+        const int i_point = (int)((r >> 6) % (Ndigits + 1));
+        uint64_t  digits  = rng();
+        for(int j=0; j<Ndigits; j++)
+        {
+            if(j == i_point) *p++ = '.';
+            *p++ = (char)('0' + digits % 10);
+            digits /= 10;
+            if(digits == 0) digits = rng();
+        }
+        if(r & (1 << 11))
+            p += sprintf(p, "e%d", (int)((r >> 12) % 700) - 350);
+        *p = '\0';
+        check_double(buf);
+    }
+
+    // Random integers of all sizes
+    for(int i=0; i<100000; i++)
+    {
+        const uint64_t r = rng();
+        sprintf(buf, "%" PRId64, (int64_t)(r >> (r % 64)));
+        check_int64(buf);
+    }
+
+    if(Nfailed)
+    {
+        MSG("%d checks failed", Nfailed);
+        return 1;
+    }
+    return 0;
+}
@@ -1,51 +1,217 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <pthread.h>
 
 #include "../vnlog-parser.h"
 
 #define MSG(fmt, ...) \
     fprintf(stderr, "%s:%d " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__)
 
-int main(int argc, char* argv[])
+// Prints the records, until the end of the input or an error. Returns false on
+// error
+static bool print_records(FILE* out, vnlog_parser_t* ctx, FILE* fp, const char* querykey)
 {
-    if(argc != 3)
+    const char*const* queryvalue = vnlog_parser_record_from_key(ctx, querykey);
+    const vnlog_parser_column_t querycolumn = vnlog_parser_column(ctx, querykey);
+    if((queryvalue == NULL) != (querycolumn < 0) ||
+       (queryvalue != NULL && (const char*const*)&ctx->record[querycolumn].value != queryvalue))
     {
-        fprintf(stderr, "Usage: %s input.vnl query-key\n", argv[0]);
-        return 1;
+        MSG("vnlog_parser_column() doesn't agree with vnlog_parser_record_from_key()");
+        return false;
     }
 
-    const char* filename = argv[1];
-    FILE* fp = (0 == strcmp(filename,"-")) ?
-        stdin : fopen(filename, "r");
-    if(fp == NULL)
+    vnlog_parser_result_t result;
+    while(VNL_OK == (result = vnlog_parser_read_record(ctx, fp)))
     {
-        MSG("Couldn't open '%s'", filename);
-        return 1;
+        fprintf(out, "======\n");
+        const vnlog_parser_field_t* fields = vnlog_parser_fields(ctx);
+        for(int i=0; i<ctx->Ncolumns; i++)
+        {
+            // The fields and the strings must agree
+            if((int)strlen(ctx->record[i].value) != fields[i].len ||
+               0 != memcmp(ctx->record[i].value, fields[i].data, fields[i].len))
+            {
+                MSG("Field %d: the string is '%s', but the field is '%.*s'",
+                    i, ctx->record[i].value, fields[i].len, fields[i].data);
+                return false;
+            }
+
+            // The typed accessors must agree with the strings too
+            char* end;
+            const bool is_null = (0 == strcmp(ctx->record[i].value, "-"));
+            const double x_want = is_null ? NAN : strtod(ctx->record[i].value, &end);
+            double x;
+            if(is_null != vnlog_parser_is_null(ctx, i) ||
+               vnlog_parser_get_double(ctx, i, &x) != (is_null || *end == '\0') ||
+               ((is_null || *end == '\0') &&
+                x != x_want && !(isnan(x) && isnan(x_want))))
+            {
+                MSG("Field %d: '%s' doesn't read as the number %.17g",
+                    i, ctx->record[i].value, x_want);
+                return false;
+            }
+            fprintf(out, "%s = %s\n", ctx->record[i].key, ctx->record[i].value);
+        }
+        fprintf(out, "query: %s = %s\n",
+                querykey,
+                queryvalue != NULL ? *queryvalue : "NOT FOUND");
     }
+    return result == VNL_OK || result == VNL_EOF;
+}
 
-    const char* querykey = argv[2];
+// --parallel: each chunk is printed into its own buffer. At the end the buffers
+// are written out in order, up to the first chunk that failed, so the output
+// is what the sequential parser would print
+typedef struct
+{
+    char*  buf;
+    size_t size;
+    bool   ok;
+} chunk_output_t;
 
+typedef struct
+{
+    const char*     querykey;
+    pthread_mutex_t mutex;
+    chunk_output_t* outputs;
+    int             Noutputs;
+} chunks_t;
 
-    vnlog_parser_t ctx;
-    if(VNL_OK != vnlog_parser_init(&ctx, fp))
+static bool print_chunk(vnlog_parser_t* chunk, int i_chunk, void* cookie)
+{
+    chunks_t* chunks = (chunks_t*)cookie;
+
+    chunk_output_t output = {};
+    FILE* out = open_memstream(&output.buf, &output.size);
+    if(out == NULL)
+        return false;
+    output.ok = print_records(out, chunk, NULL, chunks->querykey);
+    fclose(out);
+
+    pthread_mutex_lock(&chunks->mutex);
+    if(chunks->Noutputs <= i_chunk)
+    {
+        chunks->outputs = realloc(chunks->outputs, (i_chunk+1)*sizeof(chunks->outputs[0]));
+        for(int i=chunks->Noutputs; i<=i_chunk; i++)
+            chunks->outputs[i] = (chunk_output_t){};
+        chunks->Noutputs = i_chunk+1;
+    }
+    chunks->outputs[i_chunk] = output;
+    pthread_mutex_unlock(&chunks->mutex);
+
+    // Keep going even if this chunk failed: the chunks before it must be
+    // printed
+    return true;
+}
+
+static bool print_parallel(vnlog_parser_t* ctx, const char* querykey)
+{
+    // Tiny chunks, so that many chunk boundaries are exercised
+    chunks_t chunks = {.querykey = querykey};
+    pthread_mutex_init(&chunks.mutex, NULL);
+    bool ok = (VNL_OK == vnlog_parser_parallel_foreach(ctx, 3, 16, print_chunk, &chunks));
+    pthread_mutex_destroy(&chunks.mutex);
+
+    for(int i=0; i<chunks.Noutputs; i++)
+    {
+        if(ok)
+        {
+            fwrite(chunks.outputs[i].buf, 1, chunks.outputs[i].size, stdout);
+            ok = chunks.outputs[i].ok;
+        }
+        free(chunks.outputs[i].buf);
+    }
+    free(chunks.outputs);
+    return ok;
+}
+
+int main(int argc, char* argv[])
+{
+    // --mmap reads the file with vnlog_parser_init_mmap() instead of through a
+    // FILE. --parallel reads the mapped file in chunks, in parallel. --impl
+    // selects the scanner. --list-impls lists the scanners this CPU supports
+    bool use_mmap     = false;
+    bool use_parallel = false;
+    while(argc > 1 && 0 == strncmp(argv[1], "--", 2))
+    {
+        if(0 == strcmp(argv[1], "--list-impls"))
+        {
+            for(vnlog_parser_impl_t impl = 0; impl < VNLOG_PARSER_N_IMPLS; impl++)
+                if(_vnlog_parser_impl_available(impl))
+                    printf("%s\n", _vnlog_parser_impl_name(impl));
+            return 0;
+        }
+
+        if(0 == strcmp(argv[1], "--mmap"))
+        {
+            use_mmap = true;
+            argc--;
+            argv++;
+        }
+        else if(0 == strcmp(argv[1], "--parallel"))
+        {
+            use_mmap     = true;
+            use_parallel = true;
+            argc--;
+            argv++;
+        }
+        else if(0 == strcmp(argv[1], "--impl") && argc > 2)
+        {
+            vnlog_parser_impl_t impl = 0;
+            while(impl < VNLOG_PARSER_N_IMPLS &&
+                  0 != strcmp(argv[2], _vnlog_parser_impl_name(impl)))
+                impl++;
+            if(impl == VNLOG_PARSER_N_IMPLS || !_vnlog_parser_impl_available(impl))
+            {
+                MSG("Unknown or unavailable implementation '%s'", argv[2]);
+                return 1;
+            }
+            _vnlog_parser_set_impl(impl);
+            argc -= 2;
+            argv += 2;
+        }
+        else
+            break;
+    }
+
+    if(argc != 3)
+    {
+        fprintf(stderr, "Usage: %s [--mmap|--parallel] [--impl NAME] input.vnl query-key\n"
+                        "       %s --list-impls\n", argv[0], argv[0]);
         return 1;
+    }
 
-    const char*const* queryvalue = vnlog_parser_record_from_key(&ctx, querykey);
+    const char* filename = argv[1];
+    const char* querykey = argv[2];
 
-    vnlog_parser_result_t result;
-    while(VNL_OK == (result = vnlog_parser_read_record(&ctx, fp)))
+    FILE* fp = NULL;
+    vnlog_parser_t ctx;
+    if(use_mmap)
     {
-        printf("======\n");
-        for(int i=0; i<ctx.Ncolumns; i++)
+        if(VNL_OK != vnlog_parser_init_mmap(&ctx, filename, true))
+            return 1;
+    }
+    else
+    {
+        fp = (0 == strcmp(filename,"-")) ?
+            stdin : fopen(filename, "r");
+        if(fp == NULL)
         {
-            printf("%s = %s\n", ctx.record[i].key, ctx.record[i].value);
+            MSG("Couldn't open '%s'", filename);
+            return 1;
         }
-        printf("query: %s = %s\n",
-               querykey,
-               queryvalue != NULL ? *queryvalue : "NOT FOUND");
+
+        if(VNL_OK != vnlog_parser_init(&ctx, fp))
+            return 1;
     }
 
+    const bool ok = use_parallel ?
+        print_parallel(&ctx, querykey) :
+        print_records(stdout, &ctx, fp, querykey);
     vnlog_parser_free(&ctx);
-    return (result == VNL_OK || result == VNL_EOF) ? 0 : 1;
+    return ok ? 0 : 1;
 }
@@ -0,0 +1,69 @@
+// Writes records into a shared-memory session. Usage:
+//
+//   test-shm /shm-name
+//
+// Waits for a reader (vnl-shm-cat) to attach, and then writes a running counter
+// into "z". The ring is small, so it wraps around many times. The writer pauses
+// periodically to let the reader keep up
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "vnlog_fields_generated1.h"
+#include "../vnlog-shm.h"
+
+#define NRECORDS  200000
+#define RING_SIZE (1 << 20)
+
+int main(int argc, char* argv[])
+{
+    if(argc != 2)
+    {
+        fprintf(stderr, "Usage: %s /shm-name\n", argv[0]);
+        return 1;
+    }
+
+    vnlog_set_output_shm(NULL, argv[1], RING_SIZE);
+
+    int fd = shm_open(argv[1], O_RDONLY, 0);
+    if(fd < 0)
+    {
+        fprintf(stderr, "Couldn't open '%s'\n", argv[1]);
+        return 1;
+    }
+    const vnlog_shm_header_t* header =
+        mmap(NULL, sizeof(*header), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(header == MAP_FAILED)
+    {
+        fprintf(stderr, "Couldn't map '%s'\n", argv[1]);
+        return 1;
+    }
+
+    const struct timespec ts_wait = {.tv_nsec = 1000000};
+    for(int i=0; __atomic_load_n(&header->Nreaders, __ATOMIC_ACQUIRE) == 0; i++)
+    {
+        if(i == 10000)
+        {
+            fprintf(stderr, "No reader attached\n");
+            return 1;
+        }
+        nanosleep(&ts_wait, NULL);
+    }
+
+    vnlog_emit_legend();
+    for(int i=0; i<NRECORDS; i++)
+    {
+        vnlog_set_field_value__w(1);
+        vnlog_set_field_value__z((double)i);
+        vnlog_emit_record();
+
+        if(i % 1000 == 999)
+            nanosleep(&ts_wait, NULL);
+    }
+    vnlog_printf("## done\n");
+    return 0;
+}
@@ -0,0 +1,33 @@
+// Writes the records that test-emitter writes, with vnlog::writer. Usage:
+//
+//   test-writer [capture]
+#include <stdio.h>
+#include <string.h>
+
+#include "vnlog_emitter_generated1.h"
+
+#define NRECORDS 100
+
+static const char* strings[] = { NULL, "short",
+                                 "a-string-that-is-much-longer-than-the-fields-themselves" };
+
+int main(int argc, char* argv[])
+{
+    if(argc > 1 && 0 == strcmp(argv[1], "capture"))
+        vnlog_set_binary_capture(NULL);
+
+    vnlog_emit_legend();
+
+    char data[32];
+    for(int i=0; i<(int)sizeof(data); i++)
+        data[i] = (char)(i*41);
+
+    vnlog_writer_t w;
+    for(int i=0; i<NRECORDS; i++)
+        w.emit(i*37 - 500,
+               (uint8_t)(i*5),
+               (char*)strings[i%3],
+               i*0.1,
+               vnlog::binary{ i%4 ? &data[i%8] : NULL, 1 + i%20 });
+    return 0;
+}
@@ -4,8 +4,13 @@
 
 void test2(void);
 
-int main()
+int main(int argc, char* argv[])
 {
+    // "test1 capture" writes a binary capture instead of text. vnl-decode
+    // should turn it into exactly the same output
+    if(argc > 1 && 0 == strcmp(argv[1], "capture"))
+        vnlog_set_binary_capture(NULL);
+
     vnlog_emit_legend();
 
     vnlog_set_field_value__w(-10);
@@ -13,6 +18,12 @@ int main()
     vnlog_set_field_value__y("asdf");
     vnlog_emit_record();
 
+    // Long values don't fit into the field, and are stored separately
+    vnlog_set_field_value__w(-1234567890);
+    vnlog_set_field_value__y("a-string-that-is-much-longer-than-the-fields-themselves");
+    vnlog_set_field_value__z(0.1234567890123);
+    vnlog_emit_record();
+
     vnlog_set_field_value__w(55);
 
     const char* str = "123\x01\x02\x03";
@@ -10,9 +10,101 @@ cd `dirname $0`
 diff -q test1.want test1.got
 diff -q test2.want test2.got
 
+# Binary captures decode to the same text. test1 also calls test2(), which
+# rewrites test2.got from its own text session: the capture of the global
+# context must not affect it
+rm -f test2.got
+./test1 capture > test1-capture.got
+../vnl-decode test1-capture.got > test1.got || { echo "LINE $LINENO: FAILED!"; exit 1; }
+diff -q test1.want test1.got
+diff -q test2.want test2.got
+../vnl-decode < test1-capture.got | diff -q test1.want - >/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
+# A capture cut off in the middle of a record is reported
+head -c -3 test1-capture.got | ../vnl-decode >/dev/null 2>&1 && { echo "LINE $LINENO: SHOULD HAVE FAILED!"; exit 1; } || true
+
+./test-format || { echo "LINE $LINENO: FAILED!"; exit 1; }
+./test-parse-number || { echo "LINE $LINENO: FAILED!"; exit 1; }
+./test-batch 2>/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
+./test-follow 2>/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
+./test-base64 >/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
+./test-alloc  >/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
+
+# The specialized emitters write exactly what the generic setters write, in C
+# and in C++, as text and as binary captures
+./test-emitter generic > test-emitter.got
+./test-emitter struct | diff -q test-emitter.got - >/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
+./test-writer         | diff -q test-emitter.got - >/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
+./test-emitter struct capture | ../vnl-decode | diff -q test-emitter.got - >/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
+./test-writer capture         | ../vnl-decode | diff -q test-emitter.got - >/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
+
+# Asynchronous sessions. With "block" all 8 threads must write all 20000
+# records, in order (each thread writes a running counter into z). With "drop" the records that were written plus the ones
+# reported as dropped must add up
+./test-async block | mawk '
+  /^#/ { next }
+  $2 != "-" || $3 != "-" || $5 != "-" { bad = 1 }
+  { if($4 != n[$1]+0) bad = 1; n[$1]++; N++ }
+  END { for(t in n) if(n[t] != 20000) bad = 1;
+        exit (bad || N != 8*20000) }' || { echo "LINE $LINENO: FAILED!"; exit 1; }
+
+./test-async drop | mawk '
+  /^## dropped/ { dropped = $3; next }
+  /^#/ { next }
+  { N++ }
+  END { exit (N + dropped != 8*20000) }' || { echo "LINE $LINENO: FAILED!"; exit 1; }
+
+# Shared-memory output. vnl-shm-cat must see every record, in order, across many
+# wraparounds of the ring. If it reports falling behind (possible on a loaded
+# machine), the records that did make it through must still be in order
+shmname=/vnlog-test-$$
+./test-shm $shmname &
+shmpid=$!
+../vnl-shm-cat --wait $shmname | mawk '
+  /^## done/ { done = 1; next }
+  /fell behind|attached late/ { lossy = 1; next }
+  /^#/ { next }
+  $1 != 1 || $2 != "-" || $3 != "-" || $5 != "-" { bad = 1 }
+  { if(N && $4 <= prev) bad = 1;
+    if(!lossy && $4 != N) bad = 1;
+    prev = $4; N++ }
+  END { exit (bad || !done || (!lossy && N != 200000)) }' || { echo "LINE $LINENO: FAILED!"; exit 1; }
+wait $shmpid || { echo "LINE $LINENO: FAILED!"; exit 1; }
+
+# A segment that the writer hasn't set up yet (still empty). Without --wait that's
+# an error. With --wait, vnl-shm-cat waits for the writer to replace it
+if [ -d /dev/shm ]; then
+    : > /dev/shm$shmname
+    ../vnl-shm-cat $shmname >/dev/null 2>&1 && { echo "LINE $LINENO: SHOULD HAVE FAILED!"; exit 1; }
+    (sleep 0.2; exec ./test-shm $shmname) &
+    shmpid=$!
+    ../vnl-shm-cat --wait $shmname | mawk '/^## done/ { done = 1 } END { exit !done }' || { echo "LINE $LINENO: FAILED!"; exit 1; }
+    wait $shmpid || { echo "LINE $LINENO: FAILED!"; exit 1; }
+fi
+
 
 #### reader
 
+# Parses the vnlog on stdin into test-parser.got, through a FILE and with the
+# file mapped, with each scanner this CPU supports. These must all agree.
+# Returns 1 if the parsing failed, and 2 if the results disagreed
+parse()
+{
+    cat > test-parser-input.got
+    local status=0 status_other
+    ./test-parser test-parser-input.got "$@" > test-parser.got 2>/dev/null || status=$?
+    for impl in `./test-parser --list-impls`; do
+        for mmap in "" --mmap --parallel; do
+            status_other=0
+            ./test-parser $mmap --impl $impl test-parser-input.got "$@" > test-parser-other.got 2>/dev/null || status_other=$?
+            if [ $status != $status_other ] || ! diff -q test-parser.got test-parser-other.got >&/dev/null; then
+                echo "Parsing with '$mmap --impl $impl' disagrees with the default" >&2
+                return 2
+            fi
+        done
+    done
+    [ $status = 0 ] || return 1
+}
+
 read -r -d '' ref_df <<'EOF' || true
 ======
 time = 0
@@ -85,7 +177,7 @@ echo '
 # time id x y z
 0 abc 1 5 3
 1 def 11 25 53
-' | ./test-parser - y 2>/dev/null > test-parser.got || { echo "LINE $LINENO: FAILED!"; exit 1; }
+' | parse y || { echo "LINE $LINENO: FAILED!"; exit 1; }
 
 diff -q test-parser.got <(echo "$ref_y") >&/dev/null || { echo "LINE $LINENO: mismatched output!"; exit 1; }
 
@@ -95,7 +187,7 @@ echo '
 ## zxvvvv
 1 def 11 25 53
 
-' | ./test-parser - y 2>/dev/null > test-parser.got || { echo "LINE $LINENO: FAILED!"; exit 1; }
+' | parse y || { echo "LINE $LINENO: FAILED!"; exit 1; }
 
 diff -q test-parser.got <(echo "$ref_y") >&/dev/null || { echo "LINE $LINENO: mismatched output!"; exit 1; }
 
@@ -105,7 +197,7 @@ echo '
 
 1 def 11 25 53
 # qwer
-' | ./test-parser - y 2>/dev/null > test-parser.got || { echo "LINE $LINENO: FAILED!"; exit 1; }
+' | parse y || { echo "LINE $LINENO: FAILED!"; exit 1; }
 
 diff -q test-parser.got <(echo "$ref_y_gap_first_row") >&/dev/null || { echo "LINE $LINENO: mismatched output!"; exit 1; }
 
@@ -114,7 +206,7 @@ echo '
 0 abc 1 5 3 # 115 113
 ## zxvvvv
 1 def 11 - -
-' | ./test-parser - y 2>/dev/null > test-parser.got || { echo "LINE $LINENO: FAILED!"; exit 1; }
+' | parse y || { echo "LINE $LINENO: FAILED!"; exit 1; }
 
 diff -q test-parser.got <(echo "$ref_y_gap_second_row") >&/dev/null || { echo "LINE $LINENO: mismatched output!"; exit 1; }
 
@@ -126,7 +218,7 @@ echo '
    #   time id x y z
 0 abc 1 5 3
 1 def 11 25 53
-' | ./test-parser - df 2>/dev/null > test-parser.got || { echo "LINE $LINENO: FAILED!"; exit 1; }
+' | parse df || { echo "LINE $LINENO: FAILED!"; exit 1; }
 
 diff -q test-parser.got <(echo "$ref_df") >&/dev/null || { echo "LINE $LINENO: mismatched output!"; exit 1; }
 
@@ -137,33 +229,120 @@ echo '
 # time id x y z # asdf err
 0 abc 1 5 3
 1 def 11 25 53
-' | ./test-parser - df 2>/dev/null > test-parser.got || { echo "LINE $LINENO: FAILED!"; exit 1; }
+' | parse df || { echo "LINE $LINENO: FAILED!"; exit 1; }
 
 diff -q test-parser.got <(echo "$ref_df") >&/dev/null || { echo "LINE $LINENO: mismatched output!"; exit 1; }
 
 
+printf '# time id x y z\n0 abc 1 5 3\n1 def 11 25 53' | parse y || { echo "LINE $LINENO: FAILED!"; exit 1; }
+
+diff -q test-parser.got <(echo "$ref_y") >&/dev/null || { echo "LINE $LINENO: mismatched output!"; exit 1; }
+
+# Fields and lines that straddle the 64-byte blocks of the scanners
+long=`printf '%070d' 5`
+printf "# time id x y z\n0\tabc  1 $long 3 # $long\n  1 def$long 11 - \t 53 #\n" | parse y || { echo "LINE $LINENO: FAILED!"; exit 1; }
+
+diff -q test-parser.got <(printf "======\ntime = 0\nid = abc\nx = 1\ny = $long\nz = 3\nquery: y = $long\n======\ntime = 1\nid = def$long\nx = 11\ny = -\nz = 53\nquery: y = -\n") >&/dev/null || { echo "LINE $LINENO: mismatched output!"; exit 1; }
+
+printf '# time id x y z' | parse y || { echo "LINE $LINENO: FAILED!"; exit 1; }
+
+[ -s test-parser.got ] && { echo "LINE $LINENO: mismatched output!"; exit 1; }
+
 
 ## And the expected failures
 echo '
 # time id x y
 0 abc 1 5 3
 1 def 11 25 53
-' | ./test-parser - y >&/dev/null && { echo "LINE $LINENO: SHOULD HAVE FAILED!"; exit 1; } || true
+' | parse y && { echo "LINE $LINENO: SHOULD HAVE FAILED!"; exit 1; } || [ $? = 1 ] || { echo "LINE $LINENO: mismatched mmap result!"; exit 1; }
 
 echo '
 # time id x y z z
 0 abc 1 5 3
 1 def 11 25 53
-' | ./test-parser - y >&/dev/null && { echo "LINE $LINENO: SHOULD HAVE FAILED!"; exit 1; } || true
+' | parse y && { echo "LINE $LINENO: SHOULD HAVE FAILED!"; exit 1; } || [ $? = 1 ] || { echo "LINE $LINENO: mismatched mmap result!"; exit 1; }
 
 echo '
 ## time id x y z
 0 abc 1 5 3
 1 def 11 25 53
-' | ./test-parser - y >&/dev/null && { echo "LINE $LINENO: SHOULD HAVE FAILED!"; exit 1; } || true
+' | parse y && { echo "LINE $LINENO: SHOULD HAVE FAILED!"; exit 1; } || [ $? = 1 ] || { echo "LINE $LINENO: mismatched mmap result!"; exit 1; }
 
 echo '
 time id x y z
 0 abc 1 5 3
 1 def 11 25 53
-' | ./test-parser - y >&/dev/null && { echo "LINE $LINENO: SHOULD HAVE FAILED!"; exit 1; } || true
+' | parse y && { echo "LINE $LINENO: SHOULD HAVE FAILED!"; exit 1; } || [ $? = 1 ] || { echo "LINE $LINENO: mismatched mmap result!"; exit 1; }
+
+
+#### index
+
+# Queries through the sparse index must return exactly what a full scan
+# returns. Some x are null or not numbers
+mawk 'BEGIN { print "## a log"; print "# t x s";
+              for(i=0; i<1000; i++)
+                print i, (i%37 == 0 ? "-" : i%101 == 0 ? "abc" : (i*7) % 50 / 10), "s" i }' > test-index.got
+../vnl-index -n 64 -c t -c x -i test-index-idx.got test-index.got || { echo "LINE $LINENO: FAILED!"; exit 1; }
+
+../vnl-index -i test-index-idx.got --records 500:510 test-index.got | diff -q - <(sed -n '2p;503,512p' test-index.got) >/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
+../vnl-index -i test-index-idx.got --records 990:   test-index.got | diff -q - <(sed -n '2p;993,$p' test-index.got) >/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
+../vnl-index -i test-index-idx.got --records 2000:  test-index.got | diff -q - <(sed -n '2p' test-index.got) >/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
+
+where_ref()
+{
+    mawk -v lo=$1 -v hi=$2 '/^##/ { next } /^#/ || ($2 ~ /^[0-9.]+$/ && $2+0 >= lo && $2+0 <= hi)' test-index.got
+}
+../vnl-index -i test-index-idx.got --where x:3:3.4 test-index.got | diff -q - <(where_ref 3 3.4) >/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
+../vnl-index -i test-index-idx.got --where t:700:  test-index.got | diff -q - <(mawk '/^##/ { next } /^#/ || $1 >= 700' test-index.got) >/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
+../vnl-index -i test-index-idx.got --where s:1:2   test-index.got >/dev/null 2>&1 && { echo "LINE $LINENO: SHOULD HAVE FAILED!"; exit 1; } || true
+
+# The log grows. The queries see the new records before the index is updated.
+# The update is incremental, and produces the same index as a full rebuild
+mawk 'BEGIN { for(i=1000; i<1100; i++) print i, (i*7) % 50 / 10, "s" i }' >> test-index.got
+../vnl-index -i test-index-idx.got --where x:3:3.4 test-index.got | diff -q - <(where_ref 3 3.4) >/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
+../vnl-index -n 64 -c t -c x -i test-index-idx.got  test-index.got || { echo "LINE $LINENO: FAILED!"; exit 1; }
+../vnl-index -n 64 -c t -c x -i test-index-idx2.got test-index.got || { echo "LINE $LINENO: FAILED!"; exit 1; }
+diff -q test-index-idx.got test-index-idx2.got >/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
+../vnl-index -i test-index-idx.got --records 1050:1052 test-index.got | diff -q - <(sed -n '2p;1053,1054p' test-index.got) >/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
+
+# The log is rewritten. The stale index is rejected, and then rebuilt
+sed -i 's/^5 /5.5 /' test-index.got
+../vnl-index -i test-index-idx.got --records 0:1 test-index.got >/dev/null 2>&1 && { echo "LINE $LINENO: SHOULD HAVE FAILED!"; exit 1; } || true
+../vnl-index -n 64 -c t -c x -i test-index-idx.got  test-index.got || { echo "LINE $LINENO: FAILED!"; exit 1; }
+rm test-index-idx2.got
+../vnl-index -n 64 -c t -c x -i test-index-idx2.got test-index.got || { echo "LINE $LINENO: FAILED!"; exit 1; }
+diff -q test-index-idx.got test-index-idx2.got >/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
+../vnl-index -i test-index-idx.got --where t:5.5:5.5 test-index.got | diff -q - <(printf '# t x s\n5.5 3.5 s5\n') >/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
+
+# The log is being written: its last line isn't finished, and has fewer fields
+# than the legend. That line isn't indexed, and the update doesn't fail. Once the
+# line is finished, the incremental update picks it up
+printf '# a b c\n1 2 3\n5 6 7\n9 10' > test-index-live.got
+../vnl-index --every 2 --column c -i test-index-live-idx.got test-index-live.got || { echo "LINE $LINENO: FAILED!"; exit 1; }
+printf ' 11\n' >> test-index-live.got
+../vnl-index --every 2 --column c -i test-index-live-idx.got test-index-live.got || { echo "LINE $LINENO: FAILED!"; exit 1; }
+../vnl-index -i test-index-live-idx.got --where c:11:11 test-index-live.got | diff -q - <(printf '# a b c\n9 10 11\n') >/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
+
+
+#### strip-comments
+
+# The comments, blank lines and trailing whitespace go away. The output is the
+# same whether we read a file (spliced from) or a pipe. The last line has no
+# newline
+printf '#! /bin/xxx\n  \n # \n# a b  ## legend\n1 2\n## c\n\n3 4 # c\n 5 6 \t\n#\n7 -' > test-strip-comments.got
+strip_ref='# a b
+1 2
+3 4
+ 5 6
+7 -'
+../vnl-strip-comments test-strip-comments.got | cat | diff -q - <(echo "$strip_ref") >/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
+../vnl-strip-comments < test-strip-comments.got   | diff -q - <(echo "$strip_ref") >/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
+cat test-strip-comments.got | ../vnl-strip-comments | diff -q - <(echo "$strip_ref") >/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
+
+# Long lines, and runs of clean lines longer than a read() or a pipe buffer
+perl -E 'say "# i s"; say $_, " ", ($_ == 500 ? "x" x 200000 : "s$_") for 0..99999' > test-strip-comments.got
+../vnl-strip-comments test-strip-comments.got | cat | diff -q - test-strip-comments.got >/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
+cat test-strip-comments.got | ../vnl-strip-comments | diff -q - test-strip-comments.got >/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
+
+# Data before the legend
+printf '## c\n1 2\n# a b\n' | ../vnl-strip-comments | diff -q - <(echo 'ERROR: Data before legend') >/dev/null || { echo "LINE $LINENO: FAILED!"; exit 1; }
@@ -9,22 +9,9 @@ use lib "$RealBin/../lib";
 
 
 use Vnlog::Parser;
+use Data::Dumper;
 
-my $parser = Vnlog::Parser->new();
-my $resultstring = '';
-while (<DATA>)
-{
-    if( !$parser->parse($_) )
-    {
-        die "Error parsing vnlog line '$_': " . $parser->error();
-    }
-
-    my $d = $parser->getValuesHash();
-    next unless %$d;
-
-    use Data::Dumper;
-    $resultstring .= Dumper [$d->{time},$d->{height}];
-}
+my $data = join('', <DATA>);
 
 my $ref = <<'EOF';
 $VAR1 = [
@@ -53,13 +40,161 @@ $VAR1 = [
         ];
 EOF
 
-if( $resultstring eq $ref)
+my $Nfailed = 0;
+sub check
+{
+    my ($what, $got, $ref) = @_;
+    return if $got eq $ref;
+    say "$what: expected '$ref' but got '$got'";
+    $Nfailed++;
+}
+sub dump_terse
+{
+    my ($x) = @_;
+    return Data::Dumper->new([$x])->Indent(0)->Sortkeys(1)->Terse(1)->Dump;
+}
+
+# I test the compiled parser (if it was built) and the pure-perl one the same
+# way
+my @impls = ('pp');
+push @impls, 'xs' if $Vnlog::Parser::have_xs;
+for my $impl (@impls)
+{
+    no strict 'refs';
+    no warnings 'redefine';
+    local *Vnlog::Parser::parse         = \&{"Vnlog::Parser::_parse_$impl"};
+    local *Vnlog::Parser::getValuesHash = \&{"Vnlog::Parser::_getValuesHash_$impl"};
+    local $Vnlog::Parser::have_xs       = $impl eq 'xs';
+    use strict 'refs';
+
+    {
+        my $parser = Vnlog::Parser->new();
+        my $resultstring = '';
+        open my $fh, '<', \$data;
+        while (<$fh>)
+        {
+            if( !$parser->parse($_) )
+            {
+                die "Error parsing vnlog line '$_': " . $parser->error();
+            }
+
+            my $d = $parser->getValuesHash();
+            next unless %$d;
+
+            $resultstring .= Dumper [$d->{time},$d->{height}];
+        }
+        check("$impl: parse()", $resultstring, $ref);
+        check("$impl: getKeys()", join(',', @{$parser->getKeys()}), 'time,height');
+    }
+
+    # Errors, and the values of single lines
+    {
+        my $parser = Vnlog::Parser->new();
+        check("$impl: data before the legend",
+              ($parser->parse("1 2\n") // 'undef') . ' ' . $parser->error(),
+              "undef Got dataline before legend");
+
+        $parser->parse("# a b\n");
+        check("$impl: mismatched counts",
+              ($parser->parse("1 2 3\n") // 'undef') . ' ' . $parser->error(),
+              qq{undef Legend line "# a b" has 2 elements, but data line "1 2 3\n" has 3 elements. Counts must match!});
+
+        $parser->parse("1 -\n");
+        check("$impl: getValues()", dump_terse($parser->getValues()), q{['1',undef]});
+        check("$impl: getValuesHash()", dump_terse($parser->getValuesHash()), q{{'a' => '1','b' => undef}});
+        $parser->parse("## comment\n");
+        check("$impl: getValuesHash() of a comment",
+              dump_terse($parser->getValuesHash()) . ' ' . dump_terse($parser->getValuesHash()),
+              "{} undef");
+    }
+
+    # readColumns(): all of them at once
+    {
+        my $parser = Vnlog::Parser->new();
+        open my $fh, '<', \$data;
+        check("$impl: readColumns()",
+              dump_terse($parser->readColumns($fh)),
+              q{{'height' => ['2','4','5',undef,undef,'8'],'time' => ['1','3',undef,'6',undef,'7']}});
+        check("$impl: readColumns() keys", join(',', @{$parser->getKeys()}), 'time,height');
+        check("$impl: readColumns() at the end",
+              ($parser->readColumns($fh) // 'undef') . ' ' . $parser->error(), 'undef ');
+    }
+
+    # readColumns(): in batches, with some columns, after parse() read the
+    # legend
+    {
+        my $parser = Vnlog::Parser->new();
+        open my $fh, '<', \"## c\n# a b c\n1 2 3\n4 5 6\n## c\n7 - 9\n10 11 12\n13 14 15";
+        while( defined(my $line = <$fh>) )
+        {
+            $parser->parse($line);
+            last if $parser->getKeys();
+        }
+
+        my @batches;
+        while(my $columns = $parser->readColumns($fh, 2, [qw(c a)]))
+        {
+            push @batches, dump_terse($columns);
+        }
+        check("$impl: readColumns() in batches",
+              join(' ', @batches),
+              q{{'a' => ['1','4'],'c' => ['3','6']} {'a' => ['7','10'],'c' => ['9','12']} {'a' => ['13'],'c' => ['15']}});
+    }
+
+    # readColumns(): duplicated keys. The last column wins
+    {
+        my $parser = Vnlog::Parser->new();
+        open my $fh, '<', \"# a b a\n1 2 3\n4 5 6\n";
+        check("$impl: readColumns() of duplicated keys",
+              dump_terse($parser->readColumns($fh)),
+              q{{'a' => ['3','6'],'b' => ['2','5']}});
+
+        $parser = Vnlog::Parser->new();
+        open $fh, '<', \"# a b a\n1 2 3\n4 5 6\n";
+        check("$impl: readColumns() of a duplicated key",
+              dump_terse($parser->readColumns($fh, 0, ['a'])),
+              q{{'a' => ['3','6']}});
+    }
+
+    # readColumns(): errors
+    {
+        my $parser = Vnlog::Parser->new();
+        open my $fh, '<', \"# a b\n1 2\n";
+        check("$impl: readColumns() of an unknown column",
+              ($parser->readColumns($fh, 0, ['x']) // 'undef') . ' ' . $parser->error(),
+              "undef Unknown column 'x'");
+
+        # The C parser complains on stderr. I don't want to see that
+        $parser = Vnlog::Parser->new();
+        open $fh, '<', \"# a b\n1 2\n3 4 5\n";
+        open my $stderr, '>&', \*STDERR;
+        close STDERR;
+        my $columns = $parser->readColumns($fh);
+        open STDERR, '>&', $stderr;
+        check("$impl: readColumns() of a bad line",
+              ($columns // 'undef') . ' ' . ($parser->error() ne '' ? 'error' : 'no error'),
+              "undef error");
+    }
+
+    # readColumns(): unicode keys and values
+    {
+        my $parser = Vnlog::Parser->new();
+        my $text   = "# \x{3b1} b\n\x{3b2} 2\n";
+        utf8::encode($text);
+        open my $fh, '<:encoding(UTF-8)', \$text;
+        my $columns = $parser->readColumns($fh);
+        check("$impl: readColumns() of unicode",
+              join(',', map {"$_=$columns->{$_}[0]"} sort keys %$columns),
+              "b=2,\x{3b1}=\x{3b2}");
+    }
+}
+
+if( !$Nfailed )
 {
     say "Test passed";
     exit 0;
 }
 
-say "Expected '$ref' but got '$resultstring'";
 say "Test failed!";
 exit 1;
 
@@ -227,6 +227,155 @@ if arr['name2'].shape != (1,):  raise Exception("Unexpected structured array inn
 if arr['x y z'].shape != (1,3): raise Exception("Unexpected structured array inner shape")
 
 
+# Batches. With the compiled extension and without
+inputstring = '''#! zxcv
+## asdf
+# time x name y
+1 2 a 3
+ ## ff
+4 - b 6 # abc
+
+7 8 c 9
+10 11 d 12
+'''
+_vnlog = vnlog._vnlog
+for native in (True, False):
+    if native and _vnlog is None:
+        continue
+    vnlog._vnlog = _vnlog if native else None
+
+    b = list(vnlog.batches(StringIO(inputstring),
+                           columns    = ('y','x'),
+                           dtype      = dict(y = np.int32, x = float),
+                           batch_size = 3))
+    if len(b) != 2 or list(b[0].keys()) != ['y','x']:
+        raise Exception(f"Unexpected batches: {b}")
+    if b[0]['y'].dtype != np.int32 or b[0]['x'].dtype != float:
+        raise Exception("Unexpected batch dtypes")
+    if b[0]['y'].tolist() != [3,6,9] or b[1]['y'].tolist() != [12]:
+        raise Exception(f"Batch mismatch: {b}")
+    if b[0]['x'][0] != 2 or not np.isnan(b[0]['x'][1]) or b[1]['x'].tolist() != [11]:
+        raise Exception(f"Batch mismatch: {b}")
+
+    # All the numerical columns, as int
+    b = list(vnlog.batches(StringIO(inputstring.replace(' - ', ' 5 ')),
+                           columns = ('time','x','y'),
+                           dtype   = int))
+    if len(b) != 1 or b[0]['x'].tolist() != [2,5,8,11] or b[0]['time'].dtype != int:
+        raise Exception(f"Batch mismatch: {b}")
+
+    for kwargs in ( dict(columns = ('x',),   dtype = int),   # null integer
+                    dict(columns = ('name',)),               # not a number
+                    dict(columns = ('z',)),                  # no such column
+                    dict(columns = ('y',),   dtype = 'U8') ):# not a numerical dtype
+        try:    list(vnlog.batches(StringIO(inputstring), **kwargs))
+        except: pass
+        else:   raise Exception(f"Bad batches() call wasn't flagged: {kwargs}")
+vnlog._vnlog = _vnlog
+
+
+# The compiled extension must give the same results as the python path, and it
+# also reads nulls
+if vnlog._vnlog is None:
+    print("The _vnlog extension isn't available. Not testing it")
+else:
+    import tempfile
+
+    def slurp_python(filename, **kwargs):
+        _vnlog = vnlog._vnlog
+        vnlog._vnlog = None
+        try:     return vnlog.slurp(filename, **kwargs)
+        finally: vnlog._vnlog = _vnlog
+
+    def check_same(a, b):
+        if type(a) is tuple:
+            if a[1] != b[1] or a[2] != b[2]:
+                raise Exception("Native slurp() keys mismatch")
+            a,b = a[0],b[0]
+        if a.dtype != b.dtype or a.shape != b.shape or not (a == b).all():
+            raise Exception(f"Native slurp() mismatch: expected '{b}' but got '{a}'")
+
+    with tempfile.TemporaryDirectory() as d:
+        filename = d + "/data.vnl"
+
+        inputstring = '''#! zxcv
+## asdf
+# x name y name2 z
+1 a 2 zz2 3
+ ## ff
+4 fbb 5 qq2 6 # abc
+
+-7 été -8 x -9
+'''
+        with open(filename, "w") as f:
+            f.write(inputstring)
+
+        for dtype in ( np.dtype([ ('name',  'U16'),
+                                  ('x y z', int, (3,)),
+                                  ('name2', 'U16'), ]),
+                       np.dtype([ ('name2', 'S2'),
+                                  ('x z',   np.float32, (2,)),
+                                  ('y',     np.int8) ]), ):
+            check_same(vnlog.slurp(filename, dtype=dtype),
+                       slurp_python(filename, dtype=dtype))
+            with open(filename, "r") as f:
+                check_same(vnlog.slurp(f, dtype=dtype),
+                           slurp_python(filename, dtype=dtype))
+                if f.read() != '':
+                    raise Exception("slurp() didn't read the whole file")
+
+        # Many small chunks, parsed by several threads, are put back in order
+        dtype = np.dtype([ ('x y z', int, (3,)) ])
+        with open(filename, "r") as f:
+            check_same(vnlog._slurp_native(f, dtype=dtype, Nthreads=3, chunk_size=16),
+                       slurp_python(filename, dtype=dtype))
+
+        dtype = np.dtype([ ('x', np.uint8) ])
+        try:    arr = vnlog.slurp(filename, dtype=dtype)
+        except: pass
+        else:   raise Exception("Out-of-range value wasn't flagged")
+
+        try:    arr = vnlog.slurp(filename)
+        except: pass
+        else:   raise Exception("Non-numerical value wasn't flagged")
+
+        # Simple dtypes. Nulls are NaN
+        with open(filename, "w") as f:
+            f.write(inputstring_noundef)
+        for dtype in (None, int, float, np.float32, np.int16):
+            check_same(vnlog.slurp(filename, dtype=dtype),
+                       slurp_python(filename, dtype=dtype))
+
+        with open(filename, "w") as f:
+            f.write("# a b\n1 -\n- 4\n")
+        arr = vnlog.slurp(filename)[0]
+        if arr.shape != (2,2) or arr[0,0] != 1 or arr[1,1] != 4 or \
+           not np.isnan(arr[0,1]) or not np.isnan(arr[1,0]):
+            raise Exception(f"Nulls weren't read as NaN: got '{arr}'")
+        try:    arr = vnlog.slurp(filename, dtype=int)
+        except: pass
+        else:   raise Exception("Null integer wasn't flagged")
+
+        # A file that was partly read already goes through the python path
+        with open(filename, "w") as f:
+            f.write("## a\n# a b\n1 2\n3 4\n")
+        with open(filename, "r") as f:
+            f.readline()
+            arr = vnlog.slurp(f)[0]
+        if arr.shape != (2,2):
+            raise Exception("Partly-read file mishandled")
+
+        # No data at all
+        with open(filename, "w") as f:
+            f.write("# a b\n")
+        import warnings
+        with warnings.catch_warnings():
+            # numpy.loadtxt() complains about the lack of data
+            warnings.simplefilter("ignore")
+            check_same(vnlog.slurp(filename),
+                       slurp_python(filename))
+
+
 print("Test passed")
 sys.exit(0);
 
@@ -7,6 +7,7 @@ use IPC::Run 'run';
 use Text::Diff 'diff';
 use Carp qw(cluck confess);
 use FindBin '$RealBin';
+use File::Temp qw(tempfile tempdir);
 
 use Term::ANSIColor;
 my $Nfailed = 0;
@@ -1392,6 +1393,131 @@ check( <<'EOF', "-p", "aaa,bbb", {data => $data_simple_colnames});
 11 16
 EOF
 
+# Long legends and comments are read in blocks, not a byte at a time. The data
+# after the legend must still all get to the awk/perl that processes it
+my $comment_long = "## " . join(' ', ('long comment') x 200) . "\n";
+my $data_wide =
+  "#!/bin/xxx\n" .
+  $comment_long .
+  "# "  . join(' ', map {"c$_"} 0..499) . "\n" .
+  join('', map { my $i = $_; join(' ', map {$i*1000 + $_} 0..499) . "\n" } 0..99);
+check( "#!/bin/xxx\n" .
+       $comment_long .
+       "# c499 c0\n" .
+       join('', map {($_*1000 + 499) . " " . ($_*1000) . "\n"} 0..99),
+       "-p", "c499,c0", {data => $data_wide});
+
+# A long preamble through a pipe. The data read past the legend is handed off to
+# a helper 'cat' process at most once, not once per comment line. I count the
+# helpers with a logging 'cat' in the PATH
+{
+    my $dir = tempdir(CLEANUP => 1);
+    open my $fh, '>', "$dir/cat" or die "Couldn't write '$dir/cat': $!";
+    print $fh "#!/bin/sh\necho >> '$dir/cat.log'\nexec /bin/cat \"\$@\"\n";
+    close $fh;
+    chmod 0755, "$dir/cat";
+
+    my $data = join('', map {"## comment line $_\n"} 1..3000) .
+      "# a b\n" .
+      join('', map {"$_ " . (2*$_) . "\n"} 1..1000);
+    open $fh, '>', "$dir/data.vnl" or die "Couldn't write '$dir/data.vnl': $!";
+    print $fh $data;
+    close $fh;
+
+    for my $engine (qw(awk perl))
+    {
+        unlink "$dir/cat.log";
+        my $out;
+        run( ['sh', '-c',
+              "perl -pe1 '$dir/data.vnl' | PATH='$dir':\$PATH perl '$RealBin/../vnl-filter' --engine=$engine -p a"],
+             \'', \$out )
+          or die "vnl-filter failed";
+
+        my $expected = join('', map {"## comment line $_\n"} 1..3000) .
+          "# a\n" .
+          join('', map {"$_\n"} 1..1000);
+        my $Nhelpers = -e "$dir/cat.log" ? (() = `cat '$dir/cat.log'`) : 0;
+        if( $out ne $expected || $Nhelpers > 1 )
+        {
+            cluck "Test failed: long preamble through a pipe with engine $engine. Output matches: " .
+              ($out eq $expected ? 'yes' : 'no') . ". Started $Nhelpers helpers";
+            $Nfailed++;
+        }
+    }
+}
+
+# The awk engines treat fields as numbers only if they look like numbers, and
+# format numbers like awk does. The native engine must match mawk exactly
+my $data_awk_values = <<'EOF';
+# a b
+1 10
+0x10 9
+1e999 -
+2147483648 abc
+3.0 .5
+-0 1e-400
+EOF
+check( <<'EOF', '-p', 'a,b,lt=a<b,s=a+b,h=a/2,x=a>b?a:b', {language => 'AWK', data => $data_awk_values});
+# a b lt s h x
+1 10 1 11 0.5 10
+0x10 9 0 25 8 0x10
+1e999 - 0 inf inf 1e999
+2147483648 abc 1 2.14748e+09 1073741824 abc
+3.0 .5 0 3.5 1.5 3.0
+-0 1e-400 1 0 0 1e-400
+EOF
+
+# The native engine hands off what it can't evaluate (regexes here) to mawk
+check( <<'EOF', '-p', 'a', 'a ~ /^[0-9]/', {language => 'AWK', data => $data_awk_values});
+# a
+1
+0x10
+1e999
+2147483648
+3.0
+EOF
+
+check( 'ERROR', '--engine=xxx' );
+check( 'ERROR', '--perl', '--engine=awk' );
+
+# -j processes files in parallel chunks, if the query keeps no state from record
+# to record. The output must be the same as from a serial run. These chunks are
+# at least 1MB, so I make a big-enough file
+{
+    my ($fh, $filename) = tempfile(UNLINK => 1);
+    print $fh "## comment\n# a b c\n";
+    for my $i (0..249999)
+    {
+        print $fh "$i " . ($i % 7 - 3) . " x$i\n";
+        print $fh "## comment $i\n" if $i % 1000 == 0;
+    }
+    close $fh;
+
+    for my $args (['-p', 'a,c,s=a+b', 'b > 0'],          # stateless
+                  ['-p', 'c', 'c ~ /1$/'],               # stateless, with a regex
+                  ['-p', 'a,d=diff(a)', 'b > 0'],        # stateful
+                  ['-p', 'a,n=NR', 'b > 0'],             # uses an awk variable
+                  ['-A', '1', 'b == 3'])                 # context
+    {
+        for my $engine (qw(awk native))
+        {
+            my ($out_serial, $out_parallel);
+            run( ["perl", "$RealBin/../vnl-filter", "--engine=$engine", @$args],
+                 '<', $filename, '>', \$out_serial )
+              or die "vnl-filter failed";
+            run( ["perl", "$RealBin/../vnl-filter", "--engine=$engine", '-j', '3', @$args],
+                 '<', $filename, '>', \$out_parallel )
+              or die "vnl-filter failed";
+
+            if( $out_serial ne $out_parallel || length($out_serial) < 1000 )
+            {
+                cluck "Test failed: '-j 3 @$args' with engine $engine doesn't match the serial output";
+                $Nfailed++;
+            }
+        }
+    }
+}
+
 
 
 
@@ -1412,8 +1538,9 @@ else
 
 sub check
 {
-    # I check stuff twice. Once with perl processing, and again with awk
-    # processing
+    # I check stuff three times: with perl processing, with awk processing,
+    # and with the native engine. The native engine evaluates the same
+    # expressions as awk, so the 'AWK' tests apply to it too
 
     my ($expected, @args) = @_;
 
@@ -1424,7 +1551,7 @@ sub check
         my $opts = pop @args;
         if($opts->{language})
         {
-            push @langs, ($opts->{language} =~ /perl/i ? 1 : 0);
+            push @langs, ($opts->{language} =~ /perl/i ? ('perl') : ('awk', 'native'));
         }
         if($opts->{data})
         {
@@ -1433,12 +1560,12 @@ sub check
     }
     if( !@langs )
     {
-        @langs = (0,1);
+        @langs = ('awk', 'native', 'perl');
     }
     $data //= $data_default;
 
   LANGUAGE:
-    for my $doperl (@langs)
+    for my $lang (@langs)
     {
         # if the arguments are a list of strings, these are simply the args to a
         # filter run. If the're a list of list-refs, then we run the filter
@@ -1456,7 +1583,7 @@ sub check
         for my $arg (@args)
         {
             my @args_here = @$arg;
-            push @args_here, '--perl' if $doperl;
+            unshift @args_here, "--engine=$lang" if $lang ne 'awk';
 
             $out = '';
             my $result =
@@ -1487,7 +1614,7 @@ sub check
         my $diff = diff(\$expected, \$out);
         if ( length $diff )
         {
-            cluck "Test failed when doperl=$doperl; diff: '$diff'";
+            cluck "Test failed when lang=$lang; diff: '$diff'";
             $Nfailed++;
         }
     }
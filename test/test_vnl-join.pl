@@ -102,6 +102,14 @@ my $data_empty2 = <<'EOF';
 # cc dd a
 EOF
 
+# Long legends are read in blocks, not a byte at a time
+my $data_wide1 =
+  "# a " . join(' ', map {"x$_"} 0..299) . "\n" .
+  join('', map { my $i = $_; "$i " . join(' ', map {$i*1000 + $_} 0..299) . "\n" } 0..49);
+my $data_wide2 =
+  "# a " . join(' ', map {"y$_"} 0..299) . "\n" .
+  join('', map { my $i = $_; "$i " . join(' ', map {-$i*1000 - $_} 0..299) . "\n" } 20..69);
+
 
 test_init('vnl-join', \$Nfailed,
           '$data1'       => $data1,
@@ -110,7 +118,9 @@ test_init('vnl-join', \$Nfailed,
           '$data_int'    => $data_int,
           '$data_int_dup'=> $data_int_dup,
           '$data_empty1'  => $data_empty1,
-          '$data_empty2'  => $data_empty2);
+          '$data_empty2'  => $data_empty2,
+          '$data_wide1'   => $data_wide1,
+          '$data_wide2'   => $data_wide2);
 
 
 
@@ -479,6 +489,11 @@ check( <<'EOF', qw(-ja -a-), '$data_empty1', '$data1', '$data_empty2');
 6a - - 42b 11 - -
 EOF
 
+check( "# a " . join(' ', (map {"x$_"} 0..299), (map {"y$_"} 0..299)) . "\n" .
+       join('', map { my $i = $_; "$i " . join(' ', (map {$i*1000 + $_} 0..299), (map {-$i*1000 - $_} 0..299)) . "\n" }
+            sort {$a cmp $b} 20..49),
+       qw(-ja --vnl-sort -), '$data_wide1', '$data_wide2');
+
 
 if($Nfailed == 0 )
 {
@@ -0,0 +1,383 @@
+// Turns binary captures written by vnlog_set_binary_capture() back into vnlog
+// text. See vnl-decode.pod for the documentation and vnlog-capture.h for the
+// format
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "vnlog-capture.h"
+#include "vnlog-format.h"
+#include "vnlog-base64.h"
+
+#define MSG(fmt, ...) \
+    fprintf(stderr, "vnl-decode: " fmt "\n", ##__VA_ARGS__)
+
+enum
+{
+#define TYPE_ENUM(name, ctype, formatter) TYPE_ ## name,
+    VNLOG_CAPTURE_TYPES( TYPE_ENUM )
+#undef TYPE_ENUM
+    TYPE_string,
+    TYPE_binary
+};
+
+typedef struct
+{
+    const char* filename;
+    FILE*       fp;
+    bool        swap;   // the capture has the other byte order
+
+    int         Nfields;
+    int*        types;
+
+    char*       payload;
+    uint32_t    payload_size;
+
+    char*       out;
+    int         out_size;
+} decoder_t;
+
+static void swap_bytes(void* x, int size)
+{
+    char* p = (char*)x;
+    for(int i=0; i<size/2; i++)
+    {
+        char t        = p[i];
+        p[i]          = p[size-1-i];
+        p[size-1-i]   = t;
+    }
+}
+
+static bool parse_type(int* type, const char* name, int len)
+{
+#define CHECK_TYPE(_name, ctype, formatter)                             \
+    if(len == (int)strlen(#_name) && 0 == strncmp(name, #_name, len))   \
+    {                                                                   \
+        *type = TYPE_ ## _name;                                         \
+        return true;                                                    \
+    }
+    VNLOG_CAPTURE_TYPES( CHECK_TYPE )
+#undef CHECK_TYPE
+
+    if(len == 6 && 0 == strncmp(name, "string", len)) { *type = TYPE_string; return true; }
+    if(len == 6 && 0 == strncmp(name, "binary", len)) { *type = TYPE_binary; return true; }
+    return false;
+}
+
+// Reads the two preamble lines. Returns false on error, after complaining
+static bool read_preamble(decoder_t* d)
+{
+    char*  line     = NULL;
+    size_t line_len = 0;
+    bool   result   = false;
+
+    if(0 >= getline(&line, &line_len, d->fp))
+    {
+        MSG("%s: empty input", d->filename);
+        goto done;
+    }
+    char endianness[8];
+    int  version;
+    if(0 != strncmp(line, VNLOG_CAPTURE_MAGIC " ", strlen(VNLOG_CAPTURE_MAGIC " ")) ||
+       2 != sscanf(&line[strlen(VNLOG_CAPTURE_MAGIC)], "%d %7s", &version, endianness))
+    {
+        MSG("%s: not a vnlog binary capture", d->filename);
+        goto done;
+    }
+    if(version != VNLOG_CAPTURE_VERSION)
+    {
+        MSG("%s: capture has version %d. I only know about version %d",
+            d->filename, version, VNLOG_CAPTURE_VERSION);
+        goto done;
+    }
+    const char* endianness_here =
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        "le";
+#else
+        "be";
+#endif
+    if(0 != strcmp(endianness, "le") && 0 != strcmp(endianness, "be"))
+    {
+        MSG("%s: unknown byte order '%s'", d->filename, endianness);
+        goto done;
+    }
+    d->swap = (0 != strcmp(endianness, endianness_here));
+
+    if(0 >= getline(&line, &line_len, d->fp) ||
+       0 != strncmp(line, "#!types ", strlen("#!types ")))
+    {
+        MSG("%s: missing the field types", d->filename);
+        goto done;
+    }
+
+    d->Nfields = 0;
+    for(const char* p = &line[strlen("#!types ")]; *p && *p != '\n'; )
+    {
+        if(*p == ' ')
+        {
+            p++;
+            continue;
+        }
+        const int len = (int)strcspn(p, " \n");
+        d->types = realloc(d->types, (d->Nfields+1) * sizeof(d->types[0]));
+        if(d->types == NULL)
+        {
+            MSG("Couldn't allocate memory");
+            goto done;
+        }
+        if(!parse_type(&d->types[d->Nfields], p, len))
+        {
+            MSG("%s: unknown field type '%.*s'", d->filename, len, p);
+            goto done;
+        }
+        d->Nfields++;
+        p += len;
+    }
+    if(d->Nfields == 0)
+    {
+        MSG("%s: no fields", d->filename);
+        goto done;
+    }
+    result = true;
+
+ done:
+    free(line);
+    return result;
+}
+
+static bool out_reserve(decoder_t* d, int len_needed)
+{
+    if(d->out_size >= len_needed)
+        return true;
+    while(d->out_size < len_needed)
+        d->out_size = d->out_size ? 2*d->out_size : 4096;
+    d->out = realloc(d->out, d->out_size);
+    if(d->out == NULL)
+    {
+        MSG("Couldn't allocate memory");
+        return false;
+    }
+    return true;
+}
+
+// Converts one record in d->payload to a line of text in d->out. Returns the
+// number of bytes, or <0 on error
+static int decode_row(decoder_t* d, uint32_t payload_len)
+{
+    const int Nbitmap = (d->Nfields+7)/8;
+    if(payload_len < (uint32_t)Nbitmap)
+        return -1;
+
+    const char* bitmap = d->payload;
+    const char* p      = &bitmap[Nbitmap];
+    const char* end    = &d->payload[payload_len];
+    int         len    = 0;
+
+    for(int i=0; i<d->Nfields; i++)
+    {
+        if(!(bitmap[i/8] & (1 << (i%8))))
+        {
+            if(!out_reserve(d, len + 2))
+                return -1;
+            d->out[len++] = '-';
+            d->out[len++] = ' ';
+            continue;
+        }
+
+        int n;
+        switch(d->types[i])
+        {
+#define DECODE_FIXED(name, ctype, formatter)                            \
+        case TYPE_ ## name:                                             \
+        {                                                               \
+            ctype x;                                                    \
+            if(end - p < (int)sizeof(x))                                \
+                return -1;                                              \
+            memcpy(&x, p, sizeof(x));                                   \
+            p += sizeof(x);                                             \
+            if(d->swap)                                                 \
+                swap_bytes(&x, sizeof(x));                              \
+            if(!out_reserve(d, len + VNLOG_FORMAT_NUMBER_MAXLEN + 1))   \
+                return -1;                                              \
+            n = vnlog_format_ ## formatter(&d->out[len],                \
+                                           d->out_size - len, x);       \
+            break;                                                      \
+        }
+            VNLOG_CAPTURE_TYPES( DECODE_FIXED )
+#undef DECODE_FIXED
+
+        default:
+        {
+            // string or binary
+            uint32_t size;
+            if(end - p < (int)sizeof(size))
+                return -1;
+            memcpy(&size, p, sizeof(size));
+            p += sizeof(size);
+            if(d->swap)
+                swap_bytes(&size, sizeof(size));
+            if((uint32_t)(end - p) < size)
+                return -1;
+
+            if(d->types[i] == TYPE_string)
+            {
+                if(!out_reserve(d, len + (int)size + 1))
+                    return -1;
+                memcpy(&d->out[len], p, size);
+                n = (int)size;
+            }
+            else
+            {
+                const int len_encoded = vnlog_base64_dstlen_to_encode((int)size);
+                if(!out_reserve(d, len + len_encoded + 1))
+                    return -1;
+                n = vnlog_base64_encode(&d->out[len], len_encoded, p, (int)size);
+            }
+            p += size;
+        }
+        }
+
+        if(n < 0)
+            return -1;
+        len += n;
+        d->out[len++] = ' ';
+    }
+
+    if(p != end)
+        return -1;
+    d->out[len-1] = '\n';
+    return len;
+}
+
+// Decodes one capture. Returns false on error, after complaining
+static bool decode(decoder_t* d)
+{
+    if(!read_preamble(d))
+        return false;
+
+    while(true)
+    {
+        uint32_t header;
+        const size_t Nread = fread(&header, 1, sizeof(header), d->fp);
+        if(Nread == 0)
+            break;
+        if(Nread != sizeof(header))
+        {
+            MSG("%s: truncated record at the end. Was the capture cut off?", d->filename);
+            return false;
+        }
+        if(d->swap)
+            swap_bytes(&header, sizeof(header));
+        const uint32_t payload_len = header & ~VNLOG_CAPTURE_TEXT;
+
+        if(d->payload_size < payload_len)
+        {
+            d->payload = realloc(d->payload, payload_len);
+            if(d->payload == NULL)
+            {
+                MSG("Couldn't allocate memory");
+                return false;
+            }
+            d->payload_size = payload_len;
+        }
+        if(payload_len != fread(d->payload, 1, payload_len, d->fp))
+        {
+            MSG("%s: truncated record at the end. Was the capture cut off?", d->filename);
+            return false;
+        }
+
+        if(header & VNLOG_CAPTURE_TEXT)
+            fwrite(d->payload, 1, payload_len, stdout);
+        else
+        {
+            const int len = decode_row(d, payload_len);
+            if(len < 0)
+            {
+                MSG("%s: corrupt record", d->filename);
+                return false;
+            }
+            fwrite(d->out, 1, len, stdout);
+        }
+    }
+    if(ferror(d->fp))
+    {
+        MSG("%s: read error: %s", d->filename, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static void usage(FILE* fp, const char* argv0)
+{
+    fprintf(fp,
+            "Usage: %s [capture ...]\n"
+            "\n"
+            "Reads binary captures written by vnlog_set_binary_capture(), and writes\n"
+            "them to stdout as vnlog text. Reads stdin if no files are given, or if\n"
+            "a file is '-'. Please see the manpage for details\n",
+            argv0);
+}
+
+int main(int argc, char* argv[])
+{
+    static const struct option opts[] =
+        {
+            { "help", no_argument, NULL, 'h' },
+            {}
+        };
+    int opt;
+    while(-1 != (opt = getopt_long(argc, argv, "h", opts, NULL)))
+    {
+        switch(opt)
+        {
+        case 'h':
+            usage(stdout, argv[0]);
+            return 0;
+        default:
+            usage(stderr, argv[0]);
+            return 1;
+        }
+    }
+
+    const char* stdin_only[] = {"-"};
+    const char** filenames   = (const char**)&argv[optind];
+    int          Nfilenames  = argc - optind;
+    if(Nfilenames == 0)
+    {
+        filenames  = stdin_only;
+        Nfilenames = 1;
+    }
+
+    decoder_t d = {};
+    int result = 0;
+    for(int i=0; i<Nfilenames; i++)
+    {
+        d.filename = filenames[i];
+        if(0 == strcmp(d.filename, "-"))
+        {
+            d.filename = "(stdin)";
+            d.fp       = stdin;
+        }
+        else if(NULL == (d.fp = fopen(d.filename, "r")))
+        {
+            MSG("Couldn't open '%s': %s", d.filename, strerror(errno));
+            result = 1;
+            continue;
+        }
+
+        if(!decode(&d))
+            result = 1;
+
+        if(d.fp != stdin)
+            fclose(d.fp);
+    }
+
+    free(d.types);
+    free(d.payload);
+    free(d.out);
+    return result;
+}
@@ -0,0 +1,1307 @@
+// The native data-processing engine of vnl-filter (vnl-filter --engine=native).
+//
+// vnl-filter reads the legend, and figures out what to do, exactly as it does
+// when it runs mawk. Then instead of handing the awk program it generated to
+// mawk, it execs this tool with the pieces of that program: the expressions to
+// output, the match expressions, the outer rel()/diff()/... calls to evaluate
+// for each record, and the various flags. The column references in these are
+// already resolved to $N, and each rel()/diff()/... call is numbered, as they
+// are in the awk program. Here these expressions are compiled into a tree of
+// nodes, and each record is evaluated natively. Only the columns that are
+// referenced are split out of each record.
+//
+// The output is byte-identical to what mawk produces from the same program, so
+// the awk semantics are reproduced carefully: fields are strings that are
+// compared as numbers only if they look like numbers, numbers are printed with
+// "%.6g" unless they're integers that fit in an int, and so on. Only a subset of
+// awk expressions is supported: numbers, strings, fields, arithmetic,
+// comparisons, logic, ?:, some math functions and the vnl-filter special
+// functions. If the expressions use anything else, this tool runs the given awk
+// program with mawk instead, so the results are always the same
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#define MSG(fmt, ...) \
+    fprintf(stderr, "vnl-filter-native: " fmt "\n", ##__VA_ARGS__)
+
+#define READ_SIZE 65536
+
+// What mawk calls Max_Int. Integral numbers within +-this are printed as integers
+#define MAWK_MAX_INT INT_MAX
+
+typedef enum { VAL_NUM, VAL_STR, VAL_FIELD } val_type_t;
+
+// A value, as awk sees it. VAL_FIELD is a string from the input data. Unlike
+// other strings, it's treated as a number if it looks like one
+typedef struct
+{
+    val_type_t  type;
+    double      x;              // VAL_NUM
+    const char* s;              // VAL_STR, VAL_FIELD. NUL-terminated
+    int         len;
+} val_t;
+
+// The state of one numbered rel()/diff()/sum()/prev()/latestdefined() call
+typedef enum { SPECIAL_REL, SPECIAL_DIFF, SPECIAL_SUM, SPECIAL_PREV, SPECIAL_LATESTDEFINED } special_type_t;
+static const char* special_names[] = { "rel", "diff", "sum", "prev", "latestdefined" };
+#define NSPECIAL_TYPES ((int)(sizeof(special_names)/sizeof(special_names[0])))
+
+typedef struct
+{
+    special_type_t type;
+    int            index;
+
+    bool   inited;
+    double x;                   // rel, diff, sum
+
+    // prev, latestdefined: the stored value. If it's a string, it lives in one
+    // of the two buffers; the other one receives the next value. So a value we
+    // return stays valid until the next record
+    val_t  v;
+    bool   have_v;
+    char*  buf[2];
+    int    bufsize[2];
+    int    ibuf;
+} special_t;
+
+typedef struct node_t node_t;
+struct node_t
+{
+    val_t (*eval)(const node_t* node);
+
+    const node_t* a;
+    const node_t* b;
+    const node_t* c;
+
+    val_t      constant;        // literals
+    int        i;               // field index, precomputed-variable index
+    special_t* special;
+    double   (*func)(double);   // math functions
+
+    bool       in_parens;       // This expression was written as "(...)"
+};
+
+// An outer rel()/diff()/... call, evaluated for each record before anything
+// else. Like "__rel0 = rel0($1)" in the awk program
+typedef struct
+{
+    char*         name;         // "__rel0"
+    const node_t* expr;
+    val_t         value;
+} precomputed_t;
+
+typedef struct
+{
+    const char* s;
+    int         len;
+} field_t;
+
+
+// The program
+static precomputed_t* precomputed;
+static int            Nprecomputed;
+static special_t**    specials;
+static int            Nspecials;
+static const node_t** matches;
+static int            Nmatches;
+static const node_t** outputs;
+static int            Noutputs;
+static int*           has_fields;
+static int            Nhas_fields;
+static int            Nfields_min     = 0;
+static int            Nfields_needed  = 0;
+static bool           have_abs        = false;
+static bool           skipcomments    = false;
+static bool           skipempty       = true;
+static int            Ncontext_before = 0;
+static int            Ncontext_after  = 0;
+
+// The current record
+static field_t* fields;
+static int      Nfields;
+
+static val_t val_num(double x)
+{
+    return (val_t){ .type = VAL_NUM, .x = x };
+}
+
+static val_t val_str(const char* s, int len)
+{
+    return (val_t){ .type = VAL_STR, .s = s, .len = len };
+}
+
+static bool is_awk_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+static bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// mawk's check_strnum(): does this field look like a number? It does if it
+// starts like a number, ends with a digit or '.', and strtod() reads all of it
+// without overflowing or underflowing
+static bool looks_numeric(const char* s, int len, double* x)
+{
+    const char* q = &s[len];
+    while(s < q && is_awk_space(*s))
+        s++;
+    if(s == q)
+        return false;
+    while(is_awk_space(q[-1]))
+        q--;
+    if(!is_digit(q[-1]) && q[-1] != '.')
+        return false;
+    if(!is_digit(*s) && *s != '+' && *s != '-' && *s != '.')
+        return false;
+
+    char* end;
+    errno = 0;
+    *x = strtod(s, &end);
+    if(errno == ERANGE)
+        return false;
+    return end >= q;
+}
+
+static double to_num(val_t v)
+{
+    if(v.type == VAL_NUM)
+        return v.x;
+    return strtod(v.s, NULL);
+}
+
+// awk's boolean value
+static bool to_bool(val_t v)
+{
+    double x;
+    switch(v.type)
+    {
+    case VAL_NUM:   return v.x != 0.0;
+    case VAL_STR:   return v.len > 0;
+    default:        return looks_numeric(v.s, v.len, &x) ? x != 0.0 : v.len > 0;
+    }
+}
+
+static int int_to_str(char* buf, int i)
+{
+    char  tmp[16];
+    char* p = &tmp[sizeof(tmp)];
+    unsigned int u = i < 0 ? -(unsigned int)i : (unsigned int)i;
+    do
+    {
+        *(--p) = '0' + u % 10;
+        u /= 10;
+    } while(u);
+    if(i < 0)
+        *(--p) = '-';
+    int len = &tmp[sizeof(tmp)] - p;
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    return len;
+}
+
+// Formats a number the way mawk does with the default CONVFMT and OFMT:
+// integers that fit in an int are printed as integers, and everything else
+// with "%.6g". buf should have room for 32 bytes
+static int num_to_str(char* buf, double x)
+{
+    // mawk's d_to_I()
+    int i;
+    if     (x >= MAWK_MAX_INT)  i = MAWK_MAX_INT;
+    else if(x > -MAWK_MAX_INT)  i = (int)x;
+    else                        i = -MAWK_MAX_INT;
+
+    if((double)i == x)
+        return int_to_str(buf, i);
+    return sprintf(buf, "%.6g", x);
+}
+
+// The string value. buf is used if a number needs to be formatted
+static const char* to_str(val_t v, char* buf, int* len)
+{
+    if(v.type == VAL_NUM)
+    {
+        *len = num_to_str(buf, v.x);
+        return buf;
+    }
+    *len = v.len;
+    return v.s;
+}
+
+static int compare_strings(const char* a, int alen, const char* b, int blen)
+{
+    int cmp = memcmp(a, b, alen < blen ? alen : blen);
+    if(cmp != 0)
+        return cmp;
+    return alen < blen ? -1 : alen > blen ? 1 : 0;
+}
+
+// awk's comparison: numeric if both sides are numbers or fields that look like
+// numbers. Otherwise the string values are compared
+static int compare(val_t a, val_t b)
+{
+    double xa, xb;
+    bool numa = a.type == VAL_NUM ? (xa = a.x, true) : a.type == VAL_FIELD && looks_numeric(a.s, a.len, &xa);
+    bool numb = b.type == VAL_NUM ? (xb = b.x, true) : b.type == VAL_FIELD && looks_numeric(b.s, b.len, &xb);
+    if(numa && numb)
+        return xa > xb ? 1 : xa < xb ? -1 : 0;
+
+    char bufa[32], bufb[32];
+    int  lena, lenb;
+    const char* sa = to_str(a, bufa, &lena);
+    const char* sb = to_str(b, bufb, &lenb);
+    return compare_strings(sa, lena, sb, lenb);
+}
+
+static bool str_equals(val_t v, const char* s)
+{
+    char buf[32];
+    int  len;
+    const char* sv = to_str(v, buf, &len);
+    return len == (int)strlen(s) && 0 == memcmp(sv, s, len);
+}
+
+// awk's length(v) > 0
+static bool nonempty(val_t v)
+{
+    return v.type == VAL_NUM || v.len > 0;
+}
+
+
+
+//////////////// The expression nodes
+
+#define EVAL_A (node->a->eval(node->a))
+#define EVAL_B (node->b->eval(node->b))
+#define EVAL_C (node->c->eval(node->c))
+
+static val_t eval_constant(const node_t* node)
+{
+    return node->constant;
+}
+static val_t eval_field(const node_t* node)
+{
+    if(node->i < Nfields)
+        return (val_t){ .type = VAL_FIELD, .s = fields[node->i].s, .len = fields[node->i].len };
+    // Past the end of the record: an empty string
+    return (val_t){ .type = VAL_FIELD, .s = "", .len = 0 };
+}
+static val_t eval_precomputed(const node_t* node)
+{
+    return precomputed[node->i].value;
+}
+
+static val_t eval_neg  (const node_t* node) { return val_num(-to_num(EVAL_A)); }
+static val_t eval_plus (const node_t* node) { return val_num( to_num(EVAL_A)); }
+static val_t eval_not  (const node_t* node) { return val_num(!to_bool(EVAL_A)); }
+
+// The operands are evaluated left-to-right, as in awk
+static val_t eval_add(const node_t* node) { double a = to_num(EVAL_A); return val_num(a + to_num(EVAL_B)); }
+static val_t eval_sub(const node_t* node) { double a = to_num(EVAL_A); return val_num(a - to_num(EVAL_B)); }
+static val_t eval_mul(const node_t* node) { double a = to_num(EVAL_A); return val_num(a * to_num(EVAL_B)); }
+static val_t eval_div(const node_t* node) { double a = to_num(EVAL_A); return val_num(a / to_num(EVAL_B)); }
+static val_t eval_mod(const node_t* node) { double a = to_num(EVAL_A); return val_num(fmod(a, to_num(EVAL_B))); }
+static val_t eval_pow(const node_t* node) { double a = to_num(EVAL_A); return val_num(pow(a, to_num(EVAL_B))); }
+
+static val_t eval_lt(const node_t* node) { val_t a = EVAL_A; return val_num(compare(a, EVAL_B) <  0); }
+static val_t eval_le(const node_t* node) { val_t a = EVAL_A; return val_num(compare(a, EVAL_B) <= 0); }
+static val_t eval_gt(const node_t* node) { val_t a = EVAL_A; return val_num(compare(a, EVAL_B) >  0); }
+static val_t eval_ge(const node_t* node) { val_t a = EVAL_A; return val_num(compare(a, EVAL_B) >= 0); }
+static val_t eval_eq(const node_t* node) { val_t a = EVAL_A; return val_num(compare(a, EVAL_B) == 0); }
+static val_t eval_ne(const node_t* node) { val_t a = EVAL_A; return val_num(compare(a, EVAL_B) != 0); }
+
+static val_t eval_and(const node_t* node) { return val_num(to_bool(EVAL_A) && to_bool(EVAL_B)); }
+static val_t eval_or (const node_t* node) { return val_num(to_bool(EVAL_A) || to_bool(EVAL_B)); }
+static val_t eval_cond(const node_t* node)
+{
+    return to_bool(EVAL_A) ? EVAL_B : EVAL_C;
+}
+
+static val_t eval_func(const node_t* node)
+{
+    return val_num(node->func(to_num(EVAL_A)));
+}
+static val_t eval_atan2(const node_t* node)
+{
+    double y = to_num(EVAL_A);
+    return val_num(atan2(y, to_num(EVAL_B)));
+}
+static double awk_int(double x)
+{
+    return x >= 0.0 ? floor(x) : ceil(x);
+}
+// The abs() that vnl-filter --sub-abs defines:
+//   abs(x) { if(x >= 0) { return x;} return -x;}
+static val_t eval_abs(const node_t* node)
+{
+    val_t x = EVAL_A;
+    if(compare(x, val_num(0)) >= 0)
+        return x;
+    return val_num(-to_num(x));
+}
+
+// Stores v in a special_t. Strings are copied into the buffer not holding the
+// current value
+static void special_store(special_t* special, val_t v)
+{
+    special->have_v = true;
+    if(v.type == VAL_NUM)
+    {
+        special->v = v;
+        return;
+    }
+
+    int ibuf = 1 - special->ibuf;
+    if(special->bufsize[ibuf] < v.len+1)
+    {
+        special->bufsize[ibuf] = 2*(v.len+1);
+        special->buf[ibuf]     = realloc(special->buf[ibuf], special->bufsize[ibuf]);
+        if(special->buf[ibuf] == NULL)
+        {
+            MSG("Couldn't allocate memory");
+            exit(1);
+        }
+    }
+    memcpy(special->buf[ibuf], v.s, v.len);
+    special->buf[ibuf][v.len] = '\0';
+
+    special->ibuf = ibuf;
+    special->v    = v;
+    special->v.s  = special->buf[ibuf];
+}
+
+// These are exactly the awk functions that vnl-filter defines for each special
+// call
+static val_t eval_rel(const node_t* node)
+{
+    special_t* s = node->special;
+    double     x = to_num(EVAL_A);
+    if(!s->inited)
+    {
+        s->x      = x;
+        s->inited = true;
+    }
+    return val_num(x - s->x);
+}
+static val_t eval_diff(const node_t* node)
+{
+    special_t* s = node->special;
+    double     x = to_num(EVAL_A);
+    val_t retval = s->inited ? val_num(x - s->x) : val_str("-", 1);
+    s->x      = x;
+    s->inited = true;
+    return retval;
+}
+static val_t eval_sum(const node_t* node)
+{
+    special_t* s = node->special;
+    s->x += to_num(EVAL_A);
+    return val_num(s->x);
+}
+static val_t eval_prev(const node_t* node)
+{
+    special_t* s = node->special;
+    val_t      x = EVAL_A;
+    val_t retval = s->have_v && nonempty(s->v) ? s->v : val_str("-", 1);
+    special_store(s, x);
+    return retval;
+}
+static val_t eval_latestdefined(const node_t* node)
+{
+    special_t* s = node->special;
+    val_t      x = EVAL_A;
+    if(!str_equals(x, "-"))
+        special_store(s, x);
+    return s->have_v && nonempty(s->v) ? s->v : val_str("-", 1);
+}
+
+
+
+//////////////// The expression parser. Anything it doesn't understand makes us
+//////////////// fall back to mawk
+
+typedef struct
+{
+    const char* s;
+} parser_t;
+
+static node_t* node_new(val_t (*eval)(const node_t*), const node_t* a, const node_t* b)
+{
+    node_t* node = calloc(1, sizeof(node_t));
+    if(node == NULL)
+    {
+        MSG("Couldn't allocate memory");
+        exit(1);
+    }
+    node->eval = eval;
+    node->a    = a;
+    node->b    = b;
+    return node;
+}
+
+static void skip_space(parser_t* p)
+{
+    while(*p->s == ' ' || *p->s == '\t')
+        p->s++;
+}
+
+static bool is_ident_char(char c)
+{
+    return c == '_' || is_digit(c) || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+// Consumes the given operator, if it's next. Longer operators that start with
+// the same characters don't match: "<" doesn't match "<="
+static bool accept_op(parser_t* p, const char* op)
+{
+    skip_space(p);
+    int len = strlen(op);
+    if(0 != strncmp(p->s, op, len))
+        return false;
+
+    char next = p->s[len];
+    if(len == 1 && strchr("<>=!", op[0]) && next == '=')
+        return false;
+    // "++", "--", "**", "&&"-prefixes, ... are not valid here
+    if(len == 1 && strchr("+-*/%^&|", op[0]) && (next == op[0] || next == '='))
+        return false;
+    p->s += len;
+    return true;
+}
+
+// Reads an identifier into buf. Returns its length, 0 if there isn't one
+static int read_ident(parser_t* p, char* buf, int bufsize)
+{
+    skip_space(p);
+    int len = 0;
+    if(is_digit(*p->s))
+        return 0;
+    while(is_ident_char(p->s[len]))
+        len++;
+    if(len == 0 || len >= bufsize)
+        return 0;
+    memcpy(buf, p->s, len);
+    buf[len] = '\0';
+    p->s += len;
+    return len;
+}
+
+static special_t* get_special(special_type_t type, int index)
+{
+    for(int i=0; i<Nspecials; i++)
+        if(specials[i]->type == type && specials[i]->index == index)
+            return specials[i];
+
+    specials = realloc(specials, (Nspecials+1)*sizeof(specials[0]));
+    special_t* special = calloc(1, sizeof(special_t));
+    if(specials == NULL || special == NULL)
+    {
+        MSG("Couldn't allocate memory");
+        exit(1);
+    }
+    special->type = type;
+    special->index = index;
+    specials[Nspecials++] = special;
+    return special;
+}
+
+static const node_t* parse_ternary(parser_t* p);
+static const node_t* parse_unary(parser_t* p);
+
+static const node_t* parse_string(parser_t* p)
+{
+    // p->s is at the opening '"'
+    const char* s = p->s+1;
+    char* buf = malloc(strlen(s) + 1);
+    if(buf == NULL)
+    {
+        MSG("Couldn't allocate memory");
+        exit(1);
+    }
+    int len = 0;
+    while(*s != '"')
+    {
+        if(*s == '\0' || *s == '\n')
+            goto fail;
+        if(*s != '\\')
+        {
+            buf[len++] = *s++;
+            continue;
+        }
+        s++;
+        switch(*s)
+        {
+        case '"':  buf[len++] = '"';  break;
+        case '\\': buf[len++] = '\\'; break;
+        case '/':  buf[len++] = '/';  break;
+        case 'n':  buf[len++] = '\n'; break;
+        case 't':  buf[len++] = '\t'; break;
+        case 'r':  buf[len++] = '\r'; break;
+        default:   goto fail;
+        }
+        s++;
+    }
+    buf[len] = '\0';
+    p->s = s+1;
+
+    node_t* node = node_new(eval_constant, NULL, NULL);
+    node->constant = val_str(buf, len);
+    return node;
+
+ fail:
+    free(buf);
+    return NULL;
+}
+
+static const node_t* parse_number(parser_t* p)
+{
+    // Like the awk lexer: digits, a '.', more digits, an exponent
+    const char* s = p->s;
+    while(is_digit(*s)) s++;
+    if(*s == '.')
+    {
+        s++;
+        while(is_digit(*s)) s++;
+    }
+    if(s == p->s || (s == p->s+1 && *p->s == '.'))
+        return NULL;
+    if(*s == 'e' || *s == 'E')
+    {
+        const char* e = s+1;
+        if(*e == '+' || *e == '-') e++;
+        if(is_digit(*e))
+        {
+            while(is_digit(*e)) e++;
+            s = e;
+        }
+    }
+    // "1e", "0x10" and such mean something else to awk
+    if(is_ident_char(*s) || *s == '.')
+        return NULL;
+
+    int   len = s - p->s;
+    char  buf[len+1];
+    memcpy(buf, p->s, len);
+    buf[len] = '\0';
+    p->s = s;
+
+    node_t* node = node_new(eval_constant, NULL, NULL);
+    node->constant = val_num(strtod(buf, NULL));
+    return node;
+}
+
+// Parses the arguments of a function call: "(a)" or "(a,b)". p->s is past the
+// function name
+static bool parse_args(parser_t* p, const node_t** args, int Nargs)
+{
+    if(!accept_op(p, "("))
+        return false;
+    for(int i=0; i<Nargs; i++)
+    {
+        if(i > 0 && !accept_op(p, ","))
+            return false;
+        if(NULL == (args[i] = parse_ternary(p)))
+            return false;
+    }
+    return accept_op(p, ")");
+}
+
+static const node_t* parse_call(parser_t* p, const char* name)
+{
+    const node_t* args[2];
+
+    // The numbered special functions: rel0(), diff3(), ...
+    for(int type=0; type<NSPECIAL_TYPES; type++)
+    {
+        int len = strlen(special_names[type]);
+        if(0 != strncmp(name, special_names[type], len) || !is_digit(name[len]))
+            continue;
+        char* end;
+        long index = strtol(&name[len], &end, 10);
+        if(*end != '\0' || *p->s != '(' || !parse_args(p, args, 1))
+            return NULL;
+
+        static val_t (*evals[])(const node_t*) =
+            { eval_rel, eval_diff, eval_sum, eval_prev, eval_latestdefined };
+        node_t* node = node_new(evals[type], args[0], NULL);
+        node->special = get_special(type, index);
+        return node;
+    }
+
+    static const struct
+    {
+        const char* name;
+        double    (*func)(double);
+    } funcs[] = { { "int",  awk_int }, { "sqrt", sqrt }, { "exp", exp },
+                  { "log",  log },     { "sin",  sin },  { "cos", cos } };
+    for(unsigned int i=0; i<sizeof(funcs)/sizeof(funcs[0]); i++)
+        if(0 == strcmp(name, funcs[i].name))
+        {
+            if(!parse_args(p, args, 1))
+                return NULL;
+            node_t* node = node_new(eval_func, args[0], NULL);
+            node->func = funcs[i].func;
+            return node;
+        }
+
+    if(0 == strcmp(name, "atan2"))
+    {
+        if(!parse_args(p, args, 2))
+            return NULL;
+        return node_new(eval_atan2, args[0], args[1]);
+    }
+
+    // User functions must have the ( right after the name
+    if(have_abs && 0 == strcmp(name, "abs") && *p->s == '(')
+    {
+        if(!parse_args(p, args, 1))
+            return NULL;
+        return node_new(eval_abs, args[0], NULL);
+    }
+
+    return NULL;
+}
+
+static const node_t* parse_primary(parser_t* p)
+{
+    skip_space(p);
+
+    if(*p->s == '(')
+    {
+        p->s++;
+        node_t* node = (node_t*)parse_ternary(p);
+        if(node == NULL || !accept_op(p, ")"))
+            return NULL;
+        node->in_parens = true;
+        return node;
+    }
+    if(*p->s == '"')
+        return parse_string(p);
+    if(is_digit(*p->s) || *p->s == '.')
+        return parse_number(p);
+    if(*p->s == '$')
+    {
+        // Only $N. No $0, $NF, $(expr)
+        const char* s = p->s+1;
+        if(!is_digit(*s) || *s == '0')
+            return NULL;
+        char* end;
+        long i = strtol(s, &end, 10);
+        if(is_ident_char(*end) || *end == '.' || i > 1000000)
+            return NULL;
+        p->s = end;
+
+        node_t* node = node_new(eval_field, NULL, NULL);
+        node->i = i-1;
+        if(Nfields_needed < i)
+            Nfields_needed = i;
+        return node;
+    }
+
+    char name[64];
+    if(!read_ident(p, name, sizeof(name)))
+        return NULL;
+
+    // The precomputed outer special calls: __rel0, ...
+    for(int i=0; i<Nprecomputed; i++)
+        if(0 == strcmp(name, precomputed[i].name))
+        {
+            node_t* node = node_new(eval_precomputed, NULL, NULL);
+            node->i = i;
+            return node;
+        }
+
+    skip_space(p);
+    if(*p->s == '(' || 0 == strcmp(name, "abs"))
+        return parse_call(p, name);
+
+    // Some variable we don't know about
+    return NULL;
+}
+
+// The exponent binds tighter than the unary operators, and is
+// right-associative. The exponent itself may have a unary - or +: 2^-1
+static const node_t* parse_pow(parser_t* p)
+{
+    const node_t* node = parse_primary(p);
+    if(node == NULL)
+        return NULL;
+    if(!accept_op(p, "^"))
+        return node;
+    const node_t* exponent = parse_unary(p);
+    if(exponent == NULL)
+        return NULL;
+    return node_new(eval_pow, node, exponent);
+}
+
+static const node_t* parse_unary(parser_t* p)
+{
+    val_t (*eval)(const node_t*) = NULL;
+    if     (accept_op(p, "!")) eval = eval_not;
+    else if(accept_op(p, "-")) eval = eval_neg;
+    else if(accept_op(p, "+")) eval = eval_plus;
+    if(eval == NULL)
+        return parse_pow(p);
+
+    const node_t* a = parse_unary(p);
+    if(a == NULL)
+        return NULL;
+    return node_new(eval, a, NULL);
+}
+
+typedef struct
+{
+    const char* op;
+    val_t     (*eval)(const node_t*);
+} binop_t;
+
+// A left-associative sequence of binary operators at one precedence level
+static const node_t* parse_binops(parser_t* p,
+                                  const node_t* (*parse_operand)(parser_t*),
+                                  const binop_t* ops)
+{
+    const node_t* node = parse_operand(p);
+    while(node != NULL)
+    {
+        const binop_t* op = ops;
+        while(op->op != NULL && !accept_op(p, op->op))
+            op++;
+        if(op->op == NULL)
+            break;
+        const node_t* b = parse_operand(p);
+        if(b == NULL)
+            return NULL;
+        node = node_new(op->eval, node, b);
+    }
+    return node;
+}
+
+static const node_t* parse_mul(parser_t* p)
+{
+    static const binop_t ops[] = { {"*", eval_mul}, {"/", eval_div}, {"%", eval_mod}, {} };
+    return parse_binops(p, parse_unary, ops);
+}
+static const node_t* parse_add(parser_t* p)
+{
+    static const binop_t ops[] = { {"+", eval_add}, {"-", eval_sub}, {} };
+    return parse_binops(p, parse_mul, ops);
+}
+static const node_t* parse_cmp(parser_t* p)
+{
+    static const binop_t ops[] = { {"<=", eval_le}, {">=", eval_ge}, {"==", eval_eq},
+                                   {"!=", eval_ne}, {"<",  eval_lt}, {">",  eval_gt}, {} };
+    return parse_binops(p, parse_add, ops);
+}
+static const node_t* parse_and(parser_t* p)
+{
+    static const binop_t ops[] = { {"&&", eval_and}, {} };
+    return parse_binops(p, parse_cmp, ops);
+}
+static const node_t* parse_or(parser_t* p)
+{
+    static const binop_t ops[] = { {"||", eval_or}, {} };
+    return parse_binops(p, parse_and, ops);
+}
+static const node_t* parse_ternary(parser_t* p)
+{
+    const node_t* cond = parse_or(p);
+    if(cond == NULL || !accept_op(p, "?"))
+        return cond;
+
+    const node_t* a = parse_ternary(p);
+    if(a == NULL || !accept_op(p, ":"))
+        return NULL;
+    const node_t* b = parse_ternary(p);
+    if(b == NULL)
+        return NULL;
+
+    node_t* node = node_new(eval_cond, cond, a);
+    node->c = b;
+    return node;
+}
+
+// Compiles a whole expression. NULL if it isn't one we can handle
+static const node_t* compile(const char* expr)
+{
+    parser_t p = { .s = expr };
+    const node_t* node = parse_ternary(&p);
+    skip_space(&p);
+    if(node == NULL || *p.s != '\0')
+        return NULL;
+    return node;
+}
+
+// "__rel0=rel0($1)"
+static bool compile_precomputed(const char* str)
+{
+    parser_t p = { .s = str };
+    char name[64];
+    if(!read_ident(&p, name, sizeof(name)) || !accept_op(&p, "="))
+        return false;
+
+    // The expression may refer to the earlier precomputed values, but not to
+    // this one
+    const node_t* expr = compile(p.s);
+    if(expr == NULL)
+        return false;
+
+    precomputed = realloc(precomputed, (Nprecomputed+1)*sizeof(precomputed[0]));
+    if(precomputed == NULL)
+    {
+        MSG("Couldn't allocate memory");
+        exit(1);
+    }
+    precomputed[Nprecomputed++] = (precomputed_t){ .name = strdup(name), .expr = expr };
+    return true;
+}
+
+
+
+//////////////// Output, and the -A/-B/-C context
+
+// With -A/-B/-C the awk program joins the output expressions into a context
+// line by concatenating them: __line = e0" "e1" "e2. Concatenation binds tighter
+// than the comparisons, &&, || and ?:, and a following unary - or + makes a
+// subtraction or an addition. So if an expression has any of these, the
+// context line isn't simply the values joined with ' '. We leave such cases to
+// mawk
+static bool context_line_ok(int i, const char* expr)
+{
+    if(Noutputs == 1)
+        return true;
+
+    const node_t* node = outputs[i];
+    if(!node->in_parens &&
+       (node->eval == eval_lt || node->eval == eval_le ||
+        node->eval == eval_gt || node->eval == eval_ge ||
+        node->eval == eval_eq || node->eval == eval_ne ||
+        node->eval == eval_and || node->eval == eval_or ||
+        node->eval == eval_cond))
+        return false;
+
+    while(*expr == ' ' || *expr == '\t')
+        expr++;
+    return i == 0 || (*expr != '-' && *expr != '+');
+}
+
+static void write_val(val_t v)
+{
+    if(v.type == VAL_NUM)
+    {
+        char buf[32];
+        fwrite_unlocked(buf, 1, num_to_str(buf, v.x), stdout);
+    }
+    else
+        fwrite_unlocked(v.s, 1, v.len, stdout);
+}
+
+typedef struct
+{
+    char* s;
+    int   len, size;
+} line_t;
+
+// The circular buffer of the last -B lines, and the rest of the context state.
+// This mirrors the awk and perl implementations in vnl-filter
+static line_t* contextbuffer;
+static int     i1_contextbuffer       = 0;
+static int     N_contextbuffer        = 0;
+static int     N_printafter           = 0;
+static bool    just_skipped_something = false;
+static bool    printed_something_ever = false;
+
+static void line_append(line_t* line, const char* s, int len)
+{
+    if(line->len + len > line->size)
+    {
+        line->size = 2*(line->len + len) + 64;
+        line->s    = realloc(line->s, line->size);
+        if(line->s == NULL)
+        {
+            MSG("Couldn't allocate memory");
+            exit(1);
+        }
+    }
+    memcpy(&line->s[line->len], s, len);
+    line->len += len;
+}
+
+// The record as a line of text: the values joined with ' '
+static void line_set(line_t* line, const val_t* values)
+{
+    line->len = 0;
+    for(int i=0; i<Noutputs; i++)
+    {
+        char buf[32];
+        int  len;
+        const char* s = to_str(values[i], buf, &len);
+        if(i > 0)
+            line_append(line, " ", 1);
+        line_append(line, s, len);
+    }
+}
+
+static void print_line(const line_t* line)
+{
+    fwrite_unlocked(line->s, 1, line->len, stdout);
+    putc_unlocked('\n', stdout);
+}
+
+static void contextbuffer_output_and_clear(void)
+{
+    int i0 = i1_contextbuffer - N_contextbuffer;
+    if(i0 < 0) i0 += Ncontext_before;
+    while(N_contextbuffer)
+    {
+        print_line(&contextbuffer[i0++]);
+        if(i0 == Ncontext_before) i0 = 0;
+        N_contextbuffer--;
+    }
+}
+
+
+
+//////////////// The data
+
+// Splits the line into fields: runs of non-blanks. Only the first
+// Nfields_needed are looked at. The fields are NUL-terminated in place. Sets
+// Nfields to the number of fields found, up to Nfields_needed
+static void split_fields(char* s, char* end)
+{
+    Nfields = 0;
+    while(Nfields < Nfields_needed)
+    {
+        while(s < end && (*s == ' ' || *s == '\t'))
+            s++;
+        if(s == end)
+            break;
+        char* f = s;
+        while(s < end && *s != ' ' && *s != '\t')
+            s++;
+        fields[Nfields].s   = f;
+        fields[Nfields].len = s - f;
+        Nfields++;
+        if(s < end)
+            *(s++) = '\0';
+    }
+}
+
+// One line of input, without its newline. line[len] is writeable
+static void process_line(char* line, int len)
+{
+    static val_t*  values;
+    static line_t  context_line;
+    if(values == NULL)
+    {
+        values = malloc(Noutputs * sizeof(values[0]));
+        if(values == NULL)
+        {
+            MSG("Couldn't allocate memory");
+            exit(1);
+        }
+    }
+
+    // Comments: /^ *(#|$)/. If printing, these do not count towards the
+    // context stuff (-A/-B/-C)
+    int i = 0;
+    while(i < len && line[i] == ' ')
+        i++;
+    if(i == len || line[i] == '#')
+    {
+        if(!skipcomments)
+        {
+            fwrite_unlocked(line, 1, len, stdout);
+            putc_unlocked('\n', stdout);
+        }
+        return;
+    }
+
+    line[len] = '\0';
+    split_fields(line, &line[len]);
+
+    // skip incomplete records, and records that have empty input columns that
+    // must be non-empty
+    if(Nfields < Nfields_min)
+        return;
+    for(int i=0; i<Nhas_fields; i++)
+        if(has_fields[i] < Nfields &&
+           fields[has_fields[i]].len == 1 && fields[has_fields[i]].s[0] == '-')
+            return;
+
+    for(int i=0; i<Nprecomputed; i++)
+        precomputed[i].value = precomputed[i].expr->eval(precomputed[i].expr);
+
+    for(int i=0; i<Nmatches; i++)
+        if(!to_bool(matches[i]->eval(matches[i])))
+        {
+            if(Ncontext_before == 0 && Ncontext_after == 0)
+                return;
+
+            for(int j=0; j<Noutputs; j++)
+                values[j] = outputs[j]->eval(outputs[j]);
+
+            if(N_printafter)
+            {
+                line_set(&context_line, values);
+                print_line(&context_line);
+                N_printafter--;
+            }
+            else
+            {
+                if(N_contextbuffer == Ncontext_before)
+                    just_skipped_something = true;
+                if(Ncontext_before)
+                {
+                    line_set(&contextbuffer[i1_contextbuffer++], values);
+                    if(i1_contextbuffer == Ncontext_before) i1_contextbuffer = 0;
+                    if(N_contextbuffer  != Ncontext_before) N_contextbuffer++;
+                }
+            }
+            return;
+        }
+
+    // I make sure the reported field doesn't have length-0. This would confuse
+    // the vnlog fields
+    bool all_empty = true;
+    for(int i=0; i<Noutputs; i++)
+    {
+        values[i] = outputs[i]->eval(outputs[i]);
+        if(!nonempty(values[i]))
+            values[i] = val_str("-", 1);
+        if(all_empty && !str_equals(values[i], "-"))
+            all_empty = false;
+    }
+    if(skipempty && all_empty)
+        return;
+
+    if(Ncontext_before || Ncontext_after)
+    {
+        if(just_skipped_something && printed_something_ever)
+            fputs_unlocked("##\n", stdout);
+        just_skipped_something = false;
+        printed_something_ever = true;
+        if(Ncontext_before)
+            contextbuffer_output_and_clear();
+    }
+
+    for(int i=0; i<Noutputs; i++)
+    {
+        if(i > 0)
+            putc_unlocked(' ', stdout);
+        write_val(values[i]);
+    }
+    putc_unlocked('\n', stdout);
+
+    if(Ncontext_before || Ncontext_after)
+        N_printafter = Ncontext_after;
+}
+
+static bool process_input(void)
+{
+    size_t bufsize = READ_SIZE;
+    char*  buf     = malloc(bufsize+1);
+    size_t n       = 0;
+    if(buf == NULL)
+    {
+        MSG("Couldn't allocate memory");
+        return false;
+    }
+
+    while(true)
+    {
+        if(n == bufsize)
+        {
+            // The current line doesn't fit in the buffer. Make it bigger
+            bufsize *= 2;
+            buf = realloc(buf, bufsize+1);
+            if(buf == NULL)
+            {
+                MSG("Couldn't allocate memory");
+                return false;
+            }
+        }
+
+        ssize_t Nread = read(STDIN_FILENO, &buf[n], bufsize - n);
+        if(Nread < 0)
+        {
+            if(errno == EINTR) continue;
+            MSG("Couldn't read: %s", strerror(errno));
+            free(buf);
+            return false;
+        }
+        if(Nread == 0)
+        {
+            // The last line may not have a newline
+            if(n > 0)
+                process_line(buf, n);
+            break;
+        }
+
+        char* s   = buf;
+        char* end = &buf[n + Nread];
+        char* nl;
+        while(NULL != (nl = memchr(s, '\n', end - s)))
+        {
+            process_line(s, nl - s);
+            s = nl+1;
+        }
+        n = end - s;
+        memmove(buf, s, n);
+    }
+
+    free(buf);
+    return true;
+}
+
+static void usage(FILE* fp, const char* argv0)
+{
+    fprintf(fp,
+            "Usage: %s [--unbuffered] [--skipcomments] [--noskipempty] [--abs]\n"
+            "          [-A N] [-B N] [--nfields-min N] [--has N ...]\n"
+            "          [--precompute '__rel0=rel0(...)' ...] [--match EXPR ...]\n"
+            "          --output EXPR ... --awk PROGRAM\n"
+            "\n"
+            "This is the data-processing engine of 'vnl-filter --engine=native'. It isn't\n"
+            "meant to be run directly: vnl-filter reads the legend, generates the awk\n"
+            "PROGRAM, and runs this with the pieces of that program. The expressions\n"
+            "refer to the columns as $N. If they can't be evaluated natively, PROGRAM\n"
+            "is run with mawk\n",
+            argv0);
+}
+
+static void push_str(const char*** list, int* N, const char* s)
+{
+    *list = realloc(*list, (*N+1)*sizeof((*list)[0]));
+    if(*list == NULL)
+    {
+        MSG("Couldn't allocate memory");
+        exit(1);
+    }
+    (*list)[(*N)++] = s;
+}
+
+int main(int argc, char* argv[])
+{
+    static const struct option opts[] =
+        {
+            { "unbuffered",   no_argument,       NULL, 'u' },
+            { "skipcomments", no_argument,       NULL, 'c' },
+            { "noskipempty",  no_argument,       NULL, 'e' },
+            { "abs",          no_argument,       NULL, 'a' },
+            { "nfields-min",  required_argument, NULL, 'n' },
+            { "has",          required_argument, NULL, 'H' },
+            { "precompute",   required_argument, NULL, 'P' },
+            { "match",        required_argument, NULL, 'm' },
+            { "output",       required_argument, NULL, 'o' },
+            { "awk",          required_argument, NULL, 'w' },
+            { "help",         no_argument,       NULL, 'h' },
+            {}
+        };
+
+    bool         unbuffered   = false;
+    const char*  awkprogram   = NULL;
+    const char** exprs_pre    = NULL;
+    int          Nexprs_pre   = 0;
+    const char** exprs_match  = NULL;
+    const char** exprs_output = NULL;
+
+    int opt;
+    while(-1 != (opt = getopt_long(argc, argv, "A:B:h", opts, NULL)))
+    {
+        switch(opt)
+        {
+        case 'u': unbuffered      = true;         break;
+        case 'c': skipcomments    = true;         break;
+        case 'e': skipempty       = false;        break;
+        case 'a': have_abs        = true;         break;
+        case 'n': Nfields_min     = atoi(optarg); break;
+        case 'A': Ncontext_after  = atoi(optarg); break;
+        case 'B': Ncontext_before = atoi(optarg); break;
+        case 'w': awkprogram      = optarg;       break;
+        case 'H':
+            has_fields = realloc(has_fields, (Nhas_fields+1)*sizeof(has_fields[0]));
+            if(has_fields == NULL)
+            {
+                MSG("Couldn't allocate memory");
+                return 1;
+            }
+            has_fields[Nhas_fields++] = atoi(optarg) - 1;
+            break;
+        case 'P': push_str(&exprs_pre,    &Nexprs_pre, optarg); break;
+        case 'm': push_str(&exprs_match,  &Nmatches,   optarg); break;
+        case 'o': push_str(&exprs_output, &Noutputs,   optarg); break;
+        case 'h':
+            usage(stdout, argv[0]);
+            return 0;
+        default:
+            usage(stderr, argv[0]);
+            return 1;
+        }
+    }
+    if(optind != argc || awkprogram == NULL || Noutputs == 0)
+    {
+        usage(stderr, argv[0]);
+        return 1;
+    }
+
+    bool ok = true;
+    for(int i=0; ok && i<Nexprs_pre; i++)
+        ok = compile_precomputed(exprs_pre[i]);
+
+    matches = calloc(Nmatches, sizeof(matches[0]));
+    outputs = calloc(Noutputs, sizeof(outputs[0]));
+    for(int i=0; ok && i<Nmatches; i++)
+        ok = NULL != (matches[i] = compile(exprs_match[i]));
+    for(int i=0; ok && i<Noutputs; i++)
+        ok = NULL != (outputs[i] = compile(exprs_output[i]));
+    ok = ok && Ncontext_before >= 0 && Ncontext_after >= 0;
+    if(ok && (Ncontext_before || Ncontext_after))
+        for(int i=0; ok && i<Noutputs; i++)
+            ok = context_line_ok(i, exprs_output[i]);
+
+    if(!ok)
+    {
+        // Something we can't evaluate natively. mawk does it instead
+        if(unbuffered)
+            execlp("mawk", "mawk", "-Winteractive", awkprogram, (char*)NULL);
+        else
+            execlp("mawk", "mawk", awkprogram, (char*)NULL);
+        MSG("Couldn't run mawk: %s", strerror(errno));
+        return 1;
+    }
+
+    if(Nfields_needed < Nfields_min)
+        Nfields_needed = Nfields_min;
+    for(int i=0; i<Nhas_fields; i++)
+        if(Nfields_needed < has_fields[i]+1)
+            Nfields_needed = has_fields[i]+1;
+    fields = malloc((Nfields_needed+1) * sizeof(fields[0]));
+    if(Ncontext_before)
+        contextbuffer = calloc(Ncontext_before, sizeof(contextbuffer[0]));
+    if(fields == NULL || (Ncontext_before && contextbuffer == NULL))
+    {
+        MSG("Couldn't allocate memory");
+        return 1;
+    }
+
+    // mawk -Winteractive writes each line as it's output
+    if(unbuffered)
+        setvbuf(stdout, NULL, _IOLBF, 0);
+    else
+        setvbuf(stdout, NULL, _IOFBF, READ_SIZE);
+
+    if(!process_input())
+        return 1;
+    return 0;
+}
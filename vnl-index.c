@@ -0,0 +1,255 @@
+// Builds and uses the sparse block index of a vnlog (vnlog-index.h). See
+// vnl-index.pod for the documentation
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <getopt.h>
+
+#include "vnlog-parser.h"
+#include "vnlog-index.h"
+
+#define MSG(fmt, ...) \
+    fprintf(stderr, "vnl-index: " fmt "\n", ##__VA_ARGS__)
+
+#define NRECORDS_PER_BLOCK_DEFAULT 10000
+
+static void print_legend(const vnlog_parser_t* ctx)
+{
+    fputc('#', stdout);
+    for(int i=0; i<ctx->Ncolumns; i++)
+        printf(" %s", ctx->record[i].key);
+    fputc('\n', stdout);
+}
+
+static void print_record(const vnlog_parser_t* ctx)
+{
+    const vnlog_parser_field_t* fields = vnlog_parser_fields(ctx);
+    for(int i=0; i<ctx->Ncolumns; i++)
+        printf("%s%.*s", i == 0 ? "" : " ", fields[i].len, fields[i].data);
+    fputc('\n', stdout);
+}
+
+// Prints the records [from,to) of the log. to<0 means "until the end"
+static bool print_records(const vnlog_index_t* index, vnlog_parser_t* ctx,
+                          int64_t from, int64_t to)
+{
+    print_legend(ctx);
+
+    vnlog_parser_result_t result = vnlog_index_seek_record(index, ctx, NULL, from);
+    for(int64_t i=from; result == VNL_OK && (to < 0 || i < to); i++)
+    {
+        result = vnlog_parser_read_record(ctx, NULL);
+        if(result == VNL_OK)
+            print_record(ctx);
+    }
+    return result != VNL_ERROR;
+}
+
+// Prints the records where lo <= key <= hi. Only the blocks that may have such
+// records are read, and then the part of the log that isn't indexed yet
+static bool print_where(const vnlog_index_t* index, vnlog_parser_t* ctx,
+                        const char* key, double lo, double hi)
+{
+    const int icolumn = vnlog_index_column(index, key);
+    const vnlog_parser_column_t column = vnlog_parser_column(ctx, key);
+    if(icolumn < 0 || column < 0)
+    {
+        MSG("Column '%s' isn't indexed", key);
+        return false;
+    }
+
+    print_legend(ctx);
+
+    for(int iblock = vnlog_index_find_block(index, 0, icolumn, lo, hi);
+        iblock < index->Nblocks;
+        iblock = vnlog_index_find_block(index, iblock+1, icolumn, lo, hi))
+    {
+        if(!vnlog_parser_seek(ctx, NULL, index->offset[iblock]))
+            return false;
+        for(int i=0; i<index->Nrecords[iblock]; i++)
+        {
+            double x;
+            if(VNL_OK != vnlog_parser_read_record(ctx, NULL))
+                return false;
+            if(vnlog_parser_get_double(ctx, column, &x) && lo <= x && x <= hi)
+                print_record(ctx);
+        }
+    }
+
+    if(!vnlog_parser_seek(ctx, NULL, index->log_size))
+        return false;
+    vnlog_parser_result_t result;
+    while(VNL_OK == (result = vnlog_parser_read_record(ctx, NULL)))
+    {
+        double x;
+        if(vnlog_parser_get_double(ctx, column, &x) && lo <= x && x <= hi)
+            print_record(ctx);
+    }
+    return result == VNL_EOF;
+}
+
+static bool parse_int64(int64_t* x, const char* s)
+{
+    char* end;
+    errno = 0;
+    *x = strtoll(s, &end, 10);
+    return end != s && *end == '\0' && errno == 0;
+}
+
+// An empty string is +-infinity
+static bool parse_bound(double* x, const char* s, double x_empty)
+{
+    if(*s == '\0')
+    {
+        *x = x_empty;
+        return true;
+    }
+    char* end;
+    *x = strtod(s, &end);
+    return end != s && *end == '\0';
+}
+
+static void usage(FILE* fp, const char* argv0)
+{
+    fprintf(fp,
+            "Usage: %s [--index INDEX] [--every N] [--column KEY ...] log.vnl\n"
+            "       %s [--index INDEX] --records FROM:TO    log.vnl\n"
+            "       %s [--index INDEX] --where   KEY:MIN:MAX log.vnl\n"
+            "\n"
+            "The first form creates or updates the index of the log: the offset of every\n"
+            "N-th record, and the range of each given column in each block of N records.\n"
+            "The other forms use the index to print the records FROM..TO-1, or the\n"
+            "records with MIN <= KEY <= MAX. The index is in log.vnl.idx by default.\n"
+            "Please see the manpage for details\n",
+            argv0, argv0, argv0);
+}
+
+int main(int argc, char* argv[])
+{
+    static const struct option opts[] =
+        {
+            { "index",   required_argument, NULL, 'i' },
+            { "every",   required_argument, NULL, 'n' },
+            { "column",  required_argument, NULL, 'c' },
+            { "records", required_argument, NULL, 'r' },
+            { "where",   required_argument, NULL, 'w' },
+            { "help",    no_argument,       NULL, 'h' },
+            {}
+        };
+
+    const char*  index_filename     = NULL;
+    int          Nrecords_per_block = NRECORDS_PER_BLOCK_DEFAULT;
+    const char** keys               = calloc(argc, sizeof(keys[0]));
+    int          Nkeys              = 0;
+    const char*  records            = NULL;
+    char*        where              = NULL;
+
+    int opt;
+    while(-1 != (opt = getopt_long(argc, argv, "i:n:c:r:w:h", opts, NULL)))
+    {
+        switch(opt)
+        {
+        case 'i': index_filename     = optarg;       break;
+        case 'n': Nrecords_per_block = atoi(optarg); break;
+        case 'c': keys[Nkeys++]      = optarg;       break;
+        case 'r': records            = optarg;       break;
+        case 'w': where              = optarg;       break;
+        case 'h':
+            usage(stdout, argv[0]);
+            return 0;
+        default:
+            usage(stderr, argv[0]);
+            return 1;
+        }
+    }
+    if(optind != argc-1 || (records != NULL && where != NULL) || Nrecords_per_block <= 0)
+    {
+        usage(stderr, argv[0]);
+        return 1;
+    }
+
+    const char* log_filename = argv[optind];
+    char index_filename_default[strlen(log_filename) + 8];
+    if(index_filename == NULL)
+    {
+        sprintf(index_filename_default, "%s.idx", log_filename);
+        index_filename = index_filename_default;
+    }
+
+    if(records == NULL && where == NULL)
+    {
+        const bool ok = vnlog_index_update(log_filename, index_filename,
+                                           Nrecords_per_block, keys, Nkeys, NULL);
+        free(keys);
+        return ok ? 0 : 1;
+    }
+    free(keys);
+
+    vnlog_index_t index;
+    if(!vnlog_index_read(&index, index_filename))
+        return 1;
+    if(!vnlog_index_check(&index, log_filename))
+    {
+        MSG("'%s' doesn't match '%s'. Run 'vnl-index %s' to update it",
+            index_filename, log_filename, log_filename);
+        vnlog_index_free(&index);
+        return 1;
+    }
+
+    vnlog_parser_t ctx;
+    if(VNL_OK != vnlog_parser_init_mmap(&ctx, log_filename, false))
+    {
+        MSG("Couldn't read the legend of '%s'", log_filename);
+        vnlog_index_free(&index);
+        return 1;
+    }
+
+    bool ok;
+    if(records != NULL)
+    {
+        // FROM:TO. An empty TO means "until the end"
+        int64_t from, to = -1;
+        char* colon = strchr(records, ':');
+        if(colon != NULL) *colon = '\0';
+        ok =
+            colon != NULL &&
+            parse_int64(&from, records) &&
+            (colon[1] == '\0' || parse_int64(&to, &colon[1])) &&
+            from >= 0;
+        if(!ok)
+            MSG("--records wants FROM:TO; got '%s'", records);
+        else
+            ok = print_records(&index, &ctx, from, to);
+    }
+    else
+    {
+        // KEY:MIN:MAX. The key may contain ':'. An empty MIN or MAX is
+        // unbounded
+        double lo, hi;
+        char* colon_hi = strrchr(where, ':');
+        char* colon_lo = NULL;
+        if(colon_hi != NULL)
+        {
+            *colon_hi = '\0';
+            colon_lo  = strrchr(where, ':');
+        }
+        if(colon_lo != NULL) *colon_lo = '\0';
+        ok =
+            colon_lo != NULL &&
+            parse_bound(&lo, &colon_lo[1], -1.0/0.0) &&
+            parse_bound(&hi, &colon_hi[1],  1.0/0.0);
+        if(!ok)
+            MSG("--where wants KEY:MIN:MAX");
+        else
+            ok = print_where(&index, &ctx, where, lo, hi);
+    }
+
+    vnlog_parser_free(&ctx);
+    vnlog_index_free(&index);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,328 @@
+// Reads the output of a vnlog session written to shared memory (with
+// vnlog_set_output_shm()), and writes it to stdout as plain vnlog text. See
+// vnl-shm-cat.pod for the documentation and vnlog-shm.h for the protocol
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vnlog-shm.h"
+
+#define MSG(fmt, ...) \
+    fprintf(stderr, "vnl-shm-cat: " fmt "\n", ##__VA_ARGS__)
+
+static volatile sig_atomic_t stop = 0;
+static void handle_signal(int sig __attribute__((unused)))
+{
+    stop = 1;
+}
+
+static void sleep_us(long us)
+{
+    struct timespec ts = { .tv_sec  = us / 1000000,
+                           .tv_nsec = (us % 1000000) * 1000 };
+    nanosleep(&ts, NULL);
+}
+
+static bool writer_is_alive(const vnlog_shm_header_t* header)
+{
+    return !(kill((pid_t)header->writer_pid, 0) != 0 && errno == ESRCH);
+}
+
+static void usage(FILE* fp, const char* argv0)
+{
+    fprintf(fp,
+            "Usage: %s [--wait] [--poll-us N] /shm-name\n"
+            "\n"
+            "Reads the vnlog written to the given POSIX shared-memory segment by\n"
+            "vnlog_set_output_shm(), and writes it to stdout. Exits when the writer\n"
+            "is done. With --wait, waits for the segment to be created if it doesn't\n"
+            "exist yet. Please see the manpage for details\n",
+            argv0);
+}
+
+// Opens and maps the segment, and validates its header. The writer creates the
+// segment in steps: shm_open(), ftruncate(), mmap(), and it writes the magic
+// last. So I can see a segment that is empty, or has no magic yet. With --wait
+// I retry until the writer is done setting it up. Without --wait that is an
+// error. Returns NULL on error
+static vnlog_shm_header_t* attach(const char* name, bool wait, long poll_us,
+                                  bool* writeable)
+{
+    while(!stop)
+    {
+        // I need write access to register as a reader. If I don't have it, I
+        // read anyway
+        *writeable = true;
+        int fd = shm_open(name, O_RDWR, 0);
+        if(fd < 0)
+        {
+            *writeable = false;
+            fd = shm_open(name, O_RDONLY, 0);
+        }
+        if(fd < 0)
+        {
+            if(wait && errno == ENOENT)
+            {
+                sleep_us(poll_us);
+                continue;
+            }
+            MSG("Couldn't open shared-memory segment '%s': %s", name, strerror(errno));
+            return NULL;
+        }
+
+        struct stat st;
+        if(0 != fstat(fd, &st))
+        {
+            MSG("Couldn't stat shared-memory segment '%s': %s", name, strerror(errno));
+            close(fd);
+            return NULL;
+        }
+        if((size_t)st.st_size < sizeof(vnlog_shm_header_t))
+        {
+            close(fd);
+            if(wait)
+            {
+                // Not sized yet. I reopen the segment each time: the writer
+                // may replace a stale segment with a new one
+                sleep_us(poll_us);
+                continue;
+            }
+            MSG("Shared-memory segment '%s' is too small to be a vnlog", name);
+            return NULL;
+        }
+
+        vnlog_shm_header_t* header =
+            mmap(NULL, st.st_size,
+                 *writeable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+                 MAP_SHARED, fd, 0);
+        close(fd);
+        if(header == MAP_FAILED)
+        {
+            MSG("Couldn't map shared-memory segment '%s': %s", name, strerror(errno));
+            return NULL;
+        }
+
+        // The writer sets the magic last. If I attached while it was still
+        // setting up, I wait a bit
+        bool have_magic = false;
+        for(int i=0; i<1000 && !stop; i++)
+        {
+            if(0 == memcmp(header->magic, VNLOG_SHM_MAGIC, sizeof(header->magic)))
+            {
+                have_magic = true;
+                break;
+            }
+            sleep_us(1000);
+        }
+        if(!have_magic)
+        {
+            munmap(header, st.st_size);
+            if(wait)
+                continue;
+            MSG("Shared-memory segment '%s' isn't a vnlog", name);
+            return NULL;
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if(header->version != VNLOG_SHM_VERSION)
+        {
+            MSG("Shared-memory segment '%s' has version %" PRIu32 ". I only know about version %d",
+                name, header->version, VNLOG_SHM_VERSION);
+            munmap(header, st.st_size);
+            return NULL;
+        }
+        if(vnlog_shm_segment_size(header->legend_max, header->ring_size) > (uint64_t)st.st_size)
+        {
+            munmap(header, st.st_size);
+            if(wait)
+            {
+                sleep_us(poll_us);
+                continue;
+            }
+            MSG("Shared-memory segment '%s' is truncated", name);
+            return NULL;
+        }
+
+        return header;
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+    long poll_us = 200;
+    bool wait    = false;
+
+    static const struct option opts[] =
+        {
+            { "poll-us", required_argument, NULL, 'p' },
+            { "wait",    no_argument,       NULL, 'w' },
+            { "help",    no_argument,       NULL, 'h' },
+            {}
+        };
+    int opt;
+    while(-1 != (opt = getopt_long(argc, argv, "h", opts, NULL)))
+    {
+        switch(opt)
+        {
+        case 'p':
+            poll_us = atol(optarg);
+            if(poll_us <= 0)
+            {
+                MSG("--poll-us must be > 0");
+                return 1;
+            }
+            break;
+        case 'w':
+            wait = true;
+            break;
+        case 'h':
+            usage(stdout, argv[0]);
+            return 0;
+        default:
+            usage(stderr, argv[0]);
+            return 1;
+        }
+    }
+    if(optind != argc-1)
+    {
+        usage(stderr, argv[0]);
+        return 1;
+    }
+    const char* name = argv[optind];
+
+    struct sigaction sa = { .sa_handler = handle_signal };
+    sigaction(SIGINT,  &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGPIPE, &sa, NULL);
+
+    bool writeable;
+    vnlog_shm_header_t* header = attach(name, wait, poll_us, &writeable);
+    if(header == NULL)
+        return 1;
+
+    if(writeable)
+        __atomic_add_fetch(&header->Nreaders, 1, __ATOMIC_SEQ_CST);
+
+    const uint64_t size = header->ring_size;
+    const char*    ring = vnlog_shm_ring(header);
+
+    char* record = malloc(size/4);
+    if(record == NULL)
+    {
+        MSG("Couldn't allocate the record buffer");
+        return 1;
+    }
+
+    // If nothing has been overwritten yet, I read everything. Otherwise I start
+    // at the current position
+    uint64_t pos = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    if(pos <= size/2)
+        pos = 0;
+    else
+        printf("## vnl-shm-cat: attached late; the earlier data was overwritten\n");
+
+    bool     printed_legend = false;
+    uint64_t Ndropped       = 0;
+    int      result         = 0;
+
+    while(!stop)
+    {
+        if(!printed_legend)
+        {
+            const uint64_t legend_len = __atomic_load_n(&header->legend_len, __ATOMIC_ACQUIRE);
+            if(legend_len)
+            {
+                fwrite(vnlog_shm_legend(header), 1, legend_len, stdout);
+                printed_legend = true;
+            }
+        }
+
+        const uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+
+        const uint64_t Ndropped_now = __atomic_load_n(&header->Ndropped, __ATOMIC_RELAXED);
+        if(Ndropped_now != Ndropped)
+        {
+            printf("## vnl-shm-cat: the writer dropped %" PRIu64 " records too large for the ring\n",
+                   Ndropped_now - Ndropped);
+            Ndropped = Ndropped_now;
+        }
+
+        if(pos == head)
+        {
+            // Caught up. Done if the writer is done
+            if(__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE))
+            {
+                if(pos == __atomic_load_n(&header->head, __ATOMIC_ACQUIRE))
+                    break;
+                continue;
+            }
+            if(!writer_is_alive(header))
+            {
+                MSG("The writer (pid %" PRIu32 ") died", header->writer_pid);
+                result = 1;
+                break;
+            }
+
+            fflush(stdout);
+            sleep_us(poll_us);
+            continue;
+        }
+
+        if(head - pos > size/2)
+        {
+            printf("## vnl-shm-cat: fell behind; lost %" PRIu64 " bytes\n", head - pos);
+            pos = head;
+            continue;
+        }
+
+        const uint64_t offset = pos & (size - 1);
+        int32_t len;
+        memcpy(&len, &ring[offset], sizeof(len));
+
+        uint64_t pos_next;
+        if(len == VNLOG_SHM_PADDING)
+            pos_next = pos + size - offset;
+        else
+        {
+            if(len < 0 || (uint64_t)len > size/4)
+                // Garbage: the data was overwritten while I was looking at it.
+                // The check below will catch this
+                len = 0;
+            else
+                memcpy(record, &ring[offset + sizeof(len)], len);
+            pos_next = pos + vnlog_shm_record_size(len);
+        }
+
+        // Make sure the writer didn't overwrite what I just copied
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        const uint64_t head_after = __atomic_load_n(&header->head, __ATOMIC_RELAXED);
+        if(head_after - pos > size/2)
+        {
+            printf("## vnl-shm-cat: fell behind; lost %" PRIu64 " bytes\n", head_after - pos);
+            pos = head_after;
+            continue;
+        }
+
+        if(len != VNLOG_SHM_PADDING)
+            fwrite(record, 1, len, stdout);
+        pos = pos_next;
+    }
+
+    fflush(stdout);
+    if(writeable)
+        __atomic_sub_fetch(&header->Nreaders, 1, __ATOMIC_SEQ_CST);
+    free(record);
+    return result;
+}
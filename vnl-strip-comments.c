@@ -0,0 +1,359 @@
+// Strips the comments from a vnlog, leaving the legend and the data. This is
+// the pre-filter that the coreutils wrappers (vnl-sort, vnl-join, ...) put in
+// front of each of their inputs. See vnl-strip-comments.pod for the
+// documentation
+//
+// The output is exactly what the mawk script in Vnlog::Util produces; that
+// script is used if this tool isn't built. Most data lines need no changes, so
+// runs of those are passed through verbatim. If the input is a regular file and
+// the output is a pipe, these runs are splice()-d, so the data isn't copied
+// through this process at all
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MSG(fmt, ...) \
+    fprintf(stderr, "vnl-strip-comments: " fmt "\n", ##__VA_ARGS__)
+
+#define READ_SIZE 65536
+
+typedef struct
+{
+    // The input. We splice() from it if it's a regular file
+    int  fd_in;
+    bool can_splice;
+
+    bool have_legend;
+
+    // Set if we saw data before the legend. We stop reading then
+    bool done;
+} context_t;
+
+static bool write_all(const char* buf, size_t n)
+{
+    while(n)
+    {
+        ssize_t Nwritten = write(STDOUT_FILENO, buf, n);
+        if(Nwritten < 0)
+        {
+            if(errno == EINTR) continue;
+            MSG("Couldn't write: %s", strerror(errno));
+            return false;
+        }
+        buf += Nwritten;
+        n   -= Nwritten;
+    }
+    return true;
+}
+
+// Writes out n bytes of input verbatim. They're at buf in memory, and at off in
+// the input file, if it's a regular file
+static bool write_verbatim(context_t* ctx, const char* buf, size_t n, off_t off)
+{
+    while(ctx->can_splice && n)
+    {
+        ssize_t Nspliced = splice(ctx->fd_in, &off, STDOUT_FILENO, NULL, n, SPLICE_F_MORE);
+        if(Nspliced > 0)
+        {
+            buf += Nspliced;
+            n   -= Nspliced;
+            continue;
+        }
+        if(Nspliced < 0 && errno == EINTR)
+            continue;
+        if(Nspliced < 0 && errno != EINVAL && errno != ENOSYS)
+        {
+            MSG("Couldn't write: %s", strerror(errno));
+            return false;
+        }
+
+        // The output isn't a pipe, or this filesystem can't splice(), or the
+        // file was truncated from under us. I write() from memory from now on
+        ctx->can_splice = false;
+    }
+    return write_all(buf, n);
+}
+
+static bool is_blank(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+static bool write_line(const char* line, size_t len)
+{
+    return write_all(line, len) && write_all("\n", 1);
+}
+
+// A line before the legend: the legend itself, or a comment. The line is len
+// bytes at line, without its newline
+static bool header_line(context_t* ctx, const char* line, size_t len)
+{
+    // Strip the ## and #! comments, and the blanks before them
+    for(size_t i=0; i+1<len; i++)
+        if(line[i] == '#' && (line[i+1] == '#' || line[i+1] == '!'))
+        {
+            len = i;
+            while(len && is_blank(line[len-1]))
+                len--;
+            break;
+        }
+
+    size_t i = 0;
+    while(i < len && is_blank(line[i]))
+        i++;
+
+    // Skip blank lines
+    if(i == len)
+        return true;
+
+    if(line[i] != '#')
+    {
+        // Only single # comments are possible before the legend. The tool
+        // reading our output reports this
+        ctx->done = true;
+        static const char error[] = "ERROR: Data before legend\n";
+        return write_all(error, sizeof(error)-1);
+    }
+
+    // A data-less # is a comment too
+    size_t j = i+1;
+    while(j < len && is_blank(line[j]))
+        j++;
+    if(j == len)
+        return true;
+
+    ctx->have_legend = true;
+    return write_line(line, len);
+}
+
+// A data line that needs changes: it has a comment, trailing blanks or no
+// newline; or it's blank
+static bool data_line_modified(const char* line, size_t len)
+{
+    const char* hash = memchr(line, '#', len);
+    if(hash != NULL)
+        len = hash - line;
+    while(len && is_blank(line[len-1]))
+        len--;
+
+    if(len == 0)
+        return true;
+    return write_line(line, len);
+}
+
+// Processes the complete lines in the n bytes at buf. If eof, the last line
+// doesn't need a newline. buf is at off in the input file, if it's a regular
+// file. Returns the number of bytes used, or -1 on error
+static ssize_t process(context_t* ctx, const char* buf, size_t n, bool eof, off_t off)
+{
+    const char* end = &buf[n];
+    const char* s   = buf;
+
+    while(!ctx->done && !ctx->have_legend && s < end)
+    {
+        const char* nl = memchr(s, '\n', end - s);
+        if(nl == NULL)
+        {
+            if(!eof)
+                return s - buf;
+            nl = end;
+        }
+        if(!header_line(ctx, s, nl - s))
+            return -1;
+        s = nl < end ? nl+1 : end;
+    }
+    if(ctx->done)
+        return n;
+
+    // The data. Lines without comments or trailing blanks are passed through
+    // as they are. I accumulate runs of these, and write() or splice() each
+    // run at once. next_hash is the next '#' at or after s, or NULL
+    const char* run_start = s;
+    const char* next_hash = memchr(s, '#', end - s);
+    while(s < end)
+    {
+        const char* nl = memchr(s, '\n', end - s);
+        if(nl == NULL && !eof)
+            break;
+
+        if(nl != NULL &&
+           nl != s &&
+           !is_blank(nl[-1]) &&
+           (next_hash == NULL || next_hash > nl))
+        {
+            // This line is fine as is
+            s = nl+1;
+            continue;
+        }
+
+        if(!write_verbatim(ctx, run_start, s - run_start, off + (run_start - buf)))
+            return -1;
+
+        const char* line_end = nl != NULL ? nl : end;
+        if(!data_line_modified(s, line_end - s))
+            return -1;
+
+        s         = nl != NULL ? nl+1 : end;
+        run_start = s;
+        if(next_hash != NULL && next_hash < s)
+            next_hash = memchr(s, '#', end - s);
+    }
+
+    if(!write_verbatim(ctx, run_start, s - run_start, off + (run_start - buf)))
+        return -1;
+    return s - buf;
+}
+
+// A regular file: I look at it all at once with mmap(). If the mmap() fails,
+// *mapped is set to false, and nothing is written
+static bool process_file(context_t* ctx, off_t size, bool* mapped)
+{
+    *mapped = true;
+
+    off_t start = lseek(ctx->fd_in, 0, SEEK_CUR);
+    if(start < 0)
+        start = 0;
+    if(start >= size)
+        return true;
+
+    const char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, ctx->fd_in, 0);
+    if(data == MAP_FAILED)
+    {
+        *mapped = false;
+        return false;
+    }
+    madvise((void*)data, size, MADV_SEQUENTIAL);
+
+    ctx->can_splice = true;
+    bool result = process(ctx, &data[start], size - start, true, start) >= 0;
+    munmap((void*)data, size);
+    return result;
+}
+
+// Anything else: a pipe, a terminal, ... I read() it in chunks. Each chunk of
+// lines is written out as soon as it's read, so the output isn't delayed when
+// reading live data
+static bool process_stream(context_t* ctx)
+{
+    size_t bufsize = READ_SIZE;
+    char*  buf     = malloc(bufsize);
+    size_t n       = 0;
+    bool   result  = false;
+
+    if(buf == NULL)
+    {
+        MSG("Couldn't allocate the read buffer");
+        return false;
+    }
+
+    ctx->can_splice = false;
+    while(!ctx->done)
+    {
+        if(n == bufsize)
+        {
+            // The current line doesn't fit in the buffer. Make it bigger
+            char* buf_new = realloc(buf, bufsize*2);
+            if(buf_new == NULL)
+            {
+                MSG("Couldn't allocate the read buffer");
+                goto done;
+            }
+            buf      = buf_new;
+            bufsize *= 2;
+        }
+
+        ssize_t Nread = read(ctx->fd_in, &buf[n], bufsize - n);
+        if(Nread < 0)
+        {
+            if(errno == EINTR) continue;
+            MSG("Couldn't read: %s", strerror(errno));
+            goto done;
+        }
+
+        const bool eof = (Nread == 0);
+        n += Nread;
+
+        ssize_t Nused = process(ctx, buf, n, eof, 0);
+        if(Nused < 0)
+            goto done;
+        memmove(buf, &buf[Nused], n - Nused);
+        n -= Nused;
+
+        if(eof)
+            break;
+    }
+    result = true;
+
+ done:
+    free(buf);
+    return result;
+}
+
+static void usage(FILE* fp, const char* argv0)
+{
+    fprintf(fp,
+            "Usage: %s [log.vnl]\n"
+            "\n"
+            "Writes the given vnlog (or stdin) to stdout, without comments, blank lines\n"
+            "and trailing whitespace. The legend is kept. Please see the manpage for\n"
+            "details\n",
+            argv0);
+}
+
+int main(int argc, char* argv[])
+{
+    static const struct option opts[] =
+        {
+            { "help", no_argument, NULL, 'h' },
+            {}
+        };
+    int opt;
+    while(-1 != (opt = getopt_long(argc, argv, "h", opts, NULL)))
+    {
+        switch(opt)
+        {
+        case 'h':
+            usage(stdout, argv[0]);
+            return 0;
+        default:
+            usage(stderr, argv[0]);
+            return 1;
+        }
+    }
+    if(optind < argc-1)
+    {
+        usage(stderr, argv[0]);
+        return 1;
+    }
+
+    context_t ctx = { .fd_in = STDIN_FILENO };
+    if(optind == argc-1 && 0 != strcmp(argv[optind], "-"))
+    {
+        ctx.fd_in = open(argv[optind], O_RDONLY);
+        if(ctx.fd_in < 0)
+        {
+            MSG("Couldn't open '%s': %s", argv[optind], strerror(errno));
+            return 1;
+        }
+    }
+
+    // If the input is a regular file, but can't be mmap()-ed, I read() it
+    struct stat st;
+    bool mapped = false;
+    bool ok     = false;
+    if(0 == fstat(ctx.fd_in, &st) && S_ISREG(st.st_mode))
+        ok = process_file(&ctx, st.st_size, &mapped);
+    if(!mapped)
+        ok = process_stream(&ctx);
+
+    return ok ? 0 : 1;
+}
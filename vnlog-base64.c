@@ -0,0 +1,407 @@
+// Base64 encoding and decoding for the binary fields.
+//
+// The scalar encoder is libb64 (b64_cencode.c). On x86 we also have SSSE3 and
+// AVX2 implementations of both the encoder and the decoder, using the methods
+// from Wojciech Muła and Daniel Lemire: "Faster Base64 Encoding and Decoding
+// Using AVX2 Instructions" (2018). The fastest implementation the CPU supports
+// is picked at runtime, the first time it's needed.
+//
+// The SIMD loops only process whole blocks, and stop early enough that their
+// full-width loads and stores never go past the end of the buffers. Whatever
+// is left over (including any padding) is handled by the scalar code
+
+#include <stdint.h>
+#include <string.h>
+
+#include "vnlog-base64.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define HAVE_X86_SIMD 1
+  #include <immintrin.h>
+#endif
+
+// 0..63 for each character in the base64 alphabet. 0xff for everything else
+// (including the '=' padding)
+static const uint8_t decode_table[256] =
+{
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+    0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+// Decodes srclen characters (a multiple of 4). Only the last group of 4 may
+// have padding. Returns the number of bytes written or <0 if the input is
+// invalid
+static int decode_scalar(char* dst, const char* src, int srclen)
+{
+    char* d = dst;
+    for(int i=0; i<srclen; i+=4)
+    {
+        const uint8_t a = decode_table[(uint8_t)src[i+0]];
+        const uint8_t b = decode_table[(uint8_t)src[i+1]];
+        const uint8_t c = decode_table[(uint8_t)src[i+2]];
+        const uint8_t e = decode_table[(uint8_t)src[i+3]];
+        if((a | b) & 0x80)
+            return -1;
+
+        if(i+4 == srclen && src[i+3] == '=')
+        {
+            *d++ = (char)(a << 2 | b >> 4);
+            if(src[i+2] == '=')
+                break;
+            if(c & 0x80)
+                return -1;
+            *d++ = (char)(b << 4 | c >> 2);
+            break;
+        }
+
+        if((c | e) & 0x80)
+            return -1;
+        const uint32_t x = (uint32_t)a << 18 | (uint32_t)b << 12 | (uint32_t)c << 6 | e;
+        *d++ = (char)(x >> 16);
+        *d++ = (char)(x >>  8);
+        *d++ = (char)(x >>  0);
+    }
+    return (int)(d - dst);
+}
+
+// The SIMD kernels. Each processes as many whole blocks as it safely can, and
+// returns the number of input bytes consumed, or <0 if the input is invalid
+typedef int (*kernel_t)(char* dst, const char* src, int srclen);
+
+#ifdef HAVE_X86_SIMD
+
+// 12 bytes in, 16 characters out. Loads 16 bytes
+//
+// Always inlined, so that the AVX2 kernels can use this too, with the AVX
+// encoding. Switching between legacy SSE and AVX code is slow
+__attribute__((target("ssse3"), always_inline))
+static inline int encode_ssse3(char* dst, const char* src, int srclen)
+{
+    const __m128i shuffle =
+        _mm_setr_epi8(1,0,2,1, 4,3,5,4, 7,6,8,7, 10,9,11,10);
+    const __m128i shift_lut =
+        _mm_setr_epi8('a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+                      '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '+'-62,
+                      '/'-63, 'A', 0, 0);
+    int i = 0;
+    for(; srclen - i >= 16; i += 12)
+    {
+        __m128i in = _mm_loadu_si128((const __m128i*)&src[i]);
+
+        // Spread each 3 bytes into 4 bytes of 6-bit indices
+        in = _mm_shuffle_epi8(in, shuffle);
+        const __m128i t0 = _mm_and_si128   (in, _mm_set1_epi32(0x0fc0fc00));
+        const __m128i t1 = _mm_mulhi_epu16 (t0, _mm_set1_epi32(0x04000040));
+        const __m128i t2 = _mm_and_si128   (in, _mm_set1_epi32(0x003f03f0));
+        const __m128i t3 = _mm_mullo_epi16 (t2, _mm_set1_epi32(0x01000010));
+        const __m128i indices = _mm_or_si128(t1, t3);
+
+        // Map each index to its character by adding an offset that depends on
+        // the range the index is in
+        __m128i offset = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+        const __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+        offset = _mm_or_si128(offset, _mm_and_si128(less, _mm_set1_epi8(13)));
+        offset = _mm_shuffle_epi8(shift_lut, offset);
+
+        _mm_storeu_si128((__m128i*)&dst[i/3*4], _mm_add_epi8(offset, indices));
+    }
+    return i;
+}
+
+// 24 bytes in, 32 characters out. Loads 28 bytes
+__attribute__((target("avx2")))
+static int encode_avx2(char* dst, const char* src, int srclen)
+{
+    const __m256i shuffle =
+        _mm256_setr_epi8(1,0,2,1, 4,3,5,4, 7,6,8,7, 10,9,11,10,
+                         1,0,2,1, 4,3,5,4, 7,6,8,7, 10,9,11,10);
+    const __m256i shift_lut =
+        _mm256_setr_epi8('a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+                         '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '+'-62,
+                         '/'-63, 'A', 0, 0,
+                         'a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+                         '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '+'-62,
+                         '/'-63, 'A', 0, 0);
+    int i = 0;
+    for(; srclen - i >= 28; i += 24)
+    {
+        // 12 bytes in each 128-bit lane
+        __m256i in =
+            _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)&src[i])),
+                                    _mm_loadu_si128((const __m128i*)&src[i+12]),
+                                    1);
+
+        in = _mm256_shuffle_epi8(in, shuffle);
+        const __m256i t0 = _mm256_and_si256   (in, _mm256_set1_epi32(0x0fc0fc00));
+        const __m256i t1 = _mm256_mulhi_epu16 (t0, _mm256_set1_epi32(0x04000040));
+        const __m256i t2 = _mm256_and_si256   (in, _mm256_set1_epi32(0x003f03f0));
+        const __m256i t3 = _mm256_mullo_epi16 (t2, _mm256_set1_epi32(0x01000010));
+        const __m256i indices = _mm256_or_si256(t1, t3);
+
+        __m256i offset = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        const __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+        offset = _mm256_or_si256(offset, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+        offset = _mm256_shuffle_epi8(shift_lut, offset);
+
+        _mm256_storeu_si256((__m256i*)&dst[i/3*4], _mm256_add_epi8(offset, indices));
+    }
+
+    // Finish up with the narrower blocks. This matters for short inputs
+    return i + encode_ssse3(&dst[i/3*4], &src[i], srclen - i);
+}
+
+// 16 characters in, 12 bytes out. Stores 16 bytes. Stops while at least 8
+// characters remain: those contain any padding, and they decode to at least the
+// 4 bytes the last store spills over into. Always inlined, like encode_ssse3()
+__attribute__((target("ssse3"), always_inline))
+static inline int decode_ssse3(char* dst, const char* src, int srclen)
+{
+    // Each character is classified by its low and high nibbles. It is valid
+    // iff lut_lo[lo] & lut_hi[hi] == 0
+    const __m128i lut_lo =
+        _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                      0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lut_hi =
+        _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                      0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    // The offset to add to get the 6-bit value, indexed by the high nibble
+    // ('/' is special-cased)
+    const __m128i lut_roll =
+        _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                      0,  0,  0, 0,   0,   0,   0,   0);
+    const __m128i pack =
+        _mm_setr_epi8(2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1);
+    const __m128i slash  = _mm_set1_epi8('/');
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    const __m128i zero   = _mm_setzero_si128();
+
+    int i = 0;
+    for(; srclen - i >= 24; i += 16)
+    {
+        const __m128i in = _mm_loadu_si128((const __m128i*)&src[i]);
+
+        const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), nibble);
+        const __m128i lo_nibbles = _mm_and_si128(in, nibble);
+        const __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+        const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        if(0xFFFF != _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), zero)))
+            return -1;
+
+        const __m128i eq_slash = _mm_cmpeq_epi8(in, slash);
+        const __m128i roll     = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_slash, hi_nibbles));
+        const __m128i values   = _mm_add_epi8(in, roll);
+
+        // Pack each 4 6-bit values into 3 bytes
+        const __m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+        __m128i out = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+        out = _mm_shuffle_epi8(out, pack);
+
+        _mm_storeu_si128((__m128i*)&dst[i/4*3], out);
+    }
+    return i;
+}
+
+// 32 characters in, 24 bytes out. Stores 32 bytes. Stops while at least 16
+// characters remain, for the same reason as decode_ssse3()
+__attribute__((target("avx2")))
+static int decode_avx2(char* dst, const char* src, int srclen)
+{
+    const __m256i lut_lo =
+        _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                         0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+                         0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                         0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lut_hi =
+        _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                         0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                         0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                         0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll =
+        _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                         0,  0,  0, 0,   0,   0,   0,   0,
+                         0, 16, 19, 4, -65, -65, -71, -71,
+                         0,  0,  0, 0,   0,   0,   0,   0);
+    const __m256i pack =
+        _mm256_setr_epi8(2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1,
+                         2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1);
+    // Moves the 12 bytes from each lane together
+    const __m256i compact = _mm256_setr_epi32(0,1,2, 4,5,6, 3,7);
+    const __m256i slash   = _mm256_set1_epi8('/');
+    const __m256i nibble  = _mm256_set1_epi8(0x0f);
+
+    int i = 0;
+    for(; srclen - i >= 48; i += 32)
+    {
+        const __m256i in = _mm256_loadu_si256((const __m256i*)&src[i]);
+
+        const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), nibble);
+        const __m256i lo_nibbles = _mm256_and_si256(in, nibble);
+        const __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+        const __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+        if(!_mm256_testz_si256(lo, hi))
+            return -1;
+
+        const __m256i eq_slash = _mm256_cmpeq_epi8(in, slash);
+        const __m256i roll     = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_slash, hi_nibbles));
+        const __m256i values   = _mm256_add_epi8(in, roll);
+
+        const __m256i merged = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+        __m256i out = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+        out = _mm256_shuffle_epi8(out, pack);
+        out = _mm256_permutevar8x32_epi32(out, compact);
+
+        _mm256_storeu_si256((__m256i*)&dst[i/4*3], out);
+    }
+
+    // Finish up with the narrower blocks. This matters for short inputs
+    const int Ntail = decode_ssse3(&dst[i/4*3], &src[i], srclen - i);
+    if(Ntail < 0)
+        return -1;
+    return i + Ntail;
+}
+
+#endif
+
+static kernel_t encode_kernel(vnlog_base64_impl_t impl)
+{
+#ifdef HAVE_X86_SIMD
+    if(impl == VNLOG_BASE64_SSSE3) return encode_ssse3;
+    if(impl == VNLOG_BASE64_AVX2)  return encode_avx2;
+#endif
+    (void)impl;
+    return NULL;
+}
+
+static kernel_t decode_kernel(vnlog_base64_impl_t impl)
+{
+#ifdef HAVE_X86_SIMD
+    if(impl == VNLOG_BASE64_SSSE3) return decode_ssse3;
+    if(impl == VNLOG_BASE64_AVX2)  return decode_avx2;
+#endif
+    (void)impl;
+    return NULL;
+}
+
+bool _vnlog_base64_impl_available(vnlog_base64_impl_t impl)
+{
+    switch(impl)
+    {
+    case VNLOG_BASE64_SCALAR:
+        return true;
+#ifdef HAVE_X86_SIMD
+    case VNLOG_BASE64_SSSE3:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("ssse3");
+    case VNLOG_BASE64_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+const char* _vnlog_base64_impl_name(vnlog_base64_impl_t impl)
+{
+    switch(impl)
+    {
+    case VNLOG_BASE64_SCALAR: return "scalar";
+    case VNLOG_BASE64_SSSE3:  return "ssse3";
+    case VNLOG_BASE64_AVX2:   return "avx2";
+    default:                  return "unknown";
+    }
+}
+
+int _vnlog_base64_encode_impl(vnlog_base64_impl_t impl,
+                                    char* dst, int dstlen,
+                              const char* src, int srclen )
+{
+    const kernel_t kernel = encode_kernel(impl);
+    if(kernel == NULL || srclen <= 0)
+        return _vnlog_base64_encode_scalar(dst, dstlen, src, srclen);
+
+    if(dstlen < vnlog_base64_dstlen_to_encode(srclen))
+        return -1;
+
+    const int Nin  = kernel(dst, src, srclen);
+    const int Nout = Nin/3*4;
+    const int len  = _vnlog_base64_encode_scalar(&dst[Nout], dstlen - Nout,
+                                                 &src[Nin],  srclen - Nin);
+    if(len < 0)
+        return -1;
+    return Nout + len;
+}
+
+int _vnlog_base64_decode_impl(vnlog_base64_impl_t impl,
+                                    char* dst, int dstlen,
+                              const char* src, int srclen )
+{
+    if(srclen < 0 || srclen % 4 != 0)
+        return -1;
+    if(srclen == 0)
+        return 0;
+
+    // I know the exact output size from the padding. If the padding is
+    // invalid, the decoder will complain
+    int len = srclen/4*3;
+    if(src[srclen-1] == '=') len--;
+    if(src[srclen-2] == '=') len--;
+    if(dstlen < len)
+        return -1;
+
+    int Nin = 0;
+    const kernel_t kernel = decode_kernel(impl);
+    if(kernel != NULL)
+    {
+        Nin = kernel(dst, src, srclen);
+        if(Nin < 0)
+            return -1;
+    }
+    const int Nout = Nin/4*3;
+    const int len_tail = decode_scalar(&dst[Nout], &src[Nin], srclen - Nin);
+    if(len_tail < 0)
+        return -1;
+    return Nout + len_tail;
+}
+
+// The best implementation for this CPU. Looked up once. Multiple threads may
+// race to look it up the first time, but they all find the same thing
+static vnlog_base64_impl_t best_impl(void)
+{
+    static int impl = -1;
+    int i = __atomic_load_n(&impl, __ATOMIC_RELAXED);
+    if(i < 0)
+    {
+        i = VNLOG_BASE64_SCALAR;
+        if     (_vnlog_base64_impl_available(VNLOG_BASE64_AVX2))  i = VNLOG_BASE64_AVX2;
+        else if(_vnlog_base64_impl_available(VNLOG_BASE64_SSSE3)) i = VNLOG_BASE64_SSSE3;
+        __atomic_store_n(&impl, i, __ATOMIC_RELAXED);
+    }
+    return (vnlog_base64_impl_t)i;
+}
+
+int vnlog_base64_encode(       char* dst, int dstlen,
+                         const char* src, int srclen )
+{
+    return _vnlog_base64_encode_impl(best_impl(), dst, dstlen, src, srclen);
+}
+
+int vnlog_base64_decode(       char* dst, int dstlen,
+                         const char* src, int srclen )
+{
+    return _vnlog_base64_decode_impl(best_impl(), dst, dstlen, src, srclen);
+}
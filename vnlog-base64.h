@@ -1,5 +1,11 @@
 #pragma once
 
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 // encodes the source buffer into the destination buffer. Dest buffer is
 // '\0'-terminated, and the output (including '\0') will fit into dstlen bytes,
 // or else failure is indicated.
@@ -9,8 +15,56 @@
 int vnlog_base64_encode(       char* dst, int dstlen,
                          const char* src, int srclen );
 
+// decodes the base64 string in the source buffer into the destination buffer.
+// The input is what vnlog_base64_encode() produces: the standard alphabet,
+// padded with '=' to a multiple of 4 characters, with no whitespace. The
+// output will fit into dstlen bytes, or else failure is indicated. No '\0' is
+// appended.
+//
+// The number of bytes in the output is returned on success, or <0 if the
+// input isn't valid base64 or if the output doesn't fit
+int vnlog_base64_decode(       char* dst, int dstlen,
+                         const char* src, int srclen );
+
 static inline int vnlog_base64_dstlen_to_encode( int len )
 {
     // + 1 for the trailing '\0'
     return (1 + (len-1)/3) * 4 + 1;
 }
+
+static inline int vnlog_base64_dstlen_to_decode( int len )
+{
+    // An upper bound. The padding makes the actual output a bit smaller
+    return len/4 * 3;
+}
+
+
+// THESE ARE NOT A PART OF THE PUBLIC API. vnlog_base64_encode() and
+// vnlog_base64_decode() pick the fastest implementation the CPU supports when
+// they're first called. These call a specific implementation instead, for
+// testing and benchmarking. Calling an implementation that isn't available
+// (check with _vnlog_base64_impl_available()) crashes the program
+typedef enum
+{
+    VNLOG_BASE64_SCALAR,
+    VNLOG_BASE64_SSSE3,
+    VNLOG_BASE64_AVX2,
+    VNLOG_BASE64_N_IMPLS
+} vnlog_base64_impl_t;
+
+bool        _vnlog_base64_impl_available(vnlog_base64_impl_t impl);
+const char* _vnlog_base64_impl_name     (vnlog_base64_impl_t impl);
+int _vnlog_base64_encode_impl(vnlog_base64_impl_t impl,
+                                    char* dst, int dstlen,
+                              const char* src, int srclen );
+int _vnlog_base64_decode_impl(vnlog_base64_impl_t impl,
+                                    char* dst, int dstlen,
+                              const char* src, int srclen );
+
+// The libb64 encoder in b64_cencode.c. This is the scalar implementation
+int _vnlog_base64_encode_scalar(       char* dst, int dstlen,
+                                 const char* src, int srclen );
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+
+// Format of the binary captures written by a vnlog session set up with
+// vnlog_set_binary_capture(). The vnl-decode tool turns these back into vnlog
+// text.
+//
+// A capture starts with two lines of text:
+//
+//   #!vnlog-capture VERSION ENDIANNESS
+//   #!types TYPE0 TYPE1 TYPE2 ...
+//
+// ENDIANNESS is "le" or "be": the byte order of all the binary values that
+// follow. The types are the names in VNLOG_CAPTURE_TYPES below, or "string" or
+// "binary", one per field. Everything after these lines is a sequence of
+// frames. Each frame is a uint32_t header followed by the payload. The low 31
+// bits of the header are the payload size in bytes. If the high bit is set, the
+// payload is text to be output verbatim (the legend and anything written with
+// vnlog_printf()). Otherwise the payload is a record:
+//
+//   - a bitmap of (Nfields+7)/8 bytes. Bit (i%8) of byte i/8 is set if field i
+//     has a value. The fields without a value are written as "-"
+//   - the values of the fields that have one, in order. Values of the types in
+//     VNLOG_CAPTURE_TYPES are stored as-is. "string" and "binary" values are
+//     a uint32_t byte count followed by the bytes
+//
+// Nothing is aligned
+
+#define VNLOG_CAPTURE_MAGIC    "#!vnlog-capture"
+#define VNLOG_CAPTURE_VERSION  1
+#define VNLOG_CAPTURE_TEXT     0x80000000u
+
+// The fixed-size types. Each entry is (name, ctype, formatter). The value is
+// written out with vnlog_format_FORMATTER() from vnlog-format.h, exactly as a
+// text session would write it
+#define VNLOG_CAPTURE_TYPES(_)                  \
+    _(int8,    int8_t,   int64)                 \
+    _(int16,   int16_t,  int64)                 \
+    _(int32,   int32_t,  int64)                 \
+    _(int64,   int64_t,  int64)                 \
+    _(uint8,   uint8_t,  uint64)                \
+    _(uint16,  uint16_t, uint64)                \
+    _(uint32,  uint32_t, uint64)                \
+    _(uint64,  uint64_t, uint64)                \
+    _(char,    char,     char)                  \
+    _(float32, float,    float)                 \
+    _(float64, double,   double)
@@ -0,0 +1,565 @@
+/*
+  Number formatting for the vnlog writer. No snprintf(), no allocation.
+
+  The floating-point path is the Grisu2 algorithm from
+
+    Florian Loitsch, "Printing Floating-Point Numbers Quickly and Accurately
+    with Integers", PLDI 2010
+
+  It produces a decimal string that is guaranteed to parse back to the same
+  binary value, and in the vast majority of cases it is also the shortest such
+  string. The structure here follows the well-known public-domain/MIT
+  implementations of this algorithm
+ */
+
+#include <string.h>
+#include <stdbool.h>
+
+#include "vnlog-format.h"
+
+// "00" "01" ... "99". Used to emit two decimal digits at a time
+static const char digits2[200] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// Writes the decimal representation of x to the END of the buffer that ends at
+// end. Returns a pointer to the first character
+static char* write_uint64_backwards(char* end, uint64_t x)
+{
+    char* p = end;
+    while(x >= 100)
+    {
+        const unsigned r = (unsigned)(x % 100);
+        x /= 100;
+        p -= 2;
+        memcpy(p, &digits2[2*r], 2);
+    }
+    if(x >= 10)
+    {
+        p -= 2;
+        memcpy(p, &digits2[2*x], 2);
+    }
+    else
+        *(--p) = (char)('0' + x);
+    return p;
+}
+
+static int finish(char* dst, int dstlen, const char* src, int len)
+{
+    if(len + 1 > dstlen)
+        return -1;
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+    return len;
+}
+
+int vnlog_format_uint64(char* dst, int dstlen, uint64_t x)
+{
+    char  buf[24];
+    char* end = &buf[sizeof(buf)];
+    char* p   = write_uint64_backwards(end, x);
+    return finish(dst, dstlen, p, (int)(end - p));
+}
+
+int vnlog_format_int64(char* dst, int dstlen, int64_t x)
+{
+    char  buf[24];
+    char* end = &buf[sizeof(buf)];
+
+    // Negating in the unsigned domain is well-defined even for INT64_MIN
+    const uint64_t absx = x < 0 ? (uint64_t)0 - (uint64_t)x : (uint64_t)x;
+    char* p = write_uint64_backwards(end, absx);
+    if(x < 0)
+        *(--p) = '-';
+    return finish(dst, dstlen, p, (int)(end - p));
+}
+
+int vnlog_format_char(char* dst, int dstlen, char x)
+{
+    if(dstlen < 2)
+        return -1;
+    dst[0] = x;
+    dst[1] = '\0';
+    return 1;
+}
+
+int vnlog_format_string(char* dst, int dstlen, const char* x)
+{
+    // Same as what glibc's printf("%s", NULL) does
+    if(x == NULL)
+        x = "(null)";
+
+    // Copy, stopping at the '\0' or at the end of the buffer, whichever comes
+    // first
+    const char* end = memccpy(dst, x, '\0', dstlen);
+    if(end == NULL)
+    {
+        if(dstlen > 0)
+            dst[dstlen-1] = '\0';
+        return -1;
+    }
+    return (int)(end - dst) - 1;
+}
+
+
+
+
+////////////////// Grisu2
+
+// A "do-it-yourself floating point" number: f * 2^e
+typedef struct
+{
+    uint64_t f;
+    int      e;
+} diyfp_t;
+
+typedef struct
+{
+    diyfp_t w, minus, plus;
+} boundaries_t;
+
+typedef struct
+{
+    uint64_t f;
+    int      e;
+    int      k;
+} cached_power_t;
+
+static diyfp_t diyfp_sub(diyfp_t x, diyfp_t y)
+{
+    return (diyfp_t){ .f = x.f - y.f, .e = x.e };
+}
+
+// Returns x*y, rounded to the nearest 64-bit significand
+static diyfp_t diyfp_mul(diyfp_t x, diyfp_t y)
+{
+#ifdef __SIZEOF_INT128__
+    const unsigned __int128 p = (unsigned __int128)x.f * y.f;
+    uint64_t h = (uint64_t)(p >> 64);
+    h += (uint64_t)(p >> 63) & 1; // round
+    return (diyfp_t){ .f = h, .e = x.e + y.e + 64 };
+#else
+    const uint64_t u_lo = x.f & 0xFFFFFFFFu;
+    const uint64_t u_hi = x.f >> 32;
+    const uint64_t v_lo = y.f & 0xFFFFFFFFu;
+    const uint64_t v_hi = y.f >> 32;
+
+    const uint64_t p0 = u_lo * v_lo;
+    const uint64_t p1 = u_lo * v_hi;
+    const uint64_t p2 = u_hi * v_lo;
+    const uint64_t p3 = u_hi * v_hi;
+
+    uint64_t Q = (p0 >> 32) + (p1 & 0xFFFFFFFFu) + (p2 & 0xFFFFFFFFu);
+    Q += (uint64_t)1 << 31; // round
+
+    const uint64_t h = p3 + (p2 >> 32) + (p1 >> 32) + (Q >> 32);
+    return (diyfp_t){ .f = h, .e = x.e + y.e + 64 };
+#endif
+}
+
+static diyfp_t diyfp_normalize(diyfp_t x)
+{
+    while((x.f >> 63) == 0)
+    {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+static diyfp_t diyfp_normalize_to(diyfp_t x, int target_exponent)
+{
+    const int delta = x.e - target_exponent;
+    return (diyfp_t){ .f = x.f << delta, .e = target_exponent };
+}
+
+// Computes the normalized value v = F*2^E and its boundaries m- and m+. These
+// are the midpoints between v and its floating-point neighbors: any decimal
+// number in (m-, m+) rounds back to v. Nprecision is the number of significand
+// bits (including the hidden bit): 53 for double, 24 for float. Nbias is the
+// exponent bias, adjusted to treat the significand as an integer
+static boundaries_t compute_boundaries(uint64_t bits,
+                                       int Nprecision, int bias)
+{
+    const uint64_t hidden_bit = (uint64_t)1 << (Nprecision - 1);
+    const int      min_exp    = 1 - bias;
+
+    const uint64_t E = bits >> (Nprecision - 1);
+    const uint64_t F = bits & (hidden_bit - 1);
+
+    const diyfp_t v = (E == 0) ?
+        (diyfp_t){ .f = F,              .e = min_exp      } : // denormal
+        (diyfp_t){ .f = F + hidden_bit, .e = (int)E - bias };
+
+    // If F == 0, the lower neighbor is closer than the upper one (the exponent
+    // changes). This doesn't apply to the smallest normal number
+    const bool lower_boundary_is_closer = (F == 0 && E > 1);
+    const diyfp_t m_plus  = { .f = 2*v.f + 1, .e = v.e - 1 };
+    const diyfp_t m_minus = lower_boundary_is_closer ?
+        (diyfp_t){ .f = 4*v.f - 1, .e = v.e - 2 } :
+        (diyfp_t){ .f = 2*v.f - 1, .e = v.e - 1 };
+
+    const diyfp_t w_plus  = diyfp_normalize(m_plus);
+    const diyfp_t w_minus = diyfp_normalize_to(m_minus, w_plus.e);
+
+    return (boundaries_t){ .w     = diyfp_normalize(v),
+                           .minus = w_minus,
+                           .plus  = w_plus };
+}
+
+// The scaled values are chosen to have binary exponents in [alpha,gamma]. This
+// lets the digit generation work on 32-bit integer parts
+#define GRISU_ALPHA (-60)
+#define GRISU_GAMMA (-32)
+
+// Normalized 10^k for k = -300, -292, ..., 324
+static const cached_power_t cached_powers[] =
+{
+    { 0xAB70FE17C79AC6CA, -1060, -300 },
+    { 0xFF77B1FCBEBCDC4F, -1034, -292 },
+    { 0xBE5691EF416BD60C, -1007, -284 },
+    { 0x8DD01FAD907FFC3C,  -980, -276 },
+    { 0xD3515C2831559A83,  -954, -268 },
+    { 0x9D71AC8FADA6C9B5,  -927, -260 },
+    { 0xEA9C227723EE8BCB,  -901, -252 },
+    { 0xAECC49914078536D,  -874, -244 },
+    { 0x823C12795DB6CE57,  -847, -236 },
+    { 0xC21094364DFB5637,  -821, -228 },
+    { 0x9096EA6F3848984F,  -794, -220 },
+    { 0xD77485CB25823AC7,  -768, -212 },
+    { 0xA086CFCD97BF97F4,  -741, -204 },
+    { 0xEF340A98172AACE5,  -715, -196 },
+    { 0xB23867FB2A35B28E,  -688, -188 },
+    { 0x84C8D4DFD2C63F3B,  -661, -180 },
+    { 0xC5DD44271AD3CDBA,  -635, -172 },
+    { 0x936B9FCEBB25C996,  -608, -164 },
+    { 0xDBAC6C247D62A584,  -582, -156 },
+    { 0xA3AB66580D5FDAF6,  -555, -148 },
+    { 0xF3E2F893DEC3F126,  -529, -140 },
+    { 0xB5B5ADA8AAFF80B8,  -502, -132 },
+    { 0x87625F056C7C4A8B,  -475, -124 },
+    { 0xC9BCFF6034C13053,  -449, -116 },
+    { 0x964E858C91BA2655,  -422, -108 },
+    { 0xDFF9772470297EBD,  -396, -100 },
+    { 0xA6DFBD9FB8E5B88F,  -369,  -92 },
+    { 0xF8A95FCF88747D94,  -343,  -84 },
+    { 0xB94470938FA89BCF,  -316,  -76 },
+    { 0x8A08F0F8BF0F156B,  -289,  -68 },
+    { 0xCDB02555653131B6,  -263,  -60 },
+    { 0x993FE2C6D07B7FAC,  -236,  -52 },
+    { 0xE45C10C42A2B3B06,  -210,  -44 },
+    { 0xAA242499697392D3,  -183,  -36 },
+    { 0xFD87B5F28300CA0E,  -157,  -28 },
+    { 0xBCE5086492111AEB,  -130,  -20 },
+    { 0x8CBCCC096F5088CC,  -103,  -12 },
+    { 0xD1B71758E219652C,   -77,   -4 },
+    { 0x9C40000000000000,   -50,    4 },
+    { 0xE8D4A51000000000,   -24,   12 },
+    { 0xAD78EBC5AC620000,     3,   20 },
+    { 0x813F3978F8940984,    30,   28 },
+    { 0xC097CE7BC90715B3,    56,   36 },
+    { 0x8F7E32CE7BEA5C70,    83,   44 },
+    { 0xD5D238A4ABE98068,   109,   52 },
+    { 0x9F4F2726179A2245,   136,   60 },
+    { 0xED63A231D4C4FB27,   162,   68 },
+    { 0xB0DE65388CC8ADA8,   189,   76 },
+    { 0x83C7088E1AAB65DB,   216,   84 },
+    { 0xC45D1DF942711D9A,   242,   92 },
+    { 0x924D692CA61BE758,   269,  100 },
+    { 0xDA01EE641A708DEA,   295,  108 },
+    { 0xA26DA3999AEF774A,   322,  116 },
+    { 0xF209787BB47D6B85,   348,  124 },
+    { 0xB454E4A179DD1877,   375,  132 },
+    { 0x865B86925B9BC5C2,   402,  140 },
+    { 0xC83553C5C8965D3D,   428,  148 },
+    { 0x952AB45CFA97A0B3,   455,  156 },
+    { 0xDE469FBD99A05FE3,   481,  164 },
+    { 0xA59BC234DB398C25,   508,  172 },
+    { 0xF6C69A72A3989F5C,   534,  180 },
+    { 0xB7DCBF5354E9BECE,   561,  188 },
+    { 0x88FCF317F22241E2,   588,  196 },
+    { 0xCC20CE9BD35C78A5,   614,  204 },
+    { 0x98165AF37B2153DF,   641,  212 },
+    { 0xE2A0B5DC971F303A,   667,  220 },
+    { 0xA8D9D1535CE3B396,   694,  228 },
+    { 0xFB9B7CD9A4A7443C,   720,  236 },
+    { 0xBB764C4CA7A44410,   747,  244 },
+    { 0x8BAB8EEFB6409C1A,   774,  252 },
+    { 0xD01FEF10A657842C,   800,  260 },
+    { 0x9B10A4E5E9913129,   827,  268 },
+    { 0xE7109BFBA19C0C9D,   853,  276 },
+    { 0xAC2820D9623BF429,   880,  284 },
+    { 0x80444B5E7AA7CF85,   907,  292 },
+    { 0xBF21E44003ACDD2D,   933,  300 },
+    { 0x8E679C2F5E44FF8F,   960,  308 },
+    { 0xD433179D9C8CB841,   986,  316 },
+    { 0x9E19DB92B4E31BA9,  1013,  324 },
+};
+#define CACHED_POWERS_MIN_DEC_EXP (-300)
+#define CACHED_POWERS_DEC_STEP    8
+
+// Returns a cached power c = f*2^e = 10^k such that
+//   alpha <= e_c + e + 64 <= gamma
+static cached_power_t get_cached_power_for_binary_exponent(int e)
+{
+    // k = ceil((alpha - e - 1) * log10(2)). 78913 / 2^18 approximates log10(2)
+    const int f = GRISU_ALPHA - e - 1;
+    const int k = (f * 78913) / (1 << 18) + (f > 0);
+
+    const int index =
+        (-CACHED_POWERS_MIN_DEC_EXP + k + (CACHED_POWERS_DEC_STEP - 1)) /
+        CACHED_POWERS_DEC_STEP;
+    return cached_powers[index];
+}
+
+// For n != 0, returns k such that pow10 := 10^(k-1) <= n < 10^k
+static int find_largest_pow10(uint32_t n, uint32_t* pow10)
+{
+    static const uint32_t p10[] =
+        { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
+    int k = 10;
+    while(k > 1 && n < p10[k-1])
+        k--;
+    *pow10 = p10[k-1];
+    return k;
+}
+
+static void grisu2_round(char* buf, int len, uint64_t dist, uint64_t delta,
+                         uint64_t rest, uint64_t ten_k)
+{
+    // Move the last digit closer to w (= the value being printed), as long as
+    // we stay inside the rounding interval
+    while( rest < dist &&
+           delta - rest >= ten_k &&
+           (rest + ten_k < dist || dist - rest > rest + ten_k - dist) )
+    {
+        buf[len - 1]--;
+        rest += ten_k;
+    }
+}
+
+// Generates the digits of a number V in (M-, M+), as close to w as possible.
+// Writes the digits to buf, and returns their count. V = buf * 10^(*decimal_exponent)
+static int grisu2_digit_gen(char* buf, int* decimal_exponent,
+                            diyfp_t M_minus, diyfp_t w, diyfp_t M_plus)
+{
+    uint64_t delta = diyfp_sub(M_plus, M_minus).f;
+    uint64_t dist  = diyfp_sub(M_plus, w      ).f;
+
+    // Split M+ = f * 2^e into an integer part p1 and a fractional part p2
+    const diyfp_t one = { .f = (uint64_t)1 << -M_plus.e, .e = M_plus.e };
+
+    uint32_t p1 = (uint32_t)(M_plus.f >> -one.e);
+    uint64_t p2 = M_plus.f & (one.f - 1);
+
+    int len = 0;
+
+    uint32_t pow10;
+    int n = find_largest_pow10(p1, &pow10);
+    while(n > 0)
+    {
+        const uint32_t d = p1 / pow10;
+        const uint32_t r = p1 % pow10;
+        buf[len++] = (char)('0' + d);
+        p1 = r;
+        n--;
+
+        const uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+        if(rest <= delta)
+        {
+            // The digits so far are inside the rounding interval. Done
+            *decimal_exponent += n;
+            grisu2_round(buf, len, dist, delta, rest, (uint64_t)pow10 << -one.e);
+            return len;
+        }
+
+        pow10 /= 10;
+    }
+
+    // The integer part is exhausted. Generate digits from the fractional part
+    int m = 0;
+    while(true)
+    {
+        p2 *= 10;
+        const uint64_t d = p2 >> -one.e;
+        const uint64_t r = p2 & (one.f - 1);
+        buf[len++] = (char)('0' + d);
+        p2 = r;
+        m++;
+
+        delta *= 10;
+        dist  *= 10;
+        if(p2 <= delta)
+            break;
+    }
+
+    *decimal_exponent -= m;
+    grisu2_round(buf, len, dist, delta, p2, one.f);
+    return len;
+}
+
+// Writes the digits of the given boundaries to buf. Returns the number of
+// digits. The value is buf * 10^(*decimal_exponent)
+static int grisu2(char* buf, int* decimal_exponent, boundaries_t b)
+{
+    const cached_power_t cached = get_cached_power_for_binary_exponent(b.plus.e);
+    const diyfp_t c_minus_k = { .f = cached.f, .e = cached.e };
+
+    const diyfp_t w       = diyfp_mul(b.w,     c_minus_k);
+    const diyfp_t w_minus = diyfp_mul(b.minus, c_minus_k);
+    const diyfp_t w_plus  = diyfp_mul(b.plus,  c_minus_k);
+
+    // The multiplications above are inexact by at most 1 ulp. I shrink the
+    // interval to stay conservative
+    const diyfp_t M_minus = { .f = w_minus.f + 1, .e = w_minus.e };
+    const diyfp_t M_plus  = { .f = w_plus.f  - 1, .e = w_plus.e  };
+
+    *decimal_exponent = -cached.k;
+    return grisu2_digit_gen(buf, decimal_exponent, M_minus, w, M_plus);
+}
+
+// Lays out Ndigits digits with value digits * 10^decimal_exponent, in a
+// printf("%g")-like way. The output is written to out, which must have room
+// for VNLOG_FORMAT_NUMBER_MAXLEN bytes. Returns the length
+static int layout_digits(char* out, const char* digits, int Ndigits, int decimal_exponent)
+{
+    char* p = out;
+
+    // The value is 0.d1d2d3... * 10^k
+    const int k = Ndigits + decimal_exponent;
+
+    if(-3 <= k && k <= 17)
+    {
+        if(k >= Ndigits)
+        {
+            // dddd000
+            memcpy(p, digits, Ndigits);
+            p += Ndigits;
+            memset(p, '0', k - Ndigits);
+            p += k - Ndigits;
+        }
+        else if(k > 0)
+        {
+            // dd.dd
+            memcpy(p, digits, k);
+            p += k;
+            *p++ = '.';
+            memcpy(p, &digits[k], Ndigits - k);
+            p += Ndigits - k;
+        }
+        else
+        {
+            // 0.000dddd
+            *p++ = '0';
+            *p++ = '.';
+            memset(p, '0', -k);
+            p += -k;
+            memcpy(p, digits, Ndigits);
+            p += Ndigits;
+        }
+        return (int)(p - out);
+    }
+
+    // d.dddde+XX
+    *p++ = digits[0];
+    if(Ndigits > 1)
+    {
+        *p++ = '.';
+        memcpy(p, &digits[1], Ndigits - 1);
+        p += Ndigits - 1;
+    }
+    *p++ = 'e';
+
+    int X = k - 1;
+    if(X < 0) { *p++ = '-'; X = -X; }
+    else      { *p++ = '+'; }
+
+    // At least 2 exponent digits, like printf() does
+    if(X >= 100)
+    {
+        *p++ = (char)('0' + X/100);
+        X %= 100;
+    }
+    memcpy(p, &digits2[2*X], 2);
+    p += 2;
+
+    return (int)(p - out);
+}
+
+// Shared logic for float and double. bits is the IEEE-754 representation with
+// the sign bit removed
+static int format_floating(char* dst, int dstlen,
+                           bool negative, bool isnan, bool isinf, bool iszero,
+                           uint64_t bits, int Nprecision, int bias)
+{
+    char  buf[VNLOG_FORMAT_NUMBER_MAXLEN];
+    char* p = buf;
+
+    if(isnan)
+        return finish(dst, dstlen, "nan", 3);
+
+    if(negative)
+        *p++ = '-';
+
+    if(isinf)
+    {
+        memcpy(p, "inf", 3);
+        p += 3;
+    }
+    else if(iszero)
+        *p++ = '0';
+    else
+    {
+        char digits[20];
+        int  decimal_exponent;
+        const int Ndigits = grisu2(digits, &decimal_exponent,
+                                   compute_boundaries(bits, Nprecision, bias));
+        p += layout_digits(p, digits, Ndigits, decimal_exponent);
+    }
+
+    return finish(dst, dstlen, buf, (int)(p - buf));
+}
+
+int vnlog_format_double(char* dst, int dstlen, double x)
+{
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+
+    const bool     negative = (bits >> 63) != 0;
+    const uint64_t absbits  = bits & ~((uint64_t)1 << 63);
+    const uint64_t expmask  = (uint64_t)0x7FF << 52;
+
+    return format_floating(dst, dstlen,
+                           negative,
+                           (absbits & expmask) == expmask && (absbits & ~expmask) != 0,
+                           absbits == expmask,
+                           absbits == 0,
+                           absbits,
+                           53, 1023 + 52);
+}
+
+int vnlog_format_float(char* dst, int dstlen, float x)
+{
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+
+    const bool     negative = (bits >> 31) != 0;
+    const uint32_t absbits  = bits & ~((uint32_t)1 << 31);
+    const uint32_t expmask  = (uint32_t)0xFF << 23;
+
+    return format_floating(dst, dstlen,
+                           negative,
+                           (absbits & expmask) == expmask && (absbits & ~expmask) != 0,
+                           absbits == expmask,
+                           absbits == 0,
+                           absbits,
+                           24, 127 + 23);
+}
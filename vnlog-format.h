@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+
+// Formatting routines used by the vnlog writer to turn values into vnlog
+// fields. These replace snprintf() on the hot path: they don't parse a format
+// string, and they don't touch the locale.
+//
+// Integers are written in decimal. floats and doubles are written with a short
+// representation that parses back (with strtof() and strtod() respectively) to
+// the same value. So 0.3 is written as "0.3" and not as
+// "0.2999999999999999889". This is USUALLY the shortest such representation,
+// but not always: the Grisu2 algorithm (see vnlog-format.c) sometimes produces
+// one more digit than needed. 43.00205761316872 reads back to the same double,
+// but is written as "43.002057613168724". The layout matches printf("%g") with enough
+// precision: plain decimal notation if the decimal exponent is in [-4,17), and
+// scientific notation ("1.5e+300") otherwise. Infinities and NaNs are written
+// as "inf", "-inf", "nan"
+//
+// Each function writes a '\0'-terminated string into dst. The output
+// (including the '\0') will fit into dstlen bytes, or else failure is
+// indicated. The number of bytes in the output (not including the trailing
+// '\0') is returned on success, or <0 on error
+
+// Longest possible output of vnlog_format_double(), vnlog_format_float(),
+// vnlog_format_int64(), vnlog_format_uint64(), including the trailing '\0'
+#define VNLOG_FORMAT_NUMBER_MAXLEN 25
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int vnlog_format_int64 (char* dst, int dstlen, int64_t     x);
+int vnlog_format_uint64(char* dst, int dstlen, uint64_t    x);
+int vnlog_format_double(char* dst, int dstlen, double      x);
+int vnlog_format_float (char* dst, int dstlen, float       x);
+int vnlog_format_char  (char* dst, int dstlen, char        x);
+int vnlog_format_string(char* dst, int dstlen, const char* x);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,629 @@
+/*
+  Sparse block index of vnlog files. See vnlog-index.h.
+
+  The index file is a vnlog:
+
+    ## vnl-index 1
+    ## records-per-block 10000
+    ## log-size 123456789
+    ## log-fingerprint 0123456789abcdef
+    # record offset Nrecords time_min time_max
+    0 42 10000 0 99.99
+    10000 1050042 10000 100 199.99
+    ...
+
+  A range of NaN (all the values were null) is written as "-"
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "vnlog-index.h"
+#include "vnlog-format.h"
+
+#define MSG(fmt, ...) \
+    fprintf(stderr, "%s:%d " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+
+#define INDEX_VERSION 1
+
+// The fingerprint looks at this many bytes at the start of the indexed part of
+// the log, and at the end of it. An appended-to log doesn't change these. A log
+// that was rewritten almost certainly does
+#define FINGERPRINT_SPAN 4096
+
+static bool hash_range(uint64_t* hash, int fd, int64_t begin, int64_t end)
+{
+    char buf[FINGERPRINT_SPAN];
+    const ssize_t N = pread(fd, buf, end-begin, begin);
+    if(N != end-begin)
+        return false;
+
+    // FNV-1a
+    for(ssize_t i=0; i<N; i++)
+    {
+        *hash ^= (uint8_t)buf[i];
+        *hash *= 0x100000001b3ULL;
+    }
+    return true;
+}
+
+static bool fingerprint(uint64_t* hash, const char* log_filename, int64_t size)
+{
+    const int fd = open(log_filename, O_RDONLY);
+    if(fd < 0)
+    {
+        MSG("Couldn't open '%s': %s", log_filename, strerror(errno));
+        return false;
+    }
+
+    *hash = 0xcbf29ce484222325ULL;
+    const int64_t span = size < FINGERPRINT_SPAN ? size : FINGERPRINT_SPAN;
+    const bool result =
+        hash_range(hash, fd, 0,         span) &&
+        hash_range(hash, fd, size-span, size);
+    close(fd);
+    if(!result)
+        MSG("Couldn't read '%s'", log_filename);
+    return result;
+}
+
+// The size of the log up to the end of its last complete line. If the log is
+// being written, its last line may not be finished yet, and I don't index it
+static bool complete_size(int64_t* size, const char* log_filename)
+{
+    const int fd = open(log_filename, O_RDONLY);
+    if(fd < 0)
+    {
+        MSG("Couldn't open '%s': %s", log_filename, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    bool result = (0 == fstat(fd, &st));
+    *size = result ? st.st_size : 0;
+    while(result && *size > 0)
+    {
+        char buf[FINGERPRINT_SPAN];
+        const int64_t N = *size < FINGERPRINT_SPAN ? *size : FINGERPRINT_SPAN;
+        result = (N == pread(fd, buf, N, *size - N));
+        const char* newline = result ? memrchr(buf, '\n', N) : NULL;
+        if(newline != NULL)
+        {
+            *size -= N - (newline+1 - buf);
+            break;
+        }
+        *size -= N;
+    }
+    close(fd);
+    if(!result)
+        MSG("Couldn't read '%s'", log_filename);
+    return result;
+}
+
+void vnlog_index_free(vnlog_index_t* index)
+{
+    if(index->keys != NULL)
+        for(int i=0; i<index->Ncolumns; i++)
+            free(index->keys[i]);
+    free(index->keys);
+    free(index->record);
+    free(index->offset);
+    free(index->Nrecords);
+    free(index->min);
+    free(index->max);
+    *index = (vnlog_index_t){};
+}
+
+// Adds a block with the given ranges of the columns
+static bool append_block(vnlog_index_t* index,
+                         int64_t record, int64_t offset, int Nrecords,
+                         const double* min, const double* max)
+{
+    if(index->Nblocks >= index->_Nblocks_allocated)
+    {
+        const int N = index->_Nblocks_allocated > 0 ? index->_Nblocks_allocated*2 : 256;
+        const int Nranges = N * (index->Ncolumns > 0 ? index->Ncolumns : 1);
+        int64_t* p_record   = realloc(index->record,   N*sizeof(index->record[0]));
+        if(p_record   != NULL) index->record   = p_record;
+        int64_t* p_offset   = realloc(index->offset,   N*sizeof(index->offset[0]));
+        if(p_offset   != NULL) index->offset   = p_offset;
+        int*     p_Nrecords = realloc(index->Nrecords, N*sizeof(index->Nrecords[0]));
+        if(p_Nrecords != NULL) index->Nrecords = p_Nrecords;
+        double*  p_min      = realloc(index->min,      Nranges*sizeof(index->min[0]));
+        if(p_min      != NULL) index->min      = p_min;
+        double*  p_max      = realloc(index->max,      Nranges*sizeof(index->max[0]));
+        if(p_max      != NULL) index->max      = p_max;
+        if(p_record == NULL || p_offset == NULL || p_Nrecords == NULL ||
+           p_min    == NULL || p_max    == NULL)
+        {
+            MSG("Couldn't allocate the index");
+            return false;
+        }
+        index->_Nblocks_allocated = N;
+    }
+
+    const int i = index->Nblocks++;
+    index->record  [i] = record;
+    index->offset  [i] = offset;
+    index->Nrecords[i] = Nrecords;
+    memcpy(&index->min[i*index->Ncolumns], min, index->Ncolumns*sizeof(min[0]));
+    memcpy(&index->max[i*index->Ncolumns], max, index->Ncolumns*sizeof(max[0]));
+    return true;
+}
+
+// Reads the "## name value" settings at the top of the index. Leaves fp at the
+// legend
+static bool read_settings(vnlog_index_t* index, FILE* fp, const char* index_filename)
+{
+    char*  line = NULL;
+    size_t n    = 0;
+    int    version = -1;
+    bool   have_size = false, have_fingerprint = false;
+    while(true)
+    {
+        const off_t pos = ftello(fp);
+        if(0 > getline(&line, &n, fp))
+            break;
+        if(0 != strncmp(line, "##", 2))
+        {
+            fseeko(fp, pos, SEEK_SET);
+            break;
+        }
+
+        char name[64];
+        char value[64];
+        if(2 != sscanf(line, "## %63s %63s", name, value))
+            continue;
+        if     (0 == strcmp(name, "vnl-index"))
+            version = atoi(value);
+        else if(0 == strcmp(name, "records-per-block"))
+            index->Nrecords_per_block = atoi(value);
+        else if(0 == strcmp(name, "log-size"))
+            have_size = (1 == sscanf(value, "%" SCNd64, &index->log_size));
+        else if(0 == strcmp(name, "log-fingerprint"))
+            have_fingerprint = (1 == sscanf(value, "%" SCNx64, &index->log_fingerprint));
+    }
+    free(line);
+
+    if(version != INDEX_VERSION || index->Nrecords_per_block <= 0 ||
+       !have_size || !have_fingerprint)
+    {
+        MSG("'%s' isn't a valid vnlog index", index_filename);
+        return false;
+    }
+    return true;
+}
+
+// The legend is "record offset Nrecords" followed by "KEY_min KEY_max" for each
+// indexed column
+static bool read_legend_keys(vnlog_index_t* index, const vnlog_parser_t* ctx,
+                             const char* index_filename)
+{
+    if(ctx->Ncolumns < 3 || (ctx->Ncolumns - 3) % 2 != 0 ||
+       0 != strcmp(ctx->record[0].key, "record") ||
+       0 != strcmp(ctx->record[1].key, "offset") ||
+       0 != strcmp(ctx->record[2].key, "Nrecords"))
+    {
+        MSG("'%s' has an unexpected legend", index_filename);
+        return false;
+    }
+
+    index->Ncolumns = (ctx->Ncolumns - 3) / 2;
+    index->keys     = calloc(index->Ncolumns > 0 ? index->Ncolumns : 1, sizeof(index->keys[0]));
+    if(index->keys == NULL)
+    {
+        MSG("Couldn't allocate the index");
+        return false;
+    }
+    for(int i=0; i<index->Ncolumns; i++)
+    {
+        const char* key_min = ctx->record[3 + 2*i    ].key;
+        const char* key_max = ctx->record[3 + 2*i + 1].key;
+        const int   len     = (int)strlen(key_min) - 4;
+        if(len <= 0 ||
+           0 != strcmp(&key_min[len], "_min") ||
+           (int)strlen(key_max) != len + 4 ||
+           0 != strncmp(key_max, key_min, len) ||
+           0 != strcmp(&key_max[len], "_max"))
+        {
+            MSG("'%s' has an unexpected legend", index_filename);
+            return false;
+        }
+        index->keys[i] = strndup(key_min, len);
+        if(index->keys[i] == NULL)
+        {
+            MSG("Couldn't allocate the index");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool vnlog_index_read(vnlog_index_t* index, const char* index_filename)
+{
+    *index = (vnlog_index_t){};
+
+    FILE* fp = fopen(index_filename, "r");
+    if(fp == NULL)
+    {
+        MSG("Couldn't open '%s': %s", index_filename, strerror(errno));
+        return false;
+    }
+
+    bool result = false;
+    vnlog_parser_t ctx = {};
+    if(!read_settings(index, fp, index_filename))
+        goto done;
+    if(VNL_OK != vnlog_parser_init(&ctx, fp))
+    {
+        MSG("'%s' has no legend", index_filename);
+        goto done;
+    }
+    if(!read_legend_keys(index, &ctx, index_filename))
+        goto done;
+
+    {
+        double min[index->Ncolumns > 0 ? index->Ncolumns : 1];
+        double max[index->Ncolumns > 0 ? index->Ncolumns : 1];
+        vnlog_parser_result_t result_read;
+        while(VNL_OK == (result_read = vnlog_parser_read_record(&ctx, fp)))
+        {
+            int64_t record, offset, Nrecords;
+            bool ok =
+                vnlog_parser_get_int64(&ctx, 0, &record) &&
+                vnlog_parser_get_int64(&ctx, 1, &offset) &&
+                vnlog_parser_get_int64(&ctx, 2, &Nrecords);
+            for(int i=0; ok && i<index->Ncolumns; i++)
+                ok =
+                    vnlog_parser_get_double(&ctx, 3 + 2*i,     &min[i]) &&
+                    vnlog_parser_get_double(&ctx, 3 + 2*i + 1, &max[i]);
+            if(!ok)
+            {
+                MSG("'%s' has an invalid block", index_filename);
+                goto done;
+            }
+            if(!append_block(index, record, offset, (int)Nrecords, min, max))
+                goto done;
+        }
+        if(result_read != VNL_EOF)
+            goto done;
+    }
+
+    result = true;
+
+ done:
+    vnlog_parser_free(&ctx);
+    fclose(fp);
+    if(!result)
+        vnlog_index_free(index);
+    return result;
+}
+
+static void write_range_value(FILE* fp, double x)
+{
+    char buf[VNLOG_FORMAT_NUMBER_MAXLEN];
+    if(isnan(x))
+        fputs(" -", fp);
+    else if(0 < vnlog_format_double(buf, sizeof(buf), x))
+        fprintf(fp, " %s", buf);
+}
+
+// Writes the index to a temporary file, and then moves it into place, so that
+// readers never see a partial index
+static bool write_index(const vnlog_index_t* index, const char* index_filename)
+{
+    char filename_tmp[strlen(index_filename) + 8];
+    sprintf(filename_tmp, "%s.tmp", index_filename);
+
+    FILE* fp = fopen(filename_tmp, "w");
+    if(fp == NULL)
+    {
+        MSG("Couldn't open '%s': %s", filename_tmp, strerror(errno));
+        return false;
+    }
+
+    fprintf(fp,
+            "## vnl-index %d\n"
+            "## records-per-block %d\n"
+            "## log-size %" PRId64 "\n"
+            "## log-fingerprint %016" PRIx64 "\n"
+            "# record offset Nrecords",
+            INDEX_VERSION, index->Nrecords_per_block,
+            index->log_size, index->log_fingerprint);
+    for(int i=0; i<index->Ncolumns; i++)
+        fprintf(fp, " %s_min %s_max", index->keys[i], index->keys[i]);
+    fputc('\n', fp);
+
+    for(int iblock=0; iblock<index->Nblocks; iblock++)
+    {
+        fprintf(fp, "%" PRId64 " %" PRId64 " %d",
+                index->record[iblock], index->offset[iblock], index->Nrecords[iblock]);
+        for(int i=0; i<index->Ncolumns; i++)
+        {
+            write_range_value(fp, index->min[iblock*index->Ncolumns + i]);
+            write_range_value(fp, index->max[iblock*index->Ncolumns + i]);
+        }
+        fputc('\n', fp);
+    }
+
+    if(0 != fclose(fp))
+    {
+        MSG("Couldn't write '%s': %s", filename_tmp, strerror(errno));
+        unlink(filename_tmp);
+        return false;
+    }
+    if(0 != rename(filename_tmp, index_filename))
+    {
+        MSG("Couldn't rename '%s' to '%s': %s", filename_tmp, index_filename, strerror(errno));
+        unlink(filename_tmp);
+        return false;
+    }
+    return true;
+}
+
+bool vnlog_index_check(const vnlog_index_t* index, const char* log_filename)
+{
+    struct stat st;
+    if(0 != stat(log_filename, &st))
+    {
+        MSG("Couldn't stat '%s': %s", log_filename, strerror(errno));
+        return false;
+    }
+    if(st.st_size < index->log_size)
+        return false;
+
+    uint64_t hash;
+    return
+        fingerprint(&hash, log_filename, index->log_size) &&
+        hash == index->log_fingerprint;
+}
+
+// Can the old index be extended to make the one we want?
+static bool can_resume(const vnlog_index_t* index, const char* log_filename,
+                       int Nrecords_per_block, const char* const* keys, int Ncolumns)
+{
+    if(index->Nrecords_per_block != Nrecords_per_block ||
+       index->Ncolumns           != Ncolumns)
+        return false;
+    for(int i=0; i<Ncolumns; i++)
+        if(0 != strcmp(index->keys[i], keys[i]))
+            return false;
+    return vnlog_index_check(index, log_filename);
+}
+
+bool vnlog_index_update(const char* log_filename, const char* index_filename,
+                        int Nrecords_per_block,
+                        const char* const* keys, int Ncolumns,
+                        bool* incremental)
+{
+    if(incremental != NULL)
+        *incremental = false;
+    if(Nrecords_per_block <= 0)
+    {
+        MSG("Nrecords_per_block must be > 0");
+        return false;
+    }
+
+    // I index the log up to the end of its last complete line. The file may
+    // grow while I'm looking at it, so I get this size before mapping the file:
+    // the mapping then contains all of it
+    int64_t size;
+    if(!complete_size(&size, log_filename))
+        return false;
+
+    vnlog_parser_t ctx;
+    if(VNL_OK != vnlog_parser_init_mmap(&ctx, log_filename, false))
+    {
+        MSG("Couldn't read the legend of '%s'", log_filename);
+        return false;
+    }
+
+    bool          result = false;
+    vnlog_index_t index  = {};
+
+    vnlog_parser_column_t columns[Ncolumns > 0 ? Ncolumns : 1];
+    for(int i=0; i<Ncolumns; i++)
+    {
+        columns[i] = vnlog_parser_column(&ctx, keys[i]);
+        if(columns[i] < 0)
+        {
+            MSG("'%s' has no column '%s'", log_filename, keys[i]);
+            goto done;
+        }
+    }
+    if(!vnlog_parser_set_projection(&ctx, columns, Ncolumns, false))
+        goto done;
+
+    // If the log was only appended to, I keep the old index, except its last
+    // block: it may not be complete
+    int64_t irecord = 0;
+    if(0 == access(index_filename, F_OK) &&
+       vnlog_index_read(&index, index_filename))
+    {
+        if(index.Nblocks > 0 &&
+           can_resume(&index, log_filename, Nrecords_per_block, keys, Ncolumns))
+        {
+            index.Nblocks--;
+            irecord = index.record[index.Nblocks];
+            if(!vnlog_parser_seek(&ctx, NULL, index.offset[index.Nblocks]))
+                goto done;
+            if(incremental != NULL)
+                *incremental = true;
+        }
+        else
+            vnlog_index_free(&index);
+    }
+    if(index.keys == NULL)
+    {
+        index = (vnlog_index_t){.Nrecords_per_block = Nrecords_per_block,
+                                .Ncolumns           = Ncolumns};
+        index.keys = calloc(Ncolumns > 0 ? Ncolumns : 1, sizeof(index.keys[0]));
+        if(index.keys == NULL)
+        {
+            MSG("Couldn't allocate the index");
+            goto done;
+        }
+        for(int i=0; i<Ncolumns; i++)
+            if(NULL == (index.keys[i] = strdup(keys[i])))
+            {
+                MSG("Couldn't allocate the index");
+                goto done;
+            }
+    }
+
+    {
+        // The parser stops at the end of the last complete line: the
+        // unfinished line after it may be missing some fields. If the legend
+        // itself isn't finished, there's nothing to read
+        const int64_t pos = vnlog_parser_tell(&ctx, NULL);
+        if(!vnlog_parser_set_end(&ctx, size > pos ? size : pos))
+            goto done;
+    }
+
+    {
+        double  min[Ncolumns > 0 ? Ncolumns : 1];
+        double  max[Ncolumns > 0 ? Ncolumns : 1];
+        int64_t block_record = 0;
+        int64_t block_offset = 0;
+        int     Nrecords     = 0;
+
+        vnlog_parser_result_t result_read;
+        while(VNL_OK == (result_read = vnlog_parser_read_record(&ctx, NULL)))
+        {
+            if(Nrecords == 0)
+            {
+                block_record = irecord;
+                block_offset = vnlog_parser_record_offset(&ctx);
+                for(int i=0; i<Ncolumns; i++)
+                    min[i] = max[i] = NAN;
+            }
+
+            for(int i=0; i<Ncolumns; i++)
+            {
+                if(vnlog_parser_is_null(&ctx, columns[i]))
+                    continue;
+
+                double x;
+                if(!vnlog_parser_get_double(&ctx, columns[i], &x))
+                {
+                    // Not a number. This block could match anything
+                    min[i] = -INFINITY;
+                    max[i] =  INFINITY;
+                    continue;
+                }
+                if(isnan(x))
+                    // Matches nothing
+                    continue;
+
+                // Large integers don't fit into a double exactly. I widen the
+                // range to make sure it contains them
+                double x_min = x, x_max = x;
+                if(fabs(x) >= 9007199254740992.0) // 2^53
+                {
+                    x_min = nextafter(x, -INFINITY);
+                    x_max = nextafter(x,  INFINITY);
+                }
+                if(!(x_min >= min[i])) min[i] = x_min;
+                if(!(x_max <= max[i])) max[i] = x_max;
+            }
+
+            irecord++;
+            if(++Nrecords == Nrecords_per_block)
+            {
+                if(!append_block(&index, block_record, block_offset, Nrecords, min, max))
+                    goto done;
+                Nrecords = 0;
+            }
+        }
+        if(result_read != VNL_EOF)
+            goto done;
+        if(Nrecords > 0 &&
+           !append_block(&index, block_record, block_offset, Nrecords, min, max))
+            goto done;
+    }
+
+    index.log_size = vnlog_parser_tell(&ctx, NULL);
+    if(index.log_size > size)
+        index.log_size = size;
+    if(!fingerprint(&index.log_fingerprint, log_filename, index.log_size))
+        goto done;
+    result = write_index(&index, index_filename);
+
+ done:
+    vnlog_index_free(&index);
+    vnlog_parser_free(&ctx);
+    return result;
+}
+
+int vnlog_index_column(const vnlog_index_t* index, const char* key)
+{
+    for(int i=0; i<index->Ncolumns; i++)
+        if(0 == strcmp(index->keys[i], key))
+            return i;
+    return -1;
+}
+
+int vnlog_index_find_block(const vnlog_index_t* index, int iblock,
+                           int icolumn, double lo, double hi)
+{
+    for(; iblock < index->Nblocks; iblock++)
+    {
+        // A NaN range (all nulls) matches nothing
+        const double min = index->min[iblock*index->Ncolumns + icolumn];
+        const double max = index->max[iblock*index->Ncolumns + icolumn];
+        if(min <= hi && max >= lo)
+            return iblock;
+    }
+    return index->Nblocks;
+}
+
+vnlog_parser_result_t vnlog_index_seek_record(const vnlog_index_t* index,
+                                              vnlog_parser_t* ctx, FILE* fp,
+                                              int64_t irecord)
+{
+    if(irecord < 0)
+    {
+        MSG("Record %" PRId64 " doesn't exist", irecord);
+        return VNL_ERROR;
+    }
+
+    // The last block that starts at or before irecord. Or the end of the
+    // indexed part of the log, if irecord is past that
+    int64_t record0, offset;
+    const int last = index->Nblocks - 1;
+    if(last < 0 || irecord >= index->record[last] + index->Nrecords[last])
+    {
+        record0 = last < 0 ? 0 : index->record[last] + index->Nrecords[last];
+        offset  = index->log_size;
+    }
+    else
+    {
+        int i0 = 0, i1 = last;
+        while(i0 < i1)
+        {
+            const int i = (i0 + i1 + 1) / 2;
+            if(index->record[i] <= irecord) i0 = i;
+            else                            i1 = i-1;
+        }
+        record0 = index->record[i0];
+        offset  = index->offset[i0];
+    }
+
+    if(!vnlog_parser_seek(ctx, fp, offset))
+        return VNL_ERROR;
+    for(int64_t i=record0; i<irecord; i++)
+    {
+        vnlog_parser_result_t result = vnlog_parser_read_record(ctx, fp);
+        if(result != VNL_OK)
+            return result;
+    }
+    return VNL_OK;
+}
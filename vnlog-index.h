@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "vnlog-parser.h"
+
+// A sparse index of a vnlog file, for random access into large logs. The log
+// is split into blocks of Nrecords_per_block records. For each block the index
+// has the number of its first record (counting the records of the log from 0),
+// the byte offset of that record in the log, and the range of the values of
+// each indexed column. So a reader can seek to a given record, or skip the
+// blocks that can't contain the values it wants.
+//
+// The index lives in a sidecar file (usually made with the vnl-index tool),
+// which is itself a vnlog: one row per block, with the settings and a
+// fingerprint of the log in "##" comments at the top. The blocks cover the log
+// up to log_size bytes. If the log was only appended to since, the index can be
+// updated by indexing just the new data.
+//
+// The ranges are of the non-null values that are numbers. A block where all of
+// a column's values are null has a range of NaN, which matches nothing. A block
+// where some value isn't a number has a range of (-inf,inf), which matches
+// everything. So a range lookup may return blocks that don't have any of the
+// wanted values, but never misses one.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct
+{
+    int      Nrecords_per_block;
+
+    // The indexed columns
+    int      Ncolumns;
+    char**   keys;
+
+    int      Nblocks;
+    int64_t* record;   // The number of the first record of each block
+    int64_t* offset;   // ... its offset in the log
+    int*     Nrecords; // ... and how many records the block has
+
+    // The range of each column in each block: [iblock*Ncolumns + icolumn]
+    double*  min;
+    double*  max;
+
+    // How many bytes of the log the blocks cover, and a fingerprint of those
+    // bytes, to tell if the log changed
+    int64_t  log_size;
+    uint64_t log_fingerprint;
+
+    // internal
+    int      _Nblocks_allocated;
+} vnlog_index_t;
+
+// Creates or updates the index of the given log, indexing the given columns.
+// If a valid index exists already, has the same settings, and the log was only
+// appended to, only the new part of the log is indexed. *incremental (if
+// non-NULL) says whether this happened. Returns false on error
+bool vnlog_index_update(const char* log_filename, const char* index_filename,
+                        int Nrecords_per_block,
+                        const char* const* keys, int Ncolumns,
+                        bool* incremental);
+
+bool vnlog_index_read(vnlog_index_t* index, const char* index_filename);
+void vnlog_index_free(vnlog_index_t* index);
+
+// Is the index still valid for this log: the part of the log that it covers
+// hasn't changed? The log may have grown; the records after index->log_size
+// aren't indexed then
+bool vnlog_index_check(const vnlog_index_t* index, const char* log_filename);
+
+// The index of the column with this key in the index, or <0 if it isn't
+// indexed
+int vnlog_index_column(const vnlog_index_t* index, const char* key);
+
+// The first block at or after iblock that may have values of the indexed
+// column icolumn in [lo,hi]. Nblocks if there isn't one
+int vnlog_index_find_block(const vnlog_index_t* index, int iblock,
+                           int icolumn, double lo, double hi);
+
+// Moves the parser of the log so that the next vnlog_parser_read_record()
+// reads record irecord. The records after the indexed part of the log are
+// reached by reading from log_size. Returns VNL_EOF if the log doesn't have
+// that many records
+vnlog_parser_result_t vnlog_index_seek_record(const vnlog_index_t* index,
+                                              vnlog_parser_t* ctx, FILE* fp,
+                                              int64_t irecord);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Number parsing used by the vnlog parser to read numeric fields. These are the
+// inverse of the routines in vnlog-format.h. They take a string with an
+// explicit length (the fields of a parsed row aren't '\0'-terminated), don't
+// allocate, and don't touch the locale on the fast path.
+//
+// vnlog_parse_double() returns the same value strtod() would, correctly
+// rounded. Most inputs are handled by the Eisel-Lemire algorithm; the rest
+// (more than 19 significant digits, "inf", "nan", hex floats, subnormal and
+// out-of-range results, a few ambiguous roundings) fall back to strtod()
+//
+// Each function returns true if the WHOLE string is a valid number, and false
+// otherwise. vnlog_parse_int64() also fails on overflow
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool vnlog_parse_double(const char* s, int len, double*  x);
+bool vnlog_parse_int64 (const char* s, int len, int64_t* x);
+
+#ifdef __cplusplus
+}
+#endif
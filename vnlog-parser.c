@@ -4,22 +4,72 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
 #include <errno.h>
 #include <string.h>
 #include <stddef.h>
 #include <search.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define HAVE_X86_SIMD 1
+  #include <immintrin.h>
+#endif
 
 #include "vnlog-parser.h"
+#include "vnlog-parse-number.h"
 
 #define MSG(fmt, ...) \
     fprintf(stderr, "%s:%d " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__)
 
+struct scan_mask_t;
+struct follow_t;
+
 typedef struct
 {
     // internal
     char*  line;
     size_t n;
     void*  dict_key_index;
+
+    // The fields of the most recent line
+    vnlog_parser_field_t* fields;
+    int                   Nfields_allocated;
+
+    // The scanner. See "The scanner" below
+    int  (*scan)(struct scan_mask_t* masks, int Nmasks,
+                 const char* begin, const char* limit);
+
+    // The columns from vnlog_parser_set_projection(), or NULL to use them all.
+    // Nfields_needed is 1 + the last of them
+    int* projection;
+    int  Nprojection;
+    int  Nfields_needed;
+    bool validate_projected;
+
+    // Non-NULL if we're reading a mapped file (vnlog_parser_init_mmap()). pos
+    // is where the next line starts
+    const char* map;
+    size_t      map_size;
+    size_t      pos;
+    bool        want_strings;
+
+    // Non-NULL in the parser of a chunk in parallel parsing. The legend, the
+    // key lookup and the mapping belong to this parent
+    const vnlog_parser_t* parent;
+
+    // Non-NULL in follow mode (vnlog_parser_init_follow()). See "Following a
+    // growing file" below
+    struct follow_t* follow;
 } vnlog_parser_internal_t;
 
 _Static_assert( sizeof(vnlog_parser_internal_t) <=
@@ -33,9 +83,9 @@ bool accumulate_legend(// out
                        vnlog_keyvalue_t** record,
 
                        // in
-                       char* str)
+                       const char* str, int len)
 {
-    if(*str == '\0')
+    if(len == 0)
         // Empty string. Nothing to do
         return true;
 
@@ -54,7 +104,7 @@ bool accumulate_legend(// out
     }
 
     (*record)[*i_col].value = NULL;
-    (*record)[*i_col].key   = strdup(str);
+    (*record)[*i_col].key   = strndup(str, len);
     if((*record)[*i_col].key == NULL)
         return false;
 
@@ -62,42 +112,518 @@ bool accumulate_legend(// out
     return true;
 }
 
-static
-bool accumulate_data_row(// out
-                         vnlog_keyvalue_t* record,
-                         int*              i_col,
-                         // in
-                         int   Ncolumns,
-                         char* str)
-{
-    if(*str == '\0')
-        // Empty string. Nothing to do
-        return true;
+////////////////// The scanner
+//
+// Each line is split into fields in two steps, the way simdjson finds its
+// structural characters. First a scanner classifies the bytes of the line, 64
+// at a time, into bitmasks of the separators (' ', '\t', '\n') and of the '#'
+// characters. The scanner stops at the block containing the first '\n'. Then
+// the fields are read off the masks: a field starts at each non-separator that
+// follows a separator, and ends at the next separator.
+//
+// There are AVX2, SSE4.2 and scalar scanners. The fastest one the CPU supports
+// is picked when a parser is initialized
+
+typedef struct scan_mask_t
+{
+    uint64_t sep, hash;
+} scan_mask_t;
+
+// Scans the line at begin, writing the masks of each 64-byte block until the
+// one containing the first '\n'. The data ends at limit; the scanners act as if
+// it was followed by '\n'. Returns the length of the line, not including the
+// '\n', or -1 if the line needs more than Nmasks blocks
+typedef int (*scanner_t)(scan_mask_t* masks, int Nmasks,
+                         const char* begin, const char* limit);
+
+// The scanners load full 64-byte blocks, but they may not read past limit. So
+// the last block is copied into buf, padded with '\n'
+__attribute__((always_inline))
+static inline const char* scan_block(char* buf, const char* p, const char* limit)
+{
+    if(limit - p >= 64)
+        return p;
+    memcpy(buf, p, limit - p);
+    memset(&buf[limit - p], '\n', 64 - (limit - p));
+    return buf;
+}
+
+// The scalar scanner looks at 8 bytes at a time, in a uint64_t. This has 0x80
+// in each byte of x that's c, and 0 in the others
+__attribute__((always_inline))
+static inline uint64_t swar_eq(uint64_t x, char c)
+{
+    const uint64_t lo7 = 0x7f7f7f7f7f7f7f7fULL;
+    const uint64_t t   = x ^ (0x0101010101010101ULL * (uint8_t)c);
+    return ~(((t & lo7) + lo7) | t | lo7);
+}
+// The top bit of each byte of x, gathered into the low 8 bits
+__attribute__((always_inline))
+static inline uint64_t swar_bits(uint64_t x)
+{
+    return ((x >> 7) * 0x0102040810204080ULL) >> 56;
+}
 
-    if(Ncolumns == 0)
+static int scan_scalar(scan_mask_t* masks, int Nmasks,
+                       const char* begin, const char* limit)
+{
+    for(int i=0; i<Nmasks; i++)
     {
-        MSG("Saw data line before a legend line");
-        return false;
+        char buf[64];
+        const char* p = scan_block(buf, &begin[i*64], limit);
+
+        uint64_t sep = 0, nl = 0, hash = 0;
+        for(int j=0; j<8; j++)
+        {
+            uint64_t x;
+            memcpy(&x, &p[8*j], 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            x = __builtin_bswap64(x);
+#endif
+            const uint64_t n = swar_eq(x, '\n');
+            sep  |= swar_bits(swar_eq(x, ' ') | swar_eq(x, '\t') | n) << (8*j);
+            nl   |= swar_bits(n)                                     << (8*j);
+            hash |= swar_bits(swar_eq(x, '#'))                       << (8*j);
+        }
+        masks[i] = (scan_mask_t){.sep = sep, .hash = hash};
+        if(nl != 0)
+            return i*64 + __builtin_ctzll(nl);
+    }
+    return -1;
+}
+
+#ifdef HAVE_X86_SIMD
+
+// The separators are found with a single PCMPESTRM. '\n' and '#' are compared
+// directly
+__attribute__((target("sse4.2")))
+static int scan_sse42(scan_mask_t* masks, int Nmasks,
+                      const char* begin, const char* limit)
+{
+    const __m128i separators = _mm_setr_epi8(' ', '\t', '\n', 0, 0, 0, 0, 0,
+                                             0,   0,    0,    0, 0, 0, 0, 0);
+    const __m128i newline    = _mm_set1_epi8('\n');
+    const __m128i pound      = _mm_set1_epi8('#');
+
+    for(int i=0; i<Nmasks; i++)
+    {
+        char buf[64];
+        const char* p = scan_block(buf, &begin[i*64], limit);
+
+        uint64_t sep = 0, nl = 0, hash = 0;
+        for(int j=0; j<4; j++)
+        {
+            const __m128i x = _mm_loadu_si128((const __m128i*)&p[16*j]);
+            const __m128i s =
+                _mm_cmpestrm(separators, 3, x, 16,
+                             _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK);
+            sep  |= (uint64_t)(uint16_t)_mm_cvtsi128_si32(s) << (16*j);
+            nl   |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, newline)) << (16*j);
+            hash |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, pound))   << (16*j);
+        }
+        masks[i] = (scan_mask_t){.sep = sep, .hash = hash};
+        if(nl != 0)
+            return i*64 + __builtin_ctzll(nl);
+    }
+    return -1;
+}
+
+__attribute__((target("avx2")))
+static int scan_avx2(scan_mask_t* masks, int Nmasks,
+                     const char* begin, const char* limit)
+{
+    const __m256i space   = _mm256_set1_epi8(' ');
+    const __m256i tab     = _mm256_set1_epi8('\t');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i pound   = _mm256_set1_epi8('#');
+
+    for(int i=0; i<Nmasks; i++)
+    {
+        char buf[64];
+        const char* p = scan_block(buf, &begin[i*64], limit);
+
+        uint64_t sep = 0, nl = 0, hash = 0;
+        for(int j=0; j<2; j++)
+        {
+            const __m256i x = _mm256_loadu_si256((const __m256i*)&p[32*j]);
+            const __m256i n = _mm256_cmpeq_epi8(x, newline);
+            const __m256i s = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, space),
+                                                              _mm256_cmpeq_epi8(x, tab)),
+                                              n);
+            sep  |= (uint64_t)(uint32_t)_mm256_movemask_epi8(s) << (32*j);
+            nl   |= (uint64_t)(uint32_t)_mm256_movemask_epi8(n) << (32*j);
+            hash |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, pound)) << (32*j);
+        }
+        masks[i] = (scan_mask_t){.sep = sep, .hash = hash};
+        if(nl != 0)
+            return i*64 + __builtin_ctzll(nl);
     }
+    return -1;
+}
+#endif
+
+static scanner_t scanner(vnlog_parser_impl_t impl)
+{
+#ifdef HAVE_X86_SIMD
+    if(impl == VNLOG_PARSER_SSE42) return scan_sse42;
+    if(impl == VNLOG_PARSER_AVX2)  return scan_avx2;
+#endif
+    (void)impl;
+    return scan_scalar;
+}
 
-    if((*i_col) >= Ncolumns)
+bool _vnlog_parser_impl_available(vnlog_parser_impl_t impl)
+{
+    switch(impl)
     {
-        MSG("legend said we have %d columns, but saw a data line that has too many", Ncolumns);
+    case VNLOG_PARSER_SCALAR:
+        return true;
+#ifdef HAVE_X86_SIMD
+    case VNLOG_PARSER_SSE42:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse4.2");
+    case VNLOG_PARSER_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
         return false;
     }
+}
 
-    record[(*i_col)++].value = str;
-    return true;
+const char* _vnlog_parser_impl_name(vnlog_parser_impl_t impl)
+{
+    switch(impl)
+    {
+    case VNLOG_PARSER_SCALAR: return "scalar";
+    case VNLOG_PARSER_SSE42:  return "sse4.2";
+    case VNLOG_PARSER_AVX2:   return "avx2";
+    default:                  return "unknown";
+    }
 }
 
-static
-vnlog_parser_result_t read_line(vnlog_parser_t* ctx, FILE* fp)
+// The implementation the parsers use: the best one for this CPU, unless
+// _vnlog_parser_set_impl() picked another
+static int impl_selected = -1;
+
+// Looked up once. Multiple threads may race to look it up the first time, but
+// they all find the same thing
+static vnlog_parser_impl_t selected_impl(void)
+{
+    int i = __atomic_load_n(&impl_selected, __ATOMIC_RELAXED);
+    if(i < 0)
+    {
+        i = VNLOG_PARSER_SCALAR;
+        if     (_vnlog_parser_impl_available(VNLOG_PARSER_AVX2))  i = VNLOG_PARSER_AVX2;
+        else if(_vnlog_parser_impl_available(VNLOG_PARSER_SSE42)) i = VNLOG_PARSER_SSE42;
+        __atomic_store_n(&impl_selected, i, __ATOMIC_RELAXED);
+    }
+    return (vnlog_parser_impl_t)i;
+}
+
+void _vnlog_parser_set_impl(vnlog_parser_impl_t impl)
 {
-    int Ncolumns_allocated = 0;
+    __atomic_store_n(&impl_selected, (int)impl, __ATOMIC_RELAXED);
+}
 
-    vnlog_parser_internal_t* internal = (vnlog_parser_internal_t*)ctx->_internal;
+
+
+
+////////////////// Following a growing file
+
+// In follow mode the file is read() into a buffer, and the parser reads that
+// buffer as if it was a mapped file: map is buf, and map_size is the end of the
+// last complete line in it. When the parser gets to map_size, follow_fill()
+// drops the parsed lines, and reads more. The partial line at the end stays.
+//
+// The inotify watch is on the directory of the file, not the file itself: a
+// watch on the file wouldn't see a new file replacing it
+#define FOLLOW_READ_MIN (64 << 10)
+
+typedef struct follow_t
+{
+    char*       filename;
+    const char* basename; // in filename
+    int         fd;
+    int         fd_inotify; // <0 if inotify isn't available
+
+    char*       buf;
+    size_t      size_allocated;
+    size_t      Nfilled;
+
+    // How much of the file has been read. If the file is smaller than this,
+    // it was truncated
+    off_t       offset;
+
+    // Set when the file was truncated or replaced, until its legend is seen.
+    // The legend must match the one we already have
+    bool        check_legend;
+} follow_t;
+
+// Called at the end of what's been read so far. If the file was truncated or
+// replaced, sets up to read it again from the start, and returns VNL_OK.
+// Returns VNL_AGAIN if there's nothing new
+static vnlog_parser_result_t follow_restart_if_changed(follow_t* follow)
+{
+    struct stat st_fd, st_path;
+    if(0 != fstat(follow->fd, &st_fd))
+    {
+        MSG("Couldn't stat '%s': %s", follow->filename, strerror(errno));
+        return VNL_ERROR;
+    }
+
+    if(st_fd.st_size < follow->offset)
+    {
+        // Truncated
+        if(0 > lseek(follow->fd, 0, SEEK_SET))
+        {
+            MSG("Couldn't rewind '%s': %s", follow->filename, strerror(errno));
+            return VNL_ERROR;
+        }
+    }
+    else if(0 == stat(follow->filename, &st_path) &&
+            (st_path.st_ino != st_fd.st_ino || st_path.st_dev != st_fd.st_dev))
+    {
+        // Replaced. I already read all of the old file
+        const int fd = open(follow->filename, O_RDONLY | O_CLOEXEC);
+        if(fd < 0)
+            // Probably being replaced right now. Try again later
+            return VNL_AGAIN;
+        close(follow->fd);
+        follow->fd = fd;
+    }
+    else
+        return VNL_AGAIN;
+
+    follow->offset       = 0;
+    follow->Nfilled      = 0;
+    follow->check_legend = true;
+    return VNL_OK;
+}
+
+// Called when all the complete lines in the buffer have been parsed. Returns
+// VNL_AGAIN if there isn't a new complete line yet
+static vnlog_parser_result_t follow_fill(vnlog_parser_internal_t* internal)
+{
+    follow_t* follow = internal->follow;
+
+    // Clear the notifications. Any change from now on will notify again, so a
+    // change can't slip between this read and vnlog_parser_follow_wait()
+    if(follow->fd_inotify >= 0)
+    {
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        while(read(follow->fd_inotify, events, sizeof(events)) > 0)
+            ;
+    }
+
+    // Keep the partial line
+    const size_t Nkeep = follow->Nfilled - internal->map_size;
+    memmove(follow->buf, &follow->buf[internal->map_size], Nkeep);
+    follow->Nfilled    = Nkeep;
+    internal->map_size = 0;
+    internal->pos      = 0;
 
     while(true)
+    {
+        if(follow->size_allocated - follow->Nfilled < FOLLOW_READ_MIN)
+        {
+            // A long line. I only grow the buffer if I don't have a complete
+            // line in it yet
+            const size_t size = follow->size_allocated*2;
+            char* buf = realloc(follow->buf, size);
+            if(buf == NULL)
+            {
+                MSG("Couldn't allocate the follow buffer");
+                return VNL_ERROR;
+            }
+            follow->buf            = buf;
+            follow->size_allocated = size;
+            internal->map          = buf;
+        }
+
+        const ssize_t Nread = read(follow->fd,
+                                   &follow->buf[follow->Nfilled],
+                                   follow->size_allocated - follow->Nfilled);
+        if(Nread < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            MSG("Couldn't read '%s': %s", follow->filename, strerror(errno));
+            return VNL_ERROR;
+        }
+        if(Nread > 0)
+        {
+            const char* nl = memrchr(&follow->buf[follow->Nfilled], '\n', Nread);
+            follow->Nfilled += Nread;
+            follow->offset  += Nread;
+            if(nl != NULL)
+            {
+                internal->map_size = (size_t)(nl - follow->buf) + 1;
+                return VNL_OK;
+            }
+            continue;
+        }
+
+        // At the end of what's been written
+        vnlog_parser_result_t result = follow_restart_if_changed(follow);
+        if(result != VNL_OK)
+            return result;
+    }
+}
+
+// The followed file was truncated or replaced, and this '#' line is the first
+// one in it. Its keys must match the legend I have. With a projection, only
+// Nfields_stored of the fields are available, and the others may not have been
+// counted. Returns VNL_AGAIN if this isn't a legend, but a lone '#'
+static vnlog_parser_result_t follow_check_legend(const vnlog_parser_t* ctx,
+                                                 const vnlog_parser_field_t* fields,
+                                                 int Nfields, int Nfields_stored,
+                                                 bool counted_all)
+{
+    const vnlog_parser_internal_t* internal = (const vnlog_parser_internal_t*)ctx->_internal;
+    const follow_t*                follow   = internal->follow;
+
+    // The first key may be attached to the '#'
+    const int i0 = fields[0].len > 1 ? 0 : 1;
+    if(Nfields == i0)
+        return VNL_AGAIN;
+
+    bool match = !counted_all || Nfields - i0 == ctx->Ncolumns;
+    for(int i=i0; match && i<Nfields_stored; i++)
+    {
+        const char* key = i == 0 ? &fields[0].data[1] : fields[i].data;
+        const int   len = i == 0 ? fields[0].len - 1  : fields[i].len;
+        match =
+            i - i0 < ctx->Ncolumns &&
+            (int)strlen(ctx->record[i-i0].key) == len &&
+            0 == memcmp(ctx->record[i-i0].key, key, len);
+    }
+    if(!match)
+    {
+        MSG("'%s' was restarted with a different legend", follow->filename);
+        return VNL_ERROR;
+    }
+    return VNL_OK;
+}
+
+////////////////// Splitting lines into fields
+
+// The line is scanned this many 64-byte blocks at a time, and each chunk is
+// split into fields before the next one is scanned. So a line that can be cut
+// short (a comment, or a projection that doesn't need the rest of the line) is
+// only scanned until the cut. The masks live on the stack
+#define SCAN_CHUNK 4
+
+// How far split_fields() got in a line
+typedef struct
+{
+    int      Nfields;
+    int      start;    // of the current field. <0 if between fields
+    uint64_t prev_sep; // the top bit of the previous block
+} split_state_t;
+
+// Splits the scanned blocks [0,Nmasks) of the chunk at begin[i0*64] into
+// internal->fields. Fields at index >= Nfields_store are counted but not
+// stored. Returns true if the rest of the line doesn't matter: it's a comment
+// (a field that starts with '#', unless it's the first field; read_line()
+// decides what to do with that one), or we already have Nfields_stop fields
+static
+bool split_fields(vnlog_parser_internal_t* internal,
+                  split_state_t*           state,
+                  const char* begin, int i0,
+                  const scan_mask_t* masks, int Nmasks,
+                  int Nfields_store, int Nfields_stop)
+{
+    for(int i=0; i<Nmasks; i++)
+    {
+        const uint64_t sep         = masks[i].sep;
+        const uint64_t sep_shifted = (sep << 1) | state->prev_sep; // is byte j-1 a separator?
+        state->prev_sep = sep >> 63;
+
+        uint64_t starts = ~sep &  sep_shifted;
+        uint64_t ends   =  sep & ~sep_shifted;
+
+        // The starts and ends alternate
+        while(true)
+        {
+            if(state->start < 0)
+            {
+                if(starts == 0)
+                    break;
+                const int j = __builtin_ctzll(starts);
+                starts &= starts - 1;
+
+                if(state->Nfields > 0 && (masks[i].hash >> j & 1))
+                    // A comment
+                    return true;
+                state->start = (i0+i)*64 + j;
+            }
+            else
+            {
+                if(ends == 0)
+                    break;
+                const int end = (i0+i)*64 + __builtin_ctzll(ends);
+                ends &= ends - 1;
+
+                if(state->Nfields < Nfields_store)
+                {
+                    if(state->Nfields >= internal->Nfields_allocated)
+                    {
+                        const int N = internal->Nfields_allocated > 0 ? internal->Nfields_allocated*2 : 16;
+                        vnlog_parser_field_t* fields = realloc(internal->fields, N*sizeof(fields[0]));
+                        if(fields == NULL)
+                        {
+                            MSG("Couldn't allocate fields");
+                            state->Nfields = -1;
+                            return true;
+                        }
+                        internal->fields            = fields;
+                        internal->Nfields_allocated = N;
+                    }
+                    internal->fields[state->Nfields] =
+                        (vnlog_parser_field_t){.data = &begin[state->start],
+                                               .len  = end - state->start};
+                }
+                state->Nfields++;
+                state->start = -1;
+
+                if(state->Nfields >= Nfields_stop)
+                    return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Reads the next line, and splits it into internal->fields. Sets *begin and
+// *len to the line, not including the '\n', and *Nfields to the number of
+// fields, or -1 on error. See split_fields() for the meaning of Nfields_store
+// and Nfields_stop. Returns VNL_EOF if there are no more lines
+static
+vnlog_parser_result_t next_line(// out
+                                const char** begin, int* len, int* Nfields,
+                                // in
+                                vnlog_parser_internal_t* internal,
+                                FILE* fp,
+                                int Nfields_store, int Nfields_stop)
+{
+    const char* limit;
+    if(internal->map != NULL)
+    {
+        if(internal->pos >= internal->map_size)
+        {
+            if(internal->follow == NULL)
+                return VNL_EOF;
+
+            vnlog_parser_result_t result = follow_fill(internal);
+            if(result != VNL_OK)
+                return result;
+        }
+
+        *begin = &internal->map[internal->pos];
+        limit  = &internal->map[internal->map_size];
+    }
+    else
     {
         if(0 > getline(&internal->line, &internal->n, fp))
         {
@@ -109,87 +635,198 @@ vnlog_parser_result_t read_line(vnlog_parser_t* ctx, FILE* fp)
             return VNL_ERROR;
         }
 
-        // Have one line. Parse it.
-        char* token;
-        char* string_to_tokenize = internal->line;
-        int i_col = 0;
+        // Anything past a '\0' is ignored
+        *begin = internal->line;
+        limit  = &internal->line[strlen(internal->line)];
+    }
+
+    split_state_t state = {.start = -1, .prev_sep = 1};
+    for(int i0 = 0; ; i0 += SCAN_CHUNK)
+    {
+        scan_mask_t masks[SCAN_CHUNK];
+        const int n = internal->scan(masks, SCAN_CHUNK, &(*begin)[i0*64], limit);
 
-        const bool legend_is_done = (ctx->record != NULL);
-        bool parsing_legend_now = false;
+        int Nmasks = SCAN_CHUNK;
+        if(n >= 0)
+        {
+            // This chunk has the end of the line. The block with the '\n' may
+            // have the next line in it. That's not a part of this line
+            *len   = i0*64 + n;
+            Nmasks = n/64 + 1;
+            masks[Nmasks-1].sep |= ~0ULL << (n % 64);
+        }
 
-        while(NULL != (token = strtok(string_to_tokenize, " \t\n")))
+        const bool cut = split_fields(internal, &state, *begin, i0, masks, Nmasks,
+                                      Nfields_store, Nfields_stop);
+        if(n >= 0)
+            break;
+        if(cut)
         {
-            string_to_tokenize = NULL;
+            // Don't need the rest of the line. Just find where it ends
+            const char* rest = &(*begin)[(i0 + SCAN_CHUNK)*64];
+            const char* nl   = memchr(rest, '\n', limit - rest);
+            *len = (int)((nl != NULL ? nl : limit) - *begin);
+            break;
+        }
+    }
+
+    if(internal->map != NULL)
+        internal->pos += *len + 1;
+    *Nfields = state.Nfields;
+    return VNL_OK;
+}
+
+// Points ctx->record[].value at '\0'-terminated copies of the fields of the
+// line at begin. Reading with stdio, the line is in our own buffer, and I
+// terminate the fields in place. In a mapping, the line is copied first. With
+// a projection, only the projected columns get values
+static
+bool fill_record_values(vnlog_parser_t* ctx,
+                        const char* begin, int len)
+{
+    vnlog_parser_internal_t* internal = (vnlog_parser_internal_t*)ctx->_internal;
 
-            if(token[0] == '#')
+    char* line = internal->line;
+    if(internal->map != NULL)
+    {
+        if(internal->n < (size_t)len + 1)
+        {
+            char* buf = realloc(internal->line, len + 1);
+            if(buf == NULL)
             {
-                if(token[1] == '#' || token[1] == '!')
-                    // hard comment
-                    break;
-                if(i_col > 0)
-                    // The legend can only appear in the first column
-                    break;
-                if(legend_is_done)
-                    // Already parsed the legend. The rest of this line is
-                    // comments to be ignored
-                    break;
-                if(parsing_legend_now)
-                    // We already started the legend. This comment finishes it
-                    break;
+                MSG("Couldn't allocate line buffer");
+                return false;
+            }
+            internal->line = buf;
+            internal->n    = len + 1;
+        }
+        memcpy(internal->line, begin, len);
+        line = internal->line;
+    }
 
-                // This is the start of the legend. Parse all the columns
-                parsing_legend_now = true;
-                if(!accumulate_legend(&Ncolumns_allocated,
-                                      &i_col,
-                                      &ctx->record,
-                                      &token[1]))
-                        return VNL_ERROR;
+    const int N = internal->projection != NULL ? internal->Nprojection : ctx->Ncolumns;
+    for(int k=0; k<N; k++)
+    {
+        const int i = internal->projection != NULL ? internal->projection[k] : k;
+        char* value = &line[internal->fields[i].data - begin];
+        value[internal->fields[i].len] = '\0';
+        ctx->record[i].value = value;
+    }
+    return true;
+}
+
+static
+vnlog_parser_result_t read_line(vnlog_parser_t* ctx, FILE* fp)
+{
+    vnlog_parser_internal_t* internal = (vnlog_parser_internal_t*)ctx->_internal;
+
+    // With a projection, I only need the fields up to the last projected one.
+    // I keep counting the rest only if validating
+    int Nfields_store = INT_MAX;
+    int Nfields_stop  = INT_MAX;
+    if(internal->projection != NULL)
+    {
+        Nfields_store = internal->Nfields_needed;
+        if(!internal->validate_projected)
+            Nfields_stop = internal->Nfields_needed;
+    }
+
+    while(true)
+    {
+        const char* begin;
+        int         len     = 0;
+        int         Nfields = 0;
+        vnlog_parser_result_t result = next_line(&begin, &len, &Nfields,
+                                                 internal, fp,
+                                                 Nfields_store, Nfields_stop);
+        if(result != VNL_OK)
+            return result;
+
+        // Have one line. Parse it.
+        if(Nfields < 0)
+            return VNL_ERROR;
+        if(Nfields == 0)
+            // Empty line. Get another.
+            continue;
+
+        const vnlog_parser_field_t* fields = internal->fields;
+        if(fields[0].data[0] == '#')
+        {
+            if(fields[0].len > 1 && (fields[0].data[1] == '#' || fields[0].data[1] == '!'))
+                // hard comment
+                continue;
+            if(ctx->record != NULL)
+            {
+                if(internal->follow != NULL && internal->follow->check_legend)
+                {
+                    result = follow_check_legend(ctx, fields, Nfields,
+                                                 Nfields < Nfields_store ? Nfields : Nfields_store,
+                                                 Nfields_stop == INT_MAX);
+                    if(result == VNL_ERROR)
+                        return result;
+                    if(result == VNL_OK)
+                        internal->follow->check_legend = false;
+                }
 
-                // grab next token from this line
+                // Already parsed the legend. This is a comment to be ignored
                 continue;
             }
 
-            if(parsing_legend_now)
-            {
+            // This is the legend. The first column may be attached to the '#'
+            int Ncolumns_allocated = 0;
+            int i_col              = 0;
+            if(!accumulate_legend(&Ncolumns_allocated,
+                                  &i_col,
+                                  &ctx->record,
+                                  &fields[0].data[1], fields[0].len-1))
+                return VNL_ERROR;
+            for(int i=1; i<Nfields; i++)
                 if(!accumulate_legend(&Ncolumns_allocated,
                                       &i_col,
                                       &ctx->record,
-                                      token))
+                                      fields[i].data, fields[i].len))
                     return VNL_ERROR;
+
+            if(i_col == 0)
+                // A lone '#'. Not a legend. Get another line
                 continue;
-            }
 
-            // Data token
-            if(!accumulate_data_row(ctx->record,
-                                    &i_col,
-                                    ctx->Ncolumns,
-                                    token))
-                return VNL_ERROR;
+            ctx->Ncolumns = i_col;
+            return VNL_OK;
         }
 
-        // Finished line
-        if(i_col == 0)
+        // Data line
+        if(ctx->record == NULL)
         {
-            // Empty line. Get another.
-            parsing_legend_now = false;
-            continue;
+            MSG("Saw data line before a legend line");
+            return VNL_ERROR;
         }
-
-        if(parsing_legend_now)
-            ctx->Ncolumns = i_col;
-        else if(i_col != ctx->Ncolumns)
+        if(internal->follow != NULL && internal->follow->check_legend)
+        {
+            MSG("'%s' was restarted without a legend", internal->follow->filename);
+            return VNL_ERROR;
+        }
+        if(Nfields > ctx->Ncolumns)
+        {
+            MSG("legend said we have %d columns, but saw a data line that has too many", ctx->Ncolumns);
+            return VNL_ERROR;
+        }
+        if(Nfields < ctx->Ncolumns && Nfields < Nfields_stop)
         {
             MSG("Legend has %d columns, but just saw a data line of %d columns",
-                ctx->Ncolumns, i_col);
+                ctx->Ncolumns, Nfields);
             return VNL_ERROR;
         }
 
+        if(internal->map == NULL || internal->want_strings)
+        {
+            if(!fill_record_values(ctx, begin, len))
+                return VNL_ERROR;
+        }
+
         // Done. All good!
         return VNL_OK;
     }
-
-    MSG("Getting here is a bug");
-    return VNL_ERROR;
 }
 
 #ifdef __APPLE__
@@ -232,19 +869,15 @@ static void noop_free(void* _dummy __attribute__((unused)) )
 {
 }
 
-vnlog_parser_result_t vnlog_parser_init(vnlog_parser_t* ctx, FILE* fp)
+// Reads the legend, and sets up the key lookup
+static
+vnlog_parser_result_t read_legend(vnlog_parser_t* ctx, FILE* fp)
 {
-    *ctx = (vnlog_parser_t){};
+    vnlog_parser_internal_t* internal = (vnlog_parser_internal_t*)ctx->_internal;
 
     vnlog_parser_result_t result = read_line(ctx, fp);
-
     if(result != VNL_OK)
-    {
-        vnlog_parser_free(ctx);
         return result;
-    }
-
-    vnlog_parser_internal_t* internal = (vnlog_parser_internal_t*)ctx->_internal;
 
     // Parsed the legend. Now create a tree to make it easy to look up the
     // specific column by key name. Probably these will be called once per run,
@@ -262,21 +895,235 @@ vnlog_parser_result_t vnlog_parser_init(vnlog_parser_t* ctx, FILE* fp)
     return VNL_OK;
 }
 
-void vnlog_parser_free(vnlog_parser_t* ctx)
+// Reads the legend. The input (FILE or mapping) is already set up
+static
+vnlog_parser_result_t init_from_legend(vnlog_parser_t* ctx, FILE* fp)
 {
-    if(ctx != NULL)
-    {
-        vnlog_parser_internal_t* internal = (vnlog_parser_internal_t*)ctx->_internal;
-        if(internal != NULL)
-        {
-            free(internal->line);
+    vnlog_parser_internal_t* internal = (vnlog_parser_internal_t*)ctx->_internal;
+    internal->scan = scanner(selected_impl());
+
+    vnlog_parser_result_t result = read_legend(ctx, fp);
+    if(result != VNL_OK)
+        vnlog_parser_free(ctx);
+    return result;
+}
+
+vnlog_parser_result_t vnlog_parser_init(vnlog_parser_t* ctx, FILE* fp)
+{
+    *ctx = (vnlog_parser_t){};
+    return init_from_legend(ctx, fp);
+}
+
+vnlog_parser_result_t vnlog_parser_init_mmap(vnlog_parser_t* ctx,
+                                             const char* filename,
+                                             bool want_strings)
+{
+    *ctx = (vnlog_parser_t){};
+    vnlog_parser_internal_t* internal = (vnlog_parser_internal_t*)ctx->_internal;
+    internal->want_strings = want_strings;
+
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0)
+    {
+        MSG("Couldn't open '%s': %s", filename, strerror(errno));
+        return VNL_ERROR;
+    }
+    struct stat st;
+    if(0 != fstat(fd, &st))
+    {
+        MSG("Couldn't stat '%s': %s", filename, strerror(errno));
+        close(fd);
+        return VNL_ERROR;
+    }
+    if(st.st_size == 0)
+    {
+        // Nothing to map. This has no legend
+        close(fd);
+        return VNL_EOF;
+    }
+
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        MSG("Couldn't map '%s': %s", filename, strerror(errno));
+        return VNL_ERROR;
+    }
+
+    // We read the file once, from start to finish. The kernel should read
+    // ahead aggressively, and can drop the pages behind us
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+    madvise(map, (size_t)st.st_size, MADV_WILLNEED);
+
+    internal->map      = map;
+    internal->map_size = (size_t)st.st_size;
+    internal->pos      = 0;
+
+    return init_from_legend(ctx, NULL);
+}
+
+vnlog_parser_result_t vnlog_parser_init_follow(vnlog_parser_t* ctx,
+                                               const char* filename)
+{
+    *ctx = (vnlog_parser_t){};
+    vnlog_parser_internal_t* internal = (vnlog_parser_internal_t*)ctx->_internal;
+    internal->want_strings = true;
+    internal->scan         = scanner(selected_impl());
+
+    follow_t* follow = calloc(1, sizeof(*follow));
+    if(follow == NULL)
+    {
+        MSG("Couldn't allocate the follow state");
+        return VNL_ERROR;
+    }
+    internal->follow = follow;
+    follow->fd             = -1;
+    follow->fd_inotify     = -1;
+    follow->filename       = strdup(filename);
+    follow->buf            = malloc(FOLLOW_READ_MIN);
+    follow->size_allocated = FOLLOW_READ_MIN;
+    if(follow->filename == NULL || follow->buf == NULL)
+    {
+        MSG("Couldn't allocate the follow state");
+        vnlog_parser_free(ctx);
+        return VNL_ERROR;
+    }
+    internal->map = follow->buf;
+
+    follow->fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if(follow->fd < 0)
+    {
+        MSG("Couldn't open '%s': %s", filename, strerror(errno));
+        vnlog_parser_free(ctx);
+        return VNL_ERROR;
+    }
+
+    const char* slash = strrchr(follow->filename, '/');
+    follow->basename = slash != NULL ? &slash[1] : follow->filename;
+    char* dir =
+        slash == NULL            ? strdup(".") :
+        slash == follow->filename ? strdup("/") :
+        strndup(follow->filename, slash - follow->filename);
+    follow->fd_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(follow->fd_inotify >= 0 &&
+       (dir == NULL ||
+        0 > inotify_add_watch(follow->fd_inotify, dir,
+                              IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+                              IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)))
+    {
+        // No notifications. vnlog_parser_follow_wait() will just sleep
+        close(follow->fd_inotify);
+        follow->fd_inotify = -1;
+    }
+    free(dir);
+
+    vnlog_parser_result_t result = read_legend(ctx, NULL);
+    if(result == VNL_ERROR)
+        vnlog_parser_free(ctx);
+    return result;
+}
+
+static double now_ms(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec * 1e3 + (double)t.tv_nsec / 1e6;
+}
+
+vnlog_parser_result_t vnlog_parser_follow_wait(vnlog_parser_t* ctx, int timeout_ms)
+{
+    const vnlog_parser_internal_t* internal = (const vnlog_parser_internal_t*)ctx->_internal;
+    const follow_t*                follow   = internal->follow;
+    if(follow == NULL)
+    {
+        MSG("The parser isn't in follow mode");
+        return VNL_ERROR;
+    }
+
+    if(follow->fd_inotify < 0)
+    {
+        // No notifications. Check again in a bit
+        const int sleep_ms = (timeout_ms >= 0 && timeout_ms < 100) ? timeout_ms : 100;
+        poll(NULL, 0, sleep_ms);
+        return VNL_OK;
+    }
+
+    // The watch is on the directory. I ignore the events about other files in
+    // it
+    const double t_end = now_ms() + timeout_ms;
+    while(true)
+    {
+        int remaining_ms = -1;
+        if(timeout_ms >= 0)
+        {
+            remaining_ms = (int)(t_end - now_ms());
+            if(remaining_ms < 0)
+                remaining_ms = 0;
+        }
+
+        struct pollfd pfd = {.fd = follow->fd_inotify, .events = POLLIN};
+        const int N = poll(&pfd, 1, remaining_ms);
+        if(N < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            MSG("poll() failed: %s", strerror(errno));
+            return VNL_ERROR;
+        }
+        if(N == 0)
+            return VNL_AGAIN;
+
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        const ssize_t Nread = read(follow->fd_inotify, events, sizeof(events));
+        for(ssize_t i=0; i<Nread;)
+        {
+            const struct inotify_event* event = (const struct inotify_event*)&events[i];
+            if(event->len == 0 ||
+               0 == strcmp(event->name, follow->basename) ||
+               (event->mask & IN_Q_OVERFLOW))
+                return VNL_OK;
+            i += sizeof(*event) + event->len;
+        }
+    }
+}
+
+int vnlog_parser_follow_fd(const vnlog_parser_t* ctx)
+{
+    const vnlog_parser_internal_t* internal = (const vnlog_parser_internal_t*)ctx->_internal;
+    const follow_t*                follow   = internal->follow;
+    return follow != NULL ? follow->fd_inotify : -1;
+}
+
+void vnlog_parser_free(vnlog_parser_t* ctx)
+{
+    if(ctx != NULL)
+    {
+        vnlog_parser_internal_t* internal = (vnlog_parser_internal_t*)ctx->_internal;
+        const bool is_chunk = internal->parent != NULL;
+
+        free(internal->line);
+        free(internal->fields);
+        free(internal->projection);
+        if(!is_chunk)
+        {
             tdestroy(internal->dict_key_index, &noop_free);
+            if(internal->follow != NULL)
+            {
+                if(internal->follow->fd         >= 0) close(internal->follow->fd);
+                if(internal->follow->fd_inotify >= 0) close(internal->follow->fd_inotify);
+                free(internal->follow->buf);
+                free(internal->follow->filename);
+                free(internal->follow);
+            }
+            else if(internal->map != NULL)
+                munmap((void*)internal->map, internal->map_size);
         }
 
         if(ctx->record != NULL)
         {
-            for(int i=0; i<ctx->Ncolumns; i++)
-                free(ctx->record[i].key);
+            if(!is_chunk)
+                for(int i=0; i<ctx->Ncolumns; i++)
+                    free(ctx->record[i].key);
             free(ctx->record);
         }
     }
@@ -285,6 +1132,17 @@ void vnlog_parser_free(vnlog_parser_t* ctx)
 
 vnlog_parser_result_t vnlog_parser_read_record(vnlog_parser_t* ctx, FILE* fp)
 {
+    const vnlog_parser_internal_t* internal =
+        ctx != NULL ? (const vnlog_parser_internal_t*)ctx->_internal : NULL;
+    if(internal != NULL && ctx->record == NULL && internal->follow != NULL)
+    {
+        // Follow mode, and there was no legend yet when the parser was
+        // initialized
+        vnlog_parser_result_t result = read_legend(ctx, fp);
+        if(result != VNL_OK)
+            return result;
+    }
+
     if(ctx == NULL || ctx->record == NULL)
     {
         MSG("Legend hasn't been read. Call vnlog_parser_init() first");
@@ -294,18 +1152,771 @@ vnlog_parser_result_t vnlog_parser_read_record(vnlog_parser_t* ctx, FILE* fp)
     return read_line(ctx, fp);
 }
 
+int64_t vnlog_parser_tell(const vnlog_parser_t* ctx, FILE* fp)
+{
+    const vnlog_parser_internal_t* internal = (const vnlog_parser_internal_t*)ctx->_internal;
+    if(internal->follow != NULL)
+    {
+        MSG("Positions aren't available in follow mode");
+        return -1;
+    }
+    if(internal->map == NULL)
+        return (int64_t)ftello(fp);
+
+    // pos is past the end if the last line has no '\n'
+    return (int64_t)(internal->pos < internal->map_size ? internal->pos : internal->map_size);
+}
+
+int64_t vnlog_parser_record_offset(const vnlog_parser_t* ctx)
+{
+    const vnlog_parser_internal_t* internal = (const vnlog_parser_internal_t*)ctx->_internal;
+    if(internal->map == NULL || internal->follow != NULL)
+    {
+        MSG("Record offsets are only available in a mapped file");
+        return -1;
+    }
+    if(internal->fields == NULL)
+    {
+        MSG("No record has been read");
+        return -1;
+    }
+    return (int64_t)(internal->fields[0].data - internal->map);
+}
+
+bool vnlog_parser_seek(vnlog_parser_t* ctx, FILE* fp, int64_t offset)
+{
+    vnlog_parser_internal_t* internal = (vnlog_parser_internal_t*)ctx->_internal;
+    if(internal->follow != NULL)
+    {
+        MSG("Can't seek in follow mode");
+        return false;
+    }
+    if(internal->map == NULL)
+    {
+        if(0 != fseeko(fp, (off_t)offset, SEEK_SET))
+        {
+            MSG("Couldn't seek to %lld: %s", (long long)offset, strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    if(offset < 0 || (uint64_t)offset > internal->map_size)
+    {
+        MSG("Offset %lld is outside the file of %zu bytes", (long long)offset, internal->map_size);
+        return false;
+    }
+    internal->pos = (size_t)offset;
+    return true;
+}
+
+bool vnlog_parser_set_end(vnlog_parser_t* ctx, int64_t end)
+{
+    vnlog_parser_internal_t* internal = (vnlog_parser_internal_t*)ctx->_internal;
+    if(internal->map == NULL || internal->follow != NULL || internal->parent != NULL)
+    {
+        MSG("The end can only be set in a mapped file");
+        return false;
+    }
+    if(end < (int64_t)internal->pos || (uint64_t)end > internal->map_size)
+    {
+        MSG("End %lld is outside the unread part of the file: %zu-%zu",
+            (long long)end, internal->pos, internal->map_size);
+        return false;
+    }
+
+    // I unmap the pages past the new end, so that vnlog_parser_free() can still
+    // munmap(map, map_size). The page containing the end stays mapped, so the
+    // scanners may look past the end as before
+    const size_t page     = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t keep     = ((size_t)end          + page-1) / page * page;
+    const size_t have     = (internal->map_size   + page-1) / page * page;
+    if(keep > 0 && keep < have)
+        munmap((char*)internal->map + keep, have - keep);
+
+    internal->map_size = (size_t)end;
+    return true;
+}
+
+const vnlog_parser_field_t* vnlog_parser_fields(const vnlog_parser_t* ctx)
+{
+    const vnlog_parser_internal_t* internal = (const vnlog_parser_internal_t*)ctx->_internal;
+    return internal->fields;
+}
+
 // pointer to the pointer to the string for the record corresponding to the
 // given key in the most-recently-parsed row. NULL if the given key isn't found
 const char*const* vnlog_parser_record_from_key(vnlog_parser_t* ctx, const char* key)
 {
+    const vnlog_parser_column_t column = vnlog_parser_column(ctx, key);
+    if(column < 0)
+        return NULL;
+
+    return (const char*const*)&ctx->record[column].value;
+}
+
+vnlog_parser_column_t vnlog_parser_column(vnlog_parser_t* ctx, const char* key)
+{
+    // The parser of a chunk looks up the keys in its parent
     vnlog_parser_internal_t* internal = (vnlog_parser_internal_t*)ctx->_internal;
+    if(internal->parent != NULL)
+        ctx = (vnlog_parser_t*)internal->parent;
+    internal = (vnlog_parser_internal_t*)ctx->_internal;
 
     const vnlog_keyvalue_t*const* keyvalue =
         tfind( (const void*)&(const vnlog_keyvalue_t){.key = (char*)key},
                &internal->dict_key_index,
                (int(*)(const void*,const void*))compare_record);
     if(keyvalue == NULL)
+        return -1;
+
+    return (vnlog_parser_column_t)(*keyvalue - ctx->record);
+}
+
+bool vnlog_parser_set_projection(vnlog_parser_t* ctx,
+                                 const vnlog_parser_column_t* columns, int Ncolumns,
+                                 bool validate)
+{
+    vnlog_parser_internal_t* internal = (vnlog_parser_internal_t*)ctx->_internal;
+
+    free(internal->projection);
+    internal->projection         = NULL;
+    internal->Nprojection        = 0;
+    internal->Nfields_needed     = 0;
+    internal->validate_projected = false;
+    for(int i=0; i<ctx->Ncolumns; i++)
+        ctx->record[i].value = NULL;
+
+    if(columns == NULL)
+        // Back to all the columns
+        return true;
+
+    // I always need the first field, to look for comments
+    int Nfields_needed = 1;
+    for(int i=0; i<Ncolumns; i++)
+    {
+        if(columns[i] < 0 || columns[i] >= ctx->Ncolumns)
+        {
+            MSG("Column %d doesn't exist; have %d columns", columns[i], ctx->Ncolumns);
+            return false;
+        }
+        if(Nfields_needed < columns[i] + 1)
+            Nfields_needed = columns[i] + 1;
+    }
+
+    internal->projection = malloc((Ncolumns > 0 ? Ncolumns : 1) * sizeof(int));
+    if(internal->projection == NULL)
+    {
+        MSG("Couldn't allocate projection");
+        return false;
+    }
+    memcpy(internal->projection, columns, Ncolumns * sizeof(int));
+    internal->Nprojection        = Ncolumns;
+    internal->Nfields_needed     = Nfields_needed;
+    internal->validate_projected = validate;
+    return true;
+}
+
+bool vnlog_parser_is_null(const vnlog_parser_t* ctx, vnlog_parser_column_t column)
+{
+    const vnlog_parser_internal_t* internal = (const vnlog_parser_internal_t*)ctx->_internal;
+    const vnlog_parser_field_t*    field    = &internal->fields[column];
+    return field->len == 1 && field->data[0] == '-';
+}
+
+bool vnlog_parser_get_double(const vnlog_parser_t* ctx, vnlog_parser_column_t column, double* x)
+{
+    const vnlog_parser_internal_t* internal = (const vnlog_parser_internal_t*)ctx->_internal;
+    const vnlog_parser_field_t*    field    = &internal->fields[column];
+    if(field->len == 1 && field->data[0] == '-')
+    {
+        *x = NAN;
+        return true;
+    }
+    return vnlog_parse_double(field->data, field->len, x);
+}
+
+bool vnlog_parser_get_int64(const vnlog_parser_t* ctx, vnlog_parser_column_t column, int64_t* x)
+{
+    const vnlog_parser_internal_t* internal = (const vnlog_parser_internal_t*)ctx->_internal;
+    const vnlog_parser_field_t*    field    = &internal->fields[column];
+    return vnlog_parse_int64(field->data, field->len, x);
+}
+
+bool vnlog_batch_init(vnlog_batch_t* batch, vnlog_parser_t* ctx,
+                      const char* const* keys, const vnlog_batch_type_t* types,
+                      int Ncolumns, int Nrows_max)
+{
+    *batch = (vnlog_batch_t){.Ncolumns  = Ncolumns,
+                             .Nrows_max = Nrows_max};
+    if(Ncolumns <= 0 || Nrows_max <= 0)
+    {
+        MSG("A batch needs at least one column and one row");
+        return false;
+    }
+
+    batch->columns = calloc(Ncolumns, sizeof(batch->columns[0]));
+    if(batch->columns == NULL)
+    {
+        MSG("Couldn't allocate batch columns");
+        return false;
+    }
+
+    for(int i=0; i<Ncolumns; i++)
+    {
+        batch->columns[i].column = vnlog_parser_column(ctx, keys[i]);
+        batch->columns[i].type   = types[i];
+        if(batch->columns[i].column < 0)
+        {
+            MSG("Column '%s' not found", keys[i]);
+            vnlog_batch_free(batch);
+            return false;
+        }
+    }
+    return true;
+}
+
+void vnlog_batch_free(vnlog_batch_t* batch)
+{
+    if(batch->columns != NULL)
+        for(int i=0; i<batch->Ncolumns; i++)
+        {
+            if(batch->columns[i]._own_values) free(batch->columns[i].values);
+            if(batch->columns[i]._own_null)   free(batch->columns[i].null);
+        }
+    free(batch->columns);
+    *batch = (vnlog_batch_t){};
+}
+
+// Allocates whatever buffers the caller didn't provide
+static bool batch_allocate(vnlog_batch_t* batch)
+{
+    for(int i=0; i<batch->Ncolumns; i++)
+    {
+        vnlog_batch_column_t* c = &batch->columns[i];
+        if(c->values == NULL)
+        {
+            c->values = malloc((size_t)batch->Nrows_max *
+                               (c->type == VNLOG_BATCH_DOUBLE ? sizeof(double) : sizeof(int64_t)));
+            if(c->values == NULL)
+            {
+                MSG("Couldn't allocate batch values");
+                return false;
+            }
+            c->_own_values = true;
+        }
+        if(c->null == NULL)
+        {
+            c->null = malloc((batch->Nrows_max + 7) / 8);
+            if(c->null == NULL)
+            {
+                MSG("Couldn't allocate batch null bitmap");
+                return false;
+            }
+            c->_own_null = true;
+        }
+    }
+    return true;
+}
+
+vnlog_parser_result_t vnlog_parser_read_batch(vnlog_parser_t* ctx, FILE* fp,
+                                              vnlog_batch_t* batch)
+{
+    batch->Nrows = 0;
+    if(!batch_allocate(batch))
+        return VNL_ERROR;
+
+    for(int i=0; i<batch->Ncolumns; i++)
+        memset(batch->columns[i].null, 0, (batch->Nrows_max + 7) / 8);
+
+    const vnlog_parser_internal_t* internal = (const vnlog_parser_internal_t*)ctx->_internal;
+
+    int irow;
+    for(irow = 0; irow < batch->Nrows_max; irow++)
+    {
+        vnlog_parser_result_t result = vnlog_parser_read_record(ctx, fp);
+        if(result == VNL_EOF || result == VNL_AGAIN)
+        {
+            // In follow mode, a batch ends at the end of what's available
+            batch->Nrows = irow;
+            return irow > 0 ? VNL_OK : result;
+        }
+        if(result != VNL_OK)
+            return result;
+
+        for(int i=0; i<batch->Ncolumns; i++)
+        {
+            vnlog_batch_column_t*       c     = &batch->columns[i];
+            const vnlog_parser_field_t* field = &internal->fields[c->column];
+            const bool is_null = field->len == 1 && field->data[0] == '-';
+            if(is_null)
+                c->null[irow/8] |= (uint8_t)(1 << (irow%8));
+
+            bool ok = true;
+            if(c->type == VNLOG_BATCH_DOUBLE)
+            {
+                double* x = &((double*)c->values)[irow];
+                if(is_null) *x = NAN;
+                else        ok = vnlog_parse_double(field->data, field->len, x);
+            }
+            else
+            {
+                int64_t* x = &((int64_t*)c->values)[irow];
+                if(is_null) *x = 0;
+                else        ok = vnlog_parse_int64(field->data, field->len, x);
+            }
+            if(!ok)
+            {
+                MSG("Column '%s': '%.*s' isn't a valid %s",
+                    ctx->record[c->column].key, field->len, field->data,
+                    c->type == VNLOG_BATCH_DOUBLE ? "double" : "int64");
+                return VNL_ERROR;
+            }
+        }
+    }
+
+    batch->Nrows = irow;
+    return irow > 0 ? VNL_OK : VNL_EOF;
+}
+
+////////////////// Parallel parsing
+
+#define CHUNK_SIZE_DEFAULT (16 << 20)
+
+// Splits the rest of the mapped file into chunks of about chunk_size bytes,
+// starting each chunk at the start of a line. Returns the Nchunks+1 offsets of
+// the chunks in the mapping, or NULL on error
+static size_t* chunk_boundaries(int* Nchunks,
+                                const vnlog_parser_t* ctx, size_t chunk_size)
+{
+    const vnlog_parser_internal_t* internal = (const vnlog_parser_internal_t*)ctx->_internal;
+
+    if(chunk_size == 0)
+        chunk_size = CHUNK_SIZE_DEFAULT;
+    // pos is past the end if the last line has no '\n'
+    const size_t size = internal->pos < internal->map_size ?
+                        internal->map_size - internal->pos : 0;
+    size_t* boundaries = malloc((size / chunk_size + 2) * sizeof(boundaries[0]));
+    if(boundaries == NULL)
+    {
+        MSG("Couldn't allocate chunk boundaries");
+        return NULL;
+    }
+
+    int    N   = 0;
+    size_t pos = internal->pos;
+    while(pos < internal->map_size)
+    {
+        boundaries[N++] = pos;
+        if(internal->map_size - pos <= chunk_size)
+            break;
+
+        // The chunk ends after the line that straddles its nominal end
+        const char* nl = memchr(&internal->map[pos + chunk_size - 1], '\n',
+                                internal->map_size - (pos + chunk_size - 1));
+        pos = (nl != NULL) ? (size_t)(nl - internal->map) + 1 : internal->map_size;
+    }
+    boundaries[N] = internal->map_size;
+    *Nchunks = N;
+    return boundaries;
+}
+
+// Sets up a parser for the lines in [begin,end) of the mapping of ctx. It
+// shares the legend, the key lookup and the mapping of ctx, and has its own
+// copy of the rest. Free it with vnlog_parser_free(), before ctx
+static bool chunk_parser_init(vnlog_parser_t* chunk, const vnlog_parser_t* ctx,
+                              size_t begin, size_t end)
+{
+    const vnlog_parser_internal_t* internal = (const vnlog_parser_internal_t*)ctx->_internal;
+
+    *chunk = (vnlog_parser_t){.Ncolumns = ctx->Ncolumns};
+    vnlog_parser_internal_t* internal_chunk = (vnlog_parser_internal_t*)chunk->_internal;
+    *internal_chunk = (vnlog_parser_internal_t){.scan         = internal->scan,
+                                                .map          = internal->map,
+                                                .map_size     = end,
+                                                .pos          = begin,
+                                                .want_strings = internal->want_strings,
+                                                .parent       = ctx};
+
+    chunk->record = malloc(ctx->Ncolumns * sizeof(chunk->record[0]));
+    if(chunk->record == NULL)
+    {
+        MSG("Couldn't allocate record");
+        vnlog_parser_free(chunk);
+        return false;
+    }
+    for(int i=0; i<ctx->Ncolumns; i++)
+        chunk->record[i] = (vnlog_keyvalue_t){.key = ctx->record[i].key};
+
+    if(internal->projection != NULL &&
+       !vnlog_parser_set_projection(chunk,
+                                    internal->projection, internal->Nprojection,
+                                    internal->validate_projected))
+    {
+        vnlog_parser_free(chunk);
+        return false;
+    }
+    return true;
+}
+
+// The state shared by the threads of vnlog_parser_parallel_foreach()
+typedef struct
+{
+    const vnlog_parser_t*   ctx;
+    const size_t*           boundaries;
+    int                     Nchunks;
+    vnlog_parser_chunk_cb_t cb;
+    void*                   cookie;
+
+    // These are accessed with the __atomic builtins
+    int                     i_chunk_next;
+    bool                    failed;
+} foreach_t;
+
+static void* foreach_thread(void* arg)
+{
+    foreach_t* foreach = (foreach_t*)arg;
+
+    while(!__atomic_load_n(&foreach->failed, __ATOMIC_RELAXED))
+    {
+        const int i_chunk = __atomic_fetch_add(&foreach->i_chunk_next, 1, __ATOMIC_RELAXED);
+        if(i_chunk >= foreach->Nchunks)
+            break;
+
+        vnlog_parser_t chunk;
+        bool ok = chunk_parser_init(&chunk, foreach->ctx,
+                                    foreach->boundaries[i_chunk],
+                                    foreach->boundaries[i_chunk+1]);
+        if(ok)
+        {
+            ok = foreach->cb(&chunk, i_chunk, foreach->cookie);
+            vnlog_parser_free(&chunk);
+        }
+        if(!ok)
+            __atomic_store_n(&foreach->failed, true, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static int default_Nthreads(int Nthreads)
+{
+    if(Nthreads > 0)
+        return Nthreads;
+    const long N = sysconf(_SC_NPROCESSORS_ONLN);
+    return N > 0 ? (int)N : 1;
+}
+
+// The chunks are split off the rest of the mapping of ctx, and ctx is done
+// with it
+static size_t* parallel_take_chunks(int* Nchunks,
+                                    vnlog_parser_t* ctx, size_t chunk_size)
+{
+    vnlog_parser_internal_t* internal = (vnlog_parser_internal_t*)ctx->_internal;
+    if(ctx->record == NULL || internal->map == NULL ||
+       internal->parent != NULL || internal->follow != NULL)
+    {
+        MSG("Parallel parsing needs a parser from vnlog_parser_init_mmap()");
         return NULL;
+    }
+
+    size_t* boundaries = chunk_boundaries(Nchunks, ctx, chunk_size);
+    if(boundaries != NULL)
+        internal->pos = internal->map_size;
+    return boundaries;
+}
+
+vnlog_parser_result_t vnlog_parser_parallel_foreach(vnlog_parser_t* ctx,
+                                                    int Nthreads, size_t chunk_size,
+                                                    vnlog_parser_chunk_cb_t cb, void* cookie)
+{
+    foreach_t foreach = {.ctx    = ctx,
+                         .cb     = cb,
+                         .cookie = cookie};
+    size_t* boundaries = parallel_take_chunks(&foreach.Nchunks, ctx, chunk_size);
+    if(boundaries == NULL)
+        return VNL_ERROR;
+    foreach.boundaries = boundaries;
+
+    Nthreads = default_Nthreads(Nthreads);
+    if(Nthreads > foreach.Nchunks)
+        Nthreads = foreach.Nchunks > 0 ? foreach.Nchunks : 1;
+
+    // The calling thread is one of the workers
+    pthread_t threads[Nthreads];
+    int Nstarted = 0;
+    for(; Nstarted < Nthreads-1; Nstarted++)
+        if(0 != pthread_create(&threads[Nstarted], NULL, foreach_thread, &foreach))
+        {
+            MSG("Couldn't start a worker thread. Continuing with %d", Nstarted+1);
+            break;
+        }
+    foreach_thread(&foreach);
+    for(int i=0; i<Nstarted; i++)
+        pthread_join(threads[i], NULL);
+
+    free(boundaries);
+    return foreach.failed ? VNL_ERROR : VNL_OK;
+}
+
+// The batches of one chunk, in vnlog_parser_parallel_t
+typedef struct
+{
+    int            i_chunk;
+    bool           done, failed; // protected by the mutex
+    vnlog_batch_t* batches;
+    int            Nbatches;
+} parallel_slot_t;
+
+typedef struct
+{
+    const vnlog_parser_t* ctx;
+    size_t*               boundaries;
+    int                   Nchunks;
+
+    // The columns of each batch. The buffers of this one aren't used
+    vnlog_batch_t         batch_template;
+
+    // The workers parse chunk i into slots[i % Nslots]. They may start chunk
+    // i only if i < i_chunk_read + Nslots
+    pthread_t*            threads;
+    int                   Nthreads;
+    parallel_slot_t*      slots;
+    int                   Nslots;
+
+    pthread_mutex_t       mutex;
+    // Broadcast when a slot is done, and when the reader is done with a slot
+    pthread_cond_t        cond_done;
+    pthread_cond_t        cond_room;
+
+    // Protected by the mutex
+    int                   i_chunk_next;
+    int                   i_chunk_read;
+    bool                  stop;
+
+    // The next batch to return in the slot of i_chunk_read. Used only by the
+    // reader
+    int                   i_batch_read;
+} parallel_t;
+
+static void slot_free_batches(parallel_slot_t* slot)
+{
+    for(int i=0; i<slot->Nbatches; i++)
+        vnlog_batch_free(&slot->batches[i]);
+    free(slot->batches);
+    slot->batches  = NULL;
+    slot->Nbatches = 0;
+}
+
+// Reads the whole chunk into the slot's batches
+static bool parallel_parse_chunk(parallel_t* par, parallel_slot_t* slot)
+{
+    vnlog_parser_t chunk;
+    if(!chunk_parser_init(&chunk, par->ctx,
+                          par->boundaries[slot->i_chunk],
+                          par->boundaries[slot->i_chunk+1]))
+        return false;
+
+    bool ok = true;
+    int  Nbatches_allocated = 0;
+    while(true)
+    {
+        if(slot->Nbatches >= Nbatches_allocated)
+        {
+            Nbatches_allocated = Nbatches_allocated > 0 ? Nbatches_allocated*2 : 16;
+            vnlog_batch_t* batches = realloc(slot->batches,
+                                             Nbatches_allocated*sizeof(batches[0]));
+            if(batches == NULL)
+            {
+                MSG("Couldn't allocate batches");
+                ok = false;
+                break;
+            }
+            slot->batches = batches;
+        }
+
+        vnlog_batch_t* batch = &slot->batches[slot->Nbatches];
+        *batch = (vnlog_batch_t){.Ncolumns  = par->batch_template.Ncolumns,
+                                 .Nrows_max = par->batch_template.Nrows_max};
+        batch->columns = calloc(batch->Ncolumns, sizeof(batch->columns[0]));
+        if(batch->columns == NULL)
+        {
+            MSG("Couldn't allocate batch columns");
+            ok = false;
+            break;
+        }
+        for(int i=0; i<batch->Ncolumns; i++)
+        {
+            batch->columns[i].column = par->batch_template.columns[i].column;
+            batch->columns[i].type   = par->batch_template.columns[i].type;
+        }
+
+        const vnlog_parser_result_t result = vnlog_parser_read_batch(&chunk, NULL, batch);
+        if(result != VNL_OK)
+        {
+            vnlog_batch_free(batch);
+            ok = (result == VNL_EOF);
+            break;
+        }
+        slot->Nbatches++;
+    }
+
+    vnlog_parser_free(&chunk);
+    return ok;
+}
+
+static void* parallel_thread(void* arg)
+{
+    parallel_t* par = (parallel_t*)arg;
+
+    while(true)
+    {
+        pthread_mutex_lock(&par->mutex);
+        while(!par->stop &&
+              par->i_chunk_next < par->Nchunks &&
+              par->i_chunk_next >= par->i_chunk_read + par->Nslots)
+            pthread_cond_wait(&par->cond_room, &par->mutex);
+        if(par->stop || par->i_chunk_next >= par->Nchunks)
+        {
+            pthread_mutex_unlock(&par->mutex);
+            break;
+        }
+        const int i_chunk = par->i_chunk_next++;
+        parallel_slot_t* slot = &par->slots[i_chunk % par->Nslots];
+        *slot = (parallel_slot_t){.i_chunk = i_chunk};
+        pthread_mutex_unlock(&par->mutex);
+
+        const bool ok = parallel_parse_chunk(par, slot);
+
+        pthread_mutex_lock(&par->mutex);
+        slot->done   = true;
+        slot->failed = !ok;
+        pthread_cond_broadcast(&par->cond_done);
+        pthread_mutex_unlock(&par->mutex);
+    }
+    return NULL;
+}
+
+bool vnlog_parser_parallel_init(vnlog_parser_parallel_t* _par, vnlog_parser_t* ctx,
+                                const char* const* keys, const vnlog_batch_type_t* types,
+                                int Ncolumns, int Nrows_max,
+                                int Nthreads, size_t chunk_size)
+{
+    _par->_internal = NULL;
+
+    parallel_t* par = calloc(1, sizeof(*par));
+    if(par == NULL)
+    {
+        MSG("Couldn't allocate the parallel parser");
+        return false;
+    }
+    par->ctx = ctx;
+
+    if(!vnlog_batch_init(&par->batch_template, ctx, keys, types, Ncolumns, Nrows_max))
+    {
+        free(par);
+        return false;
+    }
+
+    par->boundaries = parallel_take_chunks(&par->Nchunks, ctx, chunk_size);
+    if(par->boundaries == NULL)
+    {
+        vnlog_batch_free(&par->batch_template);
+        free(par);
+        return false;
+    }
+
+    par->Nthreads = default_Nthreads(Nthreads);
+    par->Nslots   = 2*par->Nthreads;
+    par->threads  = calloc(par->Nthreads, sizeof(par->threads[0]));
+    par->slots    = calloc(par->Nslots,   sizeof(par->slots[0]));
+    if(par->threads == NULL || par->slots == NULL)
+    {
+        MSG("Couldn't allocate the parallel parser");
+        free(par->threads);
+        free(par->slots);
+        free(par->boundaries);
+        vnlog_batch_free(&par->batch_template);
+        free(par);
+        return false;
+    }
+    for(int i=0; i<par->Nslots; i++)
+        par->slots[i].i_chunk = -1;
+
+    pthread_mutex_init(&par->mutex,     NULL);
+    pthread_cond_init (&par->cond_done, NULL);
+    pthread_cond_init (&par->cond_room, NULL);
+
+    _par->_internal = par;
+    for(int i=0; i<par->Nthreads; i++)
+        if(0 != pthread_create(&par->threads[i], NULL, parallel_thread, par))
+        {
+            MSG("Couldn't start a worker thread");
+            par->Nthreads = i;
+            vnlog_parser_parallel_free(_par);
+            return false;
+        }
+    return true;
+}
+
+vnlog_parser_result_t vnlog_parser_parallel_read_batch(vnlog_parser_parallel_t* _par,
+                                                       const vnlog_batch_t** batch)
+{
+    parallel_t* par = (parallel_t*)_par->_internal;
+
+    while(true)
+    {
+        // i_chunk_read is only changed here, so I can look at it without the
+        // mutex
+        if(par->i_chunk_read >= par->Nchunks)
+            return VNL_EOF;
+
+        parallel_slot_t* slot = &par->slots[par->i_chunk_read % par->Nslots];
+        pthread_mutex_lock(&par->mutex);
+        while(!(slot->done && slot->i_chunk == par->i_chunk_read))
+            pthread_cond_wait(&par->cond_done, &par->mutex);
+        pthread_mutex_unlock(&par->mutex);
+
+        if(slot->failed)
+            return VNL_ERROR;
+        if(par->i_batch_read < slot->Nbatches)
+        {
+            *batch = &slot->batches[par->i_batch_read++];
+            return VNL_OK;
+        }
+
+        // Done with this chunk. Let the workers have its slot
+        slot_free_batches(slot);
+        par->i_batch_read = 0;
+        pthread_mutex_lock(&par->mutex);
+        slot->done = false;
+        par->i_chunk_read++;
+        pthread_cond_broadcast(&par->cond_room);
+        pthread_mutex_unlock(&par->mutex);
+    }
+}
+
+void vnlog_parser_parallel_free(vnlog_parser_parallel_t* _par)
+{
+    parallel_t* par = (parallel_t*)_par->_internal;
+    if(par == NULL)
+        return;
+
+    pthread_mutex_lock(&par->mutex);
+    par->stop = true;
+    pthread_cond_broadcast(&par->cond_room);
+    pthread_mutex_unlock(&par->mutex);
+    for(int i=0; i<par->Nthreads; i++)
+        pthread_join(par->threads[i], NULL);
 
-    return (const char*const*)&(*keyvalue)->value;
+    for(int i=0; i<par->Nslots; i++)
+        slot_free_batches(&par->slots[i]);
+    pthread_mutex_destroy(&par->mutex);
+    pthread_cond_destroy(&par->cond_done);
+    pthread_cond_destroy(&par->cond_room);
+    free(par->threads);
+    free(par->slots);
+    free(par->boundaries);
+    vnlog_batch_free(&par->batch_template);
+    free(par);
+    _par->_internal = NULL;
 }
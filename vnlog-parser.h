@@ -1,11 +1,23 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
 typedef struct
 {
     char* key;
     char* value;
 } vnlog_keyvalue_t;
 
+// One field of the most-recently-parsed row: len bytes at data. NOT
+// '\0'-terminated
+typedef struct
+{
+    const char* data;
+    int         len;
+} vnlog_parser_field_t;
+
 typedef struct
 {
     int               Ncolumns;
@@ -19,18 +31,258 @@ typedef struct
 
 } vnlog_parser_t;
 
+// VNL_AGAIN is only returned in follow mode: see vnlog_parser_init_follow()
 typedef enum
 {
-    VNL_OK, VNL_EOF, VNL_ERROR
+    VNL_OK, VNL_EOF, VNL_ERROR, VNL_AGAIN
 } vnlog_parser_result_t;
 
 vnlog_parser_result_t vnlog_parser_init(vnlog_parser_t* ctx, FILE* fp);
 
+// Reads the file by mapping it into memory instead of through a FILE. Pass
+// fp=NULL to vnlog_parser_read_record(). vnlog_parser_fields() then points
+// straight into the mapping, so nothing is copied per row. If want_strings,
+// ctx->record[].value and vnlog_parser_record_from_key() work as with
+// vnlog_parser_init(), at the cost of a copy of each row. If !want_strings, the
+// values are NULL, and only vnlog_parser_fields() should be used
+vnlog_parser_result_t vnlog_parser_init_mmap(vnlog_parser_t* ctx,
+                                             const char* filename,
+                                             bool want_strings);
+
+// Follow mode: reads a file that's still being written, like "tail -f". Pass
+// fp=NULL to vnlog_parser_read_record(). When it gets to the end of what has
+// been written so far, vnlog_parser_read_record() returns VNL_AGAIN instead of
+// VNL_EOF. A partial last line stays buffered until the rest of it arrives.
+// Then wait for more with vnlog_parser_follow_wait(), or poll
+// vnlog_parser_follow_fd() in an external event loop, and call
+// vnlog_parser_read_record() again. The record strings are always available.
+//
+// If the file is truncated, it's read again from the start. If the file is
+// replaced (a log rotation: the path now points to a different file), the rest
+// of the old file is read, and then the new file, from the start. A partial
+// last line of the old file is thrown away. The new file must have the same
+// legend as the old one, or vnlog_parser_read_record() fails.
+//
+// This returns VNL_AGAIN if the file doesn't have a legend yet. The parser is
+// usable then: the first vnlog_parser_read_record() reads the legend first,
+// and ctx->Ncolumns and ctx->record are set when it stops returning VNL_AGAIN.
+// vnlog_parser_free() must be called in either case
+vnlog_parser_result_t vnlog_parser_init_follow(vnlog_parser_t* ctx,
+                                               const char* filename);
+
+// Blocks until the followed file (or its directory) changes, or until
+// timeout_ms milliseconds pass (forever if < 0). Returns VNL_OK if something
+// changed, VNL_AGAIN on timeout, VNL_ERROR on error. Uses inotify. Without it,
+// this just sleeps a bit
+vnlog_parser_result_t vnlog_parser_follow_wait(vnlog_parser_t* ctx, int timeout_ms);
+
+// A file descriptor that becomes readable when the followed file may have
+// changed, to be watched by an external epoll() or poll() loop. Each
+// vnlog_parser_read_record() returning VNL_AGAIN clears it. <0 if inotify
+// isn't available; poll on a timer then
+int vnlog_parser_follow_fd(const vnlog_parser_t* ctx);
+
 // Call vnlog_parser_free() when done. Even if vnlog_parser_read_record() failed
 void vnlog_parser_free(vnlog_parser_t* ctx);
 
 vnlog_parser_result_t vnlog_parser_read_record(vnlog_parser_t* ctx, FILE* fp);
 
+// The Ncolumns fields of the most-recently-parsed row. These are overwritten by
+// the next vnlog_parser_read_record(). With vnlog_parser_init_mmap() the data
+// they point to stays valid until vnlog_parser_free()
+const vnlog_parser_field_t* vnlog_parser_fields(const vnlog_parser_t* ctx);
+
+// Positions in the file, for random access with an index (vnlog-index.h).
+// vnlog_parser_tell() is the offset where the next line starts.
+// vnlog_parser_record_offset() is the offset of the first field of the
+// most-recently-parsed row: reading from there gets that row again.
+// vnlog_parser_seek() continues reading from the given offset, which must be
+// the start of a line, or of a row's first field. The legend stays. Pass the fp
+// given to vnlog_parser_read_record(). In a mapped file this just moves the
+// parser. Otherwise, it fseeko()s the FILE. vnlog_parser_record_offset() is
+// only available in a mapped file. Not available in follow mode. These return
+// <0 or false on error
+int64_t vnlog_parser_tell         (const vnlog_parser_t* ctx, FILE* fp);
+int64_t vnlog_parser_record_offset(const vnlog_parser_t* ctx);
+bool    vnlog_parser_seek         (vnlog_parser_t* ctx, FILE* fp, int64_t offset);
+
+// In a mapped file, stops the parsing at the given offset: the data past it is
+// ignored, as if the file ended there. This is for logs that are still being
+// written: their last line may be unfinished. The offset must be between
+// vnlog_parser_tell() and the end of the file. Only available in a mapped file.
+// Returns false on error
+bool    vnlog_parser_set_end      (vnlog_parser_t* ctx, int64_t end);
+
+// A column, looked up by its key once, after the legend has been read:
+//
+//   vnlog_parser_column_t col_x = vnlog_parser_column(&ctx, "x");
+//   while(VNL_OK == vnlog_parser_read_record(&ctx, fp))
+//   {
+//       double x;
+//       if(!vnlog_parser_get_double(&ctx, col_x, &x)) ... not a number ...
+//   }
+//
+// The accessors read the current row straight from vnlog_parser_fields(), so
+// they work in every mode, including vnlog_parser_init_mmap() without strings.
+// The numbers are parsed with vnlog-parse-number.h
+typedef int vnlog_parser_column_t;
+
+// The column with the given key, or <0 if there isn't one
+vnlog_parser_column_t vnlog_parser_column(vnlog_parser_t* ctx, const char* key);
+
+// Is the field in this column of the most-recently-parsed row null ("-")?
+bool vnlog_parser_is_null(const vnlog_parser_t* ctx, vnlog_parser_column_t column);
+
+// The field in this column of the most-recently-parsed row, as a number.
+// Returns false if the field isn't a valid number of that type. Null fields
+// are NaN doubles, but aren't valid integers: check vnlog_parser_is_null()
+bool vnlog_parser_get_double(const vnlog_parser_t* ctx, vnlog_parser_column_t column, double*  x);
+bool vnlog_parser_get_int64 (const vnlog_parser_t* ctx, vnlog_parser_column_t column, int64_t* x);
+
+// Projection: only the given columns are needed from now on. The parser then
+// stops splitting each line after the last of them, and only finds the end of
+// the line. The other columns are NOT available: their ctx->record[].value
+// are NULL, and their vnlog_parser_fields() and typed accessors are invalid.
+// If validate, the parser still counts all the fields of each line, and
+// complains if there are too many or too few, as it does without a projection.
+// If !validate, the parser only complains if a line is too short to hold the
+// needed columns. Call this after vnlog_parser_init(). columns=NULL goes back
+// to reading all the columns. Returns false if a column doesn't exist
+bool vnlog_parser_set_projection(vnlog_parser_t* ctx,
+                                 const vnlog_parser_column_t* columns, int Ncolumns,
+                                 bool validate);
+
+// Columnar batches: many rows parsed at once into a contiguous typed array per
+// selected column, for loops over whole columns:
+//
+//   const char*        keys [] = {"x", "n"};
+//   vnlog_batch_type_t types[] = {VNLOG_BATCH_DOUBLE, VNLOG_BATCH_INT64};
+//   vnlog_batch_t batch;
+//   if(!vnlog_batch_init(&batch, &ctx, keys, types, 2, 4096)) ...
+//   while(VNL_OK == vnlog_parser_read_batch(&ctx, fp, &batch))
+//   {
+//       const double* x = batch.columns[0].values;
+//       for(int i=0; i<batch.Nrows; i++) ... x[i] ...
+//   }
+//   vnlog_batch_free(&batch);
+//
+// Null fields ("-") have their bit set in the column's null bitmap (bit i%8 of
+// null[i/8] for row i), and are NaN (doubles) or 0 (integers) in the values. A
+// field that isn't a valid number of its column's type is an error
+typedef enum
+{
+    VNLOG_BATCH_DOUBLE, // values is a double[]
+    VNLOG_BATCH_INT64   // values is an int64_t[]
+} vnlog_batch_type_t;
+
+typedef struct
+{
+    vnlog_parser_column_t column;
+    vnlog_batch_type_t    type;
+
+    // Nrows_max values, and (Nrows_max+7)/8 bytes of null bitmap. To use your
+    // own buffers, set these after vnlog_batch_init(), before the first
+    // vnlog_parser_read_batch(). Whatever is still NULL then is allocated by
+    // the parser, and freed by vnlog_batch_free()
+    void*    values;
+    uint8_t* null;
+
+    // internal
+    bool _own_values, _own_null;
+} vnlog_batch_column_t;
+
+typedef struct
+{
+    int                   Ncolumns;
+    vnlog_batch_column_t* columns;
+
+    int Nrows_max; // The capacity of each column
+    int Nrows;     // How many rows the last vnlog_parser_read_batch() read
+} vnlog_batch_t;
+
+// Sets up a batch of up to Nrows_max rows of the columns with the given keys.
+// Returns false if a key doesn't exist, or an allocation failed
+bool vnlog_batch_init(vnlog_batch_t* batch, vnlog_parser_t* ctx,
+                      const char* const* keys, const vnlog_batch_type_t* types,
+                      int Ncolumns, int Nrows_max);
+void vnlog_batch_free(vnlog_batch_t* batch);
+
+// Reads up to batch->Nrows_max rows into the batch, setting batch->Nrows.
+// Returns VNL_OK if any rows were read, VNL_EOF if there were no more rows. In
+// follow mode, a batch ends early at the end of what's been written so far,
+// and VNL_AGAIN means that no rows were available
+vnlog_parser_result_t vnlog_parser_read_batch(vnlog_parser_t* ctx, FILE* fp,
+                                              vnlog_batch_t* batch);
+
+// Parallel parsing of a mapped file. The rest of the file of a parser from
+// vnlog_parser_init_mmap() (not follow mode) is split into chunks of about chunk_size bytes at
+// line boundaries, and the chunks are parsed by Nthreads worker threads. Each
+// chunk gets its own parser: it has the legend, the projection and the
+// want_strings of ctx, and reads only the lines of its chunk. The chunk
+// parsers work like ctx: read them with vnlog_parser_read_record(chunk, NULL),
+// the typed accessors or vnlog_parser_read_batch(), and look up columns in them
+// or in ctx. Comments are skipped in each chunk as they are in the whole file.
+// Afterwards ctx is at the end of the file. Nthreads <= 0 uses one thread per
+// CPU. chunk_size == 0 picks a default
+//
+// vnlog_parser_parallel_foreach() calls cb(chunk, i_chunk, cookie) once for
+// each chunk, in the worker threads, in no particular order. i_chunk counts
+// the chunks from 0, in file order. The chunk parser is freed when cb returns.
+// If cb returns false, the chunks that haven't started yet are skipped, and
+// this returns VNL_ERROR. Otherwise it returns VNL_OK
+typedef bool (*vnlog_parser_chunk_cb_t)(vnlog_parser_t* chunk, int i_chunk, void* cookie);
+vnlog_parser_result_t vnlog_parser_parallel_foreach(vnlog_parser_t* ctx,
+                                                    int Nthreads, size_t chunk_size,
+                                                    vnlog_parser_chunk_cb_t cb, void* cookie);
+
+// vnlog_parser_parallel_init() starts the workers reading the chunks into
+// batches of the given columns, as vnlog_batch_init() would set them up, and
+// vnlog_parser_parallel_read_batch() returns these batches in file order:
+//
+//   vnlog_parser_parallel_t par;
+//   if(!vnlog_parser_parallel_init(&par, &ctx, keys, types, 2, 4096, 0, 0)) ...
+//   const vnlog_batch_t* batch;
+//   while(VNL_OK == vnlog_parser_parallel_read_batch(&par, &batch))
+//       ... batch->Nrows rows ...
+//   vnlog_parser_parallel_free(&par);
+//
+// A batch doesn't span chunks, so batches in the middle of the file may have
+// fewer than Nrows_max rows. Each batch is valid until the next
+// vnlog_parser_parallel_read_batch(). The workers stay at most 2*Nthreads
+// chunks ahead of the reader. A parsing error is reported by the
+// vnlog_parser_parallel_read_batch() that gets to the chunk that has it.
+// vnlog_parser_parallel_free() stops the workers, and must be called before
+// vnlog_parser_free(ctx)
+typedef struct
+{
+    void* _internal;
+} vnlog_parser_parallel_t;
+
+bool vnlog_parser_parallel_init(vnlog_parser_parallel_t* par, vnlog_parser_t* ctx,
+                                const char* const* keys, const vnlog_batch_type_t* types,
+                                int Ncolumns, int Nrows_max,
+                                int Nthreads, size_t chunk_size);
+vnlog_parser_result_t vnlog_parser_parallel_read_batch(vnlog_parser_parallel_t* par,
+                                                       const vnlog_batch_t** batch);
+void vnlog_parser_parallel_free(vnlog_parser_parallel_t* par);
+
+// The parser splits each line into fields using a SIMD scanner: the fastest
+// one the CPU supports. _vnlog_parser_set_impl() selects a specific
+// implementation instead, for testing and benchmarking. It applies to the
+// parsers initialized afterwards. Selecting an implementation that isn't
+// available (check with _vnlog_parser_impl_available()) crashes the program
+typedef enum
+{
+    VNLOG_PARSER_SCALAR,
+    VNLOG_PARSER_SSE42,
+    VNLOG_PARSER_AVX2,
+    VNLOG_PARSER_N_IMPLS
+} vnlog_parser_impl_t;
+
+bool        _vnlog_parser_impl_available(vnlog_parser_impl_t impl);
+const char* _vnlog_parser_impl_name     (vnlog_parser_impl_t impl);
+void        _vnlog_parser_set_impl      (vnlog_parser_impl_t impl);
+
 // pointer to the pointer to the string for the record corresponding to the
 // given key in the most-recently-parsed row. NULL if the given key isn't found
 const char*const* vnlog_parser_record_from_key(vnlog_parser_t* ctx, const char* key);
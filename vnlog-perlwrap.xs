@@ -0,0 +1,531 @@
+// The compiled part of Vnlog::Parser. lib/Vnlog/Parser.pm uses this if it's
+// built, and falls back to its pure-perl implementation otherwise.
+//
+// parse() and getValuesHash() are given one line at a time by the caller, so
+// they split the line right here, with the rules of the pure-perl parse().
+// readColumns() reads a perl filehandle with the C parser (vnlog-parser.c),
+// through a FILE made by fopencookie(), and returns whole columns at a time.
+// The state of the parser object lives in the same hash the pure-perl
+// implementation uses, so both implementations work on the same objects
+
+#define PERL_NO_GET_CONTEXT
+#include "EXTERN.h"
+#include "perl.h"
+#include "XSUB.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "vnlog-parser.h"
+
+// The whitespace that perl's split(' ') splits on
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+static const char* skip_space(const char* s, const char* end)
+{
+    while(s < end && is_space(*s))
+        s++;
+    return s;
+}
+
+static const char* skip_nonspace(const char* s, const char* end)
+{
+    while(s < end && !is_space(*s))
+        s++;
+    return s;
+}
+
+// The whitespace-separated tokens of s, as a new array
+static AV* split_tokens(pTHX_ const char* s, const char* end, bool utf8, bool nulls)
+{
+    AV* av = newAV();
+    while(true)
+    {
+        s = skip_space(s, end);
+        if(s == end)
+            return av;
+        const char* token = s;
+        s = skip_nonspace(s, end);
+
+        if(nulls && s - token == 1 && token[0] == '-')
+            av_push(av, newSV(0));
+        else
+            av_push(av, newSVpvn_flags(token, s - token, utf8 ? SVf_UTF8 : 0));
+    }
+}
+
+static AV* get_keys(pTHX_ HV* hv)
+{
+    SV** keys = hv_fetchs(hv, "keys", 0);
+    if(keys == NULL || !SvROK(*keys) || SvTYPE(SvRV(*keys)) != SVt_PVAV)
+        return NULL;
+    return (AV*)SvRV(*keys);
+}
+
+// "# key0 key1 ...", for the error messages and for the readers
+static SV* legend_line(pTHX_ AV* keys)
+{
+    SV* legend = newSVpvs("#");
+    for(SSize_t i=0; i<=av_len(keys); i++)
+    {
+        SV** key = av_fetch(keys, i, 0);
+        sv_catpvs(legend, " ");
+        if(key != NULL)
+            sv_catsv(legend, *key);
+    }
+    return legend;
+}
+
+
+
+////////////////// Readers
+
+// How much I ask the perl filehandle for at a time
+#define READ_SIZE 65536
+
+// The C parser used by readColumns(). It reads a perl filehandle through a
+// FILE made by fopencookie(). If the legend was already read by parse(), the
+// parser gets a copy of it before the data. This lives in the parser object
+// as a Vnlog::Parser::_Reader
+typedef struct
+{
+    SV*                    fh; // A reference, to keep io open
+    PerlIO*                io;
+    bool                   utf8;
+
+    SV*                    legend;
+    STRLEN                 legend_offset;
+
+    FILE*                  fp;
+    bool                   have_ctx;
+    vnlog_parser_t         ctx;
+    // The parser is done: the end of the file was reached, or there was an
+    // error
+    bool                   done;
+    bool                   failed;
+
+    // The columns being read
+    int                    Ncolumns;
+    vnlog_parser_column_t* columns;
+} reader_t;
+
+static ssize_t reader_cookie_read(void* cookie, char* buf, size_t size)
+{
+    dTHX;
+    reader_t* reader = (reader_t*)cookie;
+
+    if(reader->legend != NULL)
+    {
+        STRLEN      len;
+        const char* legend = SvPV(reader->legend, len);
+        if(reader->legend_offset < len)
+        {
+            size_t N = len - reader->legend_offset;
+            if(N > size)
+                N = size;
+            memcpy(buf, &legend[reader->legend_offset], N);
+            reader->legend_offset += N;
+            return (ssize_t)N;
+        }
+    }
+
+    if(size > READ_SIZE)
+        size = READ_SIZE;
+    SSize_t N = PerlIO_read(reader->io, buf, size);
+    return N < 0 ? -1 : (ssize_t)N;
+}
+
+static void reader_free(pTHX_ reader_t* reader)
+{
+    if(reader->have_ctx)
+        vnlog_parser_free(&reader->ctx);
+    if(reader->fp != NULL)
+        fclose(reader->fp);
+    SvREFCNT_dec(reader->fh);
+    SvREFCNT_dec(reader->legend);
+    free(reader->columns);
+    free(reader);
+}
+
+static reader_t* reader_new(pTHX_ SV* fh, PerlIO* io, AV* keys)
+{
+    reader_t* reader = (reader_t*)calloc(1, sizeof(reader_t));
+    if(reader == NULL)
+        croak("Couldn't allocate the reader");
+    reader->fh   = newSVsv(fh);
+    reader->io   = io;
+    reader->utf8 = PerlIO_isutf8(io);
+    if(keys != NULL)
+    {
+        reader->legend = legend_line(aTHX_ keys);
+        sv_catpvs(reader->legend, "\n");
+        if(SvUTF8(reader->legend) && !reader->utf8)
+            sv_utf8_downgrade(reader->legend, true);
+    }
+
+    reader->fp = fopencookie(reader, "r",
+                             (cookie_io_functions_t){.read = reader_cookie_read});
+    if(reader->fp == NULL)
+    {
+        reader_free(aTHX_ reader);
+        croak("fopencookie() failed");
+    }
+    return reader;
+}
+
+// The reader in this parser object for this filehandle. A new one is created
+// if there isn't one yet, or if the object was reading a different filehandle
+static reader_t* get_reader(pTHX_ HV* hv, SV* fh)
+{
+    IO*     sv_io = sv_2io(fh);
+    PerlIO* io    = IoIFP(sv_io);
+    if(io == NULL)
+        croak("readColumns(): the filehandle isn't open for reading");
+
+    SV** slot = hv_fetchs(hv, "_reader", 0);
+    if(slot != NULL && SvROK(*slot) && sv_derived_from(*slot, "Vnlog::Parser::_Reader"))
+    {
+        reader_t* reader = INT2PTR(reader_t*, SvIV(SvRV(*slot)));
+        if(reader->io == io)
+            return reader;
+    }
+
+    reader_t* reader = reader_new(aTHX_ fh, io, get_keys(aTHX_ hv));
+    SV* ref = newSV(0);
+    sv_setref_pv(ref, "Vnlog::Parser::_Reader", reader);
+    hv_stores(hv, "_reader", ref);
+    return reader;
+}
+
+// Reads the legend if this is a new reader, and selects the columns given in
+// the arrayref columns, or all of them if columns is undef. Sets keys in the
+// parser object. Returns VNL_OK, VNL_EOF if there's no legend, or VNL_ERROR
+static vnlog_parser_result_t reader_start(pTHX_ reader_t* reader, HV* hv, SV* columns,
+                                          SV* error)
+{
+    if(!reader->have_ctx)
+    {
+        vnlog_parser_result_t result = vnlog_parser_init(&reader->ctx, reader->fp);
+        if(result != VNL_OK)
+        {
+            if(result == VNL_ERROR)
+                sv_setpvs(error, "Couldn't read the legend");
+            return result;
+        }
+        reader->have_ctx = true;
+
+        if(get_keys(aTHX_ hv) == NULL)
+        {
+            AV* keys = newAV();
+            for(int i=0; i<reader->ctx.Ncolumns; i++)
+                av_push(keys, newSVpvn_flags(reader->ctx.record[i].key,
+                                             strlen(reader->ctx.record[i].key),
+                                             reader->utf8 ? SVf_UTF8 : 0));
+            hv_stores(hv, "keys", newRV_noinc((SV*)keys));
+        }
+    }
+
+    // The columns. A column given by key is the last one with that key, as
+    // with getValuesHash()
+    const int Ncolumns_all = reader->ctx.Ncolumns;
+    AV* av_columns = NULL;
+    int Ncolumns   = Ncolumns_all;
+    if(SvOK(columns))
+    {
+        if(!SvROK(columns) || SvTYPE(SvRV(columns)) != SVt_PVAV)
+            croak("readColumns(): the columns must be given in an arrayref");
+        av_columns = (AV*)SvRV(columns);
+        Ncolumns   = (int)(av_len(av_columns) + 1);
+    }
+
+    vnlog_parser_column_t* icols = (vnlog_parser_column_t*)malloc((Ncolumns > 0 ? Ncolumns : 1) *
+                                                                  sizeof(icols[0]));
+    if(icols == NULL)
+        croak("Couldn't allocate the columns");
+    for(int i=0; i<Ncolumns; i++)
+    {
+        if(av_columns == NULL)
+        {
+            icols[i] = i;
+            continue;
+        }
+
+        SV**        key_sv = av_fetch(av_columns, i, 0);
+        const char* key    =
+            key_sv == NULL ? "" :
+            reader->utf8   ? SvPVutf8_nolen(*key_sv) :
+                             SvPV_nolen(*key_sv);
+        icols[i] = -1;
+        for(int j=Ncolumns_all-1; j>=0; j--)
+            if(0 == strcmp(key, reader->ctx.record[j].key))
+            {
+                icols[i] = j;
+                break;
+            }
+        if(icols[i] < 0)
+        {
+            sv_setpvf(error, "Unknown column '%s'", key);
+            free(icols);
+            return VNL_ERROR;
+        }
+    }
+
+    if(Ncolumns == reader->Ncolumns && reader->columns != NULL &&
+       0 == memcmp(icols, reader->columns, Ncolumns * sizeof(icols[0])))
+    {
+        free(icols);
+        return VNL_OK;
+    }
+
+    free(reader->columns);
+    reader->columns  = icols;
+    reader->Ncolumns = Ncolumns;
+    // I only need the fields I'm returning, but the whole line is still
+    // validated, as parse() does
+    if(!vnlog_parser_set_projection(&reader->ctx,
+                                    av_columns == NULL ? NULL : icols, Ncolumns,
+                                    true))
+    {
+        sv_setpvs(error, "Couldn't select the columns");
+        return VNL_ERROR;
+    }
+    return VNL_OK;
+}
+
+
+
+MODULE = Vnlog::Parser		PACKAGE = Vnlog::Parser
+
+PROTOTYPES: DISABLE
+
+void
+_parse_xs(this, line)
+    SV* this
+    SV* line
+  PREINIT:
+    HV*         hv;
+    STRLEN      len;
+    const char* s;
+    const char* end;
+    bool        utf8;
+    AV*         keys;
+  PPCODE:
+    hv   = (HV*)SvRV(this);
+    s    = SvPV(line, len);
+    end  = s + len;
+    utf8 = SvUTF8(line);
+
+    // I reset the data first
+    hv_stores(hv, "values",      newSV(0));
+    hv_stores(hv, "values_hash", newSV(0));
+
+    const char* p = skip_space(s, end);
+    if(p == end)
+        // empty line. No data, no error
+        XSRETURN_IV(1);
+
+    if(*p == '#')
+    {
+        // hard comment or legend or comment. No data, no error
+        p++;
+        if(p < end && (*p == '#' || *p == '!'))
+            XSRETURN_IV(1);
+        p = skip_space(p, end);
+        if(p == end)
+            XSRETURN_IV(1);
+        if(get_keys(aTHX_ hv) == NULL)
+            hv_stores(hv, "keys", newRV_noinc((SV*)split_tokens(aTHX_ p, end, utf8, false)));
+        XSRETURN_IV(1);
+    }
+
+    keys = get_keys(aTHX_ hv);
+    if(keys == NULL)
+    {
+        // Not comment, not empty line, but no legend yet. Barf
+        hv_stores(hv, "error", newSVpvs("Got dataline before legend"));
+        XSRETURN_UNDEF;
+    }
+
+    AV* values = split_tokens(aTHX_ p, end, utf8, true);
+    hv_stores(hv, "values", newRV_noinc((SV*)values));
+    if(av_len(keys) != av_len(values))
+    {
+        // mismatched key/value counts
+        SV* legend = sv_2mortal(legend_line(aTHX_ keys));
+        hv_stores(hv, "error",
+                  newSVpvf("Legend line \"%" SVf "\" has %d elements, but data line \"%" SVf "\" has %d elements. Counts must match!",
+                           SVfARG(legend), (int)(av_len(keys) + 1),
+                           SVfARG(line),   (int)(av_len(values) + 1)));
+        XSRETURN_UNDEF;
+    }
+    XSRETURN_IV(1);
+
+void
+_splitFields_xs(line)
+    SV* line
+  PREINIT:
+    STRLEN      len;
+    const char* s;
+    const char* end;
+    U32         flags;
+  PPCODE:
+    s     = SvPV(line, len);
+    end   = s + len;
+    flags = SvUTF8(line) ? SVf_UTF8 : 0;
+    while(true)
+    {
+        s = skip_space(s, end);
+        if(s == end)
+            break;
+        const char* token = s;
+        s = skip_nonspace(s, end);
+
+        if(s - token == 1 && token[0] == '-')
+            XPUSHs(&PL_sv_undef);
+        else
+            mXPUSHs(newSVpvn_flags(token, s - token, flags));
+    }
+
+void
+_getValuesHash_xs(this)
+    SV* this
+  PREINIT:
+    HV*  hv;
+    SV** slot;
+    HV*  values_hash;
+    AV*  keys;
+    AV*  values;
+  PPCODE:
+    hv = (HV*)SvRV(this);
+
+    // internally:
+    //   values_hash == undef:  not yet computed
+    //   values_hash == {}:     computed, but no-data
+    // returning: undef if computed, but no-data
+    slot = hv_fetchs(hv, "values_hash", 0);
+    if(slot != NULL && SvROK(*slot))
+    {
+        if(HvUSEDKEYS((HV*)SvRV(*slot)) == 0)
+            XSRETURN_UNDEF;
+        ST(0) = sv_2mortal(newSVsv(*slot));
+        XSRETURN(1);
+    }
+
+    values_hash = newHV();
+    keys        = get_keys(aTHX_ hv);
+    slot        = hv_fetchs(hv, "values", 0);
+    values      = slot != NULL && SvROK(*slot) ? (AV*)SvRV(*slot) : NULL;
+    if(keys != NULL && values != NULL)
+        for(SSize_t i=0; i<=av_len(keys); i++)
+        {
+            SV** key   = av_fetch(keys,   i, 0);
+            SV** value = av_fetch(values, i, 0);
+            if(key != NULL)
+                hv_store_ent(values_hash, *key, value == NULL ? newSV(0) : newSVsv(*value), 0);
+        }
+
+    ST(0) = sv_2mortal(newRV_noinc((SV*)values_hash));
+    hv_stores(hv, "values_hash", newSVsv(ST(0)));
+    XSRETURN(1);
+
+void
+_readColumns_xs(this, fh, Nrows_max, columns)
+    SV* this
+    SV* fh
+    IV  Nrows_max
+    SV* columns
+  PREINIT:
+    HV*       hv;
+    reader_t* reader;
+    SV*       error;
+    HV*       result;
+    AV**      avs;
+    IV        Nrows = 0;
+  PPCODE:
+    hv = (HV*)SvRV(this);
+    hv_stores(hv, "values",      newSV(0));
+    hv_stores(hv, "values_hash", newSV(0));
+    error = newSVpvs("");
+    hv_stores(hv, "error", error);
+
+    reader = get_reader(aTHX_ hv, fh);
+    if(reader->done)
+    {
+        if(reader->failed)
+            sv_setpvs(error, "Error parsing vnlog data");
+        XSRETURN_UNDEF;
+    }
+
+    vnlog_parser_result_t result_start = reader_start(aTHX_ reader, hv, columns, error);
+    if(result_start != VNL_OK)
+    {
+        reader->done   = true;
+        reader->failed = result_start == VNL_ERROR;
+        XSRETURN_UNDEF;
+    }
+
+    const int Ncolumns = reader->Ncolumns;
+    avs = (AV**)alloca((Ncolumns > 0 ? Ncolumns : 1) * sizeof(avs[0]));
+    for(int i=0; i<Ncolumns; i++)
+    {
+        avs[i] = (AV*)sv_2mortal((SV*)newAV());
+        if(Nrows_max > 0)
+            av_extend(avs[i], Nrows_max < 4096 ? Nrows_max - 1 : 4095);
+    }
+
+    while(Nrows_max <= 0 || Nrows < Nrows_max)
+    {
+        vnlog_parser_result_t result_read = vnlog_parser_read_record(&reader->ctx, reader->fp);
+        if(result_read == VNL_EOF)
+        {
+            reader->done = true;
+            break;
+        }
+        if(result_read != VNL_OK)
+        {
+            reader->done   = true;
+            reader->failed = true;
+            sv_setpvs(error, "Error parsing vnlog data");
+            XSRETURN_UNDEF;
+        }
+
+        const vnlog_parser_field_t* fields = vnlog_parser_fields(&reader->ctx);
+        for(int i=0; i<Ncolumns; i++)
+        {
+            const vnlog_parser_field_t* field = &fields[reader->columns[i]];
+            if(field->len == 1 && field->data[0] == '-')
+                av_push(avs[i], newSV(0));
+            else
+                av_push(avs[i], newSVpvn_flags(field->data, field->len,
+                                               reader->utf8 ? SVf_UTF8 : 0));
+        }
+        Nrows++;
+    }
+
+    if(Nrows == 0)
+        XSRETURN_UNDEF;
+
+    // With duplicated keys, the last column wins, as in getValuesHash()
+    result = (HV*)sv_2mortal((SV*)newHV());
+    for(int i=0; i<Ncolumns; i++)
+    {
+        const char* key = reader->ctx.record[reader->columns[i]].key;
+        hv_store(result, key, reader->utf8 ? -(I32)strlen(key) : (I32)strlen(key),
+                 newRV_inc((SV*)avs[i]), 0);
+    }
+    ST(0) = sv_2mortal(newRV_inc((SV*)result));
+    XSRETURN(1);
+
+
+MODULE = Vnlog::Parser		PACKAGE = Vnlog::Parser::_Reader
+
+void
+DESTROY(self)
+    SV* self
+  CODE:
+    reader_free(aTHX_ INT2PTR(reader_t*, SvIV(SvRV(self))));
@@ -0,0 +1,786 @@
+// The _vnlog Python extension module: the fast paths of vnlog.slurp() and
+// vnlog.batches(). slurp() parses a mapped vnlog file with the C parser, in
+// parallel, and writes the rows straight into the memory layout of the numpy
+// array that vnlog.py constructs. batch_reader() reads columnar batches from a
+// python file object. numpy itself isn't used here: the results are bytearrays
+// that vnlog.py wraps with numpy.frombuffer()
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "vnlog-parser.h"
+#include "vnlog-parse-number.h"
+
+// One value in an output row: the vnlog column it comes from, and where and how
+// it is stored. The kind is numpy's dtype.kind:
+//   'f': a float32 or float64. Nulls ("-") are NaN
+//   'i': a signed integer of 1,2,4,8 bytes. Nulls are an error
+//   'u': an unsigned integer of 1,2,4,8 bytes. Nulls are an error
+//   'S': bytes, truncated or zero-padded to itemsize
+//   'U': UCS4 text, truncated or zero-padded to itemsize/4 characters
+typedef struct
+{
+    int  column;
+    int  offset;
+    char kind;
+    int  itemsize;
+} field_t;
+
+// The rows of one chunk of the file
+typedef struct
+{
+    char*  data;
+    size_t Nrows, Nrows_allocated;
+    char   error[256];
+} chunk_rows_t;
+
+typedef struct
+{
+    const field_t*      fields;
+    int                 Nfields;
+    int                 rowsize;
+    const char* const*  keys;
+
+    pthread_mutex_t     mutex;
+    chunk_rows_t*       chunks;
+    int                 Nchunks;
+} slurp_t;
+
+
+static bool parse_uint64(const char* s, int len, uint64_t* x)
+{
+    int i = 0;
+    if(len > 0 && s[0] == '+')
+        i++;
+    if(i == len)
+        return false;
+
+    *x = 0;
+    for(; i<len; i++)
+    {
+        if(s[i] < '0' || s[i] > '9')
+            return false;
+        const uint64_t digit = s[i] - '0';
+        if(*x > (UINT64_MAX - digit) / 10)
+            return false;
+        *x = *x*10 + digit;
+    }
+    return true;
+}
+
+// UTF-8 to UCS4, truncated to Nchars_max. Returns false on invalid UTF-8
+static bool decode_utf8(uint32_t* out, int Nchars_max, const char* s, int len)
+{
+    const uint8_t* p   = (const uint8_t*)s;
+    const uint8_t* end = p + len;
+    for(int i=0; i<Nchars_max && p < end; i++)
+    {
+        uint32_t c;
+        int      Ncontinuation;
+        if     (*p < 0x80)          { c = *p;        Ncontinuation = 0; }
+        else if((*p & 0xE0) == 0xC0) { c = *p & 0x1F; Ncontinuation = 1; }
+        else if((*p & 0xF0) == 0xE0) { c = *p & 0x0F; Ncontinuation = 2; }
+        else if((*p & 0xF8) == 0xF0) { c = *p & 0x07; Ncontinuation = 3; }
+        else return false;
+        p++;
+        if(end - p < Ncontinuation)
+            return false;
+        for(int j=0; j<Ncontinuation; j++, p++)
+        {
+            if((*p & 0xC0) != 0x80)
+                return false;
+            c = (c << 6) | (*p & 0x3F);
+        }
+        out[i] = c;
+    }
+    return true;
+}
+
+static const char* type_name(const field_t* field)
+{
+    switch(field->kind)
+    {
+    case 'f': return field->itemsize == 4 ? "float32" : "float64";
+    case 'i':
+        switch(field->itemsize)
+        {
+        case 1: return "int8";
+        case 2: return "int16";
+        case 4: return "int32";
+        default: return "int64";
+        }
+    case 'u':
+        switch(field->itemsize)
+        {
+        case 1: return "uint8";
+        case 2: return "uint16";
+        case 4: return "uint32";
+        default: return "uint64";
+        }
+    case 'S': return "bytes";
+    default:  return "str";
+    }
+}
+
+// Stores one field of the current row into dst. Returns false if the field
+// can't be represented in this type
+static bool store_field(char* dst, const field_t* field, const vnlog_parser_field_t* f)
+{
+    const bool is_null = f->len == 1 && f->data[0] == '-';
+
+    switch(field->kind)
+    {
+    case 'f':
+        {
+            double x;
+            if(is_null)
+                x = NAN;
+            else if(!vnlog_parse_double(f->data, f->len, &x))
+                return false;
+            if(field->itemsize == 4) { float y = (float)x; memcpy(dst, &y, 4); }
+            else                     memcpy(dst, &x, 8);
+            return true;
+        }
+
+    case 'i':
+        {
+            int64_t x;
+            if(is_null || !vnlog_parse_int64(f->data, f->len, &x))
+                return false;
+            switch(field->itemsize)
+            {
+            case 1: if(x < INT8_MIN  || x > INT8_MAX ) return false; *(int8_t *)dst = (int8_t )x; return true;
+            case 2: if(x < INT16_MIN || x > INT16_MAX) return false; { int16_t y = (int16_t)x; memcpy(dst, &y, 2); } return true;
+            case 4: if(x < INT32_MIN || x > INT32_MAX) return false; { int32_t y = (int32_t)x; memcpy(dst, &y, 4); } return true;
+            default: memcpy(dst, &x, 8); return true;
+            }
+        }
+
+    case 'u':
+        {
+            uint64_t x;
+            if(is_null || !parse_uint64(f->data, f->len, &x))
+                return false;
+            switch(field->itemsize)
+            {
+            case 1: if(x > UINT8_MAX ) return false; *(uint8_t*)dst = (uint8_t)x; return true;
+            case 2: if(x > UINT16_MAX) return false; { uint16_t y = (uint16_t)x; memcpy(dst, &y, 2); } return true;
+            case 4: if(x > UINT32_MAX) return false; { uint32_t y = (uint32_t)x; memcpy(dst, &y, 4); } return true;
+            default: memcpy(dst, &x, 8); return true;
+            }
+        }
+
+    case 'S':
+        memcpy(dst, f->data, f->len < field->itemsize ? f->len : field->itemsize);
+        return true;
+
+    default: // 'U'
+        {
+            const int Nchars_max = field->itemsize / 4;
+            uint32_t  out[Nchars_max > 0 ? Nchars_max : 1];
+            memset(out, 0, sizeof(out));
+            if(!decode_utf8(out, Nchars_max, f->data, f->len))
+                return false;
+            memcpy(dst, out, Nchars_max*4);
+            return true;
+        }
+    }
+}
+
+static bool parse_chunk(vnlog_parser_t* chunk, int i_chunk, void* cookie)
+{
+    slurp_t*     slurp = (slurp_t*)cookie;
+    chunk_rows_t rows  = {};
+
+    vnlog_parser_result_t result;
+    while(VNL_OK == (result = vnlog_parser_read_record(chunk, NULL)))
+    {
+        if(rows.Nrows == rows.Nrows_allocated)
+        {
+            const size_t N = rows.Nrows_allocated ? rows.Nrows_allocated*2 : 1024;
+            char* data = realloc(rows.data, N*slurp->rowsize);
+            if(data == NULL)
+            {
+                snprintf(rows.error, sizeof(rows.error), "Couldn't allocate memory");
+                break;
+            }
+            rows.data            = data;
+            rows.Nrows_allocated = N;
+        }
+
+        char* row = &rows.data[rows.Nrows*slurp->rowsize];
+        memset(row, 0, slurp->rowsize);
+
+        const vnlog_parser_field_t* f = vnlog_parser_fields(chunk);
+        int i;
+        for(i=0; i<slurp->Nfields; i++)
+        {
+            const field_t* field = &slurp->fields[i];
+            if(!store_field(&row[field->offset], field, &f[field->column]))
+            {
+                snprintf(rows.error, sizeof(rows.error),
+                         "Couldn't convert '%.*s' in column '%s' to %s",
+                         f[field->column].len > 64 ? 64 : f[field->column].len,
+                         f[field->column].data,
+                         slurp->keys[field->column],
+                         type_name(field));
+                break;
+            }
+        }
+        if(i != slurp->Nfields)
+            break;
+        rows.Nrows++;
+    }
+    if(result == VNL_ERROR)
+        snprintf(rows.error, sizeof(rows.error), "Couldn't parse the vnlog");
+
+    pthread_mutex_lock(&slurp->mutex);
+    if(i_chunk >= slurp->Nchunks)
+    {
+        int N = slurp->Nchunks ? slurp->Nchunks : 16;
+        while(N <= i_chunk) N *= 2;
+        chunk_rows_t* chunks = realloc(slurp->chunks, N*sizeof(chunks[0]));
+        if(chunks == NULL)
+        {
+            pthread_mutex_unlock(&slurp->mutex);
+            free(rows.data);
+            return false;
+        }
+        memset(&chunks[slurp->Nchunks], 0, (N - slurp->Nchunks)*sizeof(chunks[0]));
+        slurp->chunks  = chunks;
+        slurp->Nchunks = N;
+    }
+    slurp->chunks[i_chunk] = rows;
+    pthread_mutex_unlock(&slurp->mutex);
+
+    return rows.error[0] == '\0';
+}
+
+// Parses the list of (column, offset, kind, itemsize) tuples returned by the
+// layout callback
+static bool parse_layout(field_t** fields, int* Nfields, int* rowsize,
+                         PyObject* layout, int Ncolumns)
+{
+    PyObject* list;
+    if(!PyArg_ParseTuple(layout, "Oi", &list, rowsize))
+        return false;
+    if(!PyList_Check(list) || *rowsize <= 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "layout() must return ([(column,offset,kind,itemsize), ...], rowsize)");
+        return false;
+    }
+
+    *Nfields = (int)PyList_Size(list);
+    *fields  = calloc(*Nfields > 0 ? *Nfields : 1, sizeof((*fields)[0]));
+    if(*fields == NULL)
+    {
+        PyErr_NoMemory();
+        return false;
+    }
+    for(int i=0; i<*Nfields; i++)
+    {
+        field_t* field = &(*fields)[i];
+        int kind;
+        if(!PyArg_ParseTuple(PyList_GET_ITEM(list, i), "iiCi",
+                             &field->column, &field->offset, &kind, &field->itemsize))
+            return false;
+        field->kind = (char)kind;
+
+        const bool valid_size =
+            (field->kind == 'f' && (field->itemsize == 4 || field->itemsize == 8)) ||
+            ((field->kind == 'i' || field->kind == 'u') &&
+             (field->itemsize == 1 || field->itemsize == 2 ||
+              field->itemsize == 4 || field->itemsize == 8)) ||
+            (field->kind == 'S' && field->itemsize > 0) ||
+            (field->kind == 'U' && field->itemsize > 0 && field->itemsize % 4 == 0);
+        if(!valid_size ||
+           field->column < 0 || field->column >= Ncolumns ||
+           field->offset < 0 || field->offset + field->itemsize > *rowsize)
+        {
+            PyErr_Format(PyExc_ValueError, "Invalid layout field %d", i);
+            return false;
+        }
+    }
+    return true;
+}
+
+static PyObject* slurp(PyObject* self __attribute__((unused)),
+                       PyObject* args, PyObject* kwargs)
+{
+    static char* keywords[] = {"filename", "layout", "Nthreads", "chunk_size", NULL};
+
+    const char* filename;
+    PyObject*   layout_cb;
+    int         Nthreads   = 0;
+    Py_ssize_t  chunk_size = 0;
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "sO|in", keywords,
+                                    &filename, &layout_cb, &Nthreads, &chunk_size))
+        return NULL;
+    if(chunk_size < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "chunk_size must be >= 0");
+        return NULL;
+    }
+
+    PyObject*      result = NULL;
+    PyObject*      keys   = NULL;
+    PyObject*      layout = NULL;
+    PyObject*      data   = NULL;
+    field_t*       fields = NULL;
+    vnlog_parser_t ctx;
+    slurp_t        s      = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+    vnlog_parser_result_t result_init;
+    Py_BEGIN_ALLOW_THREADS;
+    result_init = vnlog_parser_init_mmap(&ctx, filename, false);
+    Py_END_ALLOW_THREADS;
+    if(result_init != VNL_OK)
+    {
+        PyErr_Format(PyExc_ValueError, "Couldn't read the vnlog legend of '%s'", filename);
+        return NULL;
+    }
+
+    const char* ckeys[ctx.Ncolumns > 0 ? ctx.Ncolumns : 1];
+    keys = PyList_New(ctx.Ncolumns);
+    if(keys == NULL)
+        goto done;
+    for(int i=0; i<ctx.Ncolumns; i++)
+    {
+        ckeys[i] = ctx.record[i].key;
+        PyObject* key = PyUnicode_FromString(ckeys[i]);
+        if(key == NULL)
+            goto done;
+        PyList_SET_ITEM(keys, i, key);
+    }
+
+    layout = PyObject_CallFunctionObjArgs(layout_cb, keys, NULL);
+    if(layout == NULL)
+        goto done;
+    if(!parse_layout(&fields, &s.Nfields, &s.rowsize, layout, ctx.Ncolumns))
+        goto done;
+    s.fields = fields;
+    s.keys   = ckeys;
+
+    // Only the needed columns are split out of each line, but the lines are
+    // still validated
+    {
+        vnlog_parser_column_t columns[s.Nfields > 0 ? s.Nfields : 1];
+        for(int i=0; i<s.Nfields; i++)
+            columns[i] = fields[i].column;
+        if(!vnlog_parser_set_projection(&ctx, columns, s.Nfields, true))
+        {
+            PyErr_SetString(PyExc_ValueError, "Couldn't set up the projection");
+            goto done;
+        }
+    }
+
+    vnlog_parser_result_t result_parse;
+    Py_BEGIN_ALLOW_THREADS;
+    result_parse = vnlog_parser_parallel_foreach(&ctx, Nthreads, (size_t)chunk_size,
+                                                 parse_chunk, &s);
+    Py_END_ALLOW_THREADS;
+
+    // The first error in the file
+    for(int i=0; i<s.Nchunks; i++)
+        if(s.chunks[i].error[0])
+        {
+            PyErr_Format(PyExc_ValueError, "'%s': %s", filename, s.chunks[i].error);
+            goto done;
+        }
+    if(result_parse != VNL_OK)
+    {
+        PyErr_Format(PyExc_ValueError, "Couldn't parse '%s'", filename);
+        goto done;
+    }
+
+    size_t Nrows = 0;
+    for(int i=0; i<s.Nchunks; i++)
+        Nrows += s.chunks[i].Nrows;
+    data = PyByteArray_FromStringAndSize(NULL, (Py_ssize_t)(Nrows*s.rowsize));
+    if(data == NULL)
+        goto done;
+    char* p = PyByteArray_AS_STRING(data);
+    for(int i=0; i<s.Nchunks; i++)
+    {
+        memcpy(p, s.chunks[i].data, s.chunks[i].Nrows*s.rowsize);
+        p += s.chunks[i].Nrows*s.rowsize;
+        free(s.chunks[i].data);
+        s.chunks[i].data = NULL;
+    }
+
+    result = Py_BuildValue("(OOn)", keys, data, (Py_ssize_t)Nrows);
+
+ done:
+    for(int i=0; i<s.Nchunks; i++)
+        free(s.chunks[i].data);
+    free(s.chunks);
+    free(fields);
+    Py_XDECREF(data);
+    Py_XDECREF(layout);
+    Py_XDECREF(keys);
+    vnlog_parser_free(&ctx);
+    return result;
+}
+
+static const char slurp_docstring[] =
+    "Reads all the rows of a vnlog file into a bytearray\n"
+    "\n"
+    "SYNOPSIS\n"
+    "\n"
+    "    keys, data, Nrows = _vnlog.slurp(filename, layout)\n"
+    "\n"
+    "This is the fast path of vnlog.slurp(); use that instead. After reading the\n"
+    "legend, calls layout(keys), which returns ([(column,offset,kind,itemsize),\n"
+    "...], rowsize): where each output row stores which of the vnlog columns,\n"
+    "and as what numpy dtype kind ('f','i','u','S','U') and itemsize. The rows\n"
+    "are then parsed by Nthreads threads (0 means one per CPU), in chunks of\n"
+    "chunk_size bytes (0 picks a default), and returned as a bytearray of\n"
+    "Nrows*rowsize bytes. Null fields are NaN in floating-point columns, and\n"
+    "an error in integer columns\n";
+
+
+////////////////// Batches
+
+// How much I ask the python file object for at a time
+#define READ_SIZE 65536
+
+// A parser reading a python file object through a FILE made by fopencookie().
+// The parser reads exactly the data the file object gives it, so text and
+// binary files, pipes, StringIO, etc all work. Everything here runs with the
+// GIL held, since the FILE calls into python
+typedef struct
+{
+    PyObject_HEAD
+
+    // f.read, or something like it: takes a size, and returns some bytes or
+    // str. Empty at the end of the file
+    PyObject*      read;
+    // What read() returned, not yet given to the parser
+    PyObject*      pending;
+    Py_ssize_t     pending_offset;
+
+    FILE*          fp;
+    bool           have_ctx;
+    vnlog_parser_t ctx;
+    bool           have_batch;
+    vnlog_batch_t  batch;
+
+    PyObject*      keys;
+} batch_reader_t;
+
+static ssize_t batch_reader_cookie_read(void* cookie, char* buf, size_t size)
+{
+    batch_reader_t* self = (batch_reader_t*)cookie;
+
+    if(self->pending == NULL ||
+       self->pending_offset >= PyBytes_GET_SIZE(self->pending))
+    {
+        Py_CLEAR(self->pending);
+        PyObject* data = PyObject_CallFunction(self->read, "n", (Py_ssize_t)READ_SIZE);
+        if(data == NULL)
+            return -1;
+        if(!PyBytes_Check(data))
+        {
+            PyObject* bytes =
+                PyUnicode_Check(data) ?
+                PyUnicode_AsUTF8String(data) :
+                PyBytes_FromObject(data);
+            Py_DECREF(data);
+            if(bytes == NULL)
+                return -1;
+            data = bytes;
+        }
+        self->pending        = data;
+        self->pending_offset = 0;
+    }
+
+    Py_ssize_t N = PyBytes_GET_SIZE(self->pending) - self->pending_offset;
+    if((size_t)N > size)
+        N = (Py_ssize_t)size;
+    memcpy(buf, &PyBytes_AS_STRING(self->pending)[self->pending_offset], N);
+    self->pending_offset += N;
+    return N;
+}
+
+static void batch_reader_dealloc(batch_reader_t* self)
+{
+    if(self->have_batch)
+        vnlog_batch_free(&self->batch);
+    if(self->have_ctx)
+        vnlog_parser_free(&self->ctx);
+    if(self->fp != NULL)
+        fclose(self->fp);
+    Py_XDECREF(self->read);
+    Py_XDECREF(self->pending);
+    Py_XDECREF(self->keys);
+    PyObject_Del(self);
+}
+
+// Reads the next batch. Returns None at the end of the file. Otherwise returns
+// (Nrows, values, Nnulls): the values of each column in a bytearray of Nrows
+// doubles or int64s, and how many of them are null
+static PyObject* batch_reader_read(batch_reader_t* self,
+                                   PyObject* args __attribute__((unused)))
+{
+    if(!self->have_batch)
+    {
+        PyErr_SetString(PyExc_ValueError, "select() must be called before read()");
+        return NULL;
+    }
+
+    const int Ncolumns  = self->batch.Ncolumns;
+    const int Nrows_max = self->batch.Nrows_max;
+
+    PyObject* result = NULL;
+    PyObject* values = PyList_New(Ncolumns);
+    PyObject* Nnulls = PyList_New(Ncolumns);
+    if(values == NULL || Nnulls == NULL)
+        goto done;
+
+    // The values are read straight into the bytearrays returned to python. New
+    // ones each time, since the previous batch may still be in use
+    for(int i=0; i<Ncolumns; i++)
+    {
+        PyObject* v = PyByteArray_FromStringAndSize(NULL, (Py_ssize_t)Nrows_max * 8);
+        if(v == NULL)
+            goto done;
+        PyList_SET_ITEM(values, i, v);
+        self->batch.columns[i].values = PyByteArray_AS_STRING(v);
+    }
+
+    vnlog_parser_result_t result_read = vnlog_parser_read_batch(&self->ctx, self->fp, &self->batch);
+    if(result_read == VNL_EOF)
+    {
+        result = Py_None;
+        Py_INCREF(result);
+        goto done;
+    }
+    if(result_read != VNL_OK)
+    {
+        if(!PyErr_Occurred())
+            PyErr_SetString(PyExc_ValueError, "Couldn't parse the vnlog");
+        goto done;
+    }
+
+    const int Nrows = self->batch.Nrows;
+    for(int i=0; i<Ncolumns; i++)
+    {
+        if(0 != PyByteArray_Resize(PyList_GET_ITEM(values, i), (Py_ssize_t)Nrows * 8))
+            goto done;
+
+        const uint8_t* null   = self->batch.columns[i].null;
+        long           Nnull  = 0;
+        for(int j=0; j<Nrows/8; j++)
+            Nnull += __builtin_popcount(null[j]);
+        if(Nrows % 8)
+            Nnull += __builtin_popcount(null[Nrows/8] & ((1 << (Nrows%8)) - 1));
+        PyObject* n = PyLong_FromLong(Nnull);
+        if(n == NULL)
+            goto done;
+        PyList_SET_ITEM(Nnulls, i, n);
+    }
+
+    result = Py_BuildValue("(iOO)", Nrows, values, Nnulls);
+
+ done:
+    // The bytearrays belong to python now. The batch mustn't point to them
+    for(int i=0; i<Ncolumns; i++)
+        self->batch.columns[i].values = NULL;
+    Py_XDECREF(values);
+    Py_XDECREF(Nnulls);
+    return result;
+}
+
+static PyObject* batch_reader_get_keys(batch_reader_t* self, void* closure __attribute__((unused)))
+{
+    Py_INCREF(self->keys);
+    return self->keys;
+}
+
+// Sets up the batches: which columns, of what types, and how many rows at a
+// time
+static PyObject* batch_reader_select(batch_reader_t* self, PyObject* args)
+{
+    PyObject* columns;
+    PyObject* types;
+    int       batch_size;
+    if(!PyArg_ParseTuple(args, "O!O!i",
+                         &PyList_Type, &columns, &PyList_Type, &types, &batch_size))
+        return NULL;
+
+    const int Ncolumns = (int)PyList_Size(columns);
+    if(Ncolumns == 0 || PyList_Size(types) != Ncolumns || batch_size <= 0)
+    {
+        PyErr_SetString(PyExc_ValueError,
+                        "Need the same number of columns and types, at least one, and batch_size > 0");
+        return NULL;
+    }
+    if(self->have_batch)
+    {
+        PyErr_SetString(PyExc_ValueError, "select() was called already");
+        return NULL;
+    }
+
+    const char*           keys    [Ncolumns];
+    vnlog_batch_type_t    btypes  [Ncolumns];
+    vnlog_parser_column_t icolumns[Ncolumns];
+    for(int i=0; i<Ncolumns; i++)
+    {
+        keys[i] = PyUnicode_AsUTF8(PyList_GET_ITEM(columns, i));
+        const char* type = PyUnicode_AsUTF8(PyList_GET_ITEM(types, i));
+        if(keys[i] == NULL || type == NULL)
+            return NULL;
+        if     (0 == strcmp(type, "f")) btypes[i] = VNLOG_BATCH_DOUBLE;
+        else if(0 == strcmp(type, "i")) btypes[i] = VNLOG_BATCH_INT64;
+        else
+        {
+            PyErr_Format(PyExc_ValueError, "Unknown type '%s'; must be 'f' or 'i'", type);
+            return NULL;
+        }
+
+        icolumns[i] = vnlog_parser_column(&self->ctx, keys[i]);
+        if(icolumns[i] < 0)
+        {
+            PyErr_Format(PyExc_KeyError, "The vnlog has no column '%s'", keys[i]);
+            return NULL;
+        }
+    }
+
+    if(!vnlog_parser_set_projection(&self->ctx, icolumns, Ncolumns, true) ||
+       !vnlog_batch_init(&self->batch, &self->ctx, keys, btypes, Ncolumns, batch_size))
+    {
+        PyErr_SetString(PyExc_ValueError, "Couldn't set up the batches");
+        return NULL;
+    }
+    self->have_batch = true;
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef batch_reader_methods[] =
+    {
+        {"select", (PyCFunction)batch_reader_select, METH_VARARGS,
+         "select(columns, types, batch_size): sets up the batches"},
+        {"read", (PyCFunction)batch_reader_read, METH_NOARGS,
+         "Reads the next batch. Returns None at the end, or (Nrows, values, Nnulls)"},
+        {}
+    };
+
+static PyGetSetDef batch_reader_getset[] =
+    {
+        {"keys", (getter)batch_reader_get_keys, NULL, "The keys in the vnlog legend", NULL},
+        {}
+    };
+
+static PyTypeObject batch_reader_type =
+    {
+        PyVarObject_HEAD_INIT(NULL, 0)
+        .tp_name      = "_vnlog.batch_reader",
+        .tp_basicsize = sizeof(batch_reader_t),
+        .tp_dealloc   = (destructor)batch_reader_dealloc,
+        .tp_flags     = Py_TPFLAGS_DEFAULT,
+        .tp_doc       = "Reads a vnlog in batches. Made by _vnlog.batch_reader()",
+        .tp_methods   = batch_reader_methods,
+        .tp_getset    = batch_reader_getset,
+    };
+
+static PyObject* batch_reader(PyObject* self __attribute__((unused)),
+                              PyObject* args)
+{
+    PyObject* read;
+    if(!PyArg_ParseTuple(args, "O", &read))
+        return NULL;
+
+    batch_reader_t* r = PyObject_New(batch_reader_t, &batch_reader_type);
+    if(r == NULL)
+        return NULL;
+    r->read           = read;
+    Py_INCREF(read);
+    r->pending        = NULL;
+    r->pending_offset = 0;
+    r->fp             = NULL;
+    r->have_ctx       = false;
+    r->have_batch     = false;
+    r->keys           = NULL;
+
+    r->fp = fopencookie(r, "r", (cookie_io_functions_t){.read = batch_reader_cookie_read});
+    if(r->fp == NULL)
+    {
+        PyErr_NoMemory();
+        goto fail;
+    }
+
+    r->have_ctx = true;
+    if(VNL_OK != vnlog_parser_init(&r->ctx, r->fp))
+    {
+        if(!PyErr_Occurred())
+            PyErr_SetString(PyExc_ValueError, "Couldn't read the vnlog legend");
+        goto fail;
+    }
+
+    r->keys = PyList_New(r->ctx.Ncolumns);
+    if(r->keys == NULL)
+        goto fail;
+    for(int i=0; i<r->ctx.Ncolumns; i++)
+    {
+        PyObject* key = PyUnicode_FromString(r->ctx.record[i].key);
+        if(key == NULL)
+            goto fail;
+        PyList_SET_ITEM(r->keys, i, key);
+    }
+    return (PyObject*)r;
+
+ fail:
+    Py_DECREF(r);
+    return NULL;
+}
+
+static const char batch_reader_docstring[] =
+    "Reads a vnlog in batches\n"
+    "\n"
+    "SYNOPSIS\n"
+    "\n"
+    "    r = _vnlog.batch_reader(f.read)\n"
+    "    r.select(['x','n'], ['f','i'], 65536)\n"
+    "    while True:\n"
+    "        b = r.read()\n"
+    "        if b is None: break\n"
+    "        Nrows, values, Nnulls = b\n"
+    "\n"
+    "This is the fast path of vnlog.batches(); use that instead. read(size) is\n"
+    "called to get more data; it returns bytes or str, and an empty result at\n"
+    "the end of the file. The legend is read immediately, and the keys are\n"
+    "available in r.keys. Then select() picks the columns, their types ('f'\n"
+    "for double or 'i' for int64) and the size of the batches. Each read()\n"
+    "returns the values of each column in a bytearray, and the number of\n"
+    "nulls in each column. Nulls are NaN or 0\n";
+
+static PyMethodDef methods[] =
+    {
+        {"slurp", (PyCFunction)(void*)slurp, METH_VARARGS | METH_KEYWORDS, slurp_docstring},
+        {"batch_reader", (PyCFunction)batch_reader, METH_VARARGS, batch_reader_docstring},
+        {}
+    };
+
+static struct PyModuleDef module_def =
+    {
+        PyModuleDef_HEAD_INIT,
+        "_vnlog",
+        "Native parts of the vnlog module",
+        -1,
+        methods
+    };
+
+PyMODINIT_FUNC PyInit__vnlog(void)
+{
+    if(PyType_Ready(&batch_reader_type) < 0)
+        return NULL;
+    return PyModule_Create(&module_def);
+}
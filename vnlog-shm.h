@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+
+// Layout of the POSIX shared-memory segment written by a vnlog session whose
+// output was set with vnlog_set_output_shm(). This is read by vnl-shm-cat.
+//
+// The segment is
+//
+//   vnlog_shm_header_t
+//   legend:  legend_max bytes. The legend string. Published once
+//   ring:    ring_size bytes
+//
+// The ring contains the records (and any other output, such as comments). Each
+// is stored as an int32_t byte count followed by the data, padded to 8 bytes. A
+// record never wraps around the end of the ring: if it doesn't fit, a
+// VNLOG_SHM_PADDING marker is written, and the record starts at the beginning
+// instead.
+//
+// The writer never waits for the readers. It simply overwrites the oldest
+// data. head counts the bytes written since the start, and is always at a
+// record boundary. A reader keeps its own position. It copies a record out, and
+// then checks that head hasn't moved more than ring_size/2 past that position:
+// the writer can't have started overwriting the copied record until then. A
+// record is at most ring_size/4 bytes, so any partially-written data is within
+// ring_size/2 of head.
+//
+// The fields that the writer updates while running are accessed with the
+// __atomic builtins
+
+#define VNLOG_SHM_MAGIC      "VNLOGSHM"
+#define VNLOG_SHM_VERSION    1
+#define VNLOG_SHM_PADDING    (-1)
+
+typedef struct
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t writer_pid;
+    uint64_t legend_max;
+    uint64_t ring_size; // power of 2
+
+    uint64_t head;
+    uint64_t legend_len; // 0 until the legend is published
+    uint64_t Ndropped;   // records too large to fit into the ring
+    uint32_t closed;     // the writer is done
+    uint32_t Nreaders;   // readers currently attached
+} vnlog_shm_header_t;
+
+static inline char* vnlog_shm_legend(vnlog_shm_header_t* header)
+{
+    return (char*)&header[1];
+}
+
+static inline char* vnlog_shm_ring(vnlog_shm_header_t* header)
+{
+    return vnlog_shm_legend(header) + header->legend_max;
+}
+
+static inline uint64_t vnlog_shm_segment_size(uint64_t legend_max, uint64_t ring_size)
+{
+    return sizeof(vnlog_shm_header_t) + legend_max + ring_size;
+}
+
+static inline uint64_t vnlog_shm_record_size(int len)
+{
+    // length prefix + data, padded to 8 bytes
+    return ((uint64_t)sizeof(int32_t) + len + 7) & ~(uint64_t)7;
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+// C++ interface to the specialized emitters. This is #included by the header
+// that "vnl-gen-header --emitter" generates, which defines
+//
+//     typedef vnlog::writer<...the types of the fields...> vnlog_writer_t;
+//
+// Usage:
+//
+//     vnlog_writer_t w;        // writes to the global context; or w(&ctx)
+//     vnlog_emit_legend();
+//     w.emit(-10, 40, "asdf", 0.3, vnlog::binary{data, len});
+//
+// emit() takes the values of all the fields, in order. Each one is formatted
+// like the setters in vnlog.h format it, but the formatters are chosen at
+// compile time from the types, so emit() is straight-line code. Needs C++17
+
+#include <string.h>
+#include <stdint.h>
+#include <utility>
+
+#include "vnlog-format.h"
+#include "vnlog-base64.h"
+
+namespace vnlog
+{
+
+// A chunk of binary data. Written out base64-encoded, or as '-' if ptr is NULL
+struct binary
+{
+    const void* ptr;
+    int         len;
+};
+
+namespace detail
+{
+// Each value type has
+//
+// - len_max(): how many bytes the value takes at most, including the ' ' that
+//   follows it (this takes the place of the '\0' that the formatters write)
+// - put(): writes the value, returning the end of what was written
+// - set(): stores the value with the setter from vnlog.h. For binary captures
+#define VNLOG_WRITER_NUMBER(ctype, formatter, typename)                 \
+    inline int   len_max(ctype)          { return VNLOG_FORMAT_NUMBER_MAXLEN; } \
+    inline char* put    (char* p, ctype x)                              \
+    { return p + vnlog_format_ ## formatter(p, VNLOG_FORMAT_NUMBER_MAXLEN, x); } \
+    inline void  set    (struct vnlog_context_t* ctx, int idx, ctype x) \
+    { _vnlog_set_field_value_ ## typename(ctx, "", idx, x); }
+
+VNLOG_WRITER_NUMBER(int8_t,   int64,  int8_t)
+VNLOG_WRITER_NUMBER(int16_t,  int64,  int16_t)
+VNLOG_WRITER_NUMBER(int32_t,  int64,  int32_t)
+VNLOG_WRITER_NUMBER(int64_t,  int64,  int64_t)
+VNLOG_WRITER_NUMBER(uint8_t,  uint64, uint8_t)
+VNLOG_WRITER_NUMBER(uint16_t, uint64, uint16_t)
+VNLOG_WRITER_NUMBER(uint32_t, uint64, uint32_t)
+VNLOG_WRITER_NUMBER(uint64_t, uint64, uint64_t)
+VNLOG_WRITER_NUMBER(char,     char,   char)
+VNLOG_WRITER_NUMBER(float,    float,  float)
+VNLOG_WRITER_NUMBER(double,   double, double)
+#undef VNLOG_WRITER_NUMBER
+
+inline int len_max(const char* x)
+{
+    return x != NULL ? (int)strlen(x) + 1 : 2;
+}
+inline char* put(char* p, const char* x)
+{
+    if(x == NULL)
+    {
+        *p = '-';
+        return p+1;
+    }
+    const int len = (int)strlen(x);
+    memcpy(p, x, len);
+    return p + len;
+}
+inline void set(struct vnlog_context_t* ctx, int idx, const char* x)
+{
+    if(x != NULL) _vnlog_set_field_value_ccharp(ctx, "", idx, x);
+}
+
+inline int len_max(const binary& x)
+{
+    return x.ptr != NULL ? vnlog_base64_dstlen_to_encode(x.len) : 2;
+}
+inline char* put(char* p, const binary& x)
+{
+    if(x.ptr == NULL)
+    {
+        *p = '-';
+        return p+1;
+    }
+    return p + vnlog_base64_encode(p, vnlog_base64_dstlen_to_encode(x.len),
+                                   (const char*)x.ptr, x.len);
+}
+inline void set(struct vnlog_context_t* ctx, int idx, const binary& x)
+{
+    if(x.ptr != NULL) _vnlog_set_field_value_binary(ctx, "", idx, x.ptr, x.len);
+}
+}
+
+template<typename... Ts>
+class writer
+{
+    struct vnlog_context_t* ctx;
+
+    template<size_t... I>
+    void emit_with_setters(std::index_sequence<I...>, const Ts&... values)
+    {
+        (detail::set(ctx, (int)I, values), ...);
+        _vnlog_emit_record(ctx, (int)sizeof...(Ts));
+    }
+
+public:
+    // ctx == NULL writes to the global context
+    explicit writer(struct vnlog_context_t* _ctx = NULL) : ctx(_ctx) {}
+
+    void emit(const Ts&... values)
+    {
+        const int len_max = 1 + (0 + ... + detail::len_max(values));
+        char* buf = _vnlog_record_buffer(ctx, len_max, (int)sizeof...(Ts));
+        if(buf == NULL)
+        {
+            // A binary capture
+            emit_with_setters(std::index_sequence_for<Ts...>{}, values...);
+            return;
+        }
+
+        char* p = buf;
+        ((p = detail::put(p, values), *p++ = ' '), ...);
+        p[-1] = '\n';
+        _vnlog_emit_record_buffer(ctx, (int)(p - buf), (int)sizeof...(Ts));
+    }
+};
+
+}
@@ -3,8 +3,18 @@
 #include <stdarg.h>
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "vnlog-base64.h"
+#include "vnlog-format.h"
+#include "vnlog-shm.h"
+#include "vnlog-capture.h"
 
 #define VNLOG_C
 #include "vnlog.h"
@@ -40,7 +50,7 @@ static struct vnlog_context_t* get_global_context(int Nfields)
 
 static void _vnlog_set_output_FILE__ctx_exists(struct vnlog_context_t* ctx, FILE* fp)
 {
-    if(ctx->root->_fp)
+    if(ctx->root->_fp || ctx->root->_shm)
         ERR("fp is already set");
     if( ctx->root->_emitted_something )
         ERR("Can only change the output at the start");
@@ -67,34 +77,860 @@ void vnlog_set_output_FILE(struct vnlog_context_t* ctx, FILE* fp)
 
 static void check_fp(struct vnlog_context_t* ctx)
 {
-    if(!ctx->root->_fp)
+    if(!ctx->root->_fp && !ctx->root->_shm)
         _vnlog_set_output_FILE__ctx_exists(ctx, stdout);
 }
-static void _emit(struct vnlog_context_t* ctx, const char* string)
+////////////////// Asynchronous sessions
+//
+// Each context has its own single-producer/single-consumer ring of bytes. The
+// producer is the thread using the context; the consumer is the background
+// writer thread. The records are stored as an int32_t length followed by the
+// data, padded to 8 bytes. A record never wraps around the end of the ring: if
+// it doesn't fit, a RING_PADDING marker is written, and the record starts at
+// the beginning instead.
+//
+// head and tail count the bytes written and consumed since the start, so
+// head-tail is the number of bytes in the ring. Only the producer writes head,
+// and only the consumer writes tail.
+//
+// All the rings of a session are in a linked list. New rings are appended by
+// the producers (holding the mutex). Only the writer thread walks the list or
+// removes from it, so it can walk it without holding the mutex
+
+#define RING_PADDING        (-1)
+#define RING_SIZE_DEFAULT   (1 << 20)
+#define CACHELINE           64
+
+struct vnlog_ring_t
+{
+    uint64_t head __attribute__((aligned(CACHELINE)));
+    uint64_t tail __attribute__((aligned(CACHELINE)));
+
+    char*    buf  __attribute__((aligned(CACHELINE)));
+    uint64_t size;      // power of 2
+
+    // Set when the context is freed. The writer frees the ring after draining
+    // it
+    bool     retired;
+
+    struct vnlog_ring_t* next;
+};
+
+struct vnlog_async_t
+{
+    FILE*                fp;
+    vnlog_async_policy_t policy;
+    uint64_t             ring_size;
+
+    pthread_t            thread;
+    pthread_mutex_t      mutex;
+    // Signalled to wake up the writer
+    pthread_cond_t       cond_work;
+    // Broadcast by the writer when it made room in the rings, or finished a
+    // flush
+    pthread_cond_t       cond_drained;
+
+    struct vnlog_ring_t* rings;
+    struct vnlog_ring_t* rings_last;
+
+    // These are accessed with the __atomic builtins
+    bool                 writer_sleeping;
+    bool                 stop;
+    int                  Nwaiting;
+    uint64_t             Ndropped;
+    uint64_t             flush_requested;
+    uint64_t             flush_completed;
+};
+
+static uint64_t ring_size_for_record(int len)
 {
-    fprintf(ctx->root->_fp, "%s", string);
-    ctx->root->_emitted_something = true;
+    // length prefix + data, padded to 8 bytes
+    return ((uint64_t)sizeof(int32_t) + len + 7) & ~(uint64_t)7;
 }
 
-static void _emit_field(struct vnlog_context_t* ctx, int i)
+// Writes out everything in the ring up to the head we see when we start.
+// Returns true if anything was written
+static bool ring_drain(struct vnlog_ring_t* ring, FILE* fp)
 {
-    if( ctx->fields[i].binptr == NULL )
-        // plain ascii field
-        _emit(ctx, ctx->fields[i].c);
+    const uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t       tail = ring->tail;
+    if(tail == head)
+        return false;
+
+    while(tail != head)
+    {
+        const uint64_t offset = tail & (ring->size - 1);
+        int32_t len;
+        memcpy(&len, &ring->buf[offset], sizeof(len));
+        if(len == RING_PADDING)
+            tail += ring->size - offset;
+        else
+        {
+            fwrite(&ring->buf[offset + sizeof(len)], 1, len, fp);
+            tail += ring_size_for_record(len);
+        }
+    }
+
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    return true;
+}
+
+static bool rings_all_empty(struct vnlog_async_t* async)
+{
+    for(struct vnlog_ring_t* ring = __atomic_load_n(&async->rings, __ATOMIC_ACQUIRE);
+        ring != NULL;
+        ring = __atomic_load_n(&ring->next, __ATOMIC_ACQUIRE))
+    {
+        if(__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != ring->tail)
+            return false;
+    }
+    return true;
+}
+
+static void timespec_from_now(struct timespec* ts, long ns)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_nsec += ns;
+    while(ts->tv_nsec >= 1000000000L)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static void* async_writer_thread(void* cookie)
+{
+    struct vnlog_async_t* async = (struct vnlog_async_t*)cookie;
+
+    while(true)
+    {
+        const bool     stop            = __atomic_load_n(&async->stop,            __ATOMIC_ACQUIRE);
+        const uint64_t flush_requested = __atomic_load_n(&async->flush_requested, __ATOMIC_ACQUIRE);
+
+        // One pass through all the rings
+        bool did_something = false;
+        struct vnlog_ring_t* prev = NULL;
+        struct vnlog_ring_t* ring = __atomic_load_n(&async->rings, __ATOMIC_ACQUIRE);
+        while(ring != NULL)
+        {
+            struct vnlog_ring_t* next = __atomic_load_n(&ring->next, __ATOMIC_ACQUIRE);
+
+            // I must look at retired BEFORE I drain: the producer sets it
+            // after its last write
+            const bool retired = __atomic_load_n(&ring->retired, __ATOMIC_ACQUIRE);
+            if(ring_drain(ring, async->fp))
+                did_something = true;
+
+            if(retired)
+            {
+                pthread_mutex_lock(&async->mutex);
+                // Reload next: a new ring may have been appended meanwhile
+                next = ring->next;
+                if(prev == NULL) __atomic_store_n(&async->rings, next, __ATOMIC_RELEASE);
+                else             __atomic_store_n(&prev->next,   next, __ATOMIC_RELEASE);
+                if(async->rings_last == ring)
+                    async->rings_last = prev;
+                pthread_mutex_unlock(&async->mutex);
+
+                free(ring->buf);
+                free(ring);
+            }
+            else
+                prev = ring;
+            ring = next;
+        }
+
+        if(flush_requested != __atomic_load_n(&async->flush_completed, __ATOMIC_ACQUIRE))
+        {
+            // Everything queued before the flush request has been written
+            fflush(async->fp);
+            __atomic_store_n(&async->flush_completed, flush_requested, __ATOMIC_RELEASE);
+            did_something = true;
+        }
+
+        if(did_something)
+        {
+            if(__atomic_load_n(&async->Nwaiting, __ATOMIC_ACQUIRE) > 0)
+            {
+                pthread_mutex_lock(&async->mutex);
+                pthread_cond_broadcast(&async->cond_drained);
+                pthread_mutex_unlock(&async->mutex);
+            }
+            continue;
+        }
+
+        // Nothing left to do. If asked to stop, I'm done. Otherwise I sleep
+        // until a producer wakes me up
+        if(stop)
+            break;
+
+        pthread_mutex_lock(&async->mutex);
+        __atomic_store_n(&async->writer_sleeping, true, __ATOMIC_SEQ_CST);
+        if(rings_all_empty(async) &&
+           !__atomic_load_n(&async->stop, __ATOMIC_SEQ_CST) &&
+           __atomic_load_n(&async->flush_requested, __ATOMIC_SEQ_CST) ==
+           __atomic_load_n(&async->flush_completed, __ATOMIC_SEQ_CST))
+        {
+            // The timeout is a safety net only; the producers wake me
+            struct timespec ts;
+            timespec_from_now(&ts, 100000000L);
+            pthread_cond_timedwait(&async->cond_work, &async->mutex, &ts);
+        }
+        __atomic_store_n(&async->writer_sleeping, false, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&async->mutex);
+    }
+
+    fflush(async->fp);
+    return NULL;
+}
+
+static void async_wake_writer(struct vnlog_async_t* async)
+{
+    // Pairs with the writer setting writer_sleeping, and then checking the
+    // rings. One of us is guaranteed to see the other
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&async->writer_sleeping, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&async->mutex);
+        pthread_cond_signal(&async->cond_work);
+        pthread_mutex_unlock(&async->mutex);
+    }
+}
+
+// Waits a little while for the writer to make progress. Used by producers
+// waiting for room, and by flushes
+static void async_wait_drained(struct vnlog_async_t* async)
+{
+    __atomic_add_fetch(&async->Nwaiting, 1, __ATOMIC_SEQ_CST);
+    async_wake_writer(async);
+
+    pthread_mutex_lock(&async->mutex);
+    struct timespec ts;
+    timespec_from_now(&ts, 1000000L);
+    pthread_cond_timedwait(&async->cond_drained, &async->mutex, &ts);
+    pthread_mutex_unlock(&async->mutex);
+
+    __atomic_sub_fetch(&async->Nwaiting, 1, __ATOMIC_SEQ_CST);
+}
+
+static struct vnlog_ring_t* ring_get(struct vnlog_context_t* ctx)
+{
+    if(ctx->_ring != NULL)
+        return ctx->_ring;
+
+    struct vnlog_async_t* async = ctx->root->_async;
+
+    struct vnlog_ring_t* ring = calloc(1, sizeof(*ring));
+    if(ring == NULL)
+        ERR("Couldn't allocate a ring");
+    ring->size = async->ring_size;
+    ring->buf  = malloc(ring->size);
+    if(ring->buf == NULL)
+        ERR("Couldn't allocate a %" PRIu64 "-byte ring", ring->size);
+
+    pthread_mutex_lock(&async->mutex);
+    if(async->rings_last == NULL)
+        __atomic_store_n(&async->rings, ring, __ATOMIC_RELEASE);
     else
+        __atomic_store_n(&async->rings_last->next, ring, __ATOMIC_RELEASE);
+    async->rings_last = ring;
+    pthread_mutex_unlock(&async->mutex);
+
+    ctx->_ring = ring;
+    return ring;
+}
+
+static void ring_wait_empty(struct vnlog_async_t* async, struct vnlog_ring_t* ring)
+{
+    while(__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head)
+        async_wait_drained(async);
+}
+
+// Queues a chunk of output from this context
+static void async_push(struct vnlog_context_t* ctx, const char* buf, int len)
+{
+    struct vnlog_async_t* async = ctx->root->_async;
+    struct vnlog_ring_t*  ring  = ring_get(ctx);
+
+    const uint64_t need = ring_size_for_record(len);
+    if(need > ring->size/2)
+    {
+        // Too big to queue. I write it out myself, after everything queued
+        // before it
+        if(async->policy == VNLOG_ASYNC_DROP)
+        {
+            __atomic_add_fetch(&async->Ndropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        ring_wait_empty(async, ring);
+        fwrite(buf, 1, len, async->fp);
+        return;
+    }
+
+    const uint64_t head   = ring->head;
+    const uint64_t offset = head & (ring->size - 1);
+    // If the record doesn't fit before the end of the ring, I pad to the end,
+    // and write it at the start
+    const uint64_t pad    = (offset + need > ring->size) ? ring->size - offset : 0;
+
+    while(ring->size - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) < pad + need)
+    {
+        if(async->policy == VNLOG_ASYNC_DROP)
+        {
+            __atomic_add_fetch(&async->Ndropped, 1, __ATOMIC_RELAXED);
+            async_wake_writer(async);
+            return;
+        }
+        async_wait_drained(async);
+    }
+
+    uint64_t offset_write = offset;
+    if(pad)
+    {
+        const int32_t padding = RING_PADDING;
+        memcpy(&ring->buf[offset], &padding, sizeof(padding));
+        offset_write = 0;
+    }
+    const int32_t len32 = len;
+    memcpy(&ring->buf[offset_write], &len32, sizeof(len32));
+    memcpy(&ring->buf[offset_write + sizeof(len32)], buf, len);
+
+    __atomic_store_n(&ring->head, head + pad + need, __ATOMIC_RELEASE);
+    async_wake_writer(async);
+}
+
+static void async_flush(struct vnlog_async_t* async)
+{
+    const uint64_t flush_id = __atomic_add_fetch(&async->flush_requested, 1, __ATOMIC_SEQ_CST);
+    while(__atomic_load_n(&async->flush_completed, __ATOMIC_ACQUIRE) < flush_id)
+        async_wait_drained(async);
+}
+
+static void async_stop(struct vnlog_async_t* async)
+{
+    __atomic_store_n(&async->stop, true, __ATOMIC_SEQ_CST);
+    async_wake_writer(async);
+    pthread_join(async->thread, NULL);
+
+    for(struct vnlog_ring_t* ring = async->rings; ring != NULL;)
+    {
+        struct vnlog_ring_t* next = ring->next;
+        free(ring->buf);
+        free(ring);
+        ring = next;
+    }
+
+    pthread_mutex_destroy(&async->mutex);
+    pthread_cond_destroy(&async->cond_work);
+    pthread_cond_destroy(&async->cond_drained);
+    free(async);
+}
+
+static void flush_global_at_exit(void)
+{
+    _vnlog_flush(NULL, -1);
+}
+
+void _vnlog_set_async(struct vnlog_context_t* ctx,
+                      size_t ring_size, vnlog_async_policy_t policy,
+                      int Nfields)
+{
+    const bool is_global = (ctx == NULL);
+    if( ctx == NULL ) ctx = get_global_context(Nfields);
+
+    if( ctx->root->_async )
+        ERR("The session is already asynchronous");
+    if( ctx->root->_emitted_something )
+        ERR("Can only make the session asynchronous at the start");
+    if( ctx->root->_shm )
+        ERR("Shared-memory output can't be used in an asynchronous session");
+    check_fp(ctx);
+
+    if(ring_size == 0)
+        ring_size = RING_SIZE_DEFAULT;
+    // Round up to a power of 2
+    uint64_t size = 64;
+    while(size < ring_size)
+        size *= 2;
+
+    struct vnlog_async_t* async = calloc(1, sizeof(*async));
+    if(async == NULL)
+        ERR("Couldn't allocate the async state");
+    async->fp        = ctx->root->_fp;
+    async->policy    = policy;
+    async->ring_size = size;
+    pthread_mutex_init(&async->mutex,        NULL);
+    pthread_cond_init (&async->cond_work,    NULL);
+    pthread_cond_init (&async->cond_drained, NULL);
+
+    if(0 != pthread_create(&async->thread, NULL, async_writer_thread, async))
+        ERR("Couldn't start the writer thread");
+
+    ctx->root->_async = async;
+
+    if(is_global)
+        atexit(flush_global_at_exit);
+}
+
+uint64_t _vnlog_async_Ndropped(struct vnlog_context_t* ctx, int Nfields)
+{
+    if( ctx == NULL ) ctx = get_global_context(Nfields);
+    if( ctx->root->_async == NULL )
+        return 0;
+    return __atomic_load_n(&ctx->root->_async->Ndropped, __ATOMIC_RELAXED);
+}
+
+
+
+
+
+////////////////// Shared-memory output
+//
+// The segment layout and the protocol are described in vnlog-shm.h. There's a
+// single writer per segment: the threads in this process take turns with a
+// mutex
+
+#define SHM_LEGEND_MAX          (1 << 20)
+#define SHM_RING_SIZE_DEFAULT   (16 << 20)
+
+struct vnlog_shm_t
+{
+    vnlog_shm_header_t* header;
+    size_t              segment_size;
+    char*               name;
+    pthread_mutex_t     mutex;
+};
+
+static void shm_push(struct vnlog_shm_t* shm, const char* buf, int len)
+{
+    vnlog_shm_header_t* header = shm->header;
+    const uint64_t      size   = header->ring_size;
+    const uint64_t      need   = vnlog_shm_record_size(len);
+
+    if(need > size/4)
+    {
+        // Too big. The readers can't safely read records this large
+        __atomic_add_fetch(&header->Ndropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    char* ring = vnlog_shm_ring(header);
+
+    pthread_mutex_lock(&shm->mutex);
+    {
+        const uint64_t head   = header->head;
+        const uint64_t offset = head & (size - 1);
+        const uint64_t pad    = (offset + need > size) ? size - offset : 0;
+
+        uint64_t offset_write = offset;
+        if(pad)
+        {
+            const int32_t padding = VNLOG_SHM_PADDING;
+            memcpy(&ring[offset], &padding, sizeof(padding));
+            offset_write = 0;
+        }
+        const int32_t len32 = len;
+        memcpy(&ring[offset_write], &len32, sizeof(len32));
+        memcpy(&ring[offset_write + sizeof(len32)], buf, len);
+
+        __atomic_store_n(&header->head, head + pad + need, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&shm->mutex);
+}
+
+static void shm_publish_legend(struct vnlog_shm_t* shm, const char* legend)
+{
+    vnlog_shm_header_t* header = shm->header;
+    const size_t        len    = strlen(legend);
+    if(len > header->legend_max)
+        ERR("The legend is too long for the shared-memory segment: %zu bytes. Max: %" PRIu64,
+            len, header->legend_max);
+
+    memcpy(vnlog_shm_legend(header), legend, len);
+    __atomic_store_n(&header->legend_len, len, __ATOMIC_RELEASE);
+}
+
+static void shm_close(struct vnlog_shm_t* shm)
+{
+    // The readers already mapped the segment keep it alive until they're done
+    __atomic_store_n(&shm->header->closed, 1, __ATOMIC_RELEASE);
+    munmap(shm->header, shm->segment_size);
+    shm_unlink(shm->name);
+    pthread_mutex_destroy(&shm->mutex);
+    free(shm->name);
+    free(shm);
+}
+
+static void close_global_shm_at_exit(void)
+{
+    struct vnlog_context_t* ctx = get_global_context(-1);
+    if(ctx->_shm != NULL)
+    {
+        shm_close(ctx->_shm);
+        ctx->_shm = NULL;
+    }
+}
+
+void _vnlog_set_output_shm(struct vnlog_context_t* ctx,
+                           const char* name, size_t ring_size,
+                           int Nfields)
+{
+    const bool is_global = (ctx == NULL);
+    if( ctx == NULL ) ctx = get_global_context(Nfields);
+
+    if(ctx->root->_fp || ctx->root->_shm)
+        ERR("The output is already set");
+    if( ctx->root->_emitted_something )
+        ERR("Can only change the output at the start");
+    if( ctx->root->_async )
+        ERR("Shared-memory output can't be used in an asynchronous session");
+    if( ctx->root->_capture )
+        ERR("Binary captures can't be written to shared memory");
+
+    if(ring_size == 0)
+        ring_size = SHM_RING_SIZE_DEFAULT;
+    // Round up to a power of 2
+    uint64_t size = 4096;
+    while(size < ring_size)
+        size *= 2;
+
+    struct vnlog_shm_t* shm = calloc(1, sizeof(*shm));
+    if(shm == NULL)
+        ERR("Couldn't allocate the shared-memory state");
+    shm->name         = strdup(name);
+    shm->segment_size = vnlog_shm_segment_size(SHM_LEGEND_MAX, size);
+    if(shm->name == NULL)
+        ERR("Couldn't allocate the shared-memory state");
+
+    // I always create a new segment. Readers still attached to an old segment
+    // with this name keep reading that one
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if(fd < 0)
+        ERR("Couldn't create shared-memory segment '%s': %s", name, strerror(errno));
+    if(0 != ftruncate(fd, (off_t)shm->segment_size))
+        ERR("Couldn't size shared-memory segment '%s': %s", name, strerror(errno));
+    shm->header = mmap(NULL, shm->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(shm->header == MAP_FAILED)
+        ERR("Couldn't map shared-memory segment '%s': %s", name, strerror(errno));
+    close(fd);
+
+    // The segment starts out zeroed
+    vnlog_shm_header_t* header = shm->header;
+    header->version    = VNLOG_SHM_VERSION;
+    header->writer_pid = (uint32_t)getpid();
+    header->legend_max = SHM_LEGEND_MAX;
+    header->ring_size  = size;
+    // The magic goes in last: the readers wait for it
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header->magic, VNLOG_SHM_MAGIC, sizeof(header->magic));
+
+    pthread_mutex_init(&shm->mutex, NULL);
+    ctx->root->_shm = shm;
+
+    if(is_global)
+        atexit(close_global_shm_at_exit);
+}
+
+
+
+
+////////////////// Field storage
+//
+// Each field is a 16-byte vnlog_field_t. Values of up to 8 bytes are stored in
+// the field itself. Longer ones are copied into the context's arena, which is
+// addressed by offset, so it can move when it grows. Each field that's set is
+// added to the context's dirty list, so clearing a record only touches those
+
+// vnlog_field_t.kind: where the value is, and whether it's binary data, to be
+// base64-encoded when written out. 0 means "not set"
+#define FIELD_INLINE     1      // in v.c
+#define FIELD_ARENA      2      // in the arena, at v.offset
+#define FIELD_BORROWED   3      // at v.ptr, owned by the caller
+#define FIELD_STORAGE    3      // the mask for the above
+#define FIELD_BINARY     4
+
+// Makes room for len more bytes in the arena, and returns their offset. The
+// arena only grows, and is reused for each record, so once it's big enough, no
+// more allocations are needed
+static uint32_t arena_alloc(struct vnlog_context_t* ctx, int len)
+{
+    const int len_needed = ctx->_arena_used + len;
+    if(len_needed < 0 || len_needed > INT_MAX/2)
+        ERR("Too much data in one record");
+
+    if(ctx->_arena_size < len_needed)
+    {
+        int size = ctx->_arena_size ? ctx->_arena_size : 256;
+        while(size < len_needed)
+            size *= 2;
+
+        char* arena = realloc(ctx->_arena, size);
+        if(arena == NULL)
+            ERR("Couldn't allocate the %d-byte arena", size);
+        ctx->_arena      = arena;
+        ctx->_arena_size = size;
+    }
+
+    const uint32_t offset = (uint32_t)ctx->_arena_used;
+    ctx->_arena_used = len_needed;
+    return offset;
+}
+
+static const char* field_data(const struct vnlog_context_t* ctx,
+                              const vnlog_field_t* field)
+{
+    switch(field->kind & FIELD_STORAGE)
     {
-        // binary field. Encode with base64 first
-        char out_base64[vnlog_base64_dstlen_to_encode(ctx->fields[i].binlen)];
-        vnlog_base64_encode( out_base64, sizeof(out_base64),
-                             ctx->fields[i].binptr, ctx->fields[i].binlen );
-        _emit(ctx, out_base64);
+    case FIELD_INLINE: return field->v.c;
+    case FIELD_ARENA:  return &ctx->_arena[field->v.offset];
+    default:           return field->v.ptr;
+    }
+}
+
+static void mark_dirty(struct vnlog_context_t* ctx, int idx)
+{
+    if(ctx->_Ndirty == ctx->_dirty_size)
+    {
+        const int size = ctx->_dirty_size ? 2*ctx->_dirty_size : 16;
+        int* dirty = realloc(ctx->_dirty, size*sizeof(dirty[0]));
+        if(dirty == NULL)
+            ERR("Couldn't allocate the %d-entry dirty list", size);
+        ctx->_dirty      = dirty;
+        ctx->_dirty_size = size;
+    }
+    ctx->_dirty[ctx->_Ndirty++] = idx;
+}
+
+// Copies a value into a field that isn't set yet. binary is 0 or FIELD_BINARY
+static void field_store(struct vnlog_context_t* ctx, int idx,
+                        const void* data, int len, uint8_t binary)
+{
+    vnlog_field_t* field = &ctx->fields[idx];
+    if(len <= (int)sizeof(field->v.c))
+    {
+        if(len > 0)
+            memcpy(field->v.c, data, len);
+        field->kind = FIELD_INLINE | binary;
+    }
+    else
+    {
+        field->v.offset = arena_alloc(ctx, len);
+        memcpy(&ctx->_arena[field->v.offset], data, len);
+        field->kind = FIELD_ARENA | binary;
+    }
+    field->len = len;
+    mark_dirty(ctx, idx);
+}
+
+// The numbers are formatted into a buffer on the stack, and then stored
+#define DEFINE_STORE_TEXT(formatter, ctype)                             \
+static void store_text_ ## formatter(struct vnlog_context_t* ctx, int idx, ctype x) \
+{                                                                       \
+    char buf[VNLOG_FORMAT_NUMBER_MAXLEN];                               \
+    const int len = vnlog_format_ ## formatter(buf, sizeof(buf), x);    \
+    if(len < 0)                                                         \
+        ERR("Couldn't format field %d", idx);                           \
+    field_store(ctx, idx, buf, len, 0);                                 \
+}
+DEFINE_STORE_TEXT(int64,  int64_t)
+DEFINE_STORE_TEXT(uint64, uint64_t)
+DEFINE_STORE_TEXT(double, double)
+DEFINE_STORE_TEXT(float,  float)
+DEFINE_STORE_TEXT(char,   char)
+#undef DEFINE_STORE_TEXT
+
+// Strings are stored as they are, however long they are
+static void store_text_string(struct vnlog_context_t* ctx, int idx, const char* x)
+{
+    // Same as what glibc's printf("%s", NULL) does
+    if(x == NULL)
+        x = "(null)";
+    field_store(ctx, idx, x, (int)strlen(x), 0);
+}
+
+
+
+
+////////////////// Binary captures
+//
+// The format is described in vnlog-capture.h. The setters store each value as
+// it is (in the native byte order) instead of formatting it. The rows are
+// assembled using the field types given to vnlog_set_binary_capture(). The
+// preamble is written before the first output
+
+#define CAPTURE_STRING   (-1)
+#define CAPTURE_BINARY   (-2)
+
+struct vnlog_capture_t
+{
+    char* preamble;
+    int   preamble_len;
+
+    // The size of each fixed-size field, or CAPTURE_STRING or CAPTURE_BINARY
+    int   Nfields;
+    int   sizes[];
+};
+
+// Every fixed-size value fits into the field
+#define DEFINE_CAPTURE_STORE(name, ctype, formatter)                    \
+static void capture_store_ ## name(struct vnlog_context_t* ctx, int idx, ctype x) \
+{                                                                       \
+    field_store(ctx, idx, &x, (int)sizeof(x), 0);                       \
+}
+VNLOG_CAPTURE_TYPES( DEFINE_CAPTURE_STORE )
+#undef DEFINE_CAPTURE_STORE
+
+static void capture_store_string(struct vnlog_context_t* ctx, int idx, const char* x)
+{
+    store_text_string(ctx, idx, x);
+}
+
+static int capture_type_size(const char* name, int len)
+{
+#define CHECK_TYPE(_name, ctype, formatter)                             \
+    if(len == (int)strlen(#_name) && 0 == strncmp(name, #_name, len))   \
+        return (int)sizeof(ctype);
+    VNLOG_CAPTURE_TYPES( CHECK_TYPE )
+#undef CHECK_TYPE
+
+    if(len == 6 && 0 == strncmp(name, "string", len)) return CAPTURE_STRING;
+    if(len == 6 && 0 == strncmp(name, "binary", len)) return CAPTURE_BINARY;
+
+    ERR("Unknown capture type '%.*s'", len, name);
+}
+
+void _vnlog_set_binary_capture(struct vnlog_context_t* ctx,
+                               const char* types, int Nfields)
+{
+    if( ctx == NULL ) ctx = get_global_context(Nfields);
+
+    if( ctx->root->_capture )
+        ERR("The session is already a binary capture");
+    if( ctx->root->_emitted_something )
+        ERR("Can only start a binary capture at the start");
+    if( ctx->root->_shm )
+        ERR("Binary captures can't be written to shared memory");
+
+    struct vnlog_capture_t* capture =
+        malloc(sizeof(*capture) + Nfields*sizeof(capture->sizes[0]));
+    if(capture == NULL)
+        ERR("Couldn't allocate the capture state");
+
+    int i = 0;
+    for(const char* p = types; *p; )
+    {
+        if(*p == ' ')
+        {
+            p++;
+            continue;
+        }
+        const int len = (int)strcspn(p, " ");
+        if(i == Nfields)
+            ERR("Got more field types than the %d fields: '%s'", Nfields, types);
+        capture->sizes[i++] = capture_type_size(p, len);
+        p += len;
+    }
+    if(i != Nfields)
+        ERR("Got %d field types, but have %d fields: '%s'", i, Nfields, types);
+    capture->Nfields = Nfields;
+
+    const char* endianness =
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        "le";
+#else
+        "be";
+#endif
+    const int len =
+        snprintf(NULL, 0, "%s %d %s\n#!types %s\n",
+                 VNLOG_CAPTURE_MAGIC, VNLOG_CAPTURE_VERSION, endianness, types);
+    capture->preamble = malloc(len+1);
+    if(capture->preamble == NULL)
+        ERR("Couldn't allocate the capture state");
+    snprintf(capture->preamble, len+1, "%s %d %s\n#!types %s\n",
+             VNLOG_CAPTURE_MAGIC, VNLOG_CAPTURE_VERSION, endianness, types);
+    capture->preamble_len = len;
+
+    ctx->root->_capture = capture;
+}
+
+static void capture_free(struct vnlog_capture_t* capture)
+{
+    free(capture->preamble);
+    free(capture);
+}
+
+static void set_frame_header(char* dst, uint32_t header)
+{
+    memcpy(dst, &header, sizeof(header));
+}
+
+
+
+
+// Sends a chunk of output to wherever this session is writing
+static void output_raw(struct vnlog_context_t* ctx, const char* buf, int len)
+{
+    if(ctx->root->_async != NULL)
+        async_push(ctx, buf, len);
+    else if(ctx->root->_shm != NULL)
+        shm_push(ctx->root->_shm, buf, len);
+    else
+        fwrite(buf, 1, len, ctx->root->_fp);
+}
+
+static void output(struct vnlog_context_t* ctx, const char* buf, int len)
+{
+    // This is shared between threads. The legend was already written when
+    // we're writing records, so this is normally already set, and we don't
+    // touch it
+    if(!ctx->root->_emitted_something)
+    {
+        if(ctx->root->_capture != NULL)
+            output_raw(ctx,
+                       ctx->root->_capture->preamble,
+                       ctx->root->_capture->preamble_len);
+        ctx->root->_emitted_something = true;
+    }
+
+    output_raw(ctx, buf, len);
+}
+
+// The buffer grows geometrically, so records that get slowly longer (counters
+// gaining digits, for instance) don't reallocate each time
+static void linebuf_reserve(struct vnlog_context_t* ctx, int len_needed)
+{
+    if(ctx->_linebuf_size < len_needed)
+    {
+        int size = ctx->_linebuf_size ? ctx->_linebuf_size : 256;
+        while(size < len_needed)
+            size *= 2;
+
+        char* linebuf = realloc(ctx->_linebuf, size);
+        if(linebuf == NULL)
+            ERR("Couldn't allocate the %d-byte record buffer", size);
+        ctx->_linebuf      = linebuf;
+        ctx->_linebuf_size = size;
     }
 }
 
 static void emit(struct vnlog_context_t* ctx, const char* string)
 {
     check_fp(ctx);
-    _emit(ctx, string);
+
+    const int len = (int)strlen(string);
+    if(ctx->root->_capture == NULL)
+    {
+        output(ctx, string, len);
+        return;
+    }
+
+    // Binary capture: the text goes out in a frame
+    const int header_len = (int)sizeof(uint32_t);
+    linebuf_reserve(ctx, header_len + len);
+    set_frame_header(ctx->_linebuf, VNLOG_CAPTURE_TEXT | (uint32_t)len);
+    memcpy(&ctx->_linebuf[header_len], string, len);
+    output(ctx, ctx->_linebuf, header_len + len);
 }
 
 void _vnlog_printf(struct vnlog_context_t* ctx, int Nfields, const char* fmt, ...)
@@ -103,40 +939,78 @@ void _vnlog_printf(struct vnlog_context_t* ctx, int Nfields, const char* fmt, ..
     check_fp(ctx);
     va_list ap;
     va_start(ap, fmt);
-    vfprintf(ctx->root->_fp, fmt, ap);
+    if(ctx->root->_async   == NULL &&
+       ctx->root->_shm     == NULL &&
+       ctx->root->_capture == NULL)
+    {
+        vfprintf(ctx->root->_fp, fmt, ap);
+        ctx->root->_emitted_something = true;
+    }
+    else
+    {
+        // Asynchronous, shared-memory or binary-capture session. I format into
+        // the record buffer, and send that out. A binary capture needs a frame
+        // header in front
+        const int header_len =
+            ctx->root->_capture != NULL ? (int)sizeof(uint32_t) : 0;
+        va_list ap2;
+        va_copy(ap2, ap);
+        const int len = vsnprintf(NULL, 0, fmt, ap2);
+        va_end(ap2);
+        if(len > 0)
+        {
+            linebuf_reserve(ctx, header_len + len+1);
+            vsnprintf(&ctx->_linebuf[header_len], len+1, fmt, ap);
+            if(header_len)
+                set_frame_header(ctx->_linebuf, VNLOG_CAPTURE_TEXT | (uint32_t)len);
+            output(ctx, ctx->_linebuf, header_len + len);
+        }
+    }
     va_end(ap);
+}
 
-    ctx->root->_emitted_something = true;
+static void flush(struct vnlog_context_t* ctx)
+{
+    if(ctx->root->_async != NULL)
+        async_flush(ctx->root->_async);
+    else if(ctx->root->_shm != NULL)
+        ; // The data is visible to the readers as soon as it's written
+    else
+        fflush(ctx->root->_fp);
 }
 
 void _vnlog_flush(struct vnlog_context_t* ctx, int Nfields)
 {
     if( ctx == NULL ) ctx = get_global_context(Nfields);
     check_fp(ctx);
-    fflush(ctx->root->_fp);
-}
-
-static void flush(struct vnlog_context_t* ctx)
-{
-    fflush(ctx->root->_fp);
+    flush(ctx);
 }
 
 void _vnlog_clear_fields_ctx(struct vnlog_context_t* ctx, int Nfields, bool do_free_binary)
 {
     ctx->line_has_any_values = false;
-    for(int i=0; i<Nfields; i++)
-    {
-        ctx->fields[i].c[0]   = '-';
-        ctx->fields[i].c[1]   = '\0';
 
-        // Here the idea is that once I emit the field I deallocate. This is
-        // inefficient, but allows some things to be simple. For instance I can
-        // use NULL to recognize empty binary fields. The vast majority of these
-        // data files will have no binary fields, and this simplicity is good
-        if(do_free_binary)
-            free(ctx->fields[i].binptr);
-        ctx->fields[i].binptr = NULL;
+    // The record buffer, the arena and the dirty list are kept across records.
+    // If we're not freeing, the buffers may be shared with another context
+    // (this context was just copied), so I forget them here, and let the other
+    // context own them. Without the dirty list, all the fields are cleared
+    if(!do_free_binary)
+    {
+        ctx->_linebuf      = NULL;
+        ctx->_linebuf_size = 0;
+        ctx->_arena        = NULL;
+        ctx->_arena_size   = 0;
+        ctx->_dirty        = NULL;
+        ctx->_dirty_size   = 0;
+        ctx->_ring         = NULL;
+        memset(ctx->fields, 0, Nfields*sizeof(ctx->fields[0]));
     }
+    else
+        for(int i=0; i<ctx->_Ndirty; i++)
+            ctx->fields[ctx->_dirty[i]].kind = 0;
+
+    ctx->_arena_used = 0;
+    ctx->_Ndirty     = 0;
 }
 
 void _vnlog_init_session_ctx( struct vnlog_context_t* ctx, int Nfields)
@@ -172,10 +1046,47 @@ void _vnlog_init_child_ctx(      struct vnlog_context_t* ctx,
 
 void _vnlog_free_ctx( struct vnlog_context_t* ctx, int Nfields )
 {
-    for(int i=0; i<Nfields; i++)
+    memset(ctx->fields, 0, Nfields*sizeof(ctx->fields[0]));
+
+    free(ctx->_linebuf);
+    ctx->_linebuf      = NULL;
+    ctx->_linebuf_size = 0;
+
+    free(ctx->_arena);
+    ctx->_arena        = NULL;
+    ctx->_arena_size   = 0;
+    ctx->_arena_used   = 0;
+
+    free(ctx->_dirty);
+    ctx->_dirty        = NULL;
+    ctx->_dirty_size   = 0;
+    ctx->_Ndirty       = 0;
+
+    if(ctx->root == ctx && ctx->_shm != NULL)
     {
-        free(ctx->fields[i].binptr);
-        ctx->fields[i].binptr = NULL;
+        shm_close(ctx->_shm);
+        ctx->_shm = NULL;
+    }
+
+    if(ctx->root == ctx && ctx->_async != NULL)
+    {
+        // This is the session context of an asynchronous session. Write out
+        // everything, and shut down the writer. This frees all the rings
+        async_stop(ctx->_async);
+        ctx->_async = NULL;
+    }
+    else if(ctx->_ring != NULL)
+    {
+        // The writer frees the ring once it has written out what's in it
+        __atomic_store_n(&ctx->_ring->retired, true, __ATOMIC_RELEASE);
+        async_wake_writer(ctx->root->_async);
+    }
+    ctx->_ring = NULL;
+
+    if(ctx->root == ctx && ctx->_capture != NULL)
+    {
+        capture_free(ctx->_capture);
+        ctx->_capture = NULL;
     }
 }
 
@@ -187,14 +1098,18 @@ void _vnlog_emit_legend(struct vnlog_context_t* ctx, const char* legend, int Nfi
         ERR("already have a legend");
     ctx->root->_legend_finished = true;
 
+    if(ctx->root->_shm != NULL)
+    {
+        // The legend lives in the segment header, not in the ring
+        shm_publish_legend(ctx->root->_shm, legend);
+        ctx->root->_emitted_something = true;
+        return;
+    }
+
     emit(ctx, legend);
     flush(ctx);
 }
 
-static bool is_field_null(const vnlog_field_t* field)
-{
-    return field->binptr == NULL && field->c[0] == '-' && field->c[1] == '\0';
-}
 
 static struct vnlog_context_t*
 set_field_prelude(struct vnlog_context_t* ctx,
@@ -204,27 +1119,31 @@ set_field_prelude(struct vnlog_context_t* ctx,
 
     if(!ctx->root->_legend_finished)
         ERR("need a legend to do this");
-    if(!is_field_null(&ctx->fields[idx]))
-        ERR("Field '%s' already set. Old value: '%s'",
-            fieldname, ctx->fields[idx].c);
+    const vnlog_field_t* field = &ctx->fields[idx];
+    if(field->kind != 0)
+    {
+        if(ctx->root->_capture != NULL || (field->kind & FIELD_BINARY))
+            ERR("Field '%s' already set", fieldname);
+        ERR("Field '%s' already set. Old value: '%.*s'",
+            fieldname, (int)field->len, field_data(ctx, field));
+    }
     ctx->line_has_any_values = true;
 
     return ctx;
 }
 
 
-#define DEFINE_SET_FIELD_FUNCTION(type, typename, fmt)                  \
+#define DEFINE_SET_FIELD_FUNCTION(type, typename, fmt, formatter, capture) \
 void                                                                    \
 _vnlog_set_field_value_ ## typename(struct vnlog_context_t* ctx,        \
                                     const char* fieldname, int idx,     \
                                     type arg)                           \
 {                                                                       \
     ctx = set_field_prelude(ctx, fieldname, idx);                       \
-    if( (int)sizeof(ctx->fields[0].c) <=                                \
-        snprintf(ctx->fields[idx].c, sizeof(ctx->fields[0].c), fmt, arg) ) \
-    {                                                                   \
-        ERR("Field size exceeded for field '%s'", fieldname);           \
-    }                                                                   \
+    if(ctx->root->_capture != NULL)                                     \
+        capture_store_ ## capture(ctx, idx, arg);                       \
+    else                                                                \
+        store_text_ ## formatter(ctx, idx, arg);                        \
 }
 
 VNLOG_TYPES( DEFINE_SET_FIELD_FUNCTION )
@@ -232,19 +1151,124 @@ VNLOG_TYPES( DEFINE_SET_FIELD_FUNCTION )
 
 void
 _vnlog_set_field_value_binary(struct vnlog_context_t* ctx,
-                              const char* fieldname __attribute__((unused)), int idx,
+                              const char* fieldname, int idx,
                               const void* data, int len)
 {
     ctx = set_field_prelude(ctx, fieldname, idx);
 
-    // Here I allocate the memory for the data, and copy into it. The idea is
-    // that once I emit the field I deallocate. This is inefficient, but allows
-    // some things to be simple. For instance I can use NULL to recognize empty
-    // binary fields. The vast majority of these data files will have no binary
-    // fields, and this simplicity is good
-    ctx->fields[idx].binlen = len;
-    ctx->fields[idx].binptr = realloc(ctx->fields[idx].binptr, len);
-    memcpy(ctx->fields[idx].binptr, data, len);
+    // The data is copied into the field or into the arena. Once the arena has
+    // grown to the steady-state record size, this doesn't allocate
+    field_store(ctx, idx, data, len, FIELD_BINARY);
+}
+
+void
+_vnlog_set_field_value_binary_borrowed(struct vnlog_context_t* ctx,
+                                       const char* fieldname, int idx,
+                                       const void* data, int len)
+{
+    ctx = set_field_prelude(ctx, fieldname, idx);
+
+    // No copy. The caller keeps the data alive until the record is emitted
+    vnlog_field_t* field = &ctx->fields[idx];
+    field->v.ptr = data;
+    field->len   = len;
+    field->kind  = FIELD_BORROWED | FIELD_BINARY;
+    mark_dirty(ctx, idx);
+}
+
+static int field_len(const vnlog_field_t* field)
+{
+    if( field->kind == 0 )
+        // written as '-'
+        return 1;
+    if( !(field->kind & FIELD_BINARY) )
+        // plain ascii field
+        return field->len;
+
+    // binary field. Will be encoded with base64. Not counting the trailing '\0'
+    return vnlog_base64_dstlen_to_encode(field->len) - 1;
+}
+
+// Writes the whole record into ctx->_linebuf. Returns the number of bytes in
+// the record
+static int assemble_record(struct vnlog_context_t* ctx, int Nfields)
+{
+    // Each field is followed by a ' ' or the trailing '\n'. I also leave room
+    // for the '\0' that vnlog_base64_encode() writes
+    int len_needed = 1;
+    for(int i=0; i<Nfields; i++)
+        len_needed += field_len(&ctx->fields[i]) + 1;
+
+    linebuf_reserve(ctx, len_needed);
+
+    char* p = ctx->_linebuf;
+    for(int i=0; i<Nfields; i++)
+    {
+        const vnlog_field_t* field = &ctx->fields[i];
+        if( field->kind == 0 )
+            *p++ = '-';
+        else if( !(field->kind & FIELD_BINARY) )
+        {
+            memcpy(p, field_data(ctx, field), field->len);
+            p += field->len;
+        }
+        else
+        {
+            const int len =
+                vnlog_base64_encode( p, ctx->_linebuf_size - (int)(p - ctx->_linebuf),
+                                     field_data(ctx, field), field->len );
+            if(len < 0)
+                ERR("Couldn't base64-encode field %d", i);
+            p += len;
+        }
+        *p++ = ' ';
+    }
+    p[-1] = '\n';
+
+    return (int)(p - ctx->_linebuf);
+}
+
+// Writes the whole binary-capture row (with its frame header) into
+// ctx->_linebuf. Returns the number of bytes in the row
+static int assemble_capture_row(struct vnlog_context_t* ctx, int Nfields)
+{
+    const struct vnlog_capture_t* capture = ctx->root->_capture;
+    const int header_len = (int)sizeof(uint32_t);
+    const int Nbitmap    = (Nfields+7)/8;
+
+    // Each value, preceded by its length
+    int len_needed = header_len + Nbitmap;
+    for(int i=0; i<Nfields; i++)
+        if(ctx->fields[i].kind != 0)
+            len_needed += (int)sizeof(uint32_t) + ctx->fields[i].len;
+    linebuf_reserve(ctx, len_needed);
+
+    char* bitmap = &ctx->_linebuf[header_len];
+    memset(bitmap, 0, Nbitmap);
+
+    char* p = &bitmap[Nbitmap];
+    for(int i=0; i<Nfields; i++)
+    {
+        const vnlog_field_t* field = &ctx->fields[i];
+        if(field->kind == 0)
+            continue;
+        const void*    data = field_data(ctx, field);
+        const uint32_t len  = (uint32_t)field->len;
+
+        bitmap[i/8] |= (char)(1 << (i%8));
+        if(capture->sizes[i] < 0)
+        {
+            // string or binary
+            memcpy(p, &len, sizeof(len));
+            p += sizeof(len);
+        }
+        memcpy(p, data, len);
+        p += len;
+    }
+
+    const int len = (int)(p - ctx->_linebuf);
+    set_frame_header(ctx->_linebuf, (uint32_t)(len - header_len));
+    return len;
 }
 
 void _vnlog_emit_record(struct vnlog_context_t* ctx, int Nfields)
@@ -259,17 +1283,43 @@ void _vnlog_emit_record(struct vnlog_context_t* ctx, int Nfields)
 
     check_fp(ctx);
 
-    flockfile(ctx->root->_fp);
-    {
-        for(int i=0; i<Nfields-1; i++)
-        {
-            _emit_field(ctx, i);
-            _emit(ctx, " ");
-        }
-        _emit_field(ctx, Nfields-1);
-        _emit(ctx, "\n");
-    }
-    funlockfile(ctx->root->_fp);
+    // The record is assembled without holding any locks, and is written out
+    // with a single fwrite() (or queued for the writer thread in an
+    // asynchronous session). stdio makes each fwrite() atomic, so records
+    // written from different threads can't interleave
+    const int len =
+        ctx->root->_capture != NULL ?
+        assemble_capture_row(ctx, Nfields) :
+        assemble_record     (ctx, Nfields);
+    output(ctx, ctx->_linebuf, len);
 
     _vnlog_clear_fields_ctx(ctx, Nfields, true);
 }
+
+char* _vnlog_record_buffer(struct vnlog_context_t* ctx, int len,
+                           int Nfields __attribute__((unused)))
+{
+    if( ctx == NULL ) ctx = get_global_context(-1);
+
+    if(!ctx->root->_legend_finished)
+        ERR("need a legend to do this");
+
+    // A binary capture isn't text. The caller falls back to the setters
+    if(ctx->root->_capture != NULL)
+        return NULL;
+
+    linebuf_reserve(ctx, len);
+    return ctx->_linebuf;
+}
+
+void _vnlog_emit_record_buffer(struct vnlog_context_t* ctx, int len,
+                               int Nfields __attribute__((unused)))
+{
+    if( ctx == NULL ) ctx = get_global_context(-1);
+
+    if(len > ctx->_linebuf_size)
+        ERR("The record is longer than the buffer: %d > %d", len, ctx->_linebuf_size);
+
+    check_fp(ctx);
+    output(ctx, ctx->_linebuf, len);
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <inttypes.h>
@@ -19,6 +20,10 @@
   #define vnlog_flush_ctx(ctx)           _vnlog_flush         (ctx,      VNLOG_N_FIELDS)
   #define vnlog_free_ctx(ctx)            _vnlog_free_ctx      (ctx,      VNLOG_N_FIELDS)
   #define vnlog_set_output_FILE(ctx,fp)  _vnlog_set_output_FILE(ctx, fp, VNLOG_N_FIELDS)
+  #define vnlog_set_output_shm(ctx,name,ring_size) _vnlog_set_output_shm(ctx, name, ring_size, VNLOG_N_FIELDS)
+  #define vnlog_set_async(ctx,ring_size,policy) _vnlog_set_async(ctx, ring_size, policy, VNLOG_N_FIELDS)
+  #define vnlog_async_Ndropped(ctx)      _vnlog_async_Ndropped(ctx,   VNLOG_N_FIELDS)
+  #define vnlog_set_binary_capture(ctx)  _vnlog_set_binary_capture(ctx, VNLOG_FIELD_TYPES, VNLOG_N_FIELDS)
 
 #else
 
@@ -73,7 +78,7 @@ This is an interface to produce vnlog output from C programs. Common usage:
 
   # w x y z binary
   -10 40 asdf - -
-  -20 50 - 0.2999999999999999889 AQID
+  -20 50 - 0.3 AQID
   -30 10 whoa 0.5 -
 
 
@@ -82,13 +87,39 @@ INCLUDED BY THE GENERATED vnlog_fields_generated.h
  */
 
 
-#define VNLOG_MAX_FIELD_LEN 32
-
+// What an asynchronous session does when a context's queue is full. See
+// vnlog_set_async()
+typedef enum
+{
+    // The emitting thread waits for the background writer to make room.
+    // Nothing is lost
+    VNLOG_ASYNC_BLOCK,
+
+    // The record is thrown away and counted. The emitting thread never waits.
+    // The count is available from vnlog_async_Ndropped()
+    VNLOG_ASYNC_DROP
+} vnlog_async_policy_t;
+
+// Opaque. Defined in vnlog.c
+struct vnlog_async_t;
+struct vnlog_ring_t;
+struct vnlog_shm_t;
+struct vnlog_capture_t;
+
+// One field of a record: 16 bytes. Short values are stored inline. Longer ones
+// (long strings, most binary data) go into the context's arena, and the field
+// stores the offset. Borrowed binary data is pointed to directly. A field that
+// is all-0 is not set, and is written out as '-'
 typedef struct
 {
-    char  c[VNLOG_MAX_FIELD_LEN];
-    void* binptr;               // If non-NULL, we have binary data instead of ascii data in c[]
-    int   binlen;
+    union
+    {
+        char        c[8];       // the value itself, if it fits. Not '\0'-terminated
+        uint32_t    offset;     // where the value is in the arena
+        const void* ptr;        // borrowed binary data
+    } v;
+    int32_t  len;               // the length of the value, in bytes
+    uint8_t  kind;              // where the value is, and what it is. 0 if not set
 } vnlog_field_t;
 
 // If we're building the LIBRARY, we don't know how many fields we'll have. The
@@ -108,6 +139,13 @@ struct vnlog_context_t
     // global state for this whole session. These should be accessed ONLY
     // through the root context.
     FILE*            _fp;
+    // Non-NULL if this session is asynchronous: the records are written out by
+    // a background thread
+    struct vnlog_async_t* _async;
+    // Non-NULL if this session writes to a shared-memory ring instead of _fp
+    struct vnlog_shm_t*   _shm;
+    // Non-NULL if this session writes binary records instead of text
+    struct vnlog_capture_t* _capture;
     bool             _emitted_something   : 1;
     bool             _legend_finished     : 1;
 
@@ -115,6 +153,32 @@ struct vnlog_context_t
     // each context instance
     bool             line_has_any_values : 1;
 
+    // Each record is assembled in this buffer, and then written out all at
+    // once. The buffer is owned by this context, and is reused for each record.
+    // It is allocated when the first record is written, and released by
+    // vnlog_free_ctx()
+    char*            _linebuf;
+    int              _linebuf_size;
+
+    // The values that don't fit into their field (long strings, binary data)
+    // are copied into this arena. It is owned by this context, and is reused
+    // for each record, so once it is big enough, logging doesn't allocate
+    char*            _arena;
+    int              _arena_size;
+    int              _arena_used;
+
+    // The indices of the fields set in the current record, so that only those
+    // need to be cleared after the record is emitted. Owned by this context,
+    // and reused for each record
+    int*             _dirty;
+    int              _dirty_size;
+    int              _Ndirty;
+
+    // In an asynchronous session, this context's records are queued here for
+    // the background writer. Allocated when the context first writes
+    // something. A context is meant to be used by one thread at a time
+    struct vnlog_ring_t* _ring;
+
     vnlog_field_t fields[
 #ifdef VNLOG_N_FIELDS
                             VNLOG_N_FIELDS
@@ -138,6 +202,80 @@ void _vnlog_set_output_FILE(struct vnlog_context_t* ctx,
                             FILE* _fp,
                             int Nfields);
 
+// THIS FUNCTION IS NOT A PART OF THE PUBLIC API. The user should call
+//
+//     vnlog_set_output_shm(ctx, name, ring_size)
+//
+// Directs the output to a POSIX shared-memory segment instead of a FILE. The
+// segment is created with shm_open(name) (name is "/something"), and contains
+// the legend and a ring buffer of ring_size bytes (0 selects a default size)
+// holding the most recent output. The writer does no file I/O, and never waits:
+// if the readers fall behind, the oldest data is overwritten. Any number of
+// readers may attach with the vnl-shm-cat tool, which writes out ordinary vnlog
+// text. The segment layout is described in vnlog-shm.h.
+//
+// When the session context is freed with vnlog_free_ctx() (or at exit() for the
+// global context), the segment is marked as closed, so the readers exit once
+// they've caught up, and the name is removed.
+//
+// Like vnlog_set_output_FILE(), this must be called at the start, before
+// anything is written. Asynchronous sessions (vnlog_set_async()) are not
+// supported with this output. Pass ctx==NULL to set the global context
+void _vnlog_set_output_shm(struct vnlog_context_t* ctx,
+                           const char* name, size_t ring_size,
+                           int Nfields);
+
+// THIS FUNCTION IS NOT A PART OF THE PUBLIC API. The user should call
+//
+//     vnlog_set_async(ctx, ring_size, policy)
+//
+// Makes this session asynchronous. The emitting threads don't write to the
+// output FILE at all. Instead each context gets its own lock-free queue of
+// ring_size bytes (0 selects a default size), with finished records placed into
+// it. A single background thread pulls the records out of all the queues, and
+// writes them to the output. The normal usage is for each thread to have its
+// own context, created with vnlog_init_child_ctx(). Records from any one
+// context are written in order. There's no ordering between contexts.
+//
+// policy says what happens when a queue is full: wait for the writer
+// (VNLOG_ASYNC_BLOCK), or throw away the record (VNLOG_ASYNC_DROP).
+//
+// This must be called at the start, before anything is written, but after
+// vnlog_set_output_FILE() if that is called. vnlog_flush() waits until all the
+// queued records have been written. Records still queued when the program
+// exits are lost, unless vnlog_flush() or vnlog_free_ctx() on the session
+// context is called first. For the global context vnlog_flush() is called
+// automatically at exit(). Pass ctx==NULL to set up the global context
+void _vnlog_set_async(struct vnlog_context_t* ctx,
+                      size_t ring_size, vnlog_async_policy_t policy,
+                      int Nfields);
+
+// THIS FUNCTION IS NOT A PART OF THE PUBLIC API. The user should call
+//
+//     vnlog_async_Ndropped(ctx)
+//
+// Returns the number of records thrown away by an asynchronous session with
+// the VNLOG_ASYNC_DROP policy
+uint64_t _vnlog_async_Ndropped(struct vnlog_context_t* ctx, int Nfields);
+
+// THIS FUNCTION IS NOT A PART OF THE PUBLIC API. The user should call
+//
+//     vnlog_set_binary_capture(ctx)
+//
+// Makes this session write each record as a compact binary row instead of
+// text. No values are formatted at log time: they're stored as they are. The
+// field types are known at compile time (the header generated by vnl-gen-header
+// lists them in VNLOG_FIELD_TYPES), and are written once at the start of the
+// output. The vnl-decode tool turns a capture back into the vnlog text that a
+// normal session would have written. The format is described in
+// vnlog-capture.h.
+//
+// This must be called at the start, before anything is written. It may be
+// combined with vnlog_set_output_FILE() and vnlog_set_async(), but not with
+// vnlog_set_output_shm(). Pass ctx==NULL to set up the global context
+void _vnlog_set_binary_capture(struct vnlog_context_t* ctx,
+                               const char* types, int Nfields);
+
 // THIS FUNCTION IS NOT A PART OF THE PUBLIC API. The user should call
 //
 //     vnlog_emit_legend()
@@ -157,25 +295,34 @@ void _vnlog_emit_legend(struct vnlog_context_t* ctx,
 // depending on whether they want to use the default context or not. The header
 // generated by vnl-gen-header converts one call to the other.
 
-#define VNLOG_TYPES(_)                                                  \
-    _(int,          int,         "%d")                                  \
-    _(int8_t,       int8_t,      "%" PRId8)                             \
-    _(int16_t,      int16_t,     "%" PRId16)                            \
-    _(int32_t,      int32_t,     "%" PRId32)                            \
-    _(int64_t,      int64_t,     "%" PRId64)                            \
-    _(unsigned,     unsigned,    "%u")                                  \
-    _(unsigned int, unsignedint, "%u")                                  \
-    _(uint8_t,      uint8_t,     "%" PRIu8)                             \
-    _(uint16_t,     uint16_t,    "%" PRIu16)                            \
-    _(uint32_t,     uint32_t,    "%" PRIu32)                            \
-    _(uint64_t,     uint64_t,    "%" PRIu64)                            \
-    _(char,         char,        "%c")                                  \
-    _(float,        float,       "%.20g") /* should fit into a VNLOG_MAX_FIELD_LEN */ \
-    _(double,       double,      "%.20g")                               \
-    _(char*,        charp,       "%s")                                  \
-    _(const char*,  ccharp,      "%s")
-
-#define DECLARE_SET_FIELD_FUNCTION(type, typename, fmt)                 \
+// Each entry is (type, typename, fmt, formatter, capture). fmt is the printf()
+// format for this type, as before. vnlog itself doesn't use it anymore: the
+// value is written out with vnlog_format_FORMATTER() from vnlog-format.h. The
+// integers are widened to 64 bits, and come out the same as with fmt. The
+// floating-point values are written with a representation that reads back to
+// the same value, and is usually the shortest one, so these do NOT match the "%.20g" output of
+// older versions of vnlog byte-for-byte: 0.3 is now written as "0.3". In a
+// binary capture (vnlog_set_binary_capture()) the value is instead stored as
+// the CAPTURE type from vnlog-capture.h. vnl-gen-header uses the same mapping
+#define VNLOG_TYPES(_)                                                          \
+    _(int,          int,         "%d",          int64,  int32)                  \
+    _(int8_t,       int8_t,      "%" PRId8,     int64,  int8)                   \
+    _(int16_t,      int16_t,     "%" PRId16,    int64,  int16)                  \
+    _(int32_t,      int32_t,     "%" PRId32,    int64,  int32)                  \
+    _(int64_t,      int64_t,     "%" PRId64,    int64,  int64)                  \
+    _(unsigned,     unsigned,    "%u",          uint64, uint32)                 \
+    _(unsigned int, unsignedint, "%u",          uint64, uint32)                 \
+    _(uint8_t,      uint8_t,     "%" PRIu8,     uint64, uint8)                  \
+    _(uint16_t,     uint16_t,    "%" PRIu16,    uint64, uint16)                 \
+    _(uint32_t,     uint32_t,    "%" PRIu32,    uint64, uint32)                 \
+    _(uint64_t,     uint64_t,    "%" PRIu64,    uint64, uint64)                 \
+    _(char,         char,        "%c",          char,   char)                   \
+    _(float,        float,       "%.20g",       float,  float32)                \
+    _(double,       double,      "%.20g",       double, float64)                \
+    _(char*,        charp,       "%s",          string, string)                 \
+    _(const char*,  ccharp,      "%s",          string, string)
+
+#define DECLARE_SET_FIELD_FUNCTION(type, typename, fmt, formatter, capture) \
 void                                                                    \
 _vnlog_set_field_value_ ## typename(struct vnlog_context_t* ctx,        \
                                     const char* fieldname, int idx,     \
@@ -188,6 +335,17 @@ _vnlog_set_field_value_binary(struct vnlog_context_t* ctx,
                               const char* fieldname, int idx,
                               const void* data, int len);
 
+// Like _vnlog_set_field_value_binary(), but the data isn't copied: the context
+// borrows the pointer, so the data must stay valid and unchanged until the
+// record is emitted (or the fields are cleared). The user calls
+//
+//     vnlog_set_field_value_borrowed__FIELDNAME(data, len)
+//     vnlog_set_field_value_borrowed_ctx__FIELDNAME(ctx, data, len)
+void
+_vnlog_set_field_value_binary_borrowed(struct vnlog_context_t* ctx,
+                                       const char* fieldname, int idx,
+                                       const void* data, int len);
+
 // THIS FUNCTION IS NOT A PART OF THE PUBLIC API. Instead, the user should call
 // either of
 //
@@ -200,10 +358,26 @@ _vnlog_set_field_value_binary(struct vnlog_context_t* ctx,
 // record. Any fields not set get written as -.
 //
 // This function is thread-safe, and multiple context can be safely written out
-// from multiple threads
+// from multiple threads. The record is assembled in a buffer owned by the
+// context, and is then written out with a single fwrite()
 void _vnlog_emit_record(struct vnlog_context_t* ctx,
                         int Nfields);
 
+// THESE FUNCTIONS ARE NOT A PART OF THE PUBLIC API. They're called by the
+// emitters that "vnl-gen-header --emitter" generates. Those format a whole
+// record themselves, and write it out with
+//
+//     char* buf = _vnlog_record_buffer(ctx, len_max, Nfields);
+//     ... write the record (with its trailing '\n') into buf ...
+//     _vnlog_emit_record_buffer(ctx, len, Nfields);
+//
+// The buffer is owned by the context, and holds at least len_max bytes. In a
+// binary capture the records aren't text, so _vnlog_record_buffer() returns
+// NULL, and the caller should use the setters and _vnlog_emit_record() instead.
+// The fields set in the context are not touched
+char* _vnlog_record_buffer     (struct vnlog_context_t* ctx, int len_max, int Nfields);
+void  _vnlog_emit_record_buffer(struct vnlog_context_t* ctx, int len,     int Nfields);
+
 // THIS FUNCTION IS NOT A PART OF THE PUBLIC API. Instead, the user should call
 // either of
 //
@@ -224,7 +398,9 @@ void _vnlog_printf(struct vnlog_context_t* ctx, int Nfields,
 //     vnlog_flush_ctx(ctx)
 //
 // depending on whether they want to use the default context or not. Flushes the
-// output buffer. Useful in conjunction with vnlog_printf()
+// output buffer. Useful in conjunction with vnlog_printf(). In an asynchronous
+// session this waits until everything queued before this call has been written
+// out
 void _vnlog_flush(struct vnlog_context_t* ctx, int Nfields);
 
 // THIS FUNCTION IS NOT A PART OF THE PUBLIC API. Instead, the user should call
@@ -254,6 +430,7 @@ void _vnlog_flush(struct vnlog_context_t* ctx, int Nfields);
 //                 ...
 //                 vnlog_emit_record_ctx(&ctx);
 //             }
+//             vnlog_free_ctx(&ctx); // required for every context
 //         }
 //
 //         // Now we resume the previous record. We still remember the value of x
@@ -310,10 +487,13 @@ void _vnlog_init_child_ctx( struct vnlog_context_t* ctx,
 //
 //         vnlog_emit_legend_ctx(&ctx);
 //         ...
-//         vnlog_set_field_value__a(...);
-//         vnlog_set_field_value__b(...);
+//         vnlog_set_field_value_ctx__a(&ctx, ...);
+//         vnlog_set_field_value_ctx__b(&ctx, ...);
 //         ...
-//         vnlog_emit_record();
+//         vnlog_emit_record_ctx(&ctx);
+//
+//         vnlog_free_ctx(&ctx); // required for every context
+//         fclose(fp);
 //     }
 void _vnlog_init_session_ctx( struct vnlog_context_t* ctx,
                               int Nfields);
@@ -332,18 +512,28 @@ void _vnlog_init_session_ctx( struct vnlog_context_t* ctx,
 //
 //     struct vnlog_context_t ctx2 = ctx1;
 //     // ctx1 and ctx2 now both have the same data, and the same pointers to
-//     // binary data. I need to get rid of the pointer references in ctx1
+//     // the arena, to the record buffer and to any borrowed binary data. I
+//     // need to get rid of the pointer references in ctx1
 //
 //     vnlog_clear_fields_ctx(&ctx1, false);
+//
+// If do_free_binary, the values are discarded, and the arena and the record
+// buffer are kept for the next record. Otherwise the pointers to these are
+// simply forgotten
 void _vnlog_clear_fields_ctx(struct vnlog_context_t* ctx, int Nfields, bool do_free_binary);
 
 // THIS FUNCTION IS NOT A PART OF THE PUBLIC API. Instead, the user should call
 //
 //     vnlog_free_ctx(ctx)
 //
-// Frees memory for an vnlog context. Do this before throwing the context
-// away. Currently this is only needed for context that have binary fields, but
-// this should be called in for all contexts, just in case
+// Frees memory for an vnlog context. This MUST be called for every context
+// before it is thrown away: each context allocates the buffer used to assemble
+// the records, the list of fields set in the current record and the arena
+// holding the long values when it first uses them, and these are released only
+// here. Older versions of vnlog needed this only for contexts with binary
+// fields. In an asynchronous session, freeing the session context
+// writes out everything that is still queued, and stops the background thread.
+// All the children contexts must be freed before the session context
 void _vnlog_free_ctx( struct vnlog_context_t* ctx, int Nfields );
 
 #ifdef __cplusplus